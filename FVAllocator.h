@@ -52,15 +52,15 @@ __BEGIN_DECLS
  
  @brief CFAllocator for moderate-to-large blocks.
  
- The allocator is thread-safe.
- @return The shared allocator instance. */
+ The allocator is thread-safe.  If the FVAllocatorZonePerNode user default is set on a machine with more than one NUMA node, each node has its own zone and allocator, and this returns the one for the calling thread's node.  Memory from any of them may be freed or reallocated with any other, so the result doesn't need to be kept with the block.
+ @return The shared allocator instance for this thread. */
 FV_PRIVATE_EXTERN CFAllocatorRef FVAllocatorGetDefault(void);
 
 /** @internal 
  
  @brief NSZone for moderate-to-large blocks.
  
- The allocator is thread-safe.
+ The allocator is thread-safe.  This is routed by node in the same way as FVAllocatorGetDefault().
  @return A shared NSZone. */
 FV_PRIVATE_EXTERN NSZone *FVDefaultZone(void);
 
@@ -39,6 +39,7 @@
 #import "FVAllocator.h"
 #import <pthread.h>
 #import "fv_zone.h"
+#import "FVMemoryBudget.h"
 
 #define USE_SYSTEM_ZONE 0
 
@@ -81,23 +82,37 @@ static CFIndex __FVPreferredSize(CFIndex size, CFOptionFlags hint, void *info)
 
 #pragma mark Setup and cleanup
 
-// single instance of this allocator
-static CFAllocatorRef  _allocator = NULL;
-static malloc_zone_t  *_allocatorZone = NULL;
+/*
+ One zone and allocator per NUMA node if the FVAllocatorZonePerNode default is set, so a block recycled by a
+ render thread was last touched on that thread's node.  Otherwise there's a single instance, and only the
+ first element of each array is used.
+ */
+static CFAllocatorRef  _allocators[FV_ZONE_MAX_NODES] = { NULL };
+static malloc_zone_t  *_allocatorZones[FV_ZONE_MAX_NODES] = { NULL };
+static unsigned        _zoneCount = 1;
 
-static void __fv_allocator_initialize()
-{        
-#if USE_SYSTEM_ZONE
-    _allocatorZone = malloc_default_zone();
-    _allocator = CFAllocatorGetDefault();
-#else
-    // create the initial zone
-    _allocatorZone = fv_create_zone_named("FVAllocatorZone");
+#if !USE_SYSTEM_ZONE
+
+static size_t __FVAllocatorCachedSize(void *info)
+{
+    size_t freeSize;
+    fv_zone_get_sizes((malloc_zone_t *)info, NULL, &freeSize);
+    return freeSize;
+}
+
+static size_t __FVAllocatorReleaseCachedBlocks(size_t bytes, void *info)
+{
+    return fv_zone_release_free_memory((malloc_zone_t *)info, bytes);
+}
+
+static void __fv_allocator_create_zone(unsigned idx, const char *name)
+{
+    _allocatorZones[idx] = fv_create_zone_named(name);
     
     // wrap the zone in a CFAllocator; could just return it directly, though
     CFAllocatorContext context = { 
         0, 
-        _allocatorZone, 
+        _allocatorZones[idx], 
         NULL, 
         NULL, 
         __FVAllocatorCopyDescription, 
@@ -106,23 +121,55 @@ static void __fv_allocator_initialize()
         __FVDeallocate, 
         __FVPreferredSize 
     };
-    _allocator = CFAllocatorCreate(CFAllocatorGetDefault(), &context);
+    _allocators[idx] = CFAllocatorCreate(CFAllocatorGetDefault(), &context);
+    
+    // cached blocks are the cheapest memory to give back
+    (void) FVMemoryBudgetAddConsumer(name, FVMemoryCostCachedBlocks, __FVAllocatorCachedSize, __FVAllocatorReleaseCachedBlocks, _allocatorZones[idx]);
+}
+
+#endif
+
+static void __fv_allocator_initialize()
+{        
+#if USE_SYSTEM_ZONE
+    _allocatorZones[0] = malloc_default_zone();
+    _allocators[0] = CFAllocatorGetDefault();
+#else
+    // create the initial zone
+    __fv_allocator_create_zone(0, "FVAllocatorZone");
+    
+    NSAutoreleasePool *pool = [NSAutoreleasePool new];
+    BOOL perNode = [[NSUserDefaults standardUserDefaults] boolForKey:@"FVAllocatorZonePerNode"];
+    [pool release];
+    
+    if (perNode && fv_zone_node_count() > 1) {
+        // names must stay valid for the life of the zone
+        static const char *names[FV_ZONE_MAX_NODES] = { "FVAllocatorZone", "FVAllocatorZone1", "FVAllocatorZone2", "FVAllocatorZone3", "FVAllocatorZone4", "FVAllocatorZone5", "FVAllocatorZone6", "FVAllocatorZone7" };
+        for (_zoneCount = 1; _zoneCount < fv_zone_node_count(); _zoneCount++)
+            __fv_allocator_create_zone(_zoneCount, names[_zoneCount]);
+    }
 #endif
 }
 
 static pthread_once_t once = PTHREAD_ONCE_INIT;
 
+// blocks from any of the zones can be freed through any other, so routing by the current node is safe after migration
+static inline unsigned __FVAllocatorLocalIndex()
+{
+    return _zoneCount > 1 ? fv_zone_current_node() : 0;
+}
+
 #pragma mark API
 
 CFAllocatorRef FVAllocatorGetDefault() 
 {  
     (void) pthread_once(&once, __fv_allocator_initialize);
-    return _allocator; 
+    return _allocators[__FVAllocatorLocalIndex()]; 
 }
 
 // NSZone is the same as malloc_zone_t: http://lists.apple.com/archives/objc-language/2008/Feb/msg00033.html
 NSZone * FVDefaultZone() 
 { 
     (void) pthread_once(&once, __fv_allocator_initialize);
-    return (void *)_allocatorZone; 
+    return (void *)_allocatorZones[__FVAllocatorLocalIndex()]; 
 }
@@ -0,0 +1,297 @@
+//
+//  fv_filter_perf.cpp
+//  FVAllocatorPerf
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ Benchmark for FVRowFilter.h, the predictor FVCacheFile applies to bitmaps before compressing them.  Each
+ image is deflated with the settings FVCacheFile uses (Huffman coding only, at the fastest level), once as
+ is and once after the filter chosen by FVRowFilterChoose, and the compression ratio and throughput of
+ both are reported.  Throughput counts the uncompressed bytes; encoding includes choosing and applying the
+ filter, and decoding includes reverting it.
+
+ Before timing anything, every filter is checked to round-trip for pixel sizes 1 through 8 and odd row
+ lengths, through both the vector and scalar paths.
+
+ Usage: fv_filter_perf [-n images] [-s size] [-w width] [file ...]
+
+    -n    synthetic thumbnails (default: 200)
+    -s    edge of a synthetic thumbnail in pixels (default: 256)
+    -w    width in pixels of the raw 32-bit bitmaps given as files
+
+ Without files, the corpus is synthetic thumbnails with smooth shading, edges, text-like detail and sensor
+ noise, which roughly resembles rendered icons and photo previews.  A file holds rows of 4-byte pixels, as
+ CGBitmapContextGetData returns for a context without row padding.
+
+ Exits with status 1 if a round-trip fails.
+ */
+
+#include "FVRowFilter.h"
+#include <zlib.h>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+struct Bitmap {
+    std::vector<uint8_t> bytes;
+    size_t rowCount;
+    size_t bytesPerRow;
+    size_t bytesPerPixel;
+};
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static size_t deflateHuffman(const uint8_t *bytes, size_t length, std::vector<uint8_t> &out)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (Z_OK != deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, 15, 9, Z_HUFFMAN_ONLY))
+        abort();
+    out.resize(deflateBound(&strm, length));
+    strm.next_in = (Bytef *)bytes;
+    strm.avail_in = length;
+    strm.next_out = &out[0];
+    strm.avail_out = out.size();
+    if (Z_STREAM_END != deflate(&strm, Z_FINISH))
+        abort();
+    size_t compressedLength = strm.total_out;
+    deflateEnd(&strm);
+    return compressedLength;
+}
+
+static void inflateAll(const uint8_t *bytes, size_t length, uint8_t *out, size_t outLength)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (Z_OK != inflateInit(&strm))
+        abort();
+    strm.next_in = (Bytef *)bytes;
+    strm.avail_in = length;
+    strm.next_out = out;
+    strm.avail_out = outLength;
+    if (Z_STREAM_END != inflate(&strm, Z_FINISH))
+        abort();
+    inflateEnd(&strm);
+}
+
+static bool checkRoundTrips(void)
+{
+    static const FVRowFilterType filters[] = { FVRowFilterNone, FVRowFilterSub, FVRowFilterUp, FVRowFilterPaeth };
+    static const size_t widths[] = { 1, 2, 3, 7, 17, 33, 100 };
+    unsigned seed = 7;
+    bool ok = true;
+    for (size_t bpp = 1; bpp <= FV_ROW_FILTER_MAX_PIXEL_SIZE; bpp++) {
+        for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+            // odd padding, as a bitmap context may have
+            const size_t bytesPerRow = widths[w] * bpp + widths[w] % 3;
+            const size_t rowCount = 5;
+            std::vector<uint8_t> source(bytesPerRow * rowCount), filtered(source.size());
+            for (size_t i = 0; i < source.size(); i++)
+                source[i] = rand_r(&seed);
+            for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+                FVRowFilterApply(filters[f], &source[0], &filtered[0], rowCount, bytesPerRow, bpp);
+                FVRowFilterRevert(filters[f], &filtered[0], rowCount, bytesPerRow, bpp);
+                if (filtered != source) {
+                    fprintf(stderr, "FAIL: filter %u, %lu bytes per pixel, %lu bytes per row\n", filters[f], (unsigned long)bpp, (unsigned long)bytesPerRow);
+                    ok = false;
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+static inline uint8_t clampByte(double v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : (uint8_t)v);
+}
+
+static void makeThumbnail(Bitmap &bitmap, size_t edge, unsigned *seed)
+{
+    bitmap.rowCount = edge;
+    bitmap.bytesPerPixel = 4;
+    bitmap.bytesPerRow = edge * 4;
+    bitmap.bytes.resize(bitmap.rowCount * bitmap.bytesPerRow);
+    
+    const double phase = rand_r(seed) % 628 / 100.0;
+    const double freq = 2.0 + rand_r(seed) % 8;
+    const double base[3] = { (double)(rand_r(seed) % 200), (double)(rand_r(seed) % 200), (double)(rand_r(seed) % 200) };
+    // a page-like rectangle with lines of "text", as in a PDF preview
+    const size_t left = edge / 8 + rand_r(seed) % (edge / 8), top = edge / 8 + rand_r(seed) % (edge / 8);
+    const size_t right = edge - left, bottom = edge - top;
+    
+    for (size_t y = 0; y < edge; y++) {
+        uint8_t *row = &bitmap.bytes[y * bitmap.bytesPerRow];
+        for (size_t x = 0; x < edge; x++) {
+            double shade = 40.0 * sin(phase + freq * x / edge) * cos(freq * y / edge);
+            double c[3];
+            for (int k = 0; k < 3; k++)
+                c[k] = base[k] + shade + (double)x * (k + 1) * 20.0 / edge;
+            if (x >= left && x < right && y >= top && y < bottom) {
+                c[0] = c[1] = c[2] = 245;
+                if ((y - top) % 12 < 7 && (y - top) % 12 > 1 && rand_r(seed) % 3 == 0)
+                    c[0] = c[1] = c[2] = 30;
+            }
+            int noise = rand_r(seed) % 5 - 2;
+            // BGRA, premultiplied with opaque alpha
+            row[4 * x + 0] = clampByte(c[2] + noise);
+            row[4 * x + 1] = clampByte(c[1] + noise);
+            row[4 * x + 2] = clampByte(c[0] + noise);
+            row[4 * x + 3] = 255;
+        }
+    }
+}
+
+static bool readBitmap(Bitmap &bitmap, const char *path, size_t width)
+{
+    FILE *file = fopen(path, "rb");
+    if (NULL == file) {
+        perror(path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    bitmap.bytesPerPixel = 4;
+    bitmap.bytesPerRow = width * 4;
+    bitmap.rowCount = length > 0 ? length / bitmap.bytesPerRow : 0;
+    bitmap.bytes.resize(bitmap.rowCount * bitmap.bytesPerRow);
+    bool ok = bitmap.rowCount > 0 && fread(&bitmap.bytes[0], 1, bitmap.bytes.size(), file) == bitmap.bytes.size();
+    if (false == ok)
+        fprintf(stderr, "%s: not a bitmap %lu pixels wide\n", path, (unsigned long)width);
+    fclose(file);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = 200, edge = 256, width = 0;
+    
+    int ch;
+    while ((ch = getopt(argc, argv, "n:s:w:h")) != -1) {
+        switch (ch) {
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            case 's': edge = strtoul(optarg, NULL, 0); break;
+            case 'w': width = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-n images] [-s size] [-w width] [file ...]\n", argv[0]);
+                return 2;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    
+    if (false == checkRoundTrips())
+        return 1;
+    printf("round trips: ok\n");
+    
+    std::vector<Bitmap> corpus;
+    if (argc > 0) {
+        if (0 == width) {
+            fprintf(stderr, "-w is required with files\n");
+            return 2;
+        }
+        corpus.resize(argc);
+        for (int i = 0; i < argc; i++) {
+            if (false == readBitmap(corpus[i], argv[i], width))
+                return 2;
+        }
+    }
+    else {
+        if (edge < 16) {
+            fprintf(stderr, "size must be at least 16\n");
+            return 2;
+        }
+        unsigned seed = 1;
+        corpus.resize(count);
+        for (size_t i = 0; i < count; i++)
+            makeThumbnail(corpus[i], edge, &seed);
+    }
+    
+    uint64_t totalBytes = 0, plainBytes = 0, filteredBytes = 0;
+    double plainEncode = 0, plainDecode = 0, filterEncode = 0, filterDecode = 0;
+    unsigned filterCounts[5] = { 0 };
+    std::vector<uint8_t> compressed, scratch, decoded;
+    
+    for (size_t i = 0; i < corpus.size(); i++) {
+        const Bitmap &bitmap = corpus[i];
+        const size_t length = bitmap.bytes.size();
+        totalBytes += length;
+        scratch.resize(length);
+        decoded.resize(length);
+        
+        double t = now();
+        size_t plainLength = deflateHuffman(&bitmap.bytes[0], length, compressed);
+        plainEncode += now() - t;
+        plainBytes += plainLength;
+        t = now();
+        inflateAll(&compressed[0], plainLength, &decoded[0], length);
+        plainDecode += now() - t;
+        
+        t = now();
+        FVRowFilterType filter = FVRowFilterChoose(&bitmap.bytes[0], bitmap.rowCount, bitmap.bytesPerRow, bitmap.bytesPerPixel);
+        FVRowFilterApply(filter, &bitmap.bytes[0], &scratch[0], bitmap.rowCount, bitmap.bytesPerRow, bitmap.bytesPerPixel);
+        size_t filteredLength = deflateHuffman(&scratch[0], length, compressed);
+        filterEncode += now() - t;
+        filteredBytes += filteredLength;
+        filterCounts[filter]++;
+        t = now();
+        inflateAll(&compressed[0], filteredLength, &decoded[0], length);
+        FVRowFilterRevert(filter, &decoded[0], bitmap.rowCount, bitmap.bytesPerRow, bitmap.bytesPerPixel);
+        filterDecode += now() - t;
+        
+        if (decoded != bitmap.bytes) {
+            fprintf(stderr, "FAIL: image %lu doesn't round-trip\n", (unsigned long)i);
+            return 1;
+        }
+    }
+    
+    const double mb = totalBytes / (1024.0 * 1024.0);
+    printf("%lu images, %.1f MB; filters chosen: none %u, sub %u, up %u, paeth %u\n", (unsigned long)corpus.size(), mb, filterCounts[FVRowFilterNone], filterCounts[FVRowFilterSub], filterCounts[FVRowFilterUp], filterCounts[FVRowFilterPaeth]);
+    printf("%-18s %8s %14s %14s\n", "", "ratio", "encode MB/s", "decode MB/s");
+    printf("%-18s %8.2f %14.0f %14.0f\n", "huffman", (double)totalBytes / plainBytes, mb / plainEncode, mb / plainDecode);
+    printf("%-18s %8.2f %14.0f %14.0f\n", "filter + huffman", (double)totalBytes / filteredBytes, mb / filterEncode, mb / filterDecode);
+    return 0;
+}
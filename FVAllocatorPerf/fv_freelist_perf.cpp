@@ -0,0 +1,302 @@
+//
+//  fv_freelist_perf.cpp
+//  FVAllocatorPerf
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ Microbenchmark for the fv_zone free list.  This compares the old multiset<fv_allocation_t *> ordered
+ by size with the segregated size-class lists that replaced it, using the same rounding, tolerance and
+ refill rules as fv_zone.cpp.  Only the free list bookkeeping is timed; no memory is mapped.
+
+ The trace is a churn of bitmap-sized requests between 16K and 8MB: thumbnails, full-size images, and
+ the planar and interleaved tile buffers used by FVCGImageUtilities.  Each step picks a random slot,
+ and either frees the block it holds or allocates a new one.
+
+ Build and run with:
+ 
+    c++ -O2 -o fv_freelist_perf fv_freelist_perf.cpp && ./fv_freelist_perf [iterations] [slots]
+ */
+
+#include <set>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+using namespace std;
+
+#define PAGE_BYTES 4096UL
+#define ROUND_PAGE(x) (((x) + PAGE_BYTES - 1) & ~(PAGE_BYTES - 1))
+
+// same constants as fv_zone.cpp
+#define FV_SIZE_CLASS_MIN_SHIFT   7
+#define FV_SIZE_CLASS_MAX_SHIFT   30
+#define FV_SIZE_CLASS_STEP_SHIFT  2
+#define FV_SIZE_CLASS_COUNT       (((FV_SIZE_CLASS_MAX_SHIFT - FV_SIZE_CLASS_MIN_SHIFT) << FV_SIZE_CLASS_STEP_SHIFT) + 1)
+#define FV_SIZE_CLASS_OVERFLOW    (FV_SIZE_CLASS_COUNT - 1)
+#define FV_SIZE_CLASS_MAP_WORDS   ((FV_SIZE_CLASS_COUNT + 63) / 64)
+
+typedef struct _block_t {
+    size_t           ptrSize;
+    unsigned         sizeClass;
+    struct _block_t *next;
+} block_t;
+
+static inline unsigned __log2(size_t x) { return (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(x); }
+
+static inline unsigned __size_class(const size_t size)
+{
+    if (size <= (1UL << FV_SIZE_CLASS_MIN_SHIFT))
+        return 0;
+    const unsigned shift = __log2(size - 1);
+    if (shift >= FV_SIZE_CLASS_MAX_SHIFT)
+        return FV_SIZE_CLASS_OVERFLOW;
+    const size_t step = ((size - 1 - (1UL << shift)) >> (shift - FV_SIZE_CLASS_STEP_SHIFT)) + 1;
+    return ((shift - FV_SIZE_CLASS_MIN_SHIFT) << FV_SIZE_CLASS_STEP_SHIFT) + step;
+}
+
+static inline size_t __class_size(const unsigned sizeClass)
+{
+    const size_t base = 1UL << ((sizeClass >> FV_SIZE_CLASS_STEP_SHIFT) + FV_SIZE_CLASS_MIN_SHIFT);
+    return base + (base >> FV_SIZE_CLASS_STEP_SHIFT) * (sizeClass & ((1U << FV_SIZE_CLASS_STEP_SHIFT) - 1));
+}
+
+#pragma mark Old free list
+
+static bool __block_size_compare(block_t *val1, block_t *val2) { return (val1->ptrSize < val2->ptrSize); }
+
+class multiset_free_list {
+    multiset<block_t *, bool(*)(block_t *, block_t *)> _blocks;
+public:
+    multiset_free_list() : _blocks(__block_size_compare) {}
+    
+    // page rounding only, with the original coarse steps below 600K
+    static size_t round_size(size_t size, unsigned *sizeClass)
+    {
+        *sizeClass = 0;
+        if (size < 102400) return ROUND_PAGE(size);
+        if (size < 143360) return ROUND_PAGE(143360);
+        if (size < 204800) return ROUND_PAGE(204800);
+        if (size < 262144) return ROUND_PAGE(262144);
+        if (size < 307200) return ROUND_PAGE(307200);
+        if (size < 512000) return ROUND_PAGE(512000);
+        if (size < 614400) return ROUND_PAGE(614400);
+        return ROUND_PAGE(size);
+    }
+    
+    block_t *remove(size_t size, unsigned sizeClass)
+    {
+        block_t request = { size, 0, NULL };
+        multiset<block_t *>::iterator next = _blocks.lower_bound(&request);
+        if (_blocks.end() == next || ((float)((*next)->ptrSize - size) / size) > 1)
+            return NULL;
+        block_t *block = *next;
+        _blocks.erase(next);
+        return block;
+    }
+    
+    void insert(block_t *block) { _blocks.insert(block); }
+    
+    void clear() { _blocks.clear(); }
+    
+    static const char *name() { return "multiset"; }
+};
+
+#pragma mark Size class free lists
+
+class size_class_free_list {
+    block_t  *_lists[FV_SIZE_CLASS_COUNT];
+    uint64_t  _map[FV_SIZE_CLASS_MAP_WORDS];
+    
+    inline block_t *unlink(block_t **link, unsigned sizeClass)
+    {
+        block_t *block = *link;
+        *link = block->next;
+        block->next = NULL;
+        if (NULL == _lists[sizeClass])
+            _map[sizeClass >> 6] &= ~(1ULL << (sizeClass & 63));
+        return block;
+    }
+    
+    inline unsigned next_class(unsigned sizeClass)
+    {
+        unsigned word = sizeClass >> 6;
+        uint64_t bits = _map[word] & (~0ULL << (sizeClass & 63));
+        while (0 == bits) {
+            if (++word == FV_SIZE_CLASS_MAP_WORDS)
+                return FV_SIZE_CLASS_COUNT;
+            bits = _map[word];
+        }
+        return (word << 6) + __builtin_ctzll(bits);
+    }
+    
+public:
+    size_class_free_list() { clear(); }
+    
+    static size_t round_size(size_t size, unsigned *sizeClass)
+    {
+        *sizeClass = __size_class(size);
+        if (FV_SIZE_CLASS_OVERFLOW != *sizeClass)
+            size = __class_size(*sizeClass);
+        return ROUND_PAGE(size);
+    }
+    
+    block_t *remove(size_t size, unsigned sizeClass)
+    {
+        if (FV_SIZE_CLASS_OVERFLOW != sizeClass) {
+            const unsigned freeClass = next_class(sizeClass);
+            if (freeClass < FV_SIZE_CLASS_OVERFLOW && __class_size(freeClass) <= 2 * size)
+                return unlink(&_lists[freeClass], freeClass);
+            return NULL;
+        }
+        block_t **best = NULL;
+        for (block_t **link = &_lists[sizeClass]; NULL != *link; link = &(*link)->next) {
+            const size_t ptrSize = (*link)->ptrSize;
+            if (ptrSize >= size && ptrSize <= 2 * size && (NULL == best || ptrSize < (*best)->ptrSize))
+                best = link;
+        }
+        return best ? unlink(best, sizeClass) : NULL;
+    }
+    
+    void insert(block_t *block)
+    {
+        block->next = _lists[block->sizeClass];
+        _lists[block->sizeClass] = block;
+        _map[block->sizeClass >> 6] |= (1ULL << (block->sizeClass & 63));
+    }
+    
+    void clear()
+    {
+        memset(_lists, 0, sizeof(_lists));
+        memset(_map, 0, sizeof(_map));
+    }
+    
+    static const char *name() { return "size class"; }
+};
+
+#pragma mark Trace
+
+// bitmap sizes that FileView requests, in bytes
+static size_t __random_request_size(unsigned *seed)
+{
+    const unsigned r = rand_r(seed) % 100;
+    // thumbnails: 64-256 pixels square, 4 bytes per pixel, rows padded to 64 bytes
+    if (r < 45) {
+        const size_t w = 64 + rand_r(seed) % 193, h = 64 + rand_r(seed) % 193;
+        return ((w * 4 + 63) & ~63UL) * h;
+    }
+    // planar tile buffers: 512-2048 pixels wide, 32-256 rows
+    if (r < 70) {
+        const size_t w = 512 << (rand_r(seed) % 3), h = 32 << (rand_r(seed) % 4);
+        return w * h;
+    }
+    // full-size images: FVMaxImageDimension 512, plus some odd aspect ratios
+    if (r < 90)
+        return (rand_r(seed) % 2) ? 512 * 512 * 4 : 512 * (256 + rand_r(seed) % 257) * 4;
+    // interleaved tile mosaics up to 8 MB
+    return 1048576 + (rand_r(seed) % 7340032);
+}
+
+static double __now(void)
+{
+    struct timeval tv;
+    (void)gettimeofday(&tv, NULL);
+    return tv.tv_sec + double(tv.tv_usec) / 1000000;
+}
+
+template <class free_list_t>
+static void __run_trace(const size_t iterations, const size_t slotCount)
+{
+    free_list_t freeList;
+    vector<block_t *> slots(slotCount, (block_t *)NULL);
+    vector<block_t *> allBlocks;
+    allBlocks.reserve(slotCount * 4);
+    unsigned seed = 20081114;
+    size_t hits = 0, misses = 0, mapped = 0;
+    
+    // precompute the trace so rand_r isn't timed
+    vector<size_t> sizes(iterations), slotIndexes(iterations);
+    for (size_t i = 0; i < iterations; i++) {
+        slotIndexes[i] = rand_r(&seed) % slotCount;
+        sizes[i] = __random_request_size(&seed);
+    }
+    
+    const double t1 = __now();
+    for (size_t i = 0; i < iterations; i++) {
+        block_t *&slot = slots[slotIndexes[i]];
+        if (slot) {
+            freeList.insert(slot);
+            slot = NULL;
+        }
+        else {
+            unsigned sizeClass;
+            const size_t size = free_list_t::round_size(sizes[i], &sizeClass);
+            block_t *block = freeList.remove(size, sizeClass);
+            if (block) {
+                hits++;
+            }
+            else {
+                misses++;
+                block = new block_t;
+                block->ptrSize = size;
+                block->sizeClass = sizeClass;
+                block->next = NULL;
+                allBlocks.push_back(block);
+                mapped += size;
+            }
+            slot = block;
+        }
+    }
+    const double t2 = __now();
+    
+    fprintf(stdout, "%-12s %10.1f ns/op %9.2f%% hits %8lu blocks %9.1f MB mapped\n", free_list_t::name(), (t2 - t1) * 1e9 / iterations, 100.0 * hits / (hits + misses), (unsigned long)allBlocks.size(), double(mapped) / 1048576);
+    
+    freeList.clear();
+    for (size_t i = 0; i < allBlocks.size(); i++)
+        delete allBlocks[i];
+}
+
+int main(int argc, const char * argv[])
+{
+    const size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    const size_t slots = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000;
+    fprintf(stdout, "%lu operations over %lu live slots, 16K-8MB requests\n", (unsigned long)iterations, (unsigned long)slots);
+    __run_trace<multiset_free_list>(iterations, slots);
+    __run_trace<size_class_free_list>(iterations, slots);
+    return 0;
+}
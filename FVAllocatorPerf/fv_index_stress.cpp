@@ -0,0 +1,267 @@
+//
+//  fv_index_stress.cpp
+//  FVAllocatorPerf
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ Stress test for FVConcurrentIndex, the table behind FVCacheFile's key lookups.  Reader threads look up
+ random keys without locking while one writer adds, replaces and removes entries, as saveData:forKey: and
+ invalidateDataForKey: do.  The key range is small compared with the number of operations, so the same
+ entries are replaced over and over and the table grows while readers are walking it.
+
+ Values are reference counted and never actually freed; a value whose count reaches zero is poisoned.
+ Readers check that every value they get is live and belongs to the key they asked for, so reading an
+ entry after the writer reclaimed it shows up as a failure instead of silent corruption.  At the end, the
+ table is compared against a std::map that the writer kept alongside it, and every value must have been
+ released exactly as often as it was retained once the index is destroyed.
+
+ Usage: fv_index_stress [-p readers] [-n writes] [-k keys] [-s seed]
+
+    -p    reader threads (default: twice the processor count)
+    -n    writer operations (default: 2000000)
+    -k    key range (default: 4096)
+    -s    random seed (default: 1)
+
+ Exits with status 1 on failure.  Build with -fsanitize=thread to have the race detector check the
+ memory ordering as well.
+ */
+
+#include "FVConcurrentIndex.h"
+#include <map>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define VALUE_LIVE 0x4c495645
+#define VALUE_DEAD 0x44454144
+
+struct StressValue {
+    volatile int32_t refcount;
+    volatile uint32_t magic;
+    uint64_t key;
+    uint64_t generation;
+};
+
+static volatile int64_t _failures = 0;
+static volatile int _writerDone = 0;
+static std::vector<StressValue *> _allValues;
+
+static void fail(const char *what, uint64_t key)
+{
+    if (__sync_add_and_fetch(&_failures, 1) <= 10)
+        fprintf(stderr, "FAIL: %s (key %llu)\n", what, (unsigned long long)key);
+}
+
+struct StressTraits {
+    static size_t hash(uint64_t key) { return (size_t)(key * 0x9E3779B97F4A7C15ULL >> 16); }
+    static bool equal(uint64_t a, uint64_t b) { return a == b; }
+    static uint64_t copyKey(uint64_t key) { return key; }
+    static void releaseKey(uint64_t key) {}
+    static StressValue *retainValue(StressValue *value)
+    {
+        if (__atomic_load_n(&value->magic, __ATOMIC_ACQUIRE) != VALUE_LIVE || __sync_fetch_and_add(&value->refcount, 1) <= 0)
+            fail("retained a released value", value->key);
+        return value;
+    }
+    static void releaseValue(StressValue *value)
+    {
+        int32_t count = __sync_sub_and_fetch(&value->refcount, 1);
+        if (count < 0)
+            fail("over-released value", value->key);
+        else if (0 == count)
+            __atomic_store_n(&value->magic, VALUE_DEAD, __ATOMIC_RELEASE);
+    }
+};
+
+typedef FVConcurrentIndex<uint64_t, StressValue *, StressTraits> StressIndex;
+
+struct ReaderArgs {
+    StressIndex *index;
+    uint64_t     keyRange;
+    unsigned     seed;
+    uint64_t     lookups;
+    uint64_t     hits;
+};
+
+static void *reader(void *arg)
+{
+    ReaderArgs *args = (ReaderArgs *)arg;
+    unsigned seed = args->seed;
+    while (0 == __atomic_load_n(&_writerDone, __ATOMIC_ACQUIRE)) {
+        uint64_t key = rand_r(&seed) % args->keyRange;
+        StressValue *value;
+        if (args->index->copyValue(key, &value)) {
+            if (value->key != key)
+                fail("value belongs to a different key", key);
+            if (__atomic_load_n(&value->magic, __ATOMIC_ACQUIRE) != VALUE_LIVE)
+                fail("value was released while a reader held it", key);
+            StressTraits::releaseValue(value);
+            args->hits++;
+        }
+        args->lookups++;
+    }
+    return NULL;
+}
+
+static StressValue *newValue(uint64_t key, uint64_t generation)
+{
+    StressValue *value = new StressValue;
+    value->refcount = 1;
+    value->magic = VALUE_LIVE;
+    value->key = key;
+    value->generation = generation;
+    _allValues.push_back(value);
+    return value;
+}
+
+static void checkContents(uint64_t key, StressValue *value, void *context)
+{
+    std::map<uint64_t, StressValue *> *model = (std::map<uint64_t, StressValue *> *)context;
+    std::map<uint64_t, StressValue *>::iterator it = model->find(key);
+    if (it == model->end() || it->second != value)
+        fail("table doesn't match model", key);
+}
+
+int main(int argc, char *argv[])
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned readerCount = ncpu > 0 ? 2 * ncpu : 4;
+    uint64_t writes = 2000000;
+    uint64_t keyRange = 4096;
+    unsigned seed = 1;
+    
+    int ch;
+    while ((ch = getopt(argc, argv, "p:n:k:s:h")) != -1) {
+        switch (ch) {
+            case 'p': readerCount = strtoul(optarg, NULL, 0); break;
+            case 'n': writes = strtoull(optarg, NULL, 0); break;
+            case 'k': keyRange = strtoull(optarg, NULL, 0); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-p readers] [-n writes] [-k keys] [-s seed]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (0 == readerCount || 0 == keyRange) {
+        fprintf(stderr, "reader count and key range must be nonzero\n");
+        return 2;
+    }
+    
+    std::map<uint64_t, StressValue *> model;
+    uint64_t sets = 0, removes = 0;
+    
+    {
+        // start small, so readers see the table grow
+        StressIndex index(16);
+        
+        std::vector<pthread_t> threads(readerCount);
+        std::vector<ReaderArgs> args(readerCount);
+        for (unsigned i = 0; i < readerCount; i++) {
+            args[i].index = &index;
+            args[i].keyRange = keyRange;
+            args[i].seed = seed + i + 1;
+            args[i].lookups = args[i].hits = 0;
+            pthread_create(&threads[i], NULL, reader, &args[i]);
+        }
+        
+        // the writer owns one reference to each value in the model
+        unsigned writerSeed = seed;
+        for (uint64_t i = 0; i < writes; i++) {
+            uint64_t key = rand_r(&writerSeed) % keyRange;
+            std::map<uint64_t, StressValue *>::iterator it = model.find(key);
+            if (rand_r(&writerSeed) % 4) {
+                StressValue *value = newValue(key, i);
+                index.setValue(key, value);
+                if (it != model.end()) {
+                    StressTraits::releaseValue(it->second);
+                    it->second = value;
+                }
+                else {
+                    model[key] = value;
+                }
+                sets++;
+            }
+            else {
+                index.removeValue(key);
+                if (it != model.end()) {
+                    StressTraits::releaseValue(it->second);
+                    model.erase(it);
+                }
+                removes++;
+            }
+            // lookups through the reader path must see the writer's own changes immediately
+            StressValue *value;
+            bool found = index.copyValue(key, &value);
+            it = model.find(key);
+            if (found != (it != model.end()) || (found && value != it->second))
+                fail("writer can't read its own change", key);
+            if (found)
+                StressTraits::releaseValue(value);
+        }
+        
+        __atomic_store_n(&_writerDone, 1, __ATOMIC_RELEASE);
+        uint64_t lookups = 0, hits = 0;
+        for (unsigned i = 0; i < readerCount; i++) {
+            pthread_join(threads[i], NULL);
+            lookups += args[i].lookups;
+            hits += args[i].hits;
+        }
+        
+        if (index.count() != model.size())
+            fail("count doesn't match model", index.count());
+        index.apply(checkContents, &model);
+        
+        printf("%u readers: %llu lookups (%.1f%% hits), %llu sets, %llu removes, %zu entries\n", readerCount, (unsigned long long)lookups, lookups ? 100.0 * hits / lookups : 0.0, (unsigned long long)sets, (unsigned long long)removes, index.count());
+    }
+    
+    // the index has released its references, so only the model's remain
+    for (std::map<uint64_t, StressValue *>::iterator it = model.begin(); it != model.end(); it++)
+        StressTraits::releaseValue(it->second);
+    for (size_t i = 0; i < _allValues.size(); i++) {
+        if (0 != _allValues[i]->refcount || VALUE_DEAD != _allValues[i]->magic)
+            fail("value leaked or over-released", _allValues[i]->key);
+        delete _allValues[i];
+    }
+    
+    if (_failures) {
+        printf("%lld failures\n", (long long)_failures);
+        return 1;
+    }
+    printf("passed\n");
+    return 0;
+}
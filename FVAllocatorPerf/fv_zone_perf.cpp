@@ -0,0 +1,565 @@
+//
+//  fv_zone_perf.cpp
+//  FVAllocatorPerf
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ Headless benchmark for fv_zone.  Unlike FVAllocatorPerf.m, this doesn't need Cocoa or Quartz, so it
+ also builds on Linux, where the zone uses mmap(2) and mremap(2) instead of Mach VM.  See the Makefile
+ in this directory.
+
+ Two workloads are run against fv_zone and the system allocator:
+
+ - churn: random frees and allocations of bitmap-sized blocks between 1K and 8MB, so requests fall on
+   both sides of FV_VM_THRESHOLD and are mostly served from the zone's cache
+ - grow: a buffer repeatedly extended with realloc, as when accumulating data of unknown length; fv_zone
+   extends blocks in place where possible, and moves pages with mremap on Linux rather than copying
+ - size: the size() callback on live blocks, which CoreGraphics calls frequently, and on pointers from
+   another zone, as malloc_zone_from_ptr() does for every registered zone
+ - remote: render threads allocate bitmaps and hand them to the main thread, which frees them, as when a
+   CGImage drawn in the background is released on the main thread; fv_zone queues these frees without locking
+ - nodes: render threads on one NUMA node hand bitmaps to scalers on another, with one shared zone and then
+   with a zone per node, reporting how often a malloc returns memory that was placed on another node; with a
+   single node, threads are assigned to two simulated nodes
+ - scan: column-order reads of large bitmaps, as when tiling and scaling an image, with and without
+   fv_zone_set_huge_page_threshold(); on Linux this also reports dTLB read misses if perf events are
+   available, and how much of the process is backed by huge pages
+
+ Usage: fv_zone_perf [iterations] [slots]
+ */
+
+#include "fv_zone.h"
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+using namespace std;
+
+static double __now(void)
+{
+    struct timeval tv;
+    (void)gettimeofday(&tv, NULL);
+    return tv.tv_sec + double(tv.tv_usec) / 1000000;
+}
+
+static size_t __random_size(unsigned *seed)
+{
+    const unsigned r = rand_r(seed) % 100;
+    // small icons and labels, below the VM threshold
+    if (r < 20)
+        return 1024 + rand_r(seed) % 14336;
+    // thumbnails: 64-256 pixels square, 4 bytes per pixel
+    if (r < 60) {
+        const size_t w = 64 + rand_r(seed) % 193, h = 64 + rand_r(seed) % 193;
+        return w * h * 4;
+    }
+    // tiles and full-size images
+    if (r < 95)
+        return (rand_r(seed) % 2) ? 512 * 512 * 4 : 512 * (256 + rand_r(seed) % 257) * 4;
+    return 1048576 + (rand_r(seed) % 7340032);
+}
+
+static void __run_churn(malloc_zone_t *zone, const char *name, const size_t iterations, const size_t slotCount)
+{
+    vector<void *> slots(slotCount, (void *)NULL);
+    vector<size_t> slotIndexes(iterations), sizes(iterations);
+    unsigned seed = 17;
+    for (size_t i = 0; i < iterations; i++) {
+        slotIndexes[i] = rand_r(&seed) % slotCount;
+        sizes[i] = __random_size(&seed);
+    }
+
+    const double t1 = __now();
+    for (size_t i = 0; i < iterations; i++) {
+        void *&slot = slots[slotIndexes[i]];
+        if (slot) {
+            malloc_zone_free(zone, slot);
+            slot = NULL;
+        }
+        else {
+            slot = malloc_zone_malloc(zone, sizes[i]);
+            // touch the first page, as a bitmap context would
+            *(char *)slot = 1;
+        }
+    }
+    const double t2 = __now();
+    for (size_t i = 0; i < slotCount; i++)
+        malloc_zone_free(zone, slots[i]);
+
+    fprintf(stdout, "churn  %-10s %10.1f ns/op\n", name, (t2 - t1) * 1e9 / iterations);
+}
+
+static void __run_grow(malloc_zone_t *zone, const char *name, const size_t repetitions)
+{
+    const size_t maxSize = 64 * 1048576, step = 65536;
+    size_t moves = 0, reallocs = 0;
+    const double t1 = __now();
+    for (size_t r = 0; r < repetitions; r++) {
+        size_t size = step;
+        char *buffer = (char *)malloc_zone_malloc(zone, size);
+        memset(buffer, 0, size);
+        while (size < maxSize) {
+            const size_t newSize = size + step;
+            char *newBuffer = (char *)malloc_zone_realloc(zone, buffer, newSize);
+            if (newBuffer != buffer) moves++;
+            // write to the new part of the buffer
+            memset(newBuffer + size, r, step);
+            buffer = newBuffer;
+            size = newSize;
+            reallocs++;
+        }
+        malloc_zone_free(zone, buffer);
+    }
+    const double t2 = __now();
+    fprintf(stdout, "grow   %-10s %10.1f us/realloc %8lu reallocs %6lu moved\n", name, (t2 - t1) * 1e6 / reallocs, (unsigned long)reallocs, (unsigned long)moves);
+}
+
+static volatile size_t _sizeSink;
+
+static void __run_size(malloc_zone_t *zone, const char *name, const size_t iterations)
+{
+    const size_t count = 1000;
+    vector<void *> blocks(count), foreign(count);
+    unsigned seed = 23;
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = malloc_zone_malloc(zone, __random_size(&seed));
+        foreign[i] = malloc(64 + i);
+    }
+    
+    size_t total = 0;
+    double t1 = __now();
+    for (size_t i = 0; i < iterations; i++)
+        total += zone->size(zone, blocks[i % count]);
+    const double ownTime = __now() - t1;
+    
+    t1 = __now();
+    for (size_t i = 0; i < iterations; i++)
+        total += zone->size(zone, foreign[i % count]);
+    const double foreignTime = __now() - t1;
+    
+    for (size_t i = 0; i < count; i++) {
+        malloc_zone_free(zone, blocks[i]);
+        free(foreign[i]);
+    }
+    // keep the loops from being optimized away
+    _sizeSink = total;
+    fprintf(stdout, "size   %-10s %10.1f ns/op %10.1f ns/op (foreign)\n", name, ownTime * 1e9 / iterations, foreignTime * 1e9 / iterations);
+}
+
+#define REMOTE_RING_SIZE 256
+
+// single-producer, single-consumer ring from a render thread to the main thread
+typedef struct _remote_ring_t {
+    malloc_zone_t  *zone;
+    size_t          count;
+    volatile size_t head;    /* written by the consumer */
+    volatile size_t tail;    /* written by the producer */
+    void           *blocks[REMOTE_RING_SIZE];
+    double          mallocTime;
+} remote_ring_t;
+
+static void *__remote_producer(void *context)
+{
+    remote_ring_t *ring = (remote_ring_t *)context;
+    unsigned seed = (unsigned)(uintptr_t)ring;
+    double elapsed = 0;
+    for (size_t i = 0; i < ring->count; i++) {
+        while (ring->tail - ring->head == REMOTE_RING_SIZE)
+            sched_yield();
+        const size_t size = __random_size(&seed);
+        const double t1 = __now();
+        void *block = malloc_zone_malloc(ring->zone, size);
+        elapsed += __now() - t1;
+        *(char *)block = 1;
+        ring->blocks[ring->tail % REMOTE_RING_SIZE] = block;
+        __sync_synchronize();
+        ring->tail++;
+    }
+    ring->mallocTime = elapsed;
+    return NULL;
+}
+
+static void __run_remote(malloc_zone_t *zone, const char *name, const size_t iterations, const size_t threadCount)
+{
+    vector<remote_ring_t> rings(threadCount);
+    vector<pthread_t> threads(threadCount);
+    for (size_t t = 0; t < threadCount; t++) {
+        memset(&rings[t], 0, sizeof(remote_ring_t));
+        rings[t].zone = zone;
+        rings[t].count = iterations / threadCount;
+        (void) pthread_create(&threads[t], NULL, __remote_producer, &rings[t]);
+    }
+    
+    // the main thread frees everything
+    size_t freed = 0, remaining = threadCount * (iterations / threadCount);
+    double freeTime = 0;
+    while (remaining) {
+        bool idle = true;
+        for (size_t t = 0; t < threadCount; t++) {
+            remote_ring_t &ring = rings[t];
+            while (ring.head != ring.tail) {
+                __sync_synchronize();
+                void *block = ring.blocks[ring.head % REMOTE_RING_SIZE];
+                const double t1 = __now();
+                malloc_zone_free(zone, block);
+                freeTime += __now() - t1;
+                ring.head++;
+                freed++;
+                remaining--;
+                idle = false;
+            }
+        }
+        if (idle) sched_yield();
+    }
+    
+    double mallocTime = 0;
+    for (size_t t = 0; t < threadCount; t++) {
+        (void) pthread_join(threads[t], NULL);
+        mallocTime += rings[t].mallocTime;
+    }
+    fprintf(stdout, "remote %-10s %10.1f ns/free %10.1f ns/malloc (%lu threads)\n", name, freeTime * 1e9 / freed, mallocTime * 1e9 / freed, (unsigned long)threadCount);
+}
+
+/*
+ Render threads on each node hand bitmaps to a scaler on the next node, which allocates a smaller copy and
+ frees the original, as when a tile drawn on one socket is scaled and cached on the other.  Each block is
+ stamped with the node that first touched it, which is where the kernel placed its pages, so a malloc that
+ returns a block stamped with another node means the caller will be writing remote memory.
+ */
+#define NODE_STAMP 0x66766e6f64650000ULL
+
+typedef struct _node_stamp_t {
+    uint64_t magic;
+    unsigned node;
+    size_t   size;  /* requested size, since the block may be from another zone */
+} node_stamp_t;
+
+typedef struct _node_thread_t {
+    malloc_zone_t  **zones;       /* one per node, or the same zone repeated */
+    unsigned         node;        /* node this thread runs on */
+    bool             simulated;   /* node is assigned rather than measured */
+    remote_ring_t   *input;       /* for scalers; NULL for render threads */
+    remote_ring_t   *output;      /* for render threads */
+    size_t           mallocs;
+    size_t           remoteMallocs;
+} node_thread_t;
+
+// pin to the node's CPUs; returns false if the system doesn't say which they are
+static bool __bind_to_node(unsigned node)
+{
+#if defined(__linux__)
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if (NULL == file)
+        return false;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    unsigned first, last;
+    char separator = ',';
+    while (',' == separator && fscanf(file, "%u", &first) == 1) {
+        last = first;
+        if (fscanf(file, "%c", &separator) == 1 && '-' == separator) {
+            if (fscanf(file, "%u", &last) != 1) break;
+            if (fscanf(file, "%c", &separator) != 1) separator = '\n';
+        }
+        for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &cpus);
+    }
+    fclose(file);
+    return 0 == sched_setaffinity(0, sizeof(cpus), &cpus);
+#else
+    return false;
+#endif
+}
+
+static void *__node_malloc(node_thread_t *thread, size_t size)
+{
+    const unsigned node = thread->simulated ? thread->node : fv_zone_current_node();
+    node_stamp_t *block = (node_stamp_t *)malloc_zone_malloc(thread->zones[node], size);
+    thread->mallocs++;
+    if (NODE_STAMP == block->magic) {
+        if (block->node != node)
+            thread->remoteMallocs++;
+    }
+    else {
+        // new pages, which are placed on this node when first written
+        block->magic = NODE_STAMP;
+        block->node = node;
+    }
+    block->size = size;
+    return block;
+}
+
+static void *__node_render_thread(void *context)
+{
+    node_thread_t *thread = (node_thread_t *)context;
+    remote_ring_t *ring = thread->output;
+    unsigned seed = thread->node + 1;
+    if (false == thread->simulated) (void) __bind_to_node(thread->node);
+    for (size_t i = 0; i < ring->count; i++) {
+        while (ring->tail - ring->head == REMOTE_RING_SIZE)
+            sched_yield();
+        void *block = __node_malloc(thread, __random_size(&seed));
+        ring->blocks[ring->tail % REMOTE_RING_SIZE] = block;
+        __sync_synchronize();
+        ring->tail++;
+    }
+    return NULL;
+}
+
+#define NODE_CACHE_SIZE 64
+
+static void *__node_scaler_thread(void *context)
+{
+    node_thread_t *thread = (node_thread_t *)context;
+    remote_ring_t *ring = thread->input;
+    if (false == thread->simulated) (void) __bind_to_node(thread->node);
+    
+    // scaled copies are cached for a while, then evicted
+    void *cache[NODE_CACHE_SIZE] = { NULL };
+    size_t done = 0;
+    while (done < ring->count) {
+        if (ring->head == ring->tail) {
+            sched_yield();
+            continue;
+        }
+        __sync_synchronize();
+        void *block = ring->blocks[ring->head % REMOTE_RING_SIZE];
+        // requests are at least 1K, so a quarter is larger than the stamp
+        const size_t size = ((node_stamp_t *)block)->size / 4;
+        void *scaled = __node_malloc(thread, size);
+        memcpy((char *)scaled + sizeof(node_stamp_t), (char *)block + sizeof(node_stamp_t), min(size, (size_t)4096) - sizeof(node_stamp_t));
+        // free through the local zone, as a CFAllocator from FVAllocatorGetDefault() would
+        malloc_zone_free(thread->zones[thread->node], block);
+        ring->head++;
+        
+        void *&slot = cache[done % NODE_CACHE_SIZE];
+        if (slot) malloc_zone_free(thread->zones[thread->node], slot);
+        slot = scaled;
+        done++;
+    }
+    for (size_t i = 0; i < NODE_CACHE_SIZE; i++)
+        if (cache[i]) malloc_zone_free(thread->zones[thread->node], cache[i]);
+    return NULL;
+}
+
+static void __run_nodes(malloc_zone_t **zones, unsigned nodeCount, bool simulated, const char *name, const size_t iterations)
+{
+    vector<remote_ring_t> rings(nodeCount);
+    vector<node_thread_t> threads(2 * nodeCount);
+    vector<pthread_t> tids(2 * nodeCount);
+    
+    const double t1 = __now();
+    for (unsigned n = 0; n < nodeCount; n++) {
+        memset(&rings[n], 0, sizeof(remote_ring_t));
+        rings[n].count = iterations / nodeCount;
+        node_thread_t *render = &threads[2 * n], *scaler = &threads[2 * n + 1];
+        memset(render, 0, sizeof(node_thread_t));
+        render->zones = zones;
+        render->node = n;
+        render->simulated = simulated;
+        render->output = &rings[n];
+        // the scaler for this ring runs on the next node
+        *scaler = *render;
+        scaler->node = (n + 1) % nodeCount;
+        scaler->output = NULL;
+        scaler->input = &rings[n];
+        (void) pthread_create(&tids[2 * n], NULL, __node_render_thread, render);
+        (void) pthread_create(&tids[2 * n + 1], NULL, __node_scaler_thread, scaler);
+    }
+    size_t mallocs = 0, remoteMallocs = 0;
+    for (unsigned t = 0; t < 2 * nodeCount; t++) {
+        (void) pthread_join(tids[t], NULL);
+        mallocs += threads[t].mallocs;
+        remoteMallocs += threads[t].remoteMallocs;
+    }
+    const double t2 = __now();
+    fprintf(stdout, "nodes  %-10s %10.1f ns/bitmap %6.1f%% of mallocs reused remote memory (%u %snodes)\n", name, (t2 - t1) * 1e9 / iterations, mallocs ? 100.0 * remoteMallocs / mallocs : 0.0, nodeCount, simulated ? "simulated " : "");
+}
+
+// returns -1 if the counter isn't available (no PMU in a VM, or perf_event_paranoid is too strict)
+static int __open_tlb_counter(void)
+{
+#if defined(__linux__)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void __start_tlb_counter(int fd)
+{
+#if defined(__linux__)
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static long long __stop_tlb_counter(int fd)
+{
+    long long count = -1;
+#if defined(__linux__)
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (sizeof(count) != read(fd, &count, sizeof(count)))
+            count = -1;
+    }
+#endif
+    return count;
+}
+
+// kilobytes of anonymous memory backed by huge pages, or -1 if unknown
+static long __huge_page_kbytes(void)
+{
+    long total = -1;
+#if defined(__linux__)
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    while (file && fgets(line, sizeof(line), file)) {
+        long kbytes;
+        if (1 == sscanf(line, "AnonHugePages: %ld kB", &kbytes))
+            total = kbytes;
+    }
+    if (file) fclose(file);
+#endif
+    return total;
+}
+
+static void __run_scan(malloc_zone_t *zone, const char *name, const size_t passes)
+{
+    // 2048 x 2048 ARGB, the size of a large tile mosaic
+    const size_t count = 8, width = 2048, height = 2048, rowBytes = width * 4;
+    vector<uint32_t *> bitmaps(count);
+    for (size_t i = 0; i < count; i++) {
+        bitmaps[i] = (uint32_t *)malloc_zone_malloc(zone, rowBytes * height);
+        memset(bitmaps[i], i, rowBytes * height);
+    }
+    const long hugeKbytes = __huge_page_kbytes();
+    
+    // each read in a column is on a different 4K page
+    const int fd = __open_tlb_counter();
+    size_t total = 0, reads = 0;
+    __start_tlb_counter(fd);
+    const double t1 = __now();
+    for (size_t p = 0; p < passes; p++) {
+        for (size_t i = 0; i < count; i++) {
+            const uint32_t *bitmap = bitmaps[i];
+            for (size_t x = 0; x < width; x += 16) {
+                for (size_t y = 0; y < height; y++)
+                    total += bitmap[y * width + x];
+                reads += height;
+            }
+        }
+    }
+    const double t2 = __now();
+    const long long misses = __stop_tlb_counter(fd);
+    if (fd >= 0) close(fd);
+    _sizeSink = total;
+    
+    for (size_t i = 0; i < count; i++)
+        malloc_zone_free(zone, bitmaps[i]);
+    
+    fprintf(stdout, "scan   %-10s %10.2f ns/read ", name, (t2 - t1) * 1e9 / reads);
+    if (misses >= 0)
+        fprintf(stdout, "%8.3f dTLB misses/read ", double(misses) / reads);
+    else
+        fprintf(stdout, "     n/a dTLB misses/read ");
+    if (hugeKbytes >= 0)
+        fprintf(stdout, "%6ld MB in huge pages\n", hugeKbytes / 1024);
+    else
+        fprintf(stdout, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    const size_t slotCount = argc > 2 ? strtoul(argv[2], NULL, 10) : 500;
+
+    malloc_zone_t *zone = fv_create_zone_named("fv_zone_perf");
+    malloc_zone_t *systemZone = malloc_default_zone();
+    malloc_zone_t *hugeZone = fv_create_zone_named("fv_zone_perf_huge");
+    fv_zone_set_huge_page_threshold(hugeZone, 2097152);
+
+    fprintf(stdout, "%lu operations over %lu live slots, 1K-8MB requests\n", (unsigned long)iterations, (unsigned long)slotCount);
+    // grow runs first, since churn raises glibc's dynamic mmap threshold and the system allocator then extends its heap instead
+    __run_grow(zone, "fv_zone", 4);
+    __run_grow(systemZone, "system", 4);
+    __run_churn(zone, "fv_zone", iterations, slotCount);
+    __run_churn(systemZone, "system", iterations, slotCount);
+    __run_size(zone, "fv_zone", 10 * iterations);
+    __run_remote(zone, "fv_zone", iterations / 4, 2);
+    __run_remote(systemZone, "system", iterations / 4, 2);
+    
+    // shared zone, as FVAllocator uses by default, then a zone per node as with FVAllocatorZonePerNode
+    const bool simulated = fv_zone_node_count() < 2;
+    const unsigned nodeCount = simulated ? 2 : fv_zone_node_count();
+    malloc_zone_t *sharedZones[FV_ZONE_MAX_NODES], *nodeZones[FV_ZONE_MAX_NODES];
+    for (unsigned n = 0; n < nodeCount; n++) {
+        sharedZones[n] = zone;
+        nodeZones[n] = fv_create_zone_named("fv_zone_perf_node");
+    }
+    __run_nodes(sharedZones, nodeCount, simulated, "shared", iterations / 4);
+    __run_nodes(nodeZones, nodeCount, simulated, "per-node", iterations / 4);
+    for (unsigned n = 0; n < nodeCount; n++)
+        malloc_destroy_zone(nodeZones[n]);
+    
+    __run_scan(zone, "4K pages", 8);
+    __run_scan(hugeZone, "huge pages", 8);
+
+    malloc_destroy_zone(hugeZone);
+    malloc_destroy_zone(zone);
+    return 0;
+}
@@ -0,0 +1,667 @@
+//
+//  fv_zone_suite.cpp
+//  FVAllocatorPerf
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ Multi-threaded benchmark suite for fv_zone.  Each run replays an allocation trace on 1..N threads against
+ a fresh fv_zone or the system allocator, and reports throughput, per-operation latency percentiles, and
+ resident memory sampled while the run is in progress.  Like fv_zone_perf.cpp, this only needs libc, so
+ it builds on Linux as well as Mac OS X; see the Makefile in this directory.
+
+ Built-in traces, modeled on FileView's own requests:
+
+ - thumbnail: a cache of icon bitmap contexts (32-512 pixels, ARGB, rows padded as by
+   FVPaddedRowBytesForWidth), with small label and text blocks mixed in
+ - image: full-size image rasters of 0.5-12 megapixels, a few alive at a time
+ - tiles: the planar and interleaved buffers created by __FVTileAndScale_8888_or_888_Image for each
+   tile of an image, allocated and freed in LIFO order while the destination image stays alive
+
+ A trace can also be read from a file, one operation per line, and each thread replays it with its own
+ slots:
+
+    m <slot> <size>     allocate size bytes and keep the pointer in slot
+    f <slot>            free the pointer in slot
+
+ Every operation is timed individually.  New blocks have one byte written on each page, as drawing into a
+ bitmap would, outside the timed region.  Memory still held at the end of a trace is freed, and resident
+ memory is measured again once all threads are done, which shows how much the allocator keeps cached.
+
+ Results are printed as a table, or with -j as JSON, one object per line, so they can be compared between
+ releases.  The first line describes the machine and options; each run adds one line.
+
+ Usage: fv_zone_suite [-j] [-t trace|path]... [-a fv_zone|system]... [-p threads] [-n ops] [-i ms] [-s seed]
+
+    -j    JSON output
+    -t    trace to run; may be repeated (default: thumbnail, image, tiles)
+    -a    allocator to run; may be repeated (default: fv_zone, system)
+    -p    maximum thread count, run with 1, 2, 4... threads (default: twice the processor count), or a
+          comma-separated list of thread counts
+    -n    operations per thread, overriding the default for each trace
+    -i    interval between resident memory samples in milliseconds (default: 10)
+    -s    random seed (default: 1)
+ */
+
+#include "fv_zone.h"
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/utsname.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#endif
+using namespace std;
+
+#pragma mark Timing and memory
+
+static uint64_t __now_ns(void)
+{
+#if defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+    if (0 == timebase.denom)
+        (void) mach_timebase_info(&timebase);
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// resident size of this process in kilobytes, or 0 if unknown
+static size_t __resident_kbytes(void)
+{
+#if defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (KERN_SUCCESS != task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count))
+        return 0;
+    return info.resident_size / 1024;
+#else
+    unsigned long pages = 0, residentPages = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (NULL == file)
+        return 0;
+    if (2 != fscanf(file, "%lu %lu", &pages, &residentPages))
+        residentPages = 0;
+    fclose(file);
+    return residentPages * (getpagesize() / 1024);
+#endif
+}
+
+static size_t __processor_count(void)
+{
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+
+#pragma mark Traces
+
+typedef struct _fv_trace_op_t {
+    uint32_t slot;
+    size_t   size;     /* 0 to free the slot */
+} fv_trace_op_t;
+
+typedef vector<fv_trace_op_t> fv_trace_t;
+
+// same rounding as FVBitmapContext.m
+static size_t __padded_row_bytes(const size_t bytesPerSample, const size_t pixelsWide)
+{
+    size_t rowBytes = (bytesPerSample * pixelsWide + 63) & ~(size_t)63;
+    while (0 == (rowBytes & (rowBytes - 1)))
+        rowBytes += 64;
+    return rowBytes;
+}
+
+static void __trace_toggle(fv_trace_t &trace, vector<bool> &live, const uint32_t slot, const size_t size)
+{
+    fv_trace_op_t op = { slot, live[slot] ? 0 : size };
+    live[slot] = !live[slot];
+    trace.push_back(op);
+}
+
+// icon cache: random slots are filled or evicted, so blocks have varying lifetimes
+static fv_trace_t __thumbnail_trace(const size_t count, unsigned seed)
+{
+    static const size_t sides[] = { 32, 64, 128, 128, 256, 256, 256, 512 };
+    const uint32_t slotCount = 256;
+    vector<bool> live(slotCount, false);
+    fv_trace_t trace;
+    trace.reserve(count);
+    while (trace.size() < count) {
+        const uint32_t slot = rand_r(&seed) % slotCount;
+        size_t size;
+        if (rand_r(&seed) % 5 == 0) {
+            // text labels and other small blocks, below FV_VM_THRESHOLD
+            size = 256 + rand_r(&seed) % 16384;
+        }
+        else {
+            // icons are rarely square, but one side is usually the nominal size
+            const size_t side = sides[rand_r(&seed) % (sizeof(sides) / sizeof(sides[0]))];
+            const size_t other = side / 2 + rand_r(&seed) % (side / 2 + 1);
+            size = __padded_row_bytes(4, side) * other;
+        }
+        __trace_toggle(trace, live, slot, size);
+    }
+    return trace;
+}
+
+// a few large rasters, decoded and discarded as the user scrolls
+static fv_trace_t __image_trace(const size_t count, unsigned seed)
+{
+    const uint32_t slotCount = 6;
+    vector<bool> live(slotCount, false);
+    fv_trace_t trace;
+    trace.reserve(count);
+    while (trace.size() < count) {
+        const uint32_t slot = rand_r(&seed) % slotCount;
+        // 800x600 to 4000x3000
+        const size_t width = 800 + rand_r(&seed) % 3201;
+        const size_t height = width * 3 / 4;
+        __trace_toggle(trace, live, slot, __padded_row_bytes(4, width) * height);
+    }
+    return trace;
+}
+
+/*
+ Buffers from __FVTileAndScale_8888_or_888_Image: for each tile, four planar buffers and an interleaved
+ region buffer at the tile size, then the scaled tile, all freed before the next tile.  The destination
+ image is allocated first and freed at the end.
+ */
+static fv_trace_t __tiles_trace(const size_t count, unsigned seed)
+{
+    enum { destSlot, planeSlot, regionSlot = planeSlot + 4, scaledSlot, slotCount };
+    fv_trace_t trace;
+    trace.reserve(count + 2 * slotCount);
+    while (trace.size() < count) {
+        const size_t tileWidth = 512 + rand_r(&seed) % 513;
+        const size_t tileHeight = 4 + rand_r(&seed) % 61;
+        const double scale = 0.1 + (rand_r(&seed) % 90) / 100.0;
+        const size_t tileCount = 16 + rand_r(&seed) % 241;
+        const size_t scaledWidth = size_t(tileWidth * scale) + 1, scaledHeight = size_t(tileHeight * scale) + 1;
+        const size_t columns = 1 + rand_r(&seed) % 4;
+        
+        fv_trace_op_t op = { destSlot, __padded_row_bytes(4, scaledWidth * columns) * scaledHeight * (tileCount / columns + 1) };
+        trace.push_back(op);
+        for (size_t t = 0; t < tileCount && trace.size() < count; t++) {
+            for (uint32_t p = 0; p < 4; p++) {
+                fv_trace_op_t plane = { planeSlot + p, __padded_row_bytes(1, tileWidth) * tileHeight };
+                trace.push_back(plane);
+            }
+            fv_trace_op_t region = { regionSlot, __padded_row_bytes(4, tileWidth) * tileHeight };
+            fv_trace_op_t scaled = { scaledSlot, __padded_row_bytes(4, scaledWidth) * scaledHeight };
+            trace.push_back(region);
+            trace.push_back(scaled);
+            for (uint32_t s = planeSlot; s < slotCount; s++) {
+                fv_trace_op_t release = { s, 0 };
+                trace.push_back(release);
+            }
+        }
+        fv_trace_op_t release = { destSlot, 0 };
+        trace.push_back(release);
+    }
+    return trace;
+}
+
+static bool __read_trace(const char *path, fv_trace_t &trace)
+{
+    FILE *file = fopen(path, "r");
+    if (NULL == file)
+        return false;
+    
+    char line[256];
+    unsigned lineNumber = 0;
+    bool ok = true;
+    vector<bool> live;
+    while (ok && fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        unsigned long slot, size;
+        fv_trace_op_t op;
+        if ('#' == line[0] || '\n' == line[0])
+            continue;
+        if (2 == sscanf(line, "m %lu %lu", &slot, &size) && size > 0) {
+            op.slot = slot;
+            op.size = size;
+        }
+        else if (1 == sscanf(line, "f %lu", &slot)) {
+            op.slot = slot;
+            op.size = 0;
+        }
+        else {
+            fprintf(stderr, "%s:%u: unrecognized operation\n", path, lineNumber);
+            ok = false;
+            break;
+        }
+        if (op.slot >= live.size())
+            live.resize(op.slot + 1, false);
+        // replaying would leak or free a bad pointer
+        if (live[op.slot] == (0 == op.size)) {
+            live[op.slot] = (0 != op.size);
+            trace.push_back(op);
+        }
+        else {
+            fprintf(stderr, "%s:%u: slot %lu is %s\n", path, lineNumber, slot, live[op.slot] ? "already in use" : "not in use");
+            ok = false;
+        }
+    }
+    fclose(file);
+    return ok && trace.size() > 0;
+}
+
+typedef struct _fv_trace_spec_t {
+    const char *name;
+    fv_trace_t (*generate)(const size_t count, unsigned seed);
+    size_t      defaultCount;    /* operations per thread */
+} fv_trace_spec_t;
+
+static const fv_trace_spec_t _traces[] = {
+    { "thumbnail", __thumbnail_trace, 400000 },
+    { "image",     __image_trace,       4000 },
+    { "tiles",     __tiles_trace,     400000 }
+};
+
+#pragma mark Runs
+
+typedef struct _fv_thread_result_t {
+    pthread_t        thread;
+    malloc_zone_t   *zone;
+    const fv_trace_t *trace;
+    vector<uint32_t> latencies;    /* nanoseconds for each operation */
+    uint64_t         elapsed;      /* nanoseconds for the whole trace, including page touches */
+} fv_thread_result_t;
+
+static pthread_mutex_t _startLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  _startCondition = PTHREAD_COND_INITIALIZER;
+static bool            _started = false;
+static volatile char   _touchSink;
+
+static void *__replay_trace(void *context)
+{
+    fv_thread_result_t *result = (fv_thread_result_t *)context;
+    malloc_zone_t *zone = result->zone;
+    const fv_trace_t &trace = *result->trace;
+    const size_t pageSize = getpagesize();
+    
+    uint32_t slotCount = 0;
+    for (fv_trace_t::const_iterator it = trace.begin(); it != trace.end(); it++)
+        slotCount = max(slotCount, it->slot + 1);
+    vector<char *> slots(slotCount, (char *)NULL);
+    result->latencies.resize(trace.size());
+    
+    // all threads start together, so they contend for the allocator
+    pthread_mutex_lock(&_startLock);
+    while (false == _started)
+        pthread_cond_wait(&_startCondition, &_startLock);
+    pthread_mutex_unlock(&_startLock);
+    
+    const uint64_t start = __now_ns();
+    for (size_t i = 0; i < trace.size(); i++) {
+        const fv_trace_op_t &op = trace[i];
+        char *&slot = slots[op.slot];
+        uint64_t t1, t2;
+        if (op.size) {
+            t1 = __now_ns();
+            slot = (char *)malloc_zone_malloc(zone, op.size);
+            t2 = __now_ns();
+            for (size_t offset = 0; offset < op.size; offset += pageSize)
+                slot[offset] = (char)i;
+        }
+        else {
+            t1 = __now_ns();
+            malloc_zone_free(zone, slot);
+            t2 = __now_ns();
+            slot = NULL;
+        }
+        result->latencies[i] = (uint32_t)min(t2 - t1, (uint64_t)UINT32_MAX);
+    }
+    result->elapsed = __now_ns() - start;
+    
+    for (uint32_t s = 0; s < slotCount; s++) {
+        if (slots[s]) {
+            _touchSink = *slots[s];
+            malloc_zone_free(zone, slots[s]);
+        }
+    }
+    return NULL;
+}
+
+typedef struct _fv_rss_sampler_t {
+    pthread_t               thread;
+    uint64_t                interval;    /* nanoseconds */
+    uint64_t                start;
+    volatile bool           stop;
+    vector< pair<double, size_t> > samples;    /* milliseconds since start, kilobytes */
+} fv_rss_sampler_t;
+
+static void *__sample_rss(void *context)
+{
+    fv_rss_sampler_t *sampler = (fv_rss_sampler_t *)context;
+    while (false == sampler->stop) {
+        sampler->samples.push_back(make_pair((__now_ns() - sampler->start) / 1e6, __resident_kbytes()));
+        usleep(sampler->interval / 1000);
+    }
+    return NULL;
+}
+
+typedef struct _fv_run_result_t {
+    size_t   operations;
+    double   seconds;
+    double   meanLatency;    /* all in nanoseconds */
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t p999;
+    uint32_t maxLatency;
+    size_t   startKbytes;
+    size_t   peakKbytes;
+    size_t   endKbytes;      /* after freeing everything, before destroying the zone */
+    vector< pair<double, size_t> > samples;
+    bool     hasZoneStats;
+    fv_zone_statistics_t zoneStats;
+} fv_run_result_t;
+
+static uint32_t __percentile(vector<uint32_t> &values, const double fraction)
+{
+    const size_t index = min(values.size() - 1, (size_t)(fraction * values.size()));
+    nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+static void __run(const fv_trace_t &trace, const bool useZone, const size_t threadCount, const uint64_t sampleInterval, fv_run_result_t *run)
+{
+    malloc_zone_t *zone = useZone ? fv_create_zone_named("fv_zone_suite") : malloc_default_zone();
+    vector<fv_thread_result_t> results(threadCount);
+    
+    _started = false;
+    for (size_t t = 0; t < threadCount; t++) {
+        results[t].zone = zone;
+        results[t].trace = &trace;
+        if (0 != pthread_create(&results[t].thread, NULL, __replay_trace, &results[t])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    
+    fv_rss_sampler_t sampler;
+    sampler.interval = sampleInterval;
+    sampler.stop = false;
+    sampler.start = __now_ns();
+    run->startKbytes = __resident_kbytes();
+    (void) pthread_create(&sampler.thread, NULL, __sample_rss, &sampler);
+    
+    const uint64_t start = __now_ns();
+    pthread_mutex_lock(&_startLock);
+    _started = true;
+    pthread_cond_broadcast(&_startCondition);
+    pthread_mutex_unlock(&_startLock);
+    
+    for (size_t t = 0; t < threadCount; t++)
+        (void) pthread_join(results[t].thread, NULL);
+    const uint64_t elapsed = __now_ns() - start;
+    
+    sampler.stop = true;
+    (void) pthread_join(sampler.thread, NULL);
+    run->endKbytes = __resident_kbytes();
+    sampler.samples.push_back(make_pair((__now_ns() - sampler.start) / 1e6, run->endKbytes));
+    run->samples.swap(sampler.samples);
+    
+    run->peakKbytes = run->startKbytes;
+    for (size_t i = 0; i < run->samples.size(); i++)
+        run->peakKbytes = max(run->peakKbytes, run->samples[i].second);
+    
+    run->hasZoneStats = useZone;
+    if (useZone) {
+        fv_zone_copy_statistics(zone, &run->zoneStats);
+        malloc_destroy_zone(zone);
+    }
+    
+    // merge latencies from all threads
+    vector<uint32_t> latencies;
+    latencies.reserve(trace.size() * threadCount);
+    for (size_t t = 0; t < threadCount; t++) {
+        latencies.insert(latencies.end(), results[t].latencies.begin(), results[t].latencies.end());
+        vector<uint32_t>().swap(results[t].latencies);
+    }
+    double sum = 0;
+    for (size_t i = 0; i < latencies.size(); i++)
+        sum += latencies[i];
+    
+    run->operations = latencies.size();
+    run->seconds = elapsed / 1e9;
+    run->meanLatency = sum / latencies.size();
+    run->maxLatency = *max_element(latencies.begin(), latencies.end());
+    run->p999 = __percentile(latencies, 0.999);
+    run->p99 = __percentile(latencies, 0.99);
+    run->p50 = __percentile(latencies, 0.5);
+}
+
+#pragma mark Output
+
+static void __print_json_string(const char *string)
+{
+    putchar('"');
+    for (const char *c = string; *c; c++) {
+        if ('"' == *c || '\\' == *c)
+            printf("\\%c", *c);
+        else if ((unsigned char)*c < 0x20)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+    putchar('"');
+}
+
+static void __print_json_header(const size_t operations, const unsigned seed, const uint64_t sampleInterval)
+{
+    struct utsname name;
+    memset(&name, 0, sizeof(name));
+    (void) uname(&name);
+    printf("{\"type\":\"machine\",\"version\":1,\"system\":");
+    __print_json_string(name.sysname);
+    printf(",\"release\":");
+    __print_json_string(name.release);
+    printf(",\"machine\":");
+    __print_json_string(name.machine);
+    printf(",\"processors\":%lu,\"page_size\":%d,\"operations\":%lu,\"seed\":%u,\"sample_interval_ms\":%.1f}\n", (unsigned long)__processor_count(), getpagesize(), (unsigned long)operations, seed, sampleInterval / 1e6);
+}
+
+static void __print_json_run(const char *traceName, const char *allocator, const size_t threadCount, const fv_run_result_t &run)
+{
+    printf("{\"type\":\"run\",\"trace\":");
+    __print_json_string(traceName);
+    printf(",\"allocator\":\"%s\",\"threads\":%lu,\"operations\":%lu,\"seconds\":%.6f,\"ops_per_second\":%.0f", allocator, (unsigned long)threadCount, (unsigned long)run.operations, run.seconds, run.operations / run.seconds);
+    printf(",\"latency_ns\":{\"mean\":%.1f,\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}", run.meanLatency, run.p50, run.p99, run.p999, run.maxLatency);
+    printf(",\"rss_kb\":{\"start\":%lu,\"peak\":%lu,\"end\":%lu,\"samples\":[", (unsigned long)run.startKbytes, (unsigned long)run.peakKbytes, (unsigned long)run.endKbytes);
+    for (size_t i = 0; i < run.samples.size(); i++)
+        printf("%s[%.1f,%lu]", i ? "," : "", run.samples[i].first, (unsigned long)run.samples[i].second);
+    printf("]}");
+    if (run.hasZoneStats) {
+        const fv_zone_statistics_t &s = run.zoneStats;
+        printf(",\"zone\":{\"magazine_hits\":%llu,\"free_list_hits\":%llu,\"misses\":%llu,\"collections\":%llu,\"bytes_released\":%llu,\"bytes_soft_released\":%llu,\"peak_allocated\":%lu,\"allocated\":%lu,\"free\":%lu}",
+               (unsigned long long)s.magazineHits, (unsigned long long)s.freeListHits, (unsigned long long)s.cacheMisses, (unsigned long long)s.collectionCount, (unsigned long long)s.bytesReleased, (unsigned long long)s.bytesSoftReleased, (unsigned long)s.peakAllocatedSize, (unsigned long)s.allocatedSize, (unsigned long)s.freeSize);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void __print_table_header(void)
+{
+    printf("%-10s %-8s %7s %10s %8s %8s %8s %9s %9s %9s %9s\n", "trace", "alloc", "threads", "ops/s", "mean ns", "p50 ns", "p99 ns", "max us", "peak MB", "end MB", "hit rate");
+}
+
+static void __print_table_run(const char *traceName, const char *allocator, const size_t threadCount, const fv_run_result_t &run)
+{
+    printf("%-10.10s %-8s %7lu %10.0f %8.0f %8u %8u %9.1f %9.1f %9.1f", traceName, allocator, (unsigned long)threadCount, run.operations / run.seconds, run.meanLatency, run.p50, run.p99, run.maxLatency / 1e3, run.peakKbytes / 1024.0, run.endKbytes / 1024.0);
+    if (run.hasZoneStats) {
+        const fv_zone_statistics_t &s = run.zoneStats;
+        const double hits = s.magazineHits + s.freeListHits;
+        printf(" %8.1f%%", hits + s.cacheMisses > 0 ? hits / (hits + s.cacheMisses) * 100 : 0.0);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+#pragma mark Options
+
+static void __usage(void)
+{
+    fprintf(stderr, "usage: fv_zone_suite [-j] [-t trace|path]... [-a fv_zone|system]... [-p threads] [-n ops] [-i ms] [-s seed]\n");
+    fprintf(stderr, "traces:");
+    for (size_t i = 0; i < sizeof(_traces) / sizeof(_traces[0]); i++)
+        fprintf(stderr, " %s", _traces[i].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static vector<size_t> __thread_counts(const char *arg)
+{
+    vector<size_t> counts;
+    if (strchr(arg, ',')) {
+        char *copy = strdup(arg), *last = NULL;
+        for (char *token = strtok_r(copy, ",", &last); token; token = strtok_r(NULL, ",", &last)) {
+            if (strtoul(token, NULL, 10) > 0)
+                counts.push_back(strtoul(token, NULL, 10));
+        }
+        free(copy);
+    }
+    else {
+        const size_t maximum = strtoul(arg, NULL, 10);
+        for (size_t count = 1; count < maximum; count *= 2)
+            counts.push_back(count);
+        if (maximum > 0)
+            counts.push_back(maximum);
+    }
+    return counts;
+}
+
+int main(int argc, char *argv[])
+{
+    bool json = false;
+    vector<string> traceNames, allocators;
+    vector<size_t> threadCounts;
+    size_t operations = 0;
+    uint64_t sampleInterval = 10000000;
+    unsigned seed = 1;
+    
+    int ch;
+    while ((ch = getopt(argc, argv, "jt:a:p:n:i:s:h")) != -1) {
+        switch (ch) {
+            case 'j':
+                json = true;
+                break;
+            case 't':
+                traceNames.push_back(optarg);
+                break;
+            case 'a':
+                if (strcmp(optarg, "fv_zone") && strcmp(optarg, "system"))
+                    __usage();
+                allocators.push_back(optarg);
+                break;
+            case 'p':
+                threadCounts = __thread_counts(optarg);
+                break;
+            case 'n':
+                operations = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                sampleInterval = max(1UL, strtoul(optarg, NULL, 10)) * 1000000ULL;
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                __usage();
+        }
+    }
+    if (optind < argc)
+        __usage();
+    
+    if (traceNames.empty()) {
+        for (size_t i = 0; i < sizeof(_traces) / sizeof(_traces[0]); i++)
+            traceNames.push_back(_traces[i].name);
+    }
+    if (allocators.empty()) {
+        allocators.push_back("fv_zone");
+        allocators.push_back("system");
+    }
+    if (threadCounts.empty()) {
+        char defaultCount[32];
+        snprintf(defaultCount, sizeof(defaultCount), "%lu", (unsigned long)(2 * __processor_count()));
+        threadCounts = __thread_counts(defaultCount);
+    }
+    
+    if (json)
+        __print_json_header(operations, seed, sampleInterval);
+    else
+        __print_table_header();
+    
+    for (size_t i = 0; i < traceNames.size(); i++) {
+        const char *traceName = traceNames[i].c_str();
+        fv_trace_t trace;
+        size_t s;
+        for (s = 0; s < sizeof(_traces) / sizeof(_traces[0]); s++) {
+            if (0 == strcmp(traceName, _traces[s].name)) {
+                trace = _traces[s].generate(operations ? operations : _traces[s].defaultCount, seed);
+                break;
+            }
+        }
+        if (trace.empty() && false == __read_trace(traceName, trace)) {
+            fprintf(stderr, "unable to read trace %s\n", traceName);
+            return 1;
+        }
+        // blocks still allocated at the end are freed after timing stops
+        if (operations && trace.size() > operations)
+            trace.resize(operations);
+        
+        for (size_t t = 0; t < threadCounts.size(); t++) {
+            for (size_t a = 0; a < allocators.size(); a++) {
+                fv_run_result_t run;
+                __run(trace, "fv_zone" == allocators[a], threadCounts[t], sampleInterval, &run);
+                if (json)
+                    __print_json_run(traceName, allocators[a].c_str(), threadCounts[t], run);
+                else
+                    __print_table_run(traceName, allocators[a].c_str(), threadCounts[t], run);
+            }
+        }
+    }
+    return 0;
+}
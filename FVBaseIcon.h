@@ -47,6 +47,7 @@
 {
 @private
     pthread_mutex_t  _mutex;
+    size_t           _recordedByteSize;
 @protected
     NSURL           *_fileURL;
     id               _cacheKey;
@@ -59,4 +60,16 @@
  @return YES if the lock was taken. */
 - (BOOL)tryLock;
 
+/** @internal @brief Bytes of bitmap data held by the icon.
+ 
+ Subclasses that keep rendered images override this to return their size, using FVCGImageUtilities.h::FVCGImageByteSize().  It's called with the lock held, each time the icon is unlocked, so it must be cheap.
+ @return The default implementation returns 0. */
+- (size_t)_imageByteSize;
+
 @end
+
+/** @internal @brief Bitmap data held by all icons.
+ 
+ Sum of FVBaseIcon::_imageByteSize for every live instance, as of the last time each was unlocked.  Icons that don't derive from FVBaseIcon, such as FVWebViewIcon and the shared Finder icons, aren't counted.  Safe to call from any thread.
+ @return Total size in bytes. */
+FV_PRIVATE_EXTERN size_t FVBaseIconGetImageByteSize(void);
@@ -39,6 +39,14 @@
 #import "FVBaseIcon.h"
 #import "FVIcon_Private.h"
 
+// sum of _recordedByteSize for all instances
+static volatile int64_t _totalImageByteSize = 0;
+
+size_t FVBaseIconGetImageByteSize(void)
+{
+    return (size_t)OSAtomicAdd64Barrier(0, &_totalImageByteSize);
+}
+
 @implementation FVBaseIcon
 
 - (id)initWithURL:(NSURL *)aURL
@@ -54,6 +62,9 @@
 
 - (void)dealloc
 {
+    // subclasses have released their images by now
+    if (_recordedByteSize)
+        OSAtomicAdd64Barrier(-(int64_t)_recordedByteSize, &_totalImageByteSize);
     pthread_mutex_destroy(&_mutex);
     [_fileURL release];
     [_cacheKey release];
@@ -62,7 +73,18 @@
 
 - (BOOL)tryLock { return pthread_mutex_trylock(&_mutex) == 0; }
 - (void)lock { pthread_mutex_lock(&_mutex); }
-- (void)unlock { pthread_mutex_unlock(&_mutex); }
 
+// images only change with the lock held, so this is where the total is kept current
+- (void)unlock
+{
+    size_t byteSize = [self _imageByteSize];
+    if (byteSize != _recordedByteSize) {
+        OSAtomicAdd64Barrier((int64_t)byteSize - (int64_t)_recordedByteSize, &_totalImageByteSize);
+        _recordedByteSize = byteSize;
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+- (size_t)_imageByteSize { return 0; }
 
 @end
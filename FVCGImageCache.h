@@ -52,6 +52,7 @@
 {
 @private;
     FVCacheFile *_cacheFile;
+    BOOL         _mapsImages;
 }
 
 /** @brief Key for caching.
@@ -91,4 +92,22 @@
  @param aKey The key representing the image, typically from FVCGImageCache::newKeyForURL:. */
 + (void)invalidateCachesForKey:(id)aKey;
 
+/** @brief Limit the image cache.
+ 
+ When the space used by cached images exceeds this, the least recently used images are evicted.  The default is 4 GB, or the FVImageCacheMegabytes default if it's set.
+ @param size Limit in bytes. */
++ (void)setMaximumImageCacheSize:(unsigned long long)size;
+
+/** @brief Limit the thumbnail cache.
+ 
+ Same as FVCGImageCache::setMaximumImageCacheSize: for thumbnails.  The default is 1 GB, or the FVThumbnailCacheMegabytes default if it's set.
+ @param size Limit in bytes. */
++ (void)setMaximumThumbnailCacheSize:(unsigned long long)size;
+
+/** @brief Usage statistics.
+ 
+ Use this to tune the cache limits.  Keys are "images" and "thumbnails", and each value is a dictionary of NSNumbers with keys "hits", "misses", "hitRate", "evictions", "evictedBytes", "compressed", "incompressible", "size" and "maximumSize", where sizes are in bytes, and "compressed" and "incompressible" count entries written compressed and entries stored as-is because they wouldn't compress.
+ @return A dictionary of dictionaries. */
++ (NSDictionary *)statistics;
+
 @end
@@ -48,6 +48,10 @@
 static CGImageRef FVCreateCGImageWithData(NSData *data);
 static CFDataRef FVCreateDataWithCGImage(CGImageRef image);
 
+// default limits for the space used in each cache file, overridden by FVImageCacheMegabytes and FVThumbnailCacheMegabytes
+#define FV_IMAGE_CACHE_MEGABYTES     4096
+#define FV_THUMBNAIL_CACHE_MEGABYTES 1024
+
 @implementation FVCGImageCache
 
 static FVCGImageCache *_bigImageCache = nil;
@@ -63,17 +67,34 @@ static FVCGImageCache *_smallImageCache = nil;
 {
     FVINITIALIZE(FVCGImageCache);
 
-    _bigImageCache = [FVCGImageCache new];
+    // thumbnails can survive relaunching the app, but since the directory is per-app it's opt-in
+    NSString *cacheDirectory = nil;
+    if ([[NSUserDefaults standardUserDefaults] boolForKey:@"FVPersistentImageCache"]) {
+        NSArray *paths = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES);
+        NSString *appName = [[NSBundle mainBundle] bundleIdentifier];
+        if ([paths count] && appName)
+            cacheDirectory = [[[paths objectAtIndex:0] stringByAppendingPathComponent:appName] stringByAppendingPathComponent:@"FileView"];
+    }
+    
+    _bigImageCache = [[FVCGImageCache alloc] initWithCacheDirectory:[cacheDirectory stringByAppendingPathComponent:@"Images"]];
     [_bigImageCache setName:@"full size images"];
-    _smallImageCache = [FVCGImageCache new];
+    _smallImageCache = [[FVCGImageCache alloc] initWithCacheDirectory:[cacheDirectory stringByAppendingPathComponent:@"Thumbnails"]];
     [_smallImageCache setName:@"thumbnail images"];
+    // thumbnails are small and redrawn constantly, so draw them straight from the file instead of inflating
+    _smallImageCache->_mapsImages = YES;
+    
+    NSInteger megabytes = [[NSUserDefaults standardUserDefaults] integerForKey:@"FVImageCacheMegabytes"];
+    [self setMaximumImageCacheSize:(unsigned long long)(megabytes > 0 ? megabytes : FV_IMAGE_CACHE_MEGABYTES) * 1024 * 1024];
+    megabytes = [[NSUserDefaults standardUserDefaults] integerForKey:@"FVThumbnailCacheMegabytes"];
+    [self setMaximumThumbnailCacheSize:(unsigned long long)(megabytes > 0 ? megabytes : FV_THUMBNAIL_CACHE_MEGABYTES) * 1024 * 1024];
 }
 
-- (id)init
+// nil directory uses a temporary file
+- (id)initWithCacheDirectory:(NSString *)path
 {
     self = [super init];
     if (self) {
-        _cacheFile = [FVCacheFile new];
+        _cacheFile = path ? [[FVCacheFile alloc] initWithDirectory:path] : [FVCacheFile new];
         
         [[NSNotificationCenter defaultCenter] addObserver:self 
                                                  selector:@selector(handleAppTerminate:) 
@@ -110,7 +131,10 @@ static FVCGImageCache *_smallImageCache = nil;
 - (void)cacheImage:(CGImageRef)image forKey:(id)aKey;
 {
     NSData *data = (NSData *)FVCreateDataWithCGImage(image);
-    [_cacheFile saveData:data forKey:aKey];
+    if (_mapsImages)
+        [_cacheFile saveData:data forKey:aKey options:FVCacheFileUncompressed];
+    else
+        [_cacheFile saveBitmapData:data forKey:aKey bytesPerRow:CGImageGetBytesPerRow(image) bytesPerPixel:CGImageGetBitsPerPixel(image) / 8];
     [data release];
 }
 
@@ -119,6 +143,28 @@ static FVCGImageCache *_smallImageCache = nil;
     [_cacheFile invalidateDataForKey:aKey];
 }
 
+- (void)setMaximumSize:(unsigned long long)size
+{
+    [_cacheFile setMaximumSize:size];
+}
+
+- (NSDictionary *)statistics
+{
+    FVCacheFileStatistics stats;
+    [_cacheFile getStatistics:&stats];
+    const uint64_t readCount = stats.hitCount + stats.missCount;
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithUnsignedLongLong:stats.hitCount], @"hits",
+            [NSNumber numberWithUnsignedLongLong:stats.missCount], @"misses",
+            [NSNumber numberWithDouble:readCount ? (double)stats.hitCount / readCount : 0], @"hitRate",
+            [NSNumber numberWithUnsignedLongLong:stats.evictionCount], @"evictions",
+            [NSNumber numberWithUnsignedLongLong:stats.evictedBytes], @"evictedBytes",
+            [NSNumber numberWithUnsignedLongLong:stats.compressedCount], @"compressed",
+            [NSNumber numberWithUnsignedLongLong:stats.incompressibleCount], @"incompressible",
+            [NSNumber numberWithUnsignedLongLong:stats.size], @"size",
+            [NSNumber numberWithUnsignedLongLong:stats.maximumSize], @"maximumSize", nil];
+}
+
 #pragma mark Class methods
 
 #pragma clang diagnostic push
@@ -156,67 +202,84 @@ static FVCGImageCache *_smallImageCache = nil;
     [_smallImageCache invalidateCachedImageForKey:aKey];
 }
 
++ (void)setMaximumImageCacheSize:(unsigned long long)size;
+{
+    [_bigImageCache setMaximumSize:size];
+}
+
++ (void)setMaximumThumbnailCacheSize:(unsigned long long)size;
+{
+    [_smallImageCache setMaximumSize:size];
+}
+
++ (NSDictionary *)statistics;
+{
+    return [NSDictionary dictionaryWithObjectsAndKeys:[_bigImageCache statistics], @"images", [_smallImageCache statistics], @"thumbnails", nil];
+}
+
 @end
 
 #pragma mark -
 
-#ifdef USE_IMAGEIO
-#undef USE_IMAGEIO
-#endif
+/*
+ Layout for all entries: bitmap data first, then an archived FVCGImageDescription without the bitmap, then the 
+ archive length as a uint64_t.  For uncompressed entries, the bitmap is page-aligned in the mapping, and the 
+ image's data provider retains the mapped NSData, so drawing reads the file's pages directly.  For compressed 
+ entries, the rows at the start are what FVCacheFile filters before compressing, and the provider retains the 
+ inflated copy instead.
+ */
 
-#define USE_IMAGEIO 0
+static CFDataRef FVCreateDataWithCGImage(CGImageRef image)
+{
+    FVCGImageDescription *imageDescription = [[FVCGImageDescription allocWithZone:FVDefaultZone()] initWithImage:image];
+    CFDataRef bitmapData = [imageDescription bitmapData];
+    [imageDescription setArchivesBitmapData:NO];
+    
+    NSMutableData *archive = [[NSMutableData allocWithZone:FVDefaultZone()] initWithCapacity:512];
+    NSArchiver *archiver = [[NSArchiver allocWithZone:FVDefaultZone()] initForWritingWithMutableData:archive];
+    [archiver encodeObject:imageDescription];
+    [archiver release];
+    
+    const uint64_t archiveLength = [archive length];
+    NSMutableData *mdata = [[NSMutableData allocWithZone:FVDefaultZone()] initWithCapacity:CFDataGetLength(bitmapData) + archiveLength + sizeof(uint64_t)];
+    [mdata appendBytes:CFDataGetBytePtr(bitmapData) length:CFDataGetLength(bitmapData)];
+    [mdata appendData:archive];
+    [mdata appendBytes:&archiveLength length:sizeof(uint64_t)];
+    [archive release];
+    [imageDescription release];
+    
+    return (CFDataRef)mdata;
+}
 
-// PNG and JPEG2000 are too slow when drawing, and TIFF is too big (although we could compress it)
-#define IMAGEIO_TYPE kUTTypeTIFF
+static void __FVReleaseMappedData(void *info, const void *data, size_t size)
+{
+    [(NSData *)info release];
+}
 
 static CGImageRef FVCreateCGImageWithData(NSData *data)
 {
     CGImageRef toReturn = NULL;
     
-    if (0 == [data length])
-        return toReturn; 
-
-#if USE_IMAGEIO
-    static NSDictionary *imageProperties = nil;
-    if (nil == imageProperties)
-        imageProperties = [[NSDictionary alloc] initWithObjectsAndKeys:[NSNumber numberWithInt:1.0], (id)kCGImageDestinationLossyCompressionQuality, nil];
+    const NSUInteger length = [data length];
+    uint64_t archiveLength;
+    if (length < sizeof(uint64_t))
+        return toReturn;
+    [data getBytes:&archiveLength range:NSMakeRange(length - sizeof(uint64_t), sizeof(uint64_t))];
+    if (archiveLength > length - sizeof(uint64_t))
+        return toReturn;
     
-    CGImageSourceRef imsrc = CGImageSourceCreateWithData((CFDataRef)data, (CFDictionaryRef)imageProperties);
-    if (imsrc && CGImageSourceGetCount(imsrc))
-        toReturn = CGImageSourceCreateImageAtIndex(imsrc, 0, NULL);
-    if (imsrc) CFRelease(imsrc);
-#else
-    NSUnarchiver *unarchiver = [[NSUnarchiver allocWithZone:FVDefaultZone()] initForReadingWithData:data];
+    const NSUInteger bitmapLength = length - sizeof(uint64_t) - archiveLength;
+    const uint8_t *bytes = (const uint8_t *)[data bytes];
+    NSData *archive = [[NSData allocWithZone:FVDefaultZone()] initWithBytesNoCopy:(void *)(bytes + bitmapLength) length:archiveLength freeWhenDone:NO];
+    NSUnarchiver *unarchiver = [[NSUnarchiver allocWithZone:FVDefaultZone()] initForReadingWithData:archive];
     // only retained by unarchiver
     FVCGImageDescription *imageDescription = [unarchiver decodeObject];
-    toReturn = [imageDescription newImage];
+    
+    // provider owns a reference to the mapping
+    CGDataProviderRef provider = CGDataProviderCreateWithData([data retain], bytes, bitmapLength, __FVReleaseMappedData);
+    toReturn = [imageDescription newImageWithDataProvider:provider];
+    CGDataProviderRelease(provider);
     [unarchiver release];
-#endif
+    [archive release];
     return toReturn;
 }
-
-static CFDataRef FVCreateDataWithCGImage(CGImageRef image)
-{
-#if USE_IMAGEIO
-    CFMutableDataRef data = CFDataCreateMutable(CFAllocatorGetDefault(), 0);
-    CGImageDestinationRef dest = CGImageDestinationCreateWithData(data, IMAGEIO_TYPE, 1, NULL);
-    CGImageDestinationAddImage(dest, image, NULL);
-    CGImageDestinationFinalize(dest);
-    if (dest) CFRelease(dest);
-#else
-    CFDataRef data = nil;
-    FVCGImageDescription *imageDescription = [[FVCGImageDescription allocWithZone:FVDefaultZone()] initWithImage:image];
-    
-    // do not call setLength:, even before writing the archive!
-    size_t approximateLength = CGImageGetBytesPerRow(image) * CGImageGetHeight(image) + 20 * sizeof(size_t);
-    NSMutableData *mdata = [[NSMutableData allocWithZone:FVDefaultZone()] initWithCapacity:approximateLength];
-    
-    NSArchiver *archiver = [[NSArchiver allocWithZone:FVDefaultZone()] initForWritingWithMutableData:(NSMutableData *)mdata];
-    [archiver encodeObject:imageDescription];
-    [imageDescription release];
-    [archiver release];
-    
-    data = (CFDataRef)mdata;
-#endif    
-    return data;
-}
@@ -62,6 +62,7 @@
     CGFloat                   *_decode;
     /* Not archived */
     CGImageRef                 _image;
+    bool                       _archivesBitmapData;
 }
 
 /** @internal 
@@ -81,4 +82,28 @@
  @return A CGImage based on the internal description. */
 - (CGImageRef)newImage;
 
+/** @internal 
+ 
+ @brief Bitmap data.
+ 
+ @return The image's bitmap data, or NULL if the instance was unarchived from an archive that didn't include it. */
+- (CFDataRef)bitmapData;
+
+/** @internal 
+ 
+ @brief Exclude the bitmap from archives.
+ 
+ By default, archives include the bitmap data.  An archive without it is only a few hundred bytes, so the bitmap can be stored separately (e.g., uncompressed and page-aligned) and passed to newImageWithDataProvider: after unarchiving.
+ @param flag NO to leave bitmap data out of archives written after this call. */
+- (void)setArchivesBitmapData:(BOOL)flag;
+
+/** @internal 
+ 
+ @brief Create a CGImage with separate bitmap data.
+ 
+ Creates a new CGImage from the internal description information and the given bitmap data, which must have the same layout as the original bitmap.  The image isn't cached by the receiver.
+ @param provider Bitmap data for the image.
+ @return A CGImage that the caller is responsible for releasing. */
+- (CGImageRef)newImageWithDataProvider:(CGDataProviderRef)provider;
+
 @end
@@ -52,6 +52,7 @@
         
         // retain in case we access the data provider's byte pointer directly
         _image = CGImageRetain(image);
+        _archivesBitmapData = true;
         
         _width = CGImageGetWidth(_image);
         _height = CGImageGetHeight(_image);
@@ -109,6 +110,18 @@
     return CGImageRetain(_image);
 }
 
+- (CGImageRef)newImageWithDataProvider:(CGDataProviderRef)provider;
+{
+    CGColorSpaceRef cspace = [_colorSpaceDescription newColorSpace];
+    CGImageRef image = CGImageCreate(_width, _height, _bitsPerComponent, _bitsPerPixel, _bytesPerRow, cspace, _bitmapInfo, provider, _decode, _shouldInterpolate, _renderingIntent);
+    CGColorSpaceRelease(cspace);
+    return image;
+}
+
+- (CFDataRef)bitmapData { return _bitmapData; }
+
+- (void)setArchivesBitmapData:(BOOL)flag { _archivesBitmapData = flag; }
+
 - (size_t)_decodeLength
 {
     return NULL == _decode ? 0 : (sizeof(CGFloat) * _bitsPerPixel / _bitsPerComponent * 2);
@@ -126,7 +139,8 @@
         [aCoder encodeInt:_shouldInterpolate forKey:@"_shouldInterpolate"];
         [aCoder encodeInt:_renderingIntent forKey:@"_renderingIntent"];
         [aCoder encodeObject:_colorSpaceDescription forKey:@"_colorSpaceDescription"];
-        [aCoder encodeObject:(NSData *)_bitmapData forKey:@"_bitmapData"];
+        if (_archivesBitmapData)
+            [aCoder encodeObject:(NSData *)_bitmapData forKey:@"_bitmapData"];
         [aCoder encodeBytes:(const uint8_t *)_decode length:[self _decodeLength]  forKey:@"_decode"];
     }
     else {
@@ -140,9 +154,11 @@
         [aCoder encodeValueOfObjCType:@encode(CGColorRenderingIntent) at:&_renderingIntent];
         [aCoder encodeObject:_colorSpaceDescription];
         
-        size_t len = CFDataGetLength(_bitmapData);
+        // zero length means the bitmap is stored elsewhere
+        size_t len = (_archivesBitmapData && _bitmapData) ? CFDataGetLength(_bitmapData) : 0;
         [aCoder encodeValueOfObjCType:@encode(size_t) at:&len];
-        [aCoder encodeArrayOfObjCType:@encode(char) count:len at:CFDataGetBytePtr(_bitmapData)];
+        if (len)
+            [aCoder encodeArrayOfObjCType:@encode(char) count:len at:CFDataGetBytePtr(_bitmapData)];
         
         [aCoder encodeBytes:_decode length:[self _decodeLength]];
     }
@@ -152,6 +168,7 @@
 {
     self = [super init];
     if (self) {
+        _archivesBitmapData = true;
         if ([aDecoder allowsKeyedCoding]) {
             _width = [aDecoder decodeIntForKey:@"_width"];
             _height = [aDecoder decodeIntForKey:@"_height"];
@@ -189,9 +206,11 @@
             
             size_t bitmapLength;
             [aDecoder decodeValueOfObjCType:@encode(size_t) at:&bitmapLength];
-            void *data = CFAllocatorAllocate(FVAllocatorGetDefault(), bitmapLength * sizeof(char), 0);
-            [aDecoder decodeArrayOfObjCType:@encode(char) count:bitmapLength at:data];
-            _bitmapData = CFDataCreateWithBytesNoCopy(FVAllocatorGetDefault(), data, bitmapLength, FVAllocatorGetDefault());
+            if (bitmapLength) {
+                void *data = CFAllocatorAllocate(FVAllocatorGetDefault(), bitmapLength * sizeof(char), 0);
+                [aDecoder decodeArrayOfObjCType:@encode(char) count:bitmapLength at:data];
+                _bitmapData = CFDataCreateWithBytesNoCopy(FVAllocatorGetDefault(), data, bitmapLength, FVAllocatorGetDefault());
+            }
 
             _image = NULL;
             
@@ -51,6 +51,12 @@ __BEGIN_DECLS
  @return CGImage size in pixels. */
 FV_PRIVATE_EXTERN NSSize FVCGImageSize(CGImageRef image);
 
+/** @internal 
+ 
+ @brief Get the size of an image's bitmap.
+ @return Bytes of pixel data, including row padding, or 0 for a NULL image. */
+FV_PRIVATE_EXTERN size_t FVCGImageByteSize(CGImageRef image);
+
 /** @internal 
  
  @brief Resample an image.
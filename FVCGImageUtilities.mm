@@ -40,6 +40,8 @@
 #import "FVBitmapContext.h"
 #import "FVUtilities.h" /* for FVLog */
 #import "FVImageBuffer.h"
+#import "FVScratchArena.h"
+#import "FVMemoryBudget.h"
 
 #import <Accelerate/Accelerate.h>
 #import <libkern/OSAtomic.h>
@@ -79,7 +81,7 @@
 #define FV_LIMIT_TILEMEMORY_USAGE 1
 
 // this is an advisory limit: actual usage will grow as needed, but this prevents scaling images simultaneously
-#define FV_TILEMEMORY_MEGABYTES 100
+#define FV_TILEMEMORY_LIMIT (FVMemoryBudgetGetCeiling() / 8)
 
 #if FV_LIMIT_TILEMEMORY_USAGE
 // Sadly, NSCondition is apparently buggy pre-10.5: http://www.cocoabuilder.com/archive/message/cocoa/2008/4/4/203257
@@ -108,12 +110,20 @@ static size_t __FVCGImageGetDataSize(CGImageRef image)
     return (CGImageGetBytesPerRow(image) * CGImageGetHeight(image));
 }
 
+size_t FVCGImageByteSize(CGImageRef image)
+{
+    return image ? __FVCGImageGetDataSize(image) : 0;
+}
+
 #if FV_LIMIT_TILEMEMORY_USAGE
 
 static void __FVCGImageRequestAllocationSize(const size_t allocSize)
 {
+    // tiles can't be shed, but making room elsewhere keeps the total bounded while they're in use
+    FVMemoryBudgetCheck();
+    
     int ret = pthread_mutex_lock(&_memoryMutex);
-    while (__FVCGImageCurrentBytesUsed() > FV_TILEMEMORY_MEGABYTES * 1024 * 1024 && 0 == ret) {
+    while (__FVCGImageCurrentBytesUsed() > FV_TILEMEMORY_LIMIT && 0 == ret) {
         ret = pthread_cond_wait(&_memoryCond, &_memoryMutex);
     }
 
@@ -852,11 +862,27 @@ static CGImageRef __FVTileAndScale_8888_or_888_Image(CGImageRef image, const NSS
         maxWidth = ceil(scale * maxWidth);
         maxHeight = ceil(scale * maxHeight);
     }
+    
+    /*
+     All of the tile buffers are temporary, so carve them out of a single arena instead of allocating
+     each one.  Sizes have to match the initializers below, or the arena will need overflow blocks.
+     */
+    const NSUInteger columnCount = __FVGetNumberOfColumnsInRegionVector(regions);
+    size_t arenaSize = 8 * FVScratchArenaSizeForAllocation(FVPaddedRowBytesForWidth(1, maxWidth) * maxHeight);
+    if (false == isIndexedImage)
+        arenaSize += FVScratchArenaSizeForAllocation(FVPaddedRowBytesForWidth(4, maxWidth) * maxHeight);
+    for (NSUInteger j = 0; j < columnCount; j++) {
+        const size_t columnWidth = regions[j].w * ceil(scale), columnHeight = regions[j].h * ceil(scale);
+        arenaSize += FVScratchArenaSizeForAllocation(FVPaddedRowBytesForWidth(4, columnWidth) * columnHeight);
+    }
+    FVScratchArenaRef arena = FVScratchArenaAcquire(arenaSize);
+    if (NULL == arena)
+        ret = kvImageMemoryAllocationError;
         
     FVImageBuffer *imageBuffer;
     NSUInteger i;
     for (i = 0; i < 4 && kvImageNoError == ret; i++) {
-        imageBuffer = [[FVImageBuffer alloc] initWithWidth:maxWidth height:maxHeight bytesPerSample:1];
+        imageBuffer = [[FVImageBuffer alloc] initWithWidth:maxWidth height:maxHeight bytesPerSample:1 arena:arena];
         if (imageBuffer) {
             [planarTilesA addObject:imageBuffer];
             [imageBuffer release];
@@ -865,7 +891,7 @@ static CGImageRef __FVTileAndScale_8888_or_888_Image(CGImageRef image, const NSS
             ret = kvImageMemoryAllocationError;
         }
 
-        imageBuffer = [[FVImageBuffer alloc] initWithWidth:maxWidth height:maxHeight bytesPerSample:1];
+        imageBuffer = [[FVImageBuffer alloc] initWithWidth:maxWidth height:maxHeight bytesPerSample:1 arena:arena];
         if (imageBuffer) {
             [planarTilesB addObject:imageBuffer];
             [imageBuffer release];
@@ -892,16 +918,15 @@ static CGImageRef __FVTileAndScale_8888_or_888_Image(CGImageRef image, const NSS
     // NB: not required for the indexed images, since we copy those directly to the planar buffers
     // this is a temporary buffer passed to the planar conversion function
     FVImageBuffer *regionBuffer = nil;
-    if (false == isIndexedImage) {
-        regionBuffer = [[FVImageBuffer alloc] initWithWidth:maxWidth height:maxHeight bytesPerSample:4];
+    if (false == isIndexedImage && kvImageNoError == ret) {
+        regionBuffer = [[FVImageBuffer alloc] initWithWidth:maxWidth height:maxHeight bytesPerSample:4 arena:arena];
         if (nil == regionBuffer)
             ret = kvImageMemoryAllocationError;
     }
     
     // maintain these instead of creating new buffers on each pass through the loop
-    NSUInteger regionColumnIndex = __FVGetNumberOfColumnsInRegionVector(regions);
-    for (NSUInteger j = 0; j < regionColumnIndex && kvImageNoError == ret; j++) {
-        imageBuffer = [[FVImageBuffer alloc] initWithWidth:(regions[j].w * ceil(scale)) height:(regions[j].h * ceil(scale)) bytesPerSample:4];
+    for (NSUInteger j = 0; j < columnCount && kvImageNoError == ret; j++) {
+        imageBuffer = [[FVImageBuffer alloc] initWithWidth:(regions[j].w * ceil(scale)) height:(regions[j].h * ceil(scale)) bytesPerSample:4 arena:arena];
         if (imageBuffer) {
             [currentRegionRow addObject:imageBuffer];
             [imageBuffer release];
@@ -911,8 +936,8 @@ static CGImageRef __FVTileAndScale_8888_or_888_Image(CGImageRef image, const NSS
         }
     }
     
-    // reset to zero so we can use this as index into currentRegionRow
-    regionColumnIndex = 0;
+    // index into currentRegionRow
+    NSUInteger regionColumnIndex = 0;
     
     const size_t imageBytesPerRow = CGImageGetBytesPerRow(image);
     const CGImageAlphaInfo alphaInfo = CGImageGetAlphaInfo(image);
@@ -1029,9 +1054,11 @@ static CGImageRef __FVTileAndScale_8888_or_888_Image(CGImageRef image, const NSS
     [planarTilesB release];
     [currentRegionRow release];
     
-    // could probably cache a few of these
     [regionBuffer release];
     
+    // the tile buffers are gone, so their memory can be reused by the next image scaled on this thread
+    FVScratchArenaRelease(arena);
+    
 #if FV_LIMIT_TILEMEMORY_USAGE
     __FVCGImageDiscardAllocationSize(0);
 #endif
@@ -37,28 +37,75 @@
  */
 
 #import <Cocoa/Cocoa.h>
+#import <dispatch/dispatch.h>
+
+/** @internal Storage options for saveData:forKey:options:. */
+enum {
+    FVCacheFileCompressed   = 0,       /**< compress with zlib */
+    FVCacheFileUncompressed = 1 << 0   /**< store the bytes as-is, so reads can map them without inflating or copying */
+};
+typedef NSUInteger FVCacheFileOptions;
+
+/** @internal Values returned by getStatistics:.  Counts are totals since the cache was opened. */
+typedef struct _FVCacheFileStatistics {
+    uint64_t hitCount;       /**< reads that found data */
+    uint64_t missCount;      /**< reads that found nothing */
+    uint64_t evictionCount;  /**< entries removed to stay within the maximum size */
+    uint64_t evictedBytes;   /**< space in the file used by evicted entries */
+    uint64_t compressedCount;      /**< entries written compressed */
+    uint64_t incompressibleCount;  /**< entries written uncompressed because sampling showed they wouldn't compress */
+    uint64_t size;           /**< space in the file used by valid entries, not counting pending writes */
+    uint64_t maximumSize;    /**< limit for size, or UINT64_MAX */
+} FVCacheFileStatistics;
+
+@class _FVCacheDataFile;
 
 /** @internal 
  
  @brief Binary cache file.
  
- Conceptually, FVCacheFile provides a dictionary-like interface to a data file wherein NSData objects are represented by a key, and only one object exists for a given key.  FVCacheFile instances are thread-safe for multiple readers and writers, although write operations are serialized.  Reads are performed using mmap(2), and data is compressed using zlib when writing and decompressed while reading.  Various preferences are available for gathering usage statistics to see object space usage per key.
+ Conceptually, FVCacheFile provides a dictionary-like interface to a data file wherein NSData objects are represented by a key, and only one object exists for a given key.  FVCacheFile instances are thread-safe for multiple readers and writers, although write operations are serialized.  Readers never wait for a lock, even while data is being written.  copyDataForKeys:completion: reads many entries at once in file order, with readahead.  Reads use one mmap(2) of the whole file, which is only replaced as the file grows, and data is compressed using zlib when writing and decompressed while reading.  Entries larger than 256 KB are split into chunks that are compressed independently, so they're compressed and decompressed in parallel, and copyDataForKey:range: only decompresses the chunks it needs.  Bitmaps can be row-filtered before compression, as in PNG.  Small entries are compressed with a preset dictionary built from the first entries written, so near-duplicates such as thumbnails of similar pages compress far better.  Writes are asynchronous: saveData:forKey: returns immediately, and a background queue compresses entries in parallel and writes them to the file in batches.  Entries that sampling shows won't compress, such as noisy photo thumbnails, are stored as-is.  Until an entry is on disk, reads return the data that was saved.  Space used by invalidated entries is reused for new entries that fit, and compact rewrites the file without any dead space.  A maximum size can be set, in which case the least recently used entries are evicted to stay within it.  Various preferences are available for gathering usage statistics to see object space usage per key.
+ 
+ By default, the file is written to a temporary location, created using mkstemp(3).  If this location is not suitable for memory-mapping files, an exception will be raised.  The file is unlinked immediately after creation, so it will vanish if the app crashes or is otherwise terminated.  Typically, the owner of the FVCacheFile should register for NSApplicationWillTerminateNotification and call closeFile at that time.
  
- The file is written to a temporary location, created using mkstemp(3).  If this location is not suitable for memory-mapping files, an exception will be raised.  The file is unlinked immediately after creation, so it will vanish if the app crashes or is otherwise terminated.  Typically, the owner of the FVCacheFile should register for NSApplicationWillTerminateNotification and call closeFile at that time.
+ A persistent cache created with initWithDirectory: keeps its data in a named directory, along with an index that is written by closeFile.  The next launch maps the index rather than rebuilding it, and entries are checked against the file's modification date and size only when they're read, so stale entries cost nothing until they're needed.  Only keys returned by newKeyForURL: for files that exist are persistent; other keys are kept for the life of the instance, as with a temporary cache.
  
- @warning FVCacheFile is not designed for persistent storage across app launches or architectures.  No validation or consistency checks are performed.  */
+ @warning The persistent format is not portable across architectures.  If the index doesn't match the data file, as after a crash or if another process has the directory open, it's discarded.  */
 
 @interface FVCacheFile : NSObject {
 @private;
     NSString            *_cacheName;
     NSString            *_path;
-    int                  _fileDescriptor;
-    uint8_t             *_deflateBuffer;
+    _FVCacheDataFile    *_dataFile;
+    NSMutableArray      *_retiredDataFiles;
     NSLock              *_writeLock;
-    NSMutableDictionary *_offsetTable;
+    struct _FVCacheOffsetTable *_offsetTable;
     NSMutableDictionary *_eventTable;
+    NSString            *_directory;
+    dispatch_queue_t     _writeQueue;
+    NSMutableArray      *_pendingWrites;
+    size_t               _pendingBytes;
+    bool                 _writeScheduled;
+    struct _FVCacheClock *_clock;
+    off_t                _liveSize;
+    off_t                _maximumSize;
+    volatile int64_t     _hitCount;
+    volatile int64_t     _missCount;
+    uint64_t             _evictionCount;
+    uint64_t             _evictedBytes;
+    uint64_t             _compressedCount;
+    uint64_t             _incompressibleCount;
+    NSData              *_dictionary;
+    NSMutableArray      *_dictionarySamples;
 }
 
+/** Persistent cache.
+ 
+ Opens or creates a cache in the given directory, which is created if needed.  If the cache is already open in another process, this falls back to a temporary file.
+ @param path Absolute path of a directory used only by this cache.
+ @return An initialized cache, or nil if the file could not be opened. */
+- (id)initWithDirectory:(NSString *)path;
+
 /** Cache key.
  
  Returns an object suitable for use as a key (needs to be safe for use as an NSDictionary key).  This assumes that each object is representable by an NSURL.  Note that file: URLs are handled specially for improved performance and for tracking files after they are moved.
@@ -70,24 +117,77 @@
 
 /** Saving data.
  
- Write data to disk and use the specified key to retrieve it later.
+ Write data to disk and use the specified key to retrieve it later.  The data is written in the background, but is available to copyDataForKey: immediately.  If too much data is waiting to be written, this waits for the writer to catch up.
  
  @param data The data object to store.
  @param aKey Key may be any object that conforms to &lt;NSCopying&gt;, and it must implement -hash and -isEqual: correctly.  */ 
 - (void)saveData:(NSData *)data forKey:(id <NSObject, NSCopying>)aKey;
 
+/** Saving data with options.
+ 
+ Same as saveData:forKey:, but allows storing data uncompressed.  Every entry starts on a page boundary, so an uncompressed entry is returned by copyDataForKey: as an NSData that points directly at a read-only mapping of the file.  Reading it costs page faults instead of a decompression and copy, and the kernel's page cache does the caching.  This is a good trade for small data that's read often, such as thumbnail bitmaps.
+ 
+ @param data The data object to store.
+ @param aKey Key may be any object that conforms to &lt;NSCopying&gt;, and it must implement -hash and -isEqual: correctly.
+ @param options FVCacheFileCompressed or FVCacheFileUncompressed. */
+- (void)saveData:(NSData *)data forKey:(id <NSObject, NSCopying>)aKey options:(FVCacheFileOptions)options;
+
+/** Saving a bitmap.
+ 
+ Same as saveData:forKey:, but tells the cache that the data starts with rows of pixels, so it can apply a PNG-style row filter before compressing them.  The filter predicts each byte from its neighbors, and the difference compresses far better than the pixel itself; the filter is chosen by sampling a few rows, and reversed when the data is read.  Bytes after the last whole row, such as metadata appended to the bitmap, are compressed as-is.  If the pixel size isn't supported, this is the same as saveData:forKey:.
+ 
+ @param data The data object to store.
+ @param aKey Key may be any object that conforms to &lt;NSCopying&gt;, and it must implement -hash and -isEqual: correctly.
+ @param bytesPerRow Length of a row, including any padding.
+ @param bytesPerPixel From 1 to 8. */
+- (void)saveBitmapData:(NSData *)data forKey:(id <NSObject, NSCopying>)aKey bytesPerRow:(NSUInteger)bytesPerRow bytesPerPixel:(NSUInteger)bytesPerPixel;
+
 /** Reading data.
  
+ Data stored uncompressed, either with FVCacheFileUncompressed or because it wouldn't compress, is mapped rather than copied, and the mapping lasts as long as the returned object.  It's still valid after invalidateDataForKey:, but must not be used after closeFile, which may truncate the file.
  @param aKey The key to read.
  @return Previously stored data or nil if the cache had no value for the specified key. */
 - (NSData *)copyDataForKey:(id)aKey;
 
+/** Reading part of the data.
+ 
+ Same as copyDataForKey:, but returns only the bytes in range.  For a large compressed entry, only the chunks that overlap the range are decompressed, so reading a band of scanlines from a large bitmap costs about as much as the band itself.
+ @param aKey The key to read.
+ @param range Range of bytes in the data that was stored.
+ @return A copy of the bytes in range, or nil if the cache had no value for the specified key, or the range extends past the end of the data. */
+- (NSData *)copyDataForKey:(id)aKey range:(NSRange)range;
+
+/** Reading many entries.
+ 
+ Reads the data for every key, as copyDataForKey: would, but in one pass over the file.  Entries are sorted by their position in the file, and the kernel is asked to read them ahead in that order, merging entries that are close together, so drawing a screenful of icons costs a few sequential reads instead of a random read per icon.  Entries are then decompressed in parallel.  The keys are looked up before this returns; the data is read in the background.
+ @param keys The keys to read, such as all keys for the visible icons.
+ @param handler Called on a background queue with an array containing the data for each key, in the same order as keys, or NSNull for keys the cache had no value for.  The caller owns nothing in the array; retain the data to keep it, as usual. */
+- (void)copyDataForKeys:(NSArray *)keys completion:(void (^)(NSArray *dataArray))handler;
+
 /** Invalidate cached data.
  
- Marks the data pointed to as invalid, but does not remove it from the on-disk cache.  It will not be accessible after this call, and the key may be safely reused for another data instance.
+ Marks the data pointed to as invalid, but does not remove it from the on-disk cache.  It will not be accessible after this call, and the key may be safely reused for another data instance.  Once no reader is using the old data, its space in the file is available to new entries, except in a persistent cache, where entries that were in the index when it was opened or last compacted stay until the next compaction.
  @param aKey The key to invalidate */
 - (void)invalidateDataForKey:(id)aKey;
 
+/** Compaction.
+ 
+ Copies all valid entries to a new file in the background, and swaps it in once they've all been copied.  Reads and writes continue meanwhile; entries saved during compaction go to the new file.  In a persistent cache, the new index is written immediately, and the old data file stays open until closeFile.  This also happens automatically after a write if more than half of the file, and at least 32 MB, is unused.
+ @param handler Called on a background queue with the number of bytes removed from the file, which may be 0 if compaction failed.  May be nil. */
+- (void)compactWithCompletionHandler:(void (^)(unsigned long long bytesReclaimed))handler;
+
+/** Size limit.
+ 
+ Entries are evicted when the space they use in the file exceeds this, using the CLOCK approximation of least recently used: each read or write of an entry marks it, and a sweep over all entries evicts the first unmarked one it finds, clearing marks as it goes.  Eviction happens as entries are written, so the file may briefly exceed the limit by the size of a write batch.  Evicted space is reused as for invalidateDataForKey:.
+ @param size The limit in bytes.  The default is UINT64_MAX, for no limit. */
+- (void)setMaximumSize:(unsigned long long)size;
+
+/** Usage statistics.
+ 
+ Read counters are updated without locking, so they're approximate while other threads are reading.
+ @param stats Filled in on return. */
+- (void)getStatistics:(FVCacheFileStatistics *)stats;
+
 /** Cache name.
  
  Name is currently only used when recording statistics to the log file.
@@ -96,7 +196,7 @@
 
 /** Close the file.
  
- The owner of the FVCacheFile is responsible for calling this before deallocating the file. */
+ The owner of the FVCacheFile is responsible for calling this before deallocating the file.  This waits for pending writes to finish, and no other methods may be called during or after it.  A persistent cache writes its index here, so entries saved since it was opened are only available to the next launch if this is called. */
 - (void)closeFile;
 
 @end
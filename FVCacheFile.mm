@@ -40,13 +40,23 @@
 #import "FVUtilities.h"
 #import "FVObject.h"
 #import "FVAllocator.h"
+#import "FVConcurrentIndex.h"
+#import "FVEpoch.h"
+#import "FVRowFilter.h"
 
 #import <libkern/OSAtomic.h>
 #import <string>
+#import <vector>
+#import <set>
+#import <map>
+#import <algorithm>
+#import <pthread.h>
 #import <sys/stat.h>
 #import <asl.h>
 #import <zlib.h>
 #import <sys/mman.h>
+#import <sys/file.h>
+#import <sys/uio.h>
 
 @interface _FVCacheKey : FVObject <NSCopying>
 {
@@ -55,10 +65,90 @@
     ino_t       _inode;
     NSURL      *_URL;
     NSUInteger  _hash;
+    struct timespec _modified;       // for validating persistent entries
+    off_t       _fileSize;
 }
 + (id)newWithURL:(NSURL *)aURL;
 @end
 
+// read-only mapping of a whole data file, which may extend past the end of the file
+typedef struct _FVCacheMapping {
+    volatile int32_t refcount;
+    void            *base;
+    size_t           length;
+} _FVCacheMapping;
+
+static void __FVCacheMappingRelease(void *ptr)
+{
+    _FVCacheMapping *mapping = (_FVCacheMapping *)ptr;
+    if (0 == OSAtomicDecrement32Barrier(&mapping->refcount)) {
+        munmap(mapping->base, mapping->length);
+        delete mapping;
+    }
+}
+
+/*
+ A data file, and for a persistent cache, the index that was mapped with it.  Locations retain the file they 
+ point into, so a file replaced by compaction stays open until the last reader is done with it.  Free extents 
+ are kept here, since they're returned by whichever thread releases the last reference to a location.
+ 
+ Reads go through one mapping of the whole file, reserved with room to grow, since pages past the end of the 
+ file become readable as it's extended.  Only when the file outgrows it does the writer map it again, and the 
+ old mapping is retired rather than unmapped, since readers use it without locking.  A reader that keeps a 
+ pointer into the mapping after it's done, as _FVMappedCacheData does, retains the mapping instead.
+ */
+@interface _FVCacheDataFile : NSObject
+{
+@public;
+    int              _fileDescriptor;
+    const void      *_index;
+    size_t           _indexLength;
+    uint8_t         *_slotReferenced;  // per index record; set by reads, and cleared by eviction
+    uint8_t         *_slotRetired;     // per index record; set when it's evicted or shadowed by _offsetTable
+    _FVCacheMapping *_mapping;         // replaced by the writer as the file grows, and retired through _mappingEpoch
+    FVEpoch         *_mappingEpoch;
+@private;
+    pthread_mutex_t  _extentLock;
+    std::map<off_t, off_t>      *_extentsByOffset;   // offset to length
+    std::multimap<off_t, off_t> *_extentsByLength;   // length to offset
+    off_t            _freeSize;
+}
+- (id)initWithFileDescriptor:(int)fd;
+- (void)addFreeExtentAtOffset:(off_t)offset length:(off_t)length;
+- (bool)takeFreeExtentWithLength:(off_t)length offset:(off_t *)offset;
+- (off_t)freeSize;
+- (void)mapLength:(off_t)length;
+@end
+
+// returns NULL if the range isn't mapped; otherwise the caller must pass the token to __FVCacheDataFileExit when it's done with the mapping
+static inline _FVCacheMapping *__FVCacheDataFileEnter(_FVCacheDataFile *file, off_t offset, size_t length, FVEpoch::Token *token)
+{
+    *token = file->_mappingEpoch->enter();
+    _FVCacheMapping *mapping = __atomic_load_n(&file->_mapping, __ATOMIC_ACQUIRE);
+    if (mapping && offset + (off_t)length <= (off_t)mapping->length)
+        return mapping;
+    file->_mappingEpoch->exit(*token);
+    return NULL;
+}
+
+static inline void __FVCacheDataFileExit(_FVCacheDataFile *file, FVEpoch::Token token)
+{
+    file->_mappingEpoch->exit(token);
+}
+
+// returns a retained mapping that covers the range, or NULL
+static _FVCacheMapping *__FVCacheDataFileCopyMapping(_FVCacheDataFile *file, off_t offset, size_t length)
+{
+    FVEpoch::Token token;
+    _FVCacheMapping *mapping = __FVCacheDataFileEnter(file, offset, length, &token);
+    if (mapping) {
+        // it can't be released until this exits the epoch
+        OSAtomicIncrement32Barrier(&mapping->refcount);
+        __FVCacheDataFileExit(file, token);
+    }
+    return mapping;
+}
+
 @interface _FVCacheLocation : NSObject
 {
 @public;
@@ -66,10 +156,94 @@
     NSUInteger _compressedLength;    // length of compressed data to read with zlib
     NSUInteger _decompressedLength;  // final length of decompressed data
     NSUInteger _padLength;           // zero padding to align this segment to page boundary size
+    FVCacheFileOptions _options;     // FVCacheFileUncompressed if the data wasn't deflated
+    NSData    *_pendingData;         // non-nil until the data is written, and the other fields are invalid
+    id         _key;                 // only set for pending writes
+    _FVCacheDataFile *_file;         // file containing the data, once it's been written
+    bool       _ownsExtent;          // if true, the space is returned to _file when this is deallocated
+    bool       _referenced;          // set by reads and writes, and cleared by eviction
+    NSUInteger _bytesPerRow;         // nonzero if _pendingData starts with rows of pixels, which are filtered before deflating
+    NSUInteger _bytesPerPixel;
 }
 // full length of this location is _compressedLength + _padLength bytes
 @end
 
+// read-only view of an uncompressed entry, which owns its mapping
+@interface _FVMappedCacheData : NSData
+{
+@private;
+    _FVCacheLocation *_location;
+    _FVCacheMapping  *_sharedMapping;
+    void      *_mapping;
+    size_t     _mapLength;
+    NSUInteger _length;
+}
+- (id)initWithLocation:(_FVCacheLocation *)location;
+@end
+
+// keys and locations; readers look these up without locking, and writes are serialized by _writeLock
+struct _FVCacheOffsetTableTraits {
+    static size_t hash(id key) { return [key hash]; }
+    static bool equal(id key1, id key2) { return [key1 isEqual:key2]; }
+    static id copyKey(id key) { return [key copyWithZone:NULL]; }
+    static void releaseKey(id key) { [key release]; }
+    static id retainValue(id value) { return [value retain]; }
+    static void releaseValue(id value) { [value release]; }
+};
+
+struct _FVCacheOffsetTable : public FVConcurrentIndex<id, id, _FVCacheOffsetTableTraits> {};
+
+// entries in the CLOCK used for eviction; only used with the write lock held
+typedef struct _FVClockEntry {
+    id                key;        // retained; nil for a record that's only in the mapped index
+    _FVCacheLocation *location;   // not retained, and only compared, to skip entries that were replaced
+    uint64_t          slot;       // index record if key is nil, or UINT64_MAX for a removed entry
+} _FVClockEntry;
+
+struct _FVCacheClock {
+    std::vector<_FVClockEntry> entries;
+    size_t                     hand;
+    size_t                     holes;
+};
+
+static inline bool __FVClockEntryIsHole(const _FVClockEntry &entry)
+{
+    return nil == entry.key && UINT64_MAX == entry.slot;
+}
+
+static void __FVClockRemoveEntry(_FVCacheClock *clock, _FVClockEntry &entry)
+{
+    [entry.key release];
+    entry.key = nil;
+    entry.location = nil;
+    entry.slot = UINT64_MAX;
+    clock->holes++;
+}
+
+static void __FVClockRemoveAllEntries(_FVCacheClock *clock)
+{
+    for (std::vector<_FVClockEntry>::iterator it = clock->entries.begin(); it != clock->entries.end(); it++)
+        [it->key release];
+    clock->entries.clear();
+    clock->hand = 0;
+    clock->holes = 0;
+}
+
+// removes holes, keeping the hand on the same entry
+static void __FVClockCompact(_FVCacheClock *clock)
+{
+    size_t next = 0, hand = 0;
+    for (size_t i = 0; i < clock->entries.size(); i++) {
+        if (i == clock->hand)
+            hand = next;
+        if (false == __FVClockEntryIsHole(clock->entries[i]))
+            clock->entries[next++] = clock->entries[i];
+    }
+    clock->entries.resize(next);
+    clock->hand = hand < next ? hand : 0;
+    clock->holes = 0;
+}
+
 @interface _FVCacheEventRecord : NSObject
 {
 @public
@@ -79,11 +253,108 @@
 }
 @end
 
+/*
+ Small entries are often near-duplicates, such as thumbnails of PDF pages with the same white margins, or the same 
+ icon for many files, but each is deflated separately, so it has no history in which to find those matches.  A zlib 
+ preset dictionary supplies that history: it's built from blocks that recur across the first entries written, and 
+ deflate and inflate both start with it.  Huffman coding alone never looks for matches, so streams of at most 
+ FV_DICTIONARY_MAX_INPUT bytes use zlib's fastest matching instead, which costs about the same for inputs that small.  
+ zlib records the dictionary's Adler-32 checksum in the stream header, which identifies it when inflating.  The 
+ dictionary never changes once it's built, and a persistent cache keeps it in the index, since entries written 
+ with it can't be inflated without it.
+ */
+#define FV_DICTIONARY_MAX_INPUT    (64 * 1024)
+#define FV_DICTIONARY_SIZE         (16 * 1024)
+#define FV_DICTIONARY_BLOCK_SIZE   64
+#define FV_DICTIONARY_SAMPLE_COUNT 64
+
+/*
+ Persistent index, written by -closeFile and mapped read-only at startup.  This is an open-addressed hash table 
+ keyed by device and inode, so lookups read the mapping directly; nothing is rebuilt in memory.  Entries saved 
+ or invalidated while the file is open are kept in _offsetTable, which shadows the mapped table.
+ */
+#define FV_INDEX_MAGIC    0x46564349  /* FVCI */
+#define FV_INDEX_VERSION  5
+#define FV_INDEX_NAME     "FileViewCache.index"
+#define FV_DATA_NAME      "FileViewCache.data"
+
+typedef struct _FVCacheIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t dataInode;      // data file this index was written for
+    uint64_t dataLength;     // anything after this wasn't indexed, as after a crash
+    uint64_t slotCount;      // power of two
+    uint64_t entryCount;
+    uint64_t dictionaryLength; // preset dictionary for zlib, stored after the records
+} FVCacheIndexHeader;
+
+typedef struct _FVCacheIndexRecord {
+    uint64_t hash;           // 0 for an empty slot
+    uint64_t device;
+    uint64_t inode;
+    int64_t  modifiedSeconds;
+    int64_t  modifiedNanoseconds;
+    int64_t  fileSize;
+    uint64_t offset;
+    uint64_t compressedLength;
+    uint64_t decompressedLength;
+    uint64_t padLength;
+    uint64_t options;
+} FVCacheIndexRecord;
+
+static inline uint64_t __FVCacheIndexHash(uint64_t device, uint64_t inode)
+{
+    // splitmix64 finalizer; never 0, which marks an empty slot
+    uint64_t x = device * 0x9E3779B97F4A7C15ULL ^ inode;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x ? x : 1;
+}
+
+static inline const FVCacheIndexRecord *__FVCacheIndexRecords(const void *index)
+{
+    return (const FVCacheIndexRecord *)((const uint8_t *)index + sizeof(FVCacheIndexHeader));
+}
+
+static const FVCacheIndexRecord *__FVCacheIndexFind(const void *index, uint64_t device, uint64_t inode)
+{
+    const FVCacheIndexHeader *header = (const FVCacheIndexHeader *)index;
+    const FVCacheIndexRecord *records = __FVCacheIndexRecords(index);
+    const uint64_t hash = __FVCacheIndexHash(device, inode);
+    const uint64_t mask = header->slotCount - 1;
+    for (uint64_t i = hash & mask, probes = 0; probes < header->slotCount; i = (i + 1) & mask, probes++) {
+        const FVCacheIndexRecord *record = &records[i];
+        if (0 == record->hash)
+            return NULL;
+        if (hash == record->hash && device == record->device && inode == record->inode)
+            return record;
+    }
+    return NULL;
+}
+
+// returns false if the index can't be used with this data file
+static bool __FVCacheIndexIsValid(const void *index, size_t length, const struct stat *dataStat)
+{
+    const FVCacheIndexHeader *header = (const FVCacheIndexHeader *)index;
+    if (length < sizeof(FVCacheIndexHeader) || FV_INDEX_MAGIC != header->magic || FV_INDEX_VERSION != header->version)
+        return false;
+    if (0 == header->slotCount || 0 != (header->slotCount & (header->slotCount - 1)) || header->slotCount > (length - sizeof(FVCacheIndexHeader)) / sizeof(FVCacheIndexRecord))
+        return false;
+    if (header->dictionaryLength > FV_DICTIONARY_SIZE || header->dictionaryLength > length - sizeof(FVCacheIndexHeader) - header->slotCount * sizeof(FVCacheIndexRecord))
+        return false;
+    return (uint64_t)dataStat->st_ino == header->dataInode && (uint64_t)dataStat->st_size >= header->dataLength;
+}
+
 @implementation FVCacheFile
 
-// http://www.zlib.net/zlib_how.html says that 128K or 256K is the most efficient size
+// limits for one writev(2), and for data waiting to be written before saveData:forKey: blocks
+#define FV_WRITE_BATCH_COUNT  64
+#define FV_WRITE_BATCH_SIZE   (8 * 1024 * 1024)
+#define FV_MAX_PENDING_SIZE   (64 * 1024 * 1024)
 
-#define ZLIB_BUFFER_SIZE 524288
+// compact automatically when unused space is at least this, and more than half of the file
+#define FV_COMPACT_MIN_UNUSED (32 * 1024 * 1024)
 
 static NSInteger FVCacheLogLevel = 0;
 
@@ -106,6 +377,42 @@ static NSInteger FVCacheLogLevel = 0;
 }
 #pragma clang diagnostic pop
 
+- (void)_commonInitWithPath:(const char *)path
+{
+    fcntl(_dataFile->_fileDescriptor, F_NOCACHE, 1);
+    
+    _path = (NSString *)CFStringCreateWithFileSystemRepresentation(NULL, path);
+    FVAPIAssert1(FVCanMapFileAtURL([NSURL fileURLWithPath:_path]), @"%@ is not safe for mmap()", _path);
+    
+    if (FVCacheLogLevel > 0)
+        _eventTable = [NSMutableDictionary new];     
+    
+    _writeLock = [NSLock new];
+    _offsetTable = new _FVCacheOffsetTable;
+    
+    _writeQueue = dispatch_queue_create("com.mac.amaxwell.fileview.cachewriter", NULL);
+    _pendingWrites = [NSMutableArray new];
+    _pendingBytes = 0;
+    _writeScheduled = false;
+    _retiredDataFiles = [NSMutableArray new];
+    
+    _clock = new _FVCacheClock;
+    _clock->hand = 0;
+    _clock->holes = 0;
+    _liveSize = 0;
+    _maximumSize = INT64_MAX;
+    _hitCount = 0;
+    _missCount = 0;
+    _evictionCount = 0;
+    _evictedBytes = 0;
+    _compressedCount = 0;
+    _incompressibleCount = 0;
+    _dictionary = nil;
+    _dictionarySamples = [NSMutableArray new];
+    
+    [_dataFile mapLength:lseek(_dataFile->_fileDescriptor, 0, SEEK_END)];
+}
+
 - (id)init
 {
     self = [super init];
@@ -130,27 +437,16 @@ static NSInteger FVCacheLogLevel = 0;
             exit(1);
         }
         
-        // all writes are synchronous since they need to occur in a single block at the end of the file
-        _fileDescriptor = open(tempName, O_RDWR);
-        if (-1 != _fileDescriptor) {
-            fcntl(_fileDescriptor, F_NOCACHE, 1);
-
-            _path = (NSString *)CFStringCreateWithFileSystemRepresentation(NULL, tempName);
-            FVAPIAssert1(FVCanMapFileAtURL([NSURL fileURLWithPath:_path]), @"%@ is not safe for mmap()", _path);
+        int fd = open(tempName, O_RDWR);
+        if (-1 != fd) {
+            _dataFile = [[_FVCacheDataFile allocWithZone:[self zone]] initWithFileDescriptor:fd];
+            [self _commonInitWithPath:tempName];
 
             // Unlink the file immediately so we don't leave turds when the program crashes.
             unlink(tempName);
-
-            if (FVCacheLogLevel > 0)
-                _eventTable = [NSMutableDictionary new];     
-
-            _writeLock = [NSLock new];
-            _offsetTable = [NSMutableDictionary new];
-            
-            _deflateBuffer = new uint8_t[ZLIB_BUFFER_SIZE];
         }
         else {
-            NSLog(@"*** ERROR *** unable to open file %@", _path);
+            NSLog(@"*** ERROR *** unable to open file %s", tempName);
             [super dealloc];
             self = nil;
         }
@@ -162,17 +458,114 @@ static NSInteger FVCacheLogLevel = 0;
     return self;
 }
 
+// returns false if the index is missing or doesn't match the data file
+- (bool)_mapIndexIntoDataFile:(_FVCacheDataFile *)file stat:(const struct stat *)dataStat
+{
+    NSString *indexPath = [_directory stringByAppendingPathComponent:@FV_INDEX_NAME];
+    int fd = open([indexPath fileSystemRepresentation], O_RDONLY);
+    struct stat sb;
+    if (-1 != fd && 0 == fstat(fd, &sb) && sb.st_size >= (off_t)sizeof(FVCacheIndexHeader)) {
+        void *index = mmap(0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        uint8_t *slotFlags = NULL;
+        if (MAP_FAILED != index && __FVCacheIndexIsValid(index, sb.st_size, dataStat) && NULL != (slotFlags = (uint8_t *)calloc(2, ((const FVCacheIndexHeader *)index)->slotCount))) {
+            file->_slotReferenced = slotFlags;
+            file->_slotRetired = slotFlags + ((const FVCacheIndexHeader *)index)->slotCount;
+            file->_index = index;
+            file->_indexLength = sb.st_size;
+        }
+        else if (MAP_FAILED != index) {
+            munmap(index, sb.st_size);
+        }
+    }
+    if (-1 != fd) close(fd);
+    return NULL != file->_index;
+}
+
+// write lock must be held, or called from an initializer; returns the space used by the records
+- (off_t)_addClockEntriesForDataFile:(_FVCacheDataFile *)file
+{
+    off_t size = 0;
+    const FVCacheIndexHeader *header = (const FVCacheIndexHeader *)file->_index;
+    const FVCacheIndexRecord *records = __FVCacheIndexRecords(file->_index);
+    for (uint64_t i = 0; i < header->slotCount; i++) {
+        if (0 != records[i].hash && 0 == file->_slotRetired[i]) {
+            _FVClockEntry entry = { nil, nil, i };
+            _clock->entries.push_back(entry);
+            size += records[i].compressedLength + records[i].padLength;
+        }
+    }
+    return size;
+}
+
+- (id)initWithDirectory:(NSString *)path;
+{
+    NSParameterAssert([path isAbsolutePath]);
+    const char *dataPath = [[path stringByAppendingPathComponent:@FV_DATA_NAME] fileSystemRepresentation];
+    
+    int fd = -1;
+    if ([[NSFileManager defaultManager] createDirectoryAtPath:path withIntermediateDirectories:YES attributes:nil error:NULL])
+        fd = open(dataPath, O_RDWR | O_CREAT, 0644);
+    
+    // only one process can own the cache; others get a temporary file
+    if (-1 == fd || 0 != flock(fd, LOCK_EX | LOCK_NB)) {
+        FVLog(@"unable to open persistent cache in %@; using a temporary file", path);
+        if (-1 != fd) close(fd);
+        return [self init];
+    }
+    
+    self = [super init];
+    if (self) {
+        _dataFile = [[_FVCacheDataFile allocWithZone:[self zone]] initWithFileDescriptor:fd];
+        _directory = [path copyWithZone:[self zone]];
+        [self _commonInitWithPath:dataPath];
+        
+        struct stat sb;
+        if (0 != fstat(fd, &sb))
+            sb.st_size = -1;
+        if (-1 == sb.st_size || false == [self _mapIndexIntoDataFile:_dataFile stat:&sb])
+            FVLog(@"creating new persistent cache in %@", path);
+        else
+            _liveSize = [self _addClockEntriesForDataFile:_dataFile];
+        
+        // a cache that already has a dictionary keeps it, so its entries can be inflated
+        const FVCacheIndexHeader *header = (const FVCacheIndexHeader *)_dataFile->_index;
+        if (header && header->dictionaryLength) {
+            const uint8_t *records = (const uint8_t *)__FVCacheIndexRecords(header);
+            _dictionary = [[NSData allocWithZone:[self zone]] initWithBytes:records + header->slotCount * sizeof(FVCacheIndexRecord) length:header->dictionaryLength];
+            [_dictionarySamples release];
+            _dictionarySamples = nil;
+        }
+        
+        // discard anything written after the index, which can't be found anyway
+        const off_t dataLength = _dataFile->_index ? ((const FVCacheIndexHeader *)_dataFile->_index)->dataLength : 0;
+        if (sb.st_size != dataLength && 0 != ftruncate(fd, dataLength))
+            perror("failed to truncate cache data file");
+    }
+    else {
+        close(fd);
+    }
+    return self;
+}
+
 - (void)dealloc
 {
     // owner is responsible for calling -closeFile at the appropriate time, and _readers is deleted in closeFile
-    if (-1 != _fileDescriptor)
-        NSLog(@"*** WARNING *** failed to close %@ before deallocating; leaking file descriptor", self);
+    if (nil != _dataFile)
+        NSLog(@"*** WARNING *** failed to close %@ before deallocating", self);
+    [_dataFile release];
+    [_retiredDataFiles release];
     [_cacheName release];
     [_path release];
-    delete [] _deflateBuffer;
+    if (_writeQueue) dispatch_release(_writeQueue);
+    [_pendingWrites release];
     [_writeLock release];
-    [_offsetTable release];
+    delete _offsetTable;
+    if (_clock) __FVClockRemoveAllEntries(_clock);
+    delete _clock;
     [_eventTable release];
+    [_directory release];
+    [_dictionary release];
+    [_dictionarySamples release];
     [super dealloc];
 }
 
@@ -183,11 +576,11 @@ static NSInteger FVCacheLogLevel = 0;
         
         const char *path = [_path fileSystemRepresentation];
         
-        NSParameterAssert(-1 != _fileDescriptor);
+        NSParameterAssert(nil != _dataFile);
         
         // print the file size, just because I'm curious about it (before closing the file, though, since we unlinked it!)
         struct stat sb;
-        if (0 == fstat(_fileDescriptor, &sb)) {
+        if (0 == fstat(_dataFile->_fileDescriptor, &sb)) {
             off_t fsize = sb.st_size;
             double mbSize = double(fsize) / 1024 / 1024;
             
@@ -197,6 +590,7 @@ static NSInteger FVCacheLogLevel = 0;
             const char *cacheName = [_cacheName UTF8String];
             asl_log(client, m, ASL_LEVEL_ERR, "%s: removing %s with cache size = %.2f MB\n", cacheName, path, mbSize);
             asl_log(client, m, ASL_LEVEL_ERR, "%s: final cache content (compressed): %s\n", cacheName, [[_eventTable description] UTF8String]);
+            asl_log(client, m, ASL_LEVEL_ERR, "%s: %lld hits, %lld misses, %llu evictions (%.2f MB)\n", cacheName, (long long)_hitCount, (long long)_missCount, (unsigned long long)_evictionCount, double(_evictedBytes) / 1024 / 1024);
             asl_free(m);
             asl_close(client);        
         }
@@ -207,21 +601,184 @@ static NSInteger FVCacheLogLevel = 0;
     }    
 }
 
+static inline bool __FVCacheKeyIsPersistent(id aKey)
+{
+    return [aKey isKindOfClass:[_FVCacheKey class]] && 0 != ((_FVCacheKey *)aKey)->_inode;
+}
+
+static void __FVCacheIndexInsert(FVCacheIndexRecord *records, uint64_t slotCount, const FVCacheIndexRecord *record)
+{
+    const uint64_t mask = slotCount - 1;
+    uint64_t i = record->hash & mask;
+    while (0 != records[i].hash)
+        i = (i + 1) & mask;
+    records[i] = *record;
+}
+
+static void __FVCacheIndexSetRecord(FVCacheIndexRecord *record, _FVCacheKey *key, _FVCacheLocation *location)
+{
+    record->hash = __FVCacheIndexHash(key->_device, key->_inode);
+    record->device = key->_device;
+    record->inode = key->_inode;
+    record->modifiedSeconds = key->_modified.tv_sec;
+    record->modifiedNanoseconds = key->_modified.tv_nsec;
+    record->fileSize = key->_fileSize;
+    record->offset = location->_offset;
+    record->compressedLength = location->_compressedLength;
+    record->decompressedLength = location->_decompressedLength;
+    record->padLength = location->_padLength;
+    record->options = location->_options;
+}
+
+typedef struct _FVCacheIndexContents {
+    std::vector<FVCacheIndexRecord>           records;
+    std::set<std::pair<uint64_t, uint64_t> >  shadowed;
+    _FVCacheDataFile                         *file;
+} _FVCacheIndexContents;
+
+static void __FVCacheIndexAddEntry(id aKey, id value, void *context)
+{
+    if (false == __FVCacheKeyIsPersistent(aKey))
+        return;
+    
+    _FVCacheIndexContents *contents = (_FVCacheIndexContents *)context;
+    _FVCacheKey *key = aKey;
+    contents->shadowed.insert(std::make_pair((uint64_t)key->_device, (uint64_t)key->_inode));
+    
+    // NSNull means it was invalidated, and there's nothing on disk for a pending write yet
+    if ([value isKindOfClass:[_FVCacheLocation class]] && ((_FVCacheLocation *)value)->_file == contents->file) {
+        FVCacheIndexRecord record;
+        __FVCacheIndexSetRecord(&record, key, value);
+        contents->records.push_back(record);
+    }
+}
+
+// write lock must be held; persistent entries in _offsetTable, and the mapped records they don't shadow
+- (void)_getLiveRecords:(std::vector<FVCacheIndexRecord> *)live
+{
+    _FVCacheIndexContents contents;
+    contents.file = _dataFile;
+    _offsetTable->apply(__FVCacheIndexAddEntry, &contents);
+    live->swap(contents.records);
+    if (_dataFile->_index) {
+        const FVCacheIndexHeader *header = (const FVCacheIndexHeader *)_dataFile->_index;
+        const FVCacheIndexRecord *records = __FVCacheIndexRecords(_dataFile->_index);
+        for (uint64_t i = 0; i < header->slotCount; i++) {
+            if (0 != records[i].hash && 0 == _dataFile->_slotRetired[i] && 0 == contents.shadowed.count(std::make_pair(records[i].device, records[i].inode)))
+                live->push_back(records[i]);
+        }
+    }
+}
+
+// returns false if the index couldn't be written, in which case the old one is left alone
+- (bool)_writeIndexWithRecords:(const std::vector<FVCacheIndexRecord> &)live dataFile:(_FVCacheDataFile *)file
+{
+    // load factor of at most 1/2 keeps probe sequences short
+    uint64_t slotCount = 16;
+    while (slotCount < 2 * live.size())
+        slotCount *= 2;
+    const size_t recordsLength = slotCount * sizeof(FVCacheIndexRecord);
+    const size_t length = sizeof(FVCacheIndexHeader) + recordsLength + [_dictionary length];
+    uint8_t *buffer = (uint8_t *)calloc(1, length);
+    if (NULL == buffer)
+        return false;
+    
+    struct stat sb;
+    (void) fstat(file->_fileDescriptor, &sb);
+    FVCacheIndexHeader *header = (FVCacheIndexHeader *)buffer;
+    header->magic = FV_INDEX_MAGIC;
+    header->version = FV_INDEX_VERSION;
+    header->dataInode = sb.st_ino;
+    header->dataLength = sb.st_size;
+    header->slotCount = slotCount;
+    header->entryCount = live.size();
+    header->dictionaryLength = [_dictionary length];
+    FVCacheIndexRecord *records = (FVCacheIndexRecord *)(buffer + sizeof(FVCacheIndexHeader));
+    for (std::vector<FVCacheIndexRecord>::const_iterator it = live.begin(); it != live.end(); it++)
+        __FVCacheIndexInsert(records, slotCount, &*it);
+    if (_dictionary)
+        memcpy(buffer + sizeof(FVCacheIndexHeader) + recordsLength, [_dictionary bytes], [_dictionary length]);
+    
+    // data has to be on disk before an index that points to it
+    (void) fsync(file->_fileDescriptor);
+    
+    NSString *indexPath = [_directory stringByAppendingPathComponent:@FV_INDEX_NAME];
+    NSString *tempPath = [indexPath stringByAppendingPathExtension:@"tmp"];
+    bool written = false;
+    int fd = open([tempPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (-1 != fd) {
+        written = (write(fd, buffer, length) == (ssize_t)length && 0 == fsync(fd));
+        close(fd);
+        // rename is atomic, so a crash leaves either the old index or the new one
+        if (written)
+            written = (0 == rename([tempPath fileSystemRepresentation], [indexPath fileSystemRepresentation]));
+        if (false == written)
+            unlink([tempPath fileSystemRepresentation]);
+    }
+    free(buffer);
+    if (false == written)
+        perror([[NSString stringWithFormat:@"failed to write cache index %@", indexPath] UTF8String]);
+    return written;
+}
+
+static void __FVCacheFileNoop(void *unused) {}
+
 - (void)closeFile
 {
+    // anything queued before this is written; the caller must not save while closing
+    if (_writeQueue)
+        dispatch_sync_f(_writeQueue, NULL, __FVCacheFileNoop);
+    
     [_writeLock lock];
     
-    FVAPIAssert1(-1 != _fileDescriptor, @"Attempt to close a file %@ that has already been closed", self);
+    FVAPIAssert1(nil != _dataFile, @"Attempt to close a file %@ that has already been closed", self);
     [self _writeLogEventsIfNeeded];
     
-    // truncate the file to avoid any zero-fill delay on close()
-    ftruncate(_fileDescriptor, 0);
-    
-    if (-1 != _fileDescriptor) {
-        close(_fileDescriptor);
-        _fileDescriptor = -1;
+    // persistent data stays for the next launch; otherwise truncate the file to avoid any zero-fill delay on close()
+    bool keepData = false;
+    if (nil != _directory) {
+        std::vector<FVCacheIndexRecord> live;
+        [self _getLiveRecords:&live];
+        keepData = [self _writeIndexWithRecords:live dataFile:_dataFile];
     }
+    if (false == keepData)
+        ftruncate(_dataFile->_fileDescriptor, 0);
     
+    // the descriptor is closed when the last location using it goes away
+    [_dataFile release];
+    _dataFile = nil;
+    [_retiredDataFiles removeAllObjects];
+    __FVClockRemoveAllEntries(_clock);
+    
+    [_writeLock unlock];
+}
+
+- (void)setMaximumSize:(unsigned long long)size;
+{
+    FVAPIAssert1(nil != _dataFile, @"Attempt to limit a file %@ that has already been closed", self);
+    [_writeLock lock];
+    _maximumSize = size > INT64_MAX ? INT64_MAX : (off_t)size;
+    [_writeLock unlock];
+    // a long sweep shouldn't hold up the caller
+    dispatch_async(_writeQueue, ^{
+        [_writeLock lock];
+        if (nil != _dataFile)
+            [self _evictToMaximumSize];
+        [_writeLock unlock];
+    });
+}
+
+- (void)getStatistics:(FVCacheFileStatistics *)stats;
+{
+    [_writeLock lock];
+    stats->hitCount = _hitCount;
+    stats->missCount = _missCount;
+    stats->evictionCount = _evictionCount;
+    stats->evictedBytes = _evictedBytes;
+    stats->compressedCount = _compressedCount;
+    stats->incompressibleCount = _incompressibleCount;
+    stats->size = _liveSize > 0 ? _liveSize : 0;
+    stats->maximumSize = INT64_MAX == _maximumSize ? UINT64_MAX : _maximumSize;
     [_writeLock unlock];
 }
 
@@ -286,202 +843,1341 @@ static NSInteger FVCacheLogLevel = 0;
     }
 }
 
-- (void)saveData:(NSData *)data forKey:(id <NSObject, NSCopying>)aKey;
+/*
+ Returns a retained location, or nil if the key has no entry.  Entries saved or invalidated since the file was 
+ opened are in _offsetTable, with NSNull marking an invalidated entry; anything else is looked up in the mapped 
+ index, and only used if the file hasn't changed since it was cached.
+ */
+- (_FVCacheLocation *)_copyLocationForKey:(id)aKey
 {
-    // hold the lock for the entire method, since we don't want anyone else messing with the file descriptor or _deflateBuffer
-    [_writeLock lock];
+    id location;
+    if (_offsetTable->copyValue(aKey, &location)) {
+        if ([location isKindOfClass:[_FVCacheLocation class]]) {
+            // check first, so reads don't keep dirtying the cache line
+            if (false == ((_FVCacheLocation *)location)->_referenced)
+                ((_FVCacheLocation *)location)->_referenced = true;
+            return location;
+        }
+        [location release];
+        return nil;
+    }
     
-    FVAPIAssert1(-1 != _fileDescriptor, @"Attempt to write to a file %@ that has already been closed", self);
-
-    if ([_offsetTable objectForKey:aKey] == nil) {
-        
-        _FVCacheLocation *location = [_FVCacheLocation new];
-        location->_decompressedLength = [data length];
+    // compaction keeps replaced persistent files alive until closeFile, so this can't go away while it's used
+    if (nil == _directory || false == __FVCacheKeyIsPersistent(aKey))
+        return nil;
+    _FVCacheDataFile *file = _dataFile;
+    if (NULL == file->_index)
+        return nil;
+    
+    _FVCacheKey *key = aKey;
+    const FVCacheIndexRecord *record = __FVCacheIndexFind(file->_index, key->_device, key->_inode);
+    if (NULL == record || record->fileSize != key->_fileSize || record->modifiedSeconds != key->_modified.tv_sec || record->modifiedNanoseconds != key->_modified.tv_nsec)
+        return nil;
+    
+    const uint64_t slot = record - __FVCacheIndexRecords(file->_index);
+    if (file->_slotRetired[slot])
+        return nil;
+    if (0 == file->_slotReferenced[slot])
+        file->_slotReferenced[slot] = 1;
+    
+    _FVCacheLocation *loc = [_FVCacheLocation new];
+    loc->_offset = record->offset;
+    loc->_compressedLength = record->compressedLength;
+    loc->_decompressedLength = record->decompressedLength;
+    loc->_padLength = record->padLength;
+    loc->_options = record->options;
+    // the index still refers to this space
+    loc->_file = [file retain];
+    loc->_ownsExtent = false;
+    return loc;
+}
 
-        // set the pointer to the end of the file, since we have no idea where it is now
-        off_t currentEnd = lseek(_fileDescriptor, 0, SEEK_END);
-            
-        if (-1 != currentEnd) {
-                
-            location->_offset = currentEnd;
-            location->_compressedLength = 0;
-            
-            z_stream strm;
-            
-            strm.zalloc = (void *(*)(void *, uInt, uInt))NSZoneCalloc;
-            strm.zfree = (void (*)(void *, void *))NSZoneFree;
-            strm.opaque = FVDefaultZone();
-            strm.total_out = 0;
-            strm.next_in = (Bytef *)[data bytes];
-            strm.avail_in = location->_decompressedLength;
-            
-            int flush, status;
-            (void) deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, 15, 9, Z_HUFFMAN_ONLY);
-            
-            ssize_t writeLength;
-            
-            do {
-                
-                flush = strm.total_in == location->_decompressedLength ? Z_FINISH : Z_NO_FLUSH;
-            
-                do {
-                    
-                    strm.next_out = _deflateBuffer;
-                    strm.avail_out = ZLIB_BUFFER_SIZE;
-                    
-                    status = deflate(&strm, flush);
-                    NSParameterAssert(Z_STREAM_ERROR != status); // indicates state was clobbered
-                    
-                    writeLength = ZLIB_BUFFER_SIZE - strm.avail_out;
-                    if (write(_fileDescriptor, _deflateBuffer, writeLength) != writeLength)
-                        FVLog(@"failed to write all data (%ld bytes)", writeLength);
-                    
-                    location->_compressedLength += writeLength;
-                    
-                } while (strm.avail_out == 0);
-                
-            } while (Z_FINISH != flush);
-
-            (void)deflateEnd(&strm);
-                        
-            // extend the file so we fall on a page boundary
-            location->_padLength = round_page(location->_compressedLength) - location->_compressedLength;
-            if (0 != ftruncate(_fileDescriptor, currentEnd + round_page(location->_compressedLength)))
-                perror([[NSString stringWithFormat:@"failed to zero pad data in file %@", self] UTF8String]);
-            
-            if (FVCacheLogLevel > 0)
-                [self _recordCacheEventWithKey:aKey size:double([data length]) / 1024];
-            
-            // set this only after writing, so the reader thread doesn't get it too early
-            [_offsetTable setObject:location forKey:aKey];
+- (void)saveData:(NSData *)data forKey:(id <NSObject, NSCopying>)aKey;
+{
+    [self saveData:data forKey:aKey options:FVCacheFileCompressed];
+}
 
-        }        
-        else {
-            perror("failed to write data");
+// write lock must be held; a persistent key in _offsetTable shadows its mapped record, which no longer counts toward _liveSize
+- (void)_retireIndexRecordForKey:(id)aKey
+{
+    if (nil == _directory || NULL == _dataFile->_index || false == __FVCacheKeyIsPersistent(aKey))
+        return;
+    _FVCacheKey *key = aKey;
+    const FVCacheIndexRecord *record = __FVCacheIndexFind(_dataFile->_index, key->_device, key->_inode);
+    if (record) {
+        const uint64_t slot = record - __FVCacheIndexRecords(_dataFile->_index);
+        if (0 == _dataFile->_slotRetired[slot]) {
+            _dataFile->_slotRetired[slot] = 1;
+            _liveSize -= record->compressedLength + record->padLength;
         }
-        [location release];
     }
-    [_writeLock unlock];
 }
 
-- (NSData *)copyDataForKey:(id)aKey;
+// write lock must be held
+- (void)_removeLocationForKey:(id)aKey
 {
-    FVAPIAssert1(-1 != _fileDescriptor, @"Attempt to read from a file %@ that has already been closed", self);
-    
-    NSData *data = nil;
+    id current;
+    if (_offsetTable->copyValue(aKey, &current)) {
+        // pending writes and tombstones don't use any space
+        if ([current isKindOfClass:[_FVCacheLocation class]] && nil != ((_FVCacheLocation *)current)->_file)
+            _liveSize -= ((_FVCacheLocation *)current)->_compressedLength + ((_FVCacheLocation *)current)->_padLength;
+        [current release];
+    }
+    else {
+        [self _retireIndexRecordForKey:aKey];
+    }
     
-    // retain to avoid losing this in case -invalidateDataForKey: is called
-    _FVCacheLocation *location = [[_offsetTable objectForKey:aKey] retain];
+    // since the mapped index can't be changed, persistent entries are marked invalid until they're replaced
+    if (nil != _directory && __FVCacheKeyIsPersistent(aKey))
+        _offsetTable->setValue(aKey, [NSNull null]);
+    else
+        _offsetTable->removeValue(aKey);
+}
 
-    if (location) {
-                    
-        // malloc the entire block immediately since we have a fixed length, insted of using NSMutableData to manage a buffer
-        char *bytes = (char *)CFAllocatorAllocate(FVAllocatorGetDefault(), location->_decompressedLength * sizeof(char), 0);
-        
-        if (NULL != bytes) {
-            
-            ssize_t bytesRemaining = location->_compressedLength;
-            // man page says mmap will fail if offset isn't a multiple of page size
-            NSParameterAssert(location->_offset == (off_t)round_page(location->_offset));
-            
-            int status;
-            
-            z_stream strm;
-            strm.avail_in = ZLIB_BUFFER_SIZE;
-            strm.total_out = 0;
-            strm.zalloc = (void *(*)(void *, uInt, uInt))NSZoneCalloc;
-            strm.zfree = (void (*)(void *, void *))NSZoneFree;
-            strm.opaque = FVDefaultZone();
-            
-            (void) inflateInit(&strm);
-            
-            void *mapregion = NULL;
-            const size_t mapLength = location->_compressedLength + location->_padLength;
-            // !!! early return
-            if ((mapregion = mmap(0, mapLength, PROT_READ, MAP_SHARED, _fileDescriptor, location->_offset)) == MAP_FAILED) {
-                perror("mmap failed");
-                CFAllocatorDeallocate(FVAllocatorGetDefault(), bytes);
-                [location release];
-                return nil;
-            }
-            
-            do {
-                                    
-                strm.next_in = (Bytef *)mapregion;
-                strm.avail_in = location->_compressedLength;
-                strm.next_out = (Bytef *)bytes + strm.total_out;
-                strm.avail_out = location->_decompressedLength - strm.total_out;
-                
-                status = inflate(&strm, Z_NO_FLUSH);
-                NSParameterAssert(Z_STREAM_ERROR != status);
-                switch (status) {
-                    case Z_NEED_DICT:
-                    case Z_DATA_ERROR:
-                    case Z_MEM_ERROR:
-                        FVLog(@"failed to decompress with error %d", status);
-                }
-                bytesRemaining -= location->_compressedLength;
-                
-            } while (bytesRemaining > 0);
-            
-            if (Z_STREAM_END != status)
-                FVLog(@"failed to decompress; now what?  status = %d", status);
-            
-            (void)inflateEnd(&strm);
-            
-            if (mapregion) munmap(mapregion, mapLength);
-            
-            NSParameterAssert(strm.total_out == location->_decompressedLength);
-            
-            // transfer ownership to NSData in order to avoid copying
-            data = (id)CFDataCreateWithBytesNoCopy(FVAllocatorGetDefault(), (const uint8_t *)bytes, location->_decompressedLength, FVAllocatorGetDefault());
+// writes all vectors, retrying after short writes; returns false on error
+static bool __FVWriteVectors(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, MIN(count, IOV_MAX));
+        if (written < 0) {
+            if (EINTR == errno)
+                continue;
+            return false;
         }
-        else {
-            FVLog(@"Unable to malloc %ld bytes in -[FVCacheFile copyDataForKey:] with key %@", (unsigned long)location->_decompressedLength, aKey);
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
         }
-
-        NSParameterAssert([data length] == location->_decompressedLength);
-        
-        [location release];
     }
-    
-    return data;
+    return true;
 }
 
-- (void)invalidateDataForKey:(id)aKey;
+/*
+ Compressed entries larger than FV_CHUNK_SIZE are split into chunks that are deflated independently, so they can 
+ be compressed and inflated in parallel, and so a reader can inflate only the chunks it needs.  Such an entry 
+ starts with a table giving the end of each compressed chunk, followed by the chunks.
+ 
+ Bitmaps saved with saveBitmapData:forKey:bytesPerRow:bytesPerPixel: are always chunked, with a chunk size that's 
+ a whole number of rows, and the whole rows in each chunk are run through a PNG-style row filter before deflating.  
+ Deflate only does Huffman coding here, which can't exploit similarity between neighboring pixels, but the filter 
+ turns it into runs of small values that Huffman coding compresses well.  The filter starts over in each chunk, so 
+ chunks can still be inflated independently.
+ */
+// http://www.zlib.net/zlib_how.html says that 128K or 256K is the most efficient size
+#define FV_CHUNK_SIZE    (256 * 1024)
+
+// stored with the location's options, and in the index
+#define FV_ENTRY_CHUNKED (1 << 16)
+
+typedef struct _FVChunkTable {
+    uint32_t chunkCount;
+    uint32_t chunkSize;     // decompressed length of every chunk but the last
+    uint32_t filter;        // FVRowFilterType applied to each chunk, or FVRowFilterNone
+    uint32_t bytesPerPixel; // filter parameters, only valid if filter isn't FVRowFilterNone
+    uint64_t bytesPerRow;   // chunkSize is a multiple of this; bytes after the last whole row of a chunk aren't filtered
+    uint64_t chunkEnds[1];  // chunkCount offsets from the start of the entry
+} FVChunkTable;
+
+static inline size_t __FVChunkTableLength(size_t chunkCount)
 {
-    [_writeLock lock];
-    // give copyDataForKey: a chance to get/retain
-    [[[_offsetTable objectForKey:aKey] retain] autorelease];
-    [_offsetTable removeObjectForKey:aKey];
-    [_writeLock unlock];
+    return offsetof(FVChunkTable, chunkEnds) + chunkCount * sizeof(uint64_t);
 }
 
-@end
+static inline bool __FVShouldChunkEntry(_FVCacheLocation *location)
+{
+    return 0 == (location->_options & FVCacheFileUncompressed) && (location->_decompressedLength > FV_CHUNK_SIZE || (location->_bytesPerRow && location->_decompressedLength));
+}
 
-@implementation _FVCacheKey
+// one call to deflate, so the buffer must hold deflateBound(NULL, length) bytes; dictionary may be nil
+static bool __FVDeflate(const uint8_t *bytes, size_t length, NSData *dictionary, uint8_t *buffer, size_t bufferLength, size_t *outLength)
+{
+    z_stream strm;
+    strm.zalloc = (void *(*)(void *, uInt, uInt))NSZoneCalloc;
+    strm.zfree = (void (*)(void *, void *))NSZoneFree;
+    strm.opaque = FVDefaultZone();
+    const bool isSmall = (length <= FV_DICTIONARY_MAX_INPUT);
+    if (Z_OK != deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, 15, 9, isSmall ? Z_DEFAULT_STRATEGY : Z_HUFFMAN_ONLY))
+        return false;
+    if (isSmall && [dictionary length] && Z_OK != deflateSetDictionary(&strm, (const Bytef *)[dictionary bytes], [dictionary length])) {
+        (void)deflateEnd(&strm);
+        return false;
+    }
+    strm.next_in = (Bytef *)bytes;
+    strm.avail_in = length;
+    strm.next_out = buffer;
+    strm.avail_out = bufferLength;
+    const bool finished = (Z_STREAM_END == deflate(&strm, Z_FINISH));
+    if (finished)
+        *outLength = strm.total_out;
+    (void)deflateEnd(&strm);
+    return finished;
+}
 
-+ (id)newWithURL:(NSURL *)aURL
+// returns a buffer from FVAllocatorGetDefault(), or NULL on failure
+static uint8_t *__FVCreateDeflatedBytes(NSData *data, NSData *dictionary, size_t *length)
 {
-    return [[self allocWithZone:[self zone]] initWithURL:aURL];
+    const uLong bound = deflateBound(NULL, [data length]);
+    uint8_t *bytes = (uint8_t *)CFAllocatorAllocate(FVAllocatorGetDefault(), bound, 0);
+    if (bytes && false == __FVDeflate((const uint8_t *)[data bytes], [data length], dictionary, bytes, bound, length)) {
+        FVLog(@"failed to compress %lu bytes", (unsigned long)[data length]);
+        CFAllocatorDeallocate(FVAllocatorGetDefault(), bytes);
+        bytes = NULL;
+    }
+    return bytes;
 }
 
-- (id)initWithURL:(NSURL *)aURL
+// filters the whole rows of a chunk into a buffer from FVAllocatorGetDefault(), and copies the rest
+static uint8_t *__FVCreateFilteredChunk(const uint8_t *chunk, size_t length, const FVChunkTable *table)
 {
-    self = [super init];
-    if (self) {
-        
-        // default to file not found
-        OSStatus err = fnfErr;
-        
-        if ([aURL isFileURL]) {
-            
-            uint8_t stackBuf[PATH_MAX];
-            uint8_t *fsPath = stackBuf;
-            
-            CFStringRef absolutePath = CFURLCopyFileSystemPath((CFURLRef)aURL, kCFURLPOSIXPathStyle);
-            NSUInteger maxLen = CFStringGetMaximumSizeOfFileSystemRepresentation(absolutePath);
-            if (maxLen > sizeof(stackBuf)) fsPath = new uint8_t[maxLen];
+    uint8_t *filtered = (uint8_t *)CFAllocatorAllocate(FVAllocatorGetDefault(), length, 0);
+    if (filtered) {
+        const size_t rowCount = length / table->bytesPerRow;
+        const size_t rowsLength = rowCount * table->bytesPerRow;
+        FVRowFilterApply(table->filter, chunk, filtered, rowCount, table->bytesPerRow, table->bytesPerPixel);
+        memcpy(filtered + rowsLength, chunk + rowsLength, length - rowsLength);
+    }
+    return filtered;
+}
+
+// everything but chunkCount and chunkEnds
+static void __FVInitChunkTable(_FVCacheLocation *location, FVChunkTable *table)
+{
+    memset(table, 0, sizeof(FVChunkTable));
+    table->chunkSize = FV_CHUNK_SIZE;
+    table->filter = FVRowFilterNone;
+    if (location->_bytesPerRow) {
+        // sampled from the whole bitmap, since choosing per chunk would cost more than it gains
+        const size_t rowCount = [location->_pendingData length] / location->_bytesPerRow;
+        table->filter = FVRowFilterChoose((const uint8_t *)[location->_pendingData bytes], rowCount, location->_bytesPerRow, location->_bytesPerPixel);
+        table->bytesPerPixel = location->_bytesPerPixel;
+        table->bytesPerRow = location->_bytesPerRow;
+        table->chunkSize = MAX(1, FV_CHUNK_SIZE / location->_bytesPerRow) * location->_bytesPerRow;
+    }
+}
+
+// header is from __FVInitChunkTable; returns a buffer from FVAllocatorGetDefault(), or NULL on failure
+static uint8_t *__FVCreateChunkedDeflatedBytes(_FVCacheLocation *location, const FVChunkTable *headerPtr, NSData *dictionary, size_t *length)
+{
+    const uint8_t *source = (const uint8_t *)[location->_pendingData bytes];
+    const size_t sourceLength = [location->_pendingData length];
+    const FVChunkTable header = *headerPtr;
+    const size_t chunkSize = header.chunkSize;
+    const size_t chunkCount = (sourceLength + chunkSize - 1) / chunkSize;
+    const size_t chunkBound = deflateBound(NULL, chunkSize);
+    const size_t tableLength = __FVChunkTableLength(chunkCount);
+    
+    // each chunk is deflated into its own slot, and then they're moved together
+    uint8_t *bytes = (uint8_t *)CFAllocatorAllocate(FVAllocatorGetDefault(), tableLength + chunkCount * chunkBound, 0);
+    if (NULL == bytes)
+        return NULL;
+    std::vector<size_t> chunkLengths(chunkCount, 0);
+    size_t *chunkLengthPtr = &chunkLengths[0];
+    __block bool failed = false;
+    dispatch_apply(chunkCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i){
+        const size_t offset = i * chunkSize;
+        const size_t chunkLength = MIN(chunkSize, sourceLength - offset);
+        const uint8_t *chunk = source + offset;
+        uint8_t *filtered = NULL;
+        if (FVRowFilterNone != headerPtr->filter && NULL == (chunk = filtered = __FVCreateFilteredChunk(chunk, chunkLength, headerPtr)))
+            failed = true;
+        else if (false == __FVDeflate(chunk, chunkLength, dictionary, bytes + tableLength + i * chunkBound, chunkBound, &chunkLengthPtr[i]))
+            failed = true;
+        if (filtered)
+            CFAllocatorDeallocate(FVAllocatorGetDefault(), filtered);
+    });
+    if (failed) {
+        FVLog(@"failed to compress %lu bytes", (unsigned long)sourceLength);
+        CFAllocatorDeallocate(FVAllocatorGetDefault(), bytes);
+        return NULL;
+    }
+    
+    FVChunkTable *table = (FVChunkTable *)bytes;
+    memcpy(table, &header, __FVChunkTableLength(0));
+    table->chunkCount = chunkCount;
+    size_t end = tableLength;
+    for (size_t i = 0; i < chunkCount; i++) {
+        memmove(bytes + end, bytes + tableLength + i * chunkBound, chunkLengths[i]);
+        end += chunkLengths[i];
+        table->chunkEnds[i] = end;
+    }
+    *length = end;
+    return bytes;
+}
+
+/*
+ Deflate spends nearly as much time on data that doesn't compress as on data that does, and inflating it costs a 
+ copy as well, so entries whose sampled bytes have close to 8 bits of entropy per byte are stored as-is, like 
+ entries saved with FVCacheFileUncompressed.  The threshold corresponds to saving less than 10%.  A few kilobytes 
+ spread through the entry are enough for noisy photo thumbnails, which are uniformly incompressible.  Huffman 
+ coding compresses to about the order-0 entropy, so this predicts its output well.  Streams of at most 
+ FV_DICTIONARY_MAX_INPUT bytes are deflated with Z_DEFAULT_STRATEGY and the preset dictionary instead, and string 
+ matching can beat the order-0 entropy on repetitive data, which the threshold allows for.  Bitmaps are sampled 
+ after the row filter, which is what deflate sees.
+ */
+#define FV_ENTROPY_SAMPLE_COUNT  4
+#define FV_ENTROPY_SAMPLE_SIZE   1024
+#define FV_INCOMPRESSIBLE_BITS   7.2
+
+static void __FVAddFilteredSample(const uint8_t *bytes, size_t length, size_t offset, const FVChunkTable *table, NSUInteger *histogram)
+{
+    uint8_t rows[2 * FV_ENTROPY_SAMPLE_SIZE], filtered[2 * FV_ENTROPY_SAMPLE_SIZE];
+    const size_t bytesPerRow = table->bytesPerRow;
+    // the filter only looks up and to the left, so the start of a row and the start of the one above are enough
+    const size_t row = MIN(offset / bytesPerRow, length / bytesPerRow - 1);
+    const size_t sampleLength = MIN(bytesPerRow, (size_t)FV_ENTROPY_SAMPLE_SIZE);
+    if (row) {
+        memcpy(rows, bytes + (row - 1) * bytesPerRow, sampleLength);
+        memcpy(rows + sampleLength, bytes + row * bytesPerRow, sampleLength);
+        FVRowFilterApply(table->filter, rows, filtered, 2, sampleLength, table->bytesPerPixel);
+    }
+    else {
+        FVRowFilterApply(table->filter, bytes, filtered + sampleLength, 1, sampleLength, table->bytesPerPixel);
+    }
+    for (size_t i = 0; i < sampleLength; i++)
+        histogram[filtered[sampleLength + i]]++;
+}
+
+// table is from __FVInitChunkTable
+static bool __FVIsIncompressible(NSData *data, const FVChunkTable *table)
+{
+    const uint8_t *bytes = (const uint8_t *)[data bytes];
+    const size_t length = [data length];
+    NSUInteger histogram[256] = { 0 };
+    const bool isFiltered = (FVRowFilterNone != table->filter && length >= table->bytesPerRow);
+    
+    for (size_t i = 0; i < FV_ENTROPY_SAMPLE_COUNT; i++) {
+        const size_t offset = i * (length / FV_ENTROPY_SAMPLE_COUNT);
+        if (isFiltered) {
+            __FVAddFilteredSample(bytes, length, offset, table, histogram);
+        }
+        else {
+            const size_t end = MIN(length, offset + FV_ENTROPY_SAMPLE_SIZE);
+            for (size_t j = offset; j < end; j++)
+                histogram[bytes[j]]++;
+        }
+    }
+    
+    NSUInteger total = 0;
+    for (size_t i = 0; i < 256; i++)
+        total += histogram[i];
+    // too little to tell, and small enough that compressing it costs nothing
+    if (total < FV_ENTROPY_SAMPLE_SIZE)
+        return false;
+    double bits = 0;
+    for (size_t i = 0; i < 256; i++) {
+        if (histogram[i]) {
+            const double p = (double)histogram[i] / total;
+            bits -= p * log2(p);
+        }
+    }
+    return bits >= FV_INCOMPRESSIBLE_BITS;
+}
+
+typedef struct _FVDictionaryBlock {
+    NSUInteger sampleCount;
+    NSUInteger lastSample;   // 1-based, so 0 means none
+} _FVDictionaryBlock;
+
+typedef std::pair<NSUInteger, const std::string *> _FVDictionaryCandidate;
+
+static bool __FVDictionaryCandidateIsMoreCommon(const _FVDictionaryCandidate &a, const _FVDictionaryCandidate &b)
+{
+    return a.first > b.first;
+}
+
+/*
+ Builds a dictionary from the blocks that occur in more than one sample, counting samples rather than occurrences 
+ so a large flat area in one entry doesn't crowd out the rest.  The most common blocks go at the end, since zlib 
+ encodes nearer matches in fewer bits.  Returns nil if no block recurs.
+ */
+static NSData *__FVCreateDictionary(NSArray *samples)
+{
+    std::map<std::string, _FVDictionaryBlock> blocks;
+    const NSUInteger sampleCount = [samples count];
+    for (NSUInteger i = 0; i < sampleCount; i++) {
+        NSData *sample = [samples objectAtIndex:i];
+        const char *bytes = (const char *)[sample bytes];
+        for (size_t offset = 0; offset + FV_DICTIONARY_BLOCK_SIZE <= [sample length]; offset += FV_DICTIONARY_BLOCK_SIZE) {
+            _FVDictionaryBlock &block = blocks[std::string(bytes + offset, FV_DICTIONARY_BLOCK_SIZE)];
+            if (block.lastSample != i + 1) {
+                block.sampleCount++;
+                block.lastSample = i + 1;
+            }
+        }
+    }
+    
+    std::vector<_FVDictionaryCandidate> candidates;
+    for (std::map<std::string, _FVDictionaryBlock>::const_iterator it = blocks.begin(); it != blocks.end(); it++) {
+        if (it->second.sampleCount > 1)
+            candidates.push_back(std::make_pair(it->second.sampleCount, &it->first));
+    }
+    if (candidates.empty())
+        return nil;
+    std::stable_sort(candidates.begin(), candidates.end(), __FVDictionaryCandidateIsMoreCommon);
+    
+    const size_t blockCount = MIN(candidates.size(), (size_t)(FV_DICTIONARY_SIZE / FV_DICTIONARY_BLOCK_SIZE));
+    NSMutableData *dictionary = [[NSMutableData allocWithZone:FVDefaultZone()] initWithCapacity:blockCount * FV_DICTIONARY_BLOCK_SIZE];
+    for (size_t i = blockCount; i > 0; i--)
+        [dictionary appendBytes:candidates[i - 1].second->data() length:FV_DICTIONARY_BLOCK_SIZE];
+    return dictionary;
+}
+
+/*
+ Keeps the deflate input of small compressed entries, which for a bitmap is its filtered rows, and builds the 
+ dictionary once there are enough.  Only called on the write queue, which is the only place _dictionary changes; 
+ readers don't lock, but the dictionary is published before any entry that uses it.
+ */
+- (void)_addDictionarySamplesFromBatch:(NSArray *)batch
+{
+    const NSUInteger count = [batch count];
+    for (NSUInteger i = 0; i < count; i++) {
+        _FVCacheLocation *location = [batch objectAtIndex:i];
+        if ((location->_options & FVCacheFileUncompressed) || 0 == location->_decompressedLength || location->_decompressedLength > FV_DICTIONARY_MAX_INPUT)
+            continue;
+        
+        NSData *sample = [location->_pendingData retain];
+        FVChunkTable table;
+        __FVInitChunkTable(location, &table);
+        if (FVRowFilterNone != table.filter) {
+            // small enough to be a single chunk
+            uint8_t *filtered = __FVCreateFilteredChunk((const uint8_t *)[sample bytes], [sample length], &table);
+            [sample release];
+            sample = filtered ? (NSData *)CFDataCreateWithBytesNoCopy(FVAllocatorGetDefault(), filtered, location->_decompressedLength, FVAllocatorGetDefault()) : nil;
+        }
+        if (sample)
+            [_dictionarySamples addObject:sample];
+        [sample release];
+    }
+    
+    if ([_dictionarySamples count] >= FV_DICTIONARY_SAMPLE_COUNT) {
+        NSData *dictionary = __FVCreateDictionary(_dictionarySamples);
+        if (FVCacheLogLevel > 0)
+            FVLog(@"built a %lu byte compression dictionary for %@", (unsigned long)[dictionary length], self);
+        OSMemoryBarrier();
+        _dictionary = dictionary;
+        [_dictionarySamples release];
+        _dictionarySamples = nil;
+    }
+}
+
+// write lock must be held
+- (void)_addClockEntryForKey:(id)aKey location:(_FVCacheLocation *)location
+{
+    _FVClockEntry entry = { [aKey retain], location, 0 };
+    _clock->entries.push_back(entry);
+}
+
+/*
+ CLOCK: the hand sweeps over entries in the order they were written, clearing the mark left by a read or write, 
+ and evicts the first entry that isn't marked.  This approximates LRU without any bookkeeping on reads besides 
+ setting a flag.  Records that are only in the mapped index are marked retired instead of being removed from 
+ _offsetTable, since the mapped index has no keys.  Write lock must be held.
+ */
+- (void)_evictToMaximumSize
+{
+    _FVCacheClock *clock = _clock;
+    // the first pass clears every mark, so two passes evict enough unless the entries run out
+    size_t steps = 2 * clock->entries.size();
+    while (_liveSize > _maximumSize && steps-- > 0) {
+        if (clock->hand >= clock->entries.size())
+            clock->hand = 0;
+        _FVClockEntry &entry = clock->entries[clock->hand++];
+        if (__FVClockEntryIsHole(entry))
+            continue;
+        
+        if (nil == entry.key) {
+            const FVCacheIndexRecord *record = __FVCacheIndexRecords(_dataFile->_index) + entry.slot;
+            if (_dataFile->_slotRetired[entry.slot]) {
+                __FVClockRemoveEntry(clock, entry);
+            }
+            else if (_dataFile->_slotReferenced[entry.slot]) {
+                _dataFile->_slotReferenced[entry.slot] = 0;
+            }
+            else {
+                const off_t length = record->compressedLength + record->padLength;
+                _dataFile->_slotRetired[entry.slot] = 1;
+                _liveSize -= length;
+                _evictionCount++;
+                _evictedBytes += length;
+                __FVClockRemoveEntry(clock, entry);
+            }
+            continue;
+        }
+        
+        id current = nil;
+        if (false == _offsetTable->copyValue(entry.key, &current) || current != entry.location) {
+            // invalidated or replaced since it was written
+            __FVClockRemoveEntry(clock, entry);
+        }
+        else if (entry.location->_referenced) {
+            entry.location->_referenced = false;
+        }
+        else {
+            const off_t length = entry.location->_compressedLength + entry.location->_padLength;
+            // readers still using this location keep its space until they're done
+            [self _removeLocationForKey:entry.key];
+            _evictionCount++;
+            _evictedBytes += length;
+            __FVClockRemoveEntry(clock, entry);
+        }
+        [current release];
+    }
+    if (clock->holes > clock->entries.size() / 2)
+        __FVClockCompact(clock);
+}
+
+/*
+ Runs on _writeQueue.  Entries are compressed in parallel, as are the chunks of large entries.  Each one that 
+ fits in a free extent is written there; the rest are laid out end to end from the current end of the file, 
+ each padded to a page boundary with zeroes, and written with a single writev.  Only then are the new locations 
+ published; the space for an entry that was invalidated or replaced in the meantime is freed again.
+ */
+- (void)_writeBatch:(NSArray *)batch
+{
+    const NSUInteger count = [batch count];
+    std::vector<uint8_t *> deflated(count, (uint8_t *)NULL);
+    std::vector<size_t> lengths(count, 0);
+    
+    if (_dictionarySamples)
+        [self _addDictionarySamplesFromBatch:batch];
+    NSData *dictionary = _dictionary;
+    
+    // blocks copy C++ objects, so give the block plain pointers to write through
+    uint8_t **deflatedPtr = &deflated[0];
+    size_t *lengthPtr = &lengths[0];
+    std::vector<char> stored(count, false);
+    char *storedPtr = &stored[0];
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i){
+        _FVCacheLocation *location = [batch objectAtIndex:i];
+        if (location->_options & FVCacheFileUncompressed) {
+            lengthPtr[i] = [location->_pendingData length];
+            return;
+        }
+        FVChunkTable table;
+        __FVInitChunkTable(location, &table);
+        if (__FVIsIncompressible(location->_pendingData, &table)) {
+            storedPtr[i] = true;
+            lengthPtr[i] = [location->_pendingData length];
+        }
+        else if (__FVShouldChunkEntry(location))
+            deflatedPtr[i] = __FVCreateChunkedDeflatedBytes(location, &table, dictionary, &lengthPtr[i]);
+        else
+            deflatedPtr[i] = __FVCreateDeflatedBytes(location->_pendingData, dictionary, &lengthPtr[i]);
+    });
+    
+    // entries that fit in free space are written there; the rest are appended with one writev
+    _FVCacheDataFile *file = _dataFile;
+    const int fd = file->_fileDescriptor;
+    std::vector<off_t> offsets(count, -1);
+    std::vector<bool> reused(count, false);
+    
+    // all padding comes from one page of zeroes; big enough for 16K pages, which aren't a compile-time constant
+    static uint8_t zeroPage[16384];
+    std::vector<struct iovec> iov;
+    iov.reserve(2 * count);
+    const off_t batchStart = lseek(fd, 0, SEEK_END);
+    off_t appendOffset = batchStart;
+    for (NSUInteger i = 0; i < count && -1 != batchStart; i++) {
+        _FVCacheLocation *location = [batch objectAtIndex:i];
+        const bool raw = (location->_options & FVCacheFileUncompressed) || stored[i];
+        // skip anything that failed to compress
+        if (false == raw && NULL == deflated[i])
+            continue;
+        const void *bytes = raw ? [location->_pendingData bytes] : deflated[i];
+        const off_t extentLength = round_page(lengths[i]);
+        
+        off_t offset;
+        if (extentLength > 0 && [file takeFreeExtentWithLength:extentLength offset:&offset]) {
+            // padding is never read, so the old contents can stay
+            if (pwrite(fd, bytes, lengths[i], offset) == (ssize_t)lengths[i]) {
+                offsets[i] = offset;
+                reused[i] = true;
+            }
+            else {
+                perror("failed to write data to free space");
+                [file addFreeExtentAtOffset:offset length:extentLength];
+            }
+            continue;
+        }
+        
+        offsets[i] = appendOffset;
+        struct iovec vec = { (void *)bytes, lengths[i] };
+        iov.push_back(vec);
+        const size_t padLength = extentLength - lengths[i];
+        NSParameterAssert(padLength <= sizeof(zeroPage));
+        if (padLength) {
+            struct iovec pad = { (void *)zeroPage, padLength };
+            iov.push_back(pad);
+        }
+        appendOffset += extentLength;
+    }
+    
+    bool appended = (-1 != batchStart);
+    if (appended && iov.size())
+        appended = __FVWriteVectors(fd, &iov[0], iov.size());
+    if (false == appended) {
+        perror([[NSString stringWithFormat:@"failed to write data to %@", self] UTF8String]);
+        // don't leave a partial entry where the next batch expects the end of the file
+        if (-1 != batchStart) (void) ftruncate(fd, batchStart);
+    }
+    
+    // before any location is published, so readers find it in the mapping
+    [file mapLength:lseek(fd, 0, SEEK_END)];
+    
+    [_writeLock lock];
+    for (NSUInteger i = 0; i < count; i++) {
+        _FVCacheLocation *pending = [batch objectAtIndex:i];
+        _FVCacheLocation *location = nil;
+        if (-1 != offsets[i] && (reused[i] || appended)) {
+            location = [_FVCacheLocation new];
+            location->_offset = offsets[i];
+            location->_compressedLength = lengths[i];
+            location->_decompressedLength = pending->_decompressedLength;
+            location->_padLength = round_page(lengths[i]) - lengths[i];
+            location->_options = pending->_options;
+            // readers map stored entries instead of inflating them
+            if (stored[i])
+                location->_options |= FVCacheFileUncompressed;
+            else if (__FVShouldChunkEntry(pending))
+                location->_options |= FV_ENTRY_CHUNKED;
+            location->_file = [file retain];
+            // nothing on disk refers to this yet, so it can be reused once it's replaced
+            location->_ownsExtent = true;
+        }
+        
+        id current;
+        if (_offsetTable->copyValue(pending->_key, &current)) {
+            if (current == pending) {
+                if (location) {
+                    location->_referenced = true;
+                    _offsetTable->setValue(pending->_key, location);
+                    [self _addClockEntryForKey:pending->_key location:location];
+                    _liveSize += location->_compressedLength + location->_padLength;
+                    if (stored[i])
+                        _incompressibleCount++;
+                    else if (0 == (pending->_options & FVCacheFileUncompressed))
+                        _compressedCount++;
+                }
+                else
+                    [self _removeLocationForKey:pending->_key];
+            }
+            [current release];
+        }
+        // if this was invalidated in the meantime, the space is freed here
+        [location release];
+        _pendingBytes -= pending->_decompressedLength;
+        if (deflated[i])
+            CFAllocatorDeallocate(FVAllocatorGetDefault(), deflated[i]);
+    }
+    if (_liveSize > _maximumSize)
+        [self _evictToMaximumSize];
+    [_writeLock unlock];
+}
+
+typedef struct _FVCompactEntry {
+    id                  key;        // nil for a record that's only in the mapped index
+    _FVCacheLocation   *location;
+    FVCacheIndexRecord  record;
+    off_t               offset;
+    off_t               length;
+    off_t               newOffset;
+} _FVCompactEntry;
+
+typedef struct _FVCompactContext {
+    std::vector<_FVCompactEntry>              entries;
+    std::set<std::pair<uint64_t, uint64_t> >  shadowed;
+    _FVCacheDataFile                         *file;
+} _FVCompactContext;
+
+static void __FVCompactAddEntry(id aKey, id value, void *context)
+{
+    _FVCompactContext *ctx = (_FVCompactContext *)context;
+    if (__FVCacheKeyIsPersistent(aKey))
+        ctx->shadowed.insert(std::make_pair((uint64_t)((_FVCacheKey *)aKey)->_device, (uint64_t)((_FVCacheKey *)aKey)->_inode));
+    
+    // skip tombstones and pending writes
+    if ([value isKindOfClass:[_FVCacheLocation class]] && ((_FVCacheLocation *)value)->_file == ctx->file) {
+        _FVCacheLocation *location = value;
+        _FVCompactEntry entry;
+        entry.key = [aKey retain];
+        entry.location = [location retain];
+        entry.offset = location->_offset;
+        entry.length = location->_compressedLength + location->_padLength;
+        entry.newOffset = -1;
+        ctx->entries.push_back(entry);
+    }
+}
+
+static bool __FVCompactEntryPrecedes(const _FVCompactEntry &a, const _FVCompactEntry &b)
+{
+    return a.offset < b.offset;
+}
+
+// returns an open descriptor for a new, already unlinked file in the given directory, or -1
+static int __FVCreateUnlinkedFile(NSString *directory)
+{
+    char *path = strdup([[directory stringByAppendingPathComponent:@"FileViewCache.XXXXXX"] fileSystemRepresentation]);
+    int fd = mkstemp(path);
+    if (-1 != fd)
+        unlink(path);
+    free(path);
+    return fd;
+}
+
+static bool __FVCopyExtent(int from, off_t offset, int to, off_t length, uint8_t *buffer, size_t bufferSize)
+{
+    while (length > 0) {
+        ssize_t copyLength = pread(from, buffer, MIN((off_t)bufferSize, length), offset);
+        if (copyLength <= 0) {
+            if (-1 == copyLength && EINTR == errno)
+                continue;
+            return false;
+        }
+        struct iovec vec = { buffer, (size_t)copyLength };
+        if (false == __FVWriteVectors(to, &vec, 1))
+            return false;
+        offset += copyLength;
+        length -= copyLength;
+    }
+    return true;
+}
+
+/*
+ Runs on _writeQueue, so nothing is written to the old file while its live entries are copied.  Readers and 
+ invalidateDataForKey: carry on meanwhile.  Entries are copied in file order, and each location that's still 
+ current afterwards is replaced by one in the new file; entries that were invalidated while copying become free 
+ space in the new file.  A persistent cache writes the new index before renaming the new data file into place, 
+ so a crash in between leaves an index that doesn't match, which is discarded at the next launch.
+ */
+- (void)_compactWithHandler:(void (^)(unsigned long long))handler
+{
+    NSAutoreleasePool *pool = [NSAutoreleasePool new];
+    _FVCacheDataFile *oldFile = _dataFile;
+    const bool persistent = (nil != _directory);
+    
+    _FVCompactContext ctx;
+    ctx.file = oldFile;
+    [_writeLock lock];
+    _offsetTable->apply(__FVCompactAddEntry, &ctx);
+    if (oldFile->_index) {
+        const FVCacheIndexHeader *header = (const FVCacheIndexHeader *)oldFile->_index;
+        const FVCacheIndexRecord *records = __FVCacheIndexRecords(oldFile->_index);
+        for (uint64_t i = 0; i < header->slotCount; i++) {
+            if (0 != records[i].hash && 0 == oldFile->_slotRetired[i] && 0 == ctx.shadowed.count(std::make_pair(records[i].device, records[i].inode))) {
+                _FVCompactEntry entry;
+                entry.key = nil;
+                entry.location = nil;
+                entry.record = records[i];
+                entry.offset = records[i].offset;
+                entry.length = records[i].compressedLength + records[i].padLength;
+                entry.newOffset = -1;
+                ctx.entries.push_back(entry);
+            }
+        }
+    }
+    [_writeLock unlock];
+    
+    struct stat sb;
+    const off_t oldLength = (0 == fstat(oldFile->_fileDescriptor, &sb)) ? sb.st_size : 0;
+    
+    const char *newPath = NULL;
+    int fd;
+    if (persistent) {
+        newPath = [[[_directory stringByAppendingPathComponent:@FV_DATA_NAME] stringByAppendingPathExtension:@"compact"] fileSystemRepresentation];
+        fd = open(newPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (-1 != fd && 0 != flock(fd, LOCK_EX | LOCK_NB)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else {
+        fd = __FVCreateUnlinkedFile([_path stringByDeletingLastPathComponent]);
+    }
+    bool copied = (-1 != fd);
+    if (copied)
+        fcntl(fd, F_NOCACHE, 1);
+    
+    // sequential reads from the old file
+    std::sort(ctx.entries.begin(), ctx.entries.end(), __FVCompactEntryPrecedes);
+    const size_t bufferSize = 1024 * 1024;
+    uint8_t *buffer = (uint8_t *)CFAllocatorAllocate(FVAllocatorGetDefault(), bufferSize, 0);
+    off_t newLength = 0;
+    for (std::vector<_FVCompactEntry>::iterator it = ctx.entries.begin(); copied && it != ctx.entries.end(); it++) {
+        copied = (NULL != buffer && __FVCopyExtent(oldFile->_fileDescriptor, it->offset, fd, it->length, buffer, bufferSize));
+        it->newOffset = newLength;
+        newLength += it->length;
+    }
+    if (buffer) CFAllocatorDeallocate(FVAllocatorGetDefault(), buffer);
+    
+    unsigned long long bytesReclaimed = 0;
+    if (copied) {
+        _FVCacheDataFile *newFile = [[_FVCacheDataFile allocWithZone:[self zone]] initWithFileDescriptor:fd];
+        [newFile mapLength:newLength];
+        std::vector<FVCacheIndexRecord> records;
+        
+        // entries can only be invalidated while copying, since this is on the write queue
+        [_writeLock lock];
+        for (std::vector<_FVCompactEntry>::iterator it = ctx.entries.begin(); it != ctx.entries.end(); it++) {
+            if (nil == it->key) {
+                it->record.offset = it->newOffset;
+                records.push_back(it->record);
+                continue;
+            }
+            id current;
+            if (_offsetTable->copyValue(it->key, &current)) {
+                if (current != it->location) {
+                    [it->location release];
+                    it->location = nil;
+                }
+                [current release];
+            }
+            else {
+                [it->location release];
+                it->location = nil;
+            }
+            if (nil != it->location && persistent && __FVCacheKeyIsPersistent(it->key)) {
+                FVCacheIndexRecord record;
+                __FVCacheIndexSetRecord(&record, it->key, it->location);
+                record.offset = it->newOffset;
+                records.push_back(record);
+            }
+        }
+        
+        // a persistent cache can't use the new file until it has an index and has replaced the old one
+        bool swapped = true;
+        if (persistent) {
+            const char *dataPath = [[_directory stringByAppendingPathComponent:@FV_DATA_NAME] fileSystemRepresentation];
+            swapped = [self _writeIndexWithRecords:records dataFile:newFile] && 0 == rename(newPath, dataPath);
+            if (swapped && (0 != fstat(fd, &sb) || false == [self _mapIndexIntoDataFile:newFile stat:&sb]))
+                FVLog(@"failed to map compacted index for %@", self);
+        }
+        
+        if (swapped) {
+            for (std::vector<_FVCompactEntry>::iterator it = ctx.entries.begin(); it != ctx.entries.end(); it++) {
+                if (nil == it->key) 
+                    continue;
+                if (nil == it->location) {
+                    [newFile addFreeExtentAtOffset:it->newOffset length:it->length];
+                    continue;
+                }
+                _FVCacheLocation *location = [_FVCacheLocation new];
+                location->_offset = it->newOffset;
+                location->_compressedLength = it->location->_compressedLength;
+                location->_decompressedLength = it->location->_decompressedLength;
+                location->_padLength = it->location->_padLength;
+                location->_options = it->location->_options;
+                location->_file = [newFile retain];
+                // the new index refers to persistent entries
+                location->_ownsExtent = (false == persistent || false == __FVCacheKeyIsPersistent(it->key));
+                location->_referenced = it->location->_referenced;
+                
+                // shadowed by _offsetTable, as for the old index
+                if (false == location->_ownsExtent && newFile->_index) {
+                    _FVCacheKey *key = it->key;
+                    const FVCacheIndexRecord *record = __FVCacheIndexFind(newFile->_index, key->_device, key->_inode);
+                    if (record)
+                        newFile->_slotRetired[record - __FVCacheIndexRecords(newFile->_index)] = 1;
+                }
+                _offsetTable->setValue(it->key, location);
+                [location release];
+            }
+            
+            // readers look at the index through _dataFile without locking, so it has to be complete first
+            OSMemoryBarrier();
+            _dataFile = newFile;
+            // lookups in the old mapped index may still be using it
+            if (persistent)
+                [_retiredDataFiles addObject:oldFile];
+            [oldFile release];
+            
+            // the CLOCK keeps its order, but records in the old index are replaced by those in the new one
+            for (std::vector<_FVClockEntry>::iterator it = _clock->entries.begin(); it != _clock->entries.end(); it++) {
+                id current;
+                if (nil != it->key && _offsetTable->copyValue(it->key, &current)) {
+                    if ([current isKindOfClass:[_FVCacheLocation class]] && nil != ((_FVCacheLocation *)current)->_file)
+                        it->location = current;
+                    else
+                        __FVClockRemoveEntry(_clock, *it);
+                    [current release];
+                }
+                else if (false == __FVClockEntryIsHole(*it)) {
+                    __FVClockRemoveEntry(_clock, *it);
+                }
+            }
+            __FVClockCompact(_clock);
+            if (newFile->_index)
+                (void) [self _addClockEntriesForDataFile:newFile];
+            _liveSize = newLength - [newFile freeSize];
+            bytesReclaimed = oldLength > newLength ? oldLength - newLength : 0;
+        }
+        else {
+            // closeFile rewrites the index for the old file
+            [newFile release];
+            unlink(newPath);
+        }
+        [_writeLock unlock];
+    }
+    else {
+        if (-1 != fd) close(fd);
+        if (newPath) unlink(newPath);
+        perror([[NSString stringWithFormat:@"failed to compact %@", self] UTF8String]);
+    }
+    
+    for (std::vector<_FVCompactEntry>::iterator it = ctx.entries.begin(); it != ctx.entries.end(); it++) {
+        [it->key release];
+        [it->location release];
+    }
+    
+    if (FVCacheLogLevel > 0)
+        FVLog(@"compacted %@ from %.2f MB, reclaiming %.2f MB", _cacheName ? _cacheName : _path, double(oldLength) / 1024 / 1024, double(bytesReclaimed) / 1024 / 1024);
+    
+    if (handler)
+        handler(bytesReclaimed);
+    [pool release];
+}
+
+- (void)compactWithCompletionHandler:(void (^)(unsigned long long bytesReclaimed))handler;
+{
+    FVAPIAssert1(nil != _dataFile, @"Attempt to compact a file %@ that has already been closed", self);
+    // the block retains self and copies the handler
+    dispatch_async(_writeQueue, ^{ [self _compactWithHandler:handler]; });
+}
+
+- (void)_writePendingData
+{
+    for (;;) {
+        NSAutoreleasePool *pool = [NSAutoreleasePool new];
+        
+        [_writeLock lock];
+        NSUInteger count = 0;
+        size_t batchSize = 0;
+        const NSUInteger pendingCount = [_pendingWrites count];
+        while (count < pendingCount && count < FV_WRITE_BATCH_COUNT && batchSize < FV_WRITE_BATCH_SIZE) {
+            batchSize += ((_FVCacheLocation *)[_pendingWrites objectAtIndex:count])->_decompressedLength;
+            count++;
+        }
+        NSArray *batch = [_pendingWrites subarrayWithRange:NSMakeRange(0, count)];
+        [_pendingWrites removeObjectsInRange:NSMakeRange(0, count)];
+        if (0 == count)
+            _writeScheduled = false;
+        [_writeLock unlock];
+        
+        if (count)
+            [self _writeBatch:batch];
+        
+        [pool release];
+        if (0 == count)
+            break;
+    }
+    
+    // only when the queue is empty, so a burst of saves isn't held up; _liveSize only changes with the lock held, but this is just a heuristic
+    const off_t unusedSize = lseek(_dataFile->_fileDescriptor, 0, SEEK_END) - _liveSize;
+    if (unusedSize >= FV_COMPACT_MIN_UNUSED && unusedSize > _liveSize)
+        [self _compactWithHandler:nil];
+}
+
+static void __FVCacheFileWritePendingData(void *context)
+{
+    FVCacheFile *self = (FVCacheFile *)context;
+    [self _writePendingData];
+    [self release];
+}
+
+// bytesPerRow is 0 unless the data starts with rows of pixels
+- (void)_saveData:(NSData *)data forKey:(id <NSObject, NSCopying>)aKey options:(FVCacheFileOptions)options bytesPerRow:(NSUInteger)bytesPerRow bytesPerPixel:(NSUInteger)bytesPerPixel
+{
+    [_writeLock lock];
+    
+    FVAPIAssert1(nil != _dataFile, @"Attempt to write to a file %@ that has already been closed", self);
+
+    _FVCacheLocation *existing = [self _copyLocationForKey:aKey];
+    if (nil == existing) {
+        
+        // readers get the data from memory until the writer has published its location
+        _FVCacheLocation *location = [_FVCacheLocation new];
+        location->_decompressedLength = [data length];
+        location->_options = options;
+        location->_bytesPerRow = bytesPerRow;
+        location->_bytesPerPixel = bytesPerPixel;
+        location->_pendingData = [data copyWithZone:NULL];
+        location->_key = [aKey copyWithZone:NULL];
+        [self _retireIndexRecordForKey:aKey];
+        _offsetTable->setValue(aKey, location);
+        [_pendingWrites addObject:location];
+        _pendingBytes += location->_decompressedLength;
+        [location release];
+        
+        if (FVCacheLogLevel > 0)
+            [self _recordCacheEventWithKey:aKey size:double([data length]) / 1024];
+        
+        if (false == _writeScheduled) {
+            _writeScheduled = true;
+            dispatch_async_f(_writeQueue, [self retain], __FVCacheFileWritePendingData);
+        }
+    }
+    const bool shouldWait = _pendingBytes > FV_MAX_PENDING_SIZE;
+    [existing release];
+    [_writeLock unlock];
+    
+    // don't let renderers queue up data faster than it can be written
+    if (shouldWait)
+        dispatch_sync_f(_writeQueue, NULL, __FVCacheFileNoop);
+}
+
+- (void)saveData:(NSData *)data forKey:(id <NSObject, NSCopying>)aKey options:(FVCacheFileOptions)options;
+{
+    [self _saveData:data forKey:aKey options:options bytesPerRow:0 bytesPerPixel:0];
+}
+
+- (void)saveBitmapData:(NSData *)data forKey:(id <NSObject, NSCopying>)aKey bytesPerRow:(NSUInteger)bytesPerRow bytesPerPixel:(NSUInteger)bytesPerPixel;
+{
+    // the filter needs whole bytes per pixel, and a row that fits in a chunk table; anything else is just deflated
+    if (bytesPerPixel < 1 || bytesPerPixel > FV_ROW_FILTER_MAX_PIXEL_SIZE || bytesPerRow < bytesPerPixel || bytesPerRow > UINT32_MAX)
+        bytesPerRow = bytesPerPixel = 0;
+    [self _saveData:data forKey:aKey options:FVCacheFileCompressed bytesPerRow:bytesPerRow bytesPerPixel:bytesPerPixel];
+}
+
+// maps a written entry, preferring the file's mapping; returns NULL on failure, or a pointer to pass to __FVCacheLocationUnmap
+static const uint8_t *__FVCacheLocationMap(_FVCacheLocation *location, _FVCacheMapping **mapping, FVEpoch::Token *token)
+{
+    const size_t mapLength = location->_compressedLength + location->_padLength;
+    // the file's mapping normally covers every entry, so this is just pointer arithmetic; if not, map only this entry
+    *mapping = __FVCacheDataFileEnter(location->_file, location->_offset, mapLength, token);
+    if (*mapping)
+        return (const uint8_t *)(*mapping)->base + location->_offset;
+    
+    // man page says mmap will fail if offset isn't a multiple of page size
+    NSCParameterAssert(location->_offset == (off_t)round_page(location->_offset));
+    void *mapregion = mmap(0, mapLength, PROT_READ, MAP_SHARED, location->_file->_fileDescriptor, location->_offset);
+    if (MAP_FAILED == mapregion) {
+        perror("mmap failed");
+        return NULL;
+    }
+    return (const uint8_t *)mapregion;
+}
+
+static void __FVCacheLocationUnmap(_FVCacheLocation *location, const uint8_t *bytes, _FVCacheMapping *mapping, FVEpoch::Token token)
+{
+    if (mapping)
+        __FVCacheDataFileExit(location->_file, token);
+    else
+        munmap((void *)bytes, location->_compressedLength + location->_padLength);
+}
+
+// one call to inflate, since the decompressed length is known; dictionary may be nil
+static bool __FVInflate(const uint8_t *bytes, size_t length, NSData *dictionary, uint8_t *buffer, size_t bufferLength)
+{
+    z_stream strm;
+    strm.zalloc = (void *(*)(void *, uInt, uInt))NSZoneCalloc;
+    strm.zfree = (void (*)(void *, void *))NSZoneFree;
+    strm.opaque = FVDefaultZone();
+    strm.next_in = (Bytef *)bytes;
+    strm.avail_in = length;
+    if (Z_OK != inflateInit(&strm))
+        return false;
+    strm.next_out = buffer;
+    strm.avail_out = bufferLength;
+    int status = inflate(&strm, Z_FINISH);
+    // inflateSetDictionary fails unless the checksum matches the one in the stream
+    if (Z_NEED_DICT == status && [dictionary length] && Z_OK == inflateSetDictionary(&strm, (const Bytef *)[dictionary bytes], [dictionary length]))
+        status = inflate(&strm, Z_FINISH);
+    NSCParameterAssert(Z_STREAM_ERROR != status);
+    if (Z_STREAM_END != status)
+        FVLog(@"failed to decompress with error %d", status);
+    (void)inflateEnd(&strm);
+    return Z_STREAM_END == status && strm.total_out == bufferLength;
+}
+
+/*
+ Inflates and unfilters the chunks that overlap range in parallel, into a buffer from FVAllocatorGetDefault().  
+ The buffer starts with the first of those chunks, which is *bufferOffset bytes before range.location.  Returns 
+ NULL on failure, including a chunk table that doesn't match the location, since it's read from the file.
+ */
+static uint8_t *__FVCreateInflatedChunks(const uint8_t *entry, _FVCacheLocation *location, NSData *dictionary, NSRange range, size_t *bufferOffset)
+{
+    const FVChunkTable *table = (const FVChunkTable *)entry;
+    const size_t chunkSize = table->chunkSize;
+    const size_t decompressedLength = location->_decompressedLength;
+    if (location->_compressedLength < __FVChunkTableLength(0) || 0 == chunkSize || table->chunkCount != (decompressedLength + chunkSize - 1) / chunkSize || __FVChunkTableLength(table->chunkCount) > location->_compressedLength)
+        return NULL;
+    const FVRowFilterType filter = table->filter;
+    const size_t bytesPerRow = table->bytesPerRow;
+    const size_t bytesPerPixel = table->bytesPerPixel;
+    if (FVRowFilterNone != filter && ((FVRowFilterSub != filter && FVRowFilterUp != filter && FVRowFilterPaeth != filter) || bytesPerPixel < 1 || bytesPerPixel > FV_ROW_FILTER_MAX_PIXEL_SIZE || bytesPerRow < bytesPerPixel || chunkSize % bytesPerRow))
+        return NULL;
+    
+    const size_t tableLength = __FVChunkTableLength(table->chunkCount);
+    const size_t first = range.location / chunkSize;
+    const size_t last = (NSMaxRange(range) - 1) / chunkSize;
+    const size_t start = first * chunkSize;
+    uint8_t *bytes = (uint8_t *)CFAllocatorAllocate(FVAllocatorGetDefault(), MIN((last + 1) * chunkSize, decompressedLength) - start, 0);
+    if (NULL == bytes)
+        return NULL;
+    
+    __block bool failed = false;
+    dispatch_apply(last - first + 1, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i){
+        const size_t chunk = first + i;
+        const uint64_t chunkStart = chunk ? table->chunkEnds[chunk - 1] : tableLength;
+        const uint64_t chunkEnd = table->chunkEnds[chunk];
+        const size_t outputStart = chunk * chunkSize;
+        const size_t outputLength = MIN(chunkSize, decompressedLength - outputStart);
+        if (chunkStart > chunkEnd || chunkEnd > location->_compressedLength || false == __FVInflate(entry + chunkStart, chunkEnd - chunkStart, dictionary, bytes + outputStart - start, outputLength))
+            failed = true;
+        else if (FVRowFilterNone != filter)
+            FVRowFilterRevert(filter, bytes + outputStart - start, outputLength / bytesPerRow, bytesPerRow, bytesPerPixel);
+    });
+    if (failed) {
+        CFAllocatorDeallocate(FVAllocatorGetDefault(), bytes);
+        return NULL;
+    }
+    *bufferOffset = range.location - start;
+    return bytes;
+}
+
+// range must be within the entry
+- (NSData *)_copyDataForLocation:(_FVCacheLocation *)location range:(NSRange)range
+{
+    const bool isEntire = (0 == range.location && location->_decompressedLength == range.length);
+    if (location->_pendingData)
+        return isEntire ? [location->_pendingData retain] : [[location->_pendingData subdataWithRange:range] retain];
+    
+    if (location->_options & FVCacheFileUncompressed) {
+        NSData *data = [[_FVMappedCacheData allocWithZone:[self zone]] initWithLocation:location];
+        if (isEntire || nil == data)
+            return data;
+        NSData *subdata = [[data subdataWithRange:range] retain];
+        [data release];
+        return subdata;
+    }
+    
+    if (0 == range.length)
+        return [[NSData allocWithZone:[self zone]] init];
+    
+    _FVCacheMapping *mapping;
+    FVEpoch::Token token;
+    const uint8_t *entry = __FVCacheLocationMap(location, &mapping, &token);
+    if (NULL == entry)
+        return nil;
+    
+    uint8_t *bytes;
+    size_t bufferOffset = 0;
+    if (location->_options & FV_ENTRY_CHUNKED) {
+        bytes = __FVCreateInflatedChunks(entry, location, _dictionary, range, &bufferOffset);
+    }
+    else {
+        // malloc the entire block immediately since we have a fixed length, insted of using NSMutableData to manage a buffer
+        bytes = (uint8_t *)CFAllocatorAllocate(FVAllocatorGetDefault(), location->_decompressedLength, 0);
+        if (bytes && false == __FVInflate(entry, location->_compressedLength, _dictionary, bytes, location->_decompressedLength)) {
+            CFAllocatorDeallocate(FVAllocatorGetDefault(), bytes);
+            bytes = NULL;
+        }
+        bufferOffset = range.location;
+    }
+    __FVCacheLocationUnmap(location, entry, mapping, token);
+    
+    NSData *data = nil;
+    if (NULL == bytes) {
+        FVLog(@"failed to read %lu bytes from %@", (unsigned long)range.length, self);
+    }
+    else if (0 == bufferOffset) {
+        // transfer ownership to NSData in order to avoid copying; anything past the range is just unused
+        data = (id)CFDataCreateWithBytesNoCopy(FVAllocatorGetDefault(), bytes, range.length, FVAllocatorGetDefault());
+    }
+    else {
+        data = (id)CFDataCreate(FVAllocatorGetDefault(), bytes + bufferOffset, range.length);
+        CFAllocatorDeallocate(FVAllocatorGetDefault(), bytes);
+    }
+    return data;
+}
+
+- (NSData *)copyDataForKey:(id)aKey;
+{
+    FVAPIAssert1(nil != _dataFile, @"Attempt to read from a file %@ that has already been closed", self);
+    
+    // retain to avoid losing this in case -invalidateDataForKey: is called
+    _FVCacheLocation *location = [self _copyLocationForKey:aKey];
+    OSAtomicIncrement64(location ? &_hitCount : &_missCount);
+    
+    NSData *data = nil;
+    if (location) {
+        data = [self _copyDataForLocation:location range:NSMakeRange(0, location->_decompressedLength)];
+        NSParameterAssert(nil == data || [data length] == location->_decompressedLength);
+        [location release];
+    }
+    return data;
+}
+
+- (NSData *)copyDataForKey:(id)aKey range:(NSRange)range;
+{
+    FVAPIAssert1(nil != _dataFile, @"Attempt to read from a file %@ that has already been closed", self);
+    
+    _FVCacheLocation *location = [self _copyLocationForKey:aKey];
+    OSAtomicIncrement64(location ? &_hitCount : &_missCount);
+    
+    NSData *data = nil;
+    if (location) {
+        if (range.location <= location->_decompressedLength && range.length <= location->_decompressedLength - range.location)
+            data = [self _copyDataForLocation:location range:range];
+        [location release];
+    }
+    return data;
+}
+
+typedef struct _FVBatchRead {
+    NSUInteger        index;      // in the array of keys
+    _FVCacheLocation *location;
+} _FVBatchRead;
+
+static bool __FVBatchReadPrecedes(const _FVBatchRead &a, const _FVBatchRead &b)
+{
+    // compaction can leave entries in two files, so group by file first
+    if (a.location->_file != b.location->_file)
+        return a.location->_file < b.location->_file;
+    return a.location->_offset < b.location->_offset;
+}
+
+// unused space smaller than this between two entries is read along with them, since it's cheaper than a seek
+#define FV_READAHEAD_GAP (128 * 1024)
+
+/*
+ Asks the kernel to start reading the entries in ascending order, merging entries that are close together into 
+ one range, so a disk sees a few long sequential reads instead of a seek per entry.  Reads go through the file's 
+ mapping, so the hint is madvise(2) on the mapping; posix_fadvise(2) isn't available on Mac OS X, and F_RDADVISE 
+ only covers a range that isn't mapped.  Reads must be sorted with __FVBatchReadPrecedes.
+ */
+static void __FVReadAhead(const std::vector<_FVBatchRead> &reads)
+{
+    size_t i = 0;
+    while (i < reads.size()) {
+        _FVCacheDataFile *file = reads[i].location->_file;
+        const off_t start = reads[i].location->_offset;
+        off_t end = start + reads[i].location->_compressedLength + reads[i].location->_padLength;
+        for (i++; i < reads.size() && reads[i].location->_file == file && reads[i].location->_offset <= end + FV_READAHEAD_GAP; i++)
+            end = MAX(end, reads[i].location->_offset + (off_t)(reads[i].location->_compressedLength + reads[i].location->_padLength));
+        
+        _FVCacheMapping *mapping = __FVCacheDataFileCopyMapping(file, start, end - start);
+        if (mapping) {
+            // entries start on page boundaries, as madvise requires
+            (void) madvise((char *)mapping->base + start, end - start, MADV_WILLNEED);
+            __FVCacheMappingRelease(mapping);
+        }
+        else {
+#if defined(F_RDADVISE)
+            struct radvisory advice = { start, (int)MIN(end - start, (off_t)INT_MAX) };
+            (void) fcntl(file->_fileDescriptor, F_RDADVISE, &advice);
+#elif defined(POSIX_FADV_WILLNEED)
+            (void) posix_fadvise(file->_fileDescriptor, start, end - start, POSIX_FADV_WILLNEED);
+#endif
+        }
+    }
+}
+
+// locations contains an _FVCacheLocation or NSNull for each key; returns NSData or NSNull for each
+- (NSArray *)_copyDataForLocations:(NSArray *)locations
+{
+    const NSUInteger count = [locations count];
+    std::vector<_FVBatchRead> reads;
+    std::vector<NSUInteger> order;
+    order.reserve(count);
+    for (NSUInteger i = 0; i < count; i++) {
+        id location = [locations objectAtIndex:i];
+        if ([location isKindOfClass:[_FVCacheLocation class]] && nil == ((_FVCacheLocation *)location)->_pendingData) {
+            _FVBatchRead read = { i, location };
+            reads.push_back(read);
+        }
+        else {
+            order.push_back(i);
+        }
+    }
+    std::sort(reads.begin(), reads.end(), __FVBatchReadPrecedes);
+    __FVReadAhead(reads);
+    
+    // entries on disk come first, in file order, so the first to be inflated are the first to be read in
+    order.insert(order.begin(), reads.size(), 0);
+    for (size_t i = 0; i < reads.size(); i++)
+        order[i] = reads[i].index;
+    
+    // results go in a C array, since NSMutableArray isn't thread-safe
+    id *results = (id *)NSZoneCalloc([self zone], MAX(count, (NSUInteger)1), sizeof(id));
+    const NSUInteger *orderPtr = count ? &order[0] : NULL;
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i){
+        const NSUInteger index = orderPtr[i];
+        id location = [locations objectAtIndex:index];
+        if ([location isKindOfClass:[_FVCacheLocation class]])
+            results[index] = [self _copyDataForLocation:location range:NSMakeRange(0, ((_FVCacheLocation *)location)->_decompressedLength)];
+    });
+    
+    NSMutableArray *dataArray = [[NSMutableArray allocWithZone:[self zone]] initWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        [dataArray addObject:results[i] ? results[i] : [NSNull null]];
+        [results[i] release];
+    }
+    NSZoneFree([self zone], results);
+    return dataArray;
+}
+
+- (void)copyDataForKeys:(NSArray *)keys completion:(void (^)(NSArray *dataArray))handler;
+{
+    FVAPIAssert1(nil != _dataFile, @"Attempt to read from a file %@ that has already been closed", self);
+    NSParameterAssert(nil != handler);
+    
+    // look up every key now, so the results are what copyDataForKey: would have returned at this point
+    const NSUInteger count = [keys count];
+    NSMutableArray *locations = [[NSMutableArray allocWithZone:[self zone]] initWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        _FVCacheLocation *location = [self _copyLocationForKey:[keys objectAtIndex:i]];
+        OSAtomicIncrement64(location ? &_hitCount : &_missCount);
+        [locations addObject:location ? (id)location : (id)[NSNull null]];
+        [location release];
+    }
+    
+    // the block retains self and copies the handler
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSArray *dataArray = [self _copyDataForLocations:locations];
+        [locations release];
+        handler(dataArray);
+        [dataArray release];
+    });
+}
+
+- (void)invalidateDataForKey:(id)aKey;
+{
+    [_writeLock lock];
+    // the old location isn't released until concurrent readers are done with it
+    [self _removeLocationForKey:aKey];
+    [_writeLock unlock];
+}
+
+@end
+
+@implementation _FVCacheKey
+
++ (id)newWithURL:(NSURL *)aURL
+{
+    return [[self allocWithZone:[self zone]] initWithURL:aURL];
+}
+
+- (id)initWithURL:(NSURL *)aURL
+{
+    self = [super init];
+    if (self) {
+        
+        // default to file not found
+        OSStatus err = fnfErr;
+        
+        if ([aURL isFileURL]) {
+            
+            uint8_t stackBuf[PATH_MAX];
+            uint8_t *fsPath = stackBuf;
+            
+            CFStringRef absolutePath = CFURLCopyFileSystemPath((CFURLRef)aURL, kCFURLPOSIXPathStyle);
+            NSUInteger maxLen = CFStringGetMaximumSizeOfFileSystemRepresentation(absolutePath);
+            if (maxLen > sizeof(stackBuf)) fsPath = new uint8_t[maxLen];
             CFStringGetFileSystemRepresentation(absolutePath, (char *)fsPath, maxLen);
             
             struct stat sb;
@@ -491,6 +2187,8 @@ static NSInteger FVCacheLogLevel = 0;
                 _inode = sb.st_ino;
                 _device = sb.st_dev;
                 _hash = _inode;
+                _modified = sb.st_mtimespec;
+                _fileSize = sb.st_size;
             }
             
             if (fsPath != stackBuf) delete [] fsPath;
@@ -502,6 +2200,8 @@ static NSInteger FVCacheLogLevel = 0;
         if (noErr != err) {
             _inode = 0;
             _device = 0;
+            _modified.tv_sec = _modified.tv_nsec = 0;
+            _fileSize = 0;
             // inline hash; CFURL hashing is expensive since it requires CFString copies
             _hash = [aURL hash];
         }
@@ -541,6 +2241,203 @@ static NSInteger FVCacheLogLevel = 0;
 @end
 
 @implementation _FVCacheLocation
+
+- (void)dealloc
+{
+    if (_ownsExtent)
+        [_file addFreeExtentAtOffset:_offset length:_compressedLength + _padLength];
+    [_file release];
+    [_pendingData release];
+    [_key release];
+    [super dealloc];
+}
+
+@end
+
+@implementation _FVCacheDataFile
+
+- (id)initWithFileDescriptor:(int)fd;
+{
+    self = [super init];
+    if (self) {
+        _fileDescriptor = fd;
+        _index = NULL;
+        _indexLength = 0;
+        _slotReferenced = NULL;
+        _slotRetired = NULL;
+        _mapping = NULL;
+        _mappingEpoch = new FVEpoch;
+        pthread_mutex_init(&_extentLock, NULL);
+        _extentsByOffset = new std::map<off_t, off_t>;
+        _extentsByLength = new std::multimap<off_t, off_t>;
+        _freeSize = 0;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (-1 != _fileDescriptor) close(_fileDescriptor);
+    if (_index) munmap((void *)_index, _indexLength);
+    // one block for both arrays
+    free(_slotReferenced);
+    // no reader can get here without a reference to this file, so retired mappings are released as well
+    delete _mappingEpoch;
+    if (_mapping) __FVCacheMappingRelease(_mapping);
+    pthread_mutex_destroy(&_extentLock);
+    delete _extentsByOffset;
+    delete _extentsByLength;
+    [super dealloc];
+}
+
+static void __FVEraseExtentByLength(std::multimap<off_t, off_t> *extents, off_t length, off_t offset)
+{
+    std::pair<std::multimap<off_t, off_t>::iterator, std::multimap<off_t, off_t>::iterator> range = extents->equal_range(length);
+    for (std::multimap<off_t, off_t>::iterator it = range.first; it != range.second; it++) {
+        if (it->second == offset) {
+            extents->erase(it);
+            return;
+        }
+    }
+}
+
+// adjacent extents are merged, so a run of small dead entries can hold a larger one
+- (void)addFreeExtentAtOffset:(off_t)offset length:(off_t)length;
+{
+    if (length <= 0)
+        return;
+    pthread_mutex_lock(&_extentLock);
+    _freeSize += length;
+    std::map<off_t, off_t>::iterator next = _extentsByOffset->lower_bound(offset);
+    if (next != _extentsByOffset->begin()) {
+        std::map<off_t, off_t>::iterator prev = next;
+        prev--;
+        if (prev->first + prev->second == offset) {
+            __FVEraseExtentByLength(_extentsByLength, prev->second, prev->first);
+            offset = prev->first;
+            length += prev->second;
+            _extentsByOffset->erase(prev);
+        }
+    }
+    if (next != _extentsByOffset->end() && offset + length == next->first) {
+        __FVEraseExtentByLength(_extentsByLength, next->second, next->first);
+        length += next->second;
+        _extentsByOffset->erase(next);
+    }
+    (*_extentsByOffset)[offset] = length;
+    _extentsByLength->insert(std::make_pair(length, offset));
+    pthread_mutex_unlock(&_extentLock);
+}
+
+// best fit; anything left over stays free
+- (bool)takeFreeExtentWithLength:(off_t)length offset:(off_t *)offset;
+{
+    bool found = false;
+    pthread_mutex_lock(&_extentLock);
+    std::multimap<off_t, off_t>::iterator it = _extentsByLength->lower_bound(length);
+    if (it != _extentsByLength->end()) {
+        const off_t extentLength = it->first;
+        *offset = it->second;
+        _extentsByLength->erase(it);
+        _extentsByOffset->erase(*offset);
+        if (extentLength > length) {
+            (*_extentsByOffset)[*offset + length] = extentLength - length;
+            _extentsByLength->insert(std::make_pair(extentLength - length, *offset + length));
+        }
+        _freeSize -= length;
+        found = true;
+    }
+    pthread_mutex_unlock(&_extentLock);
+    return found;
+}
+
+// at least this much is mapped, and twice what's needed, so growing the file rarely needs a new mapping
+#define FV_MAPPING_MIN_LENGTH (64 * 1024 * 1024)
+
+// only called by the writer; if mmap fails, readers map entries individually
+- (void)mapLength:(off_t)length;
+{
+    _mappingEpoch->reclaim();
+    if (_mapping && (off_t)_mapping->length >= length)
+        return;
+    
+    size_t mapLength = round_page(MAX(2 * length, FV_MAPPING_MIN_LENGTH));
+    void *base = mmap(0, mapLength, PROT_READ, MAP_SHARED, _fileDescriptor, 0);
+    if (MAP_FAILED == base && length > 0) {
+        // address space may be tight in a 32-bit process
+        mapLength = round_page(length);
+        base = mmap(0, mapLength, PROT_READ, MAP_SHARED, _fileDescriptor, 0);
+    }
+    if (MAP_FAILED == base) {
+        perror("failed to map cache file");
+        return;
+    }
+    
+    _FVCacheMapping *mapping = new _FVCacheMapping;
+    mapping->refcount = 1;
+    mapping->base = base;
+    mapping->length = mapLength;
+    _FVCacheMapping *oldMapping = _mapping;
+    __atomic_store_n(&_mapping, mapping, __ATOMIC_RELEASE);
+    if (oldMapping)
+        _mappingEpoch->retire(__FVCacheMappingRelease, oldMapping);
+}
+
+- (off_t)freeSize;
+{
+    pthread_mutex_lock(&_extentLock);
+    off_t freeSize = _freeSize;
+    pthread_mutex_unlock(&_extentLock);
+    return freeSize;
+}
+
+@end
+
+@implementation _FVMappedCacheData
+
+- (id)initWithLocation:(_FVCacheLocation *)location;
+{
+    self = [super init];
+    if (self) {
+        // keeps the space from being reused while it's mapped
+        _location = [location retain];
+        // entries start on a page boundary, and the mapping covers the zero padding
+        NSParameterAssert(location->_offset == (off_t)round_page(location->_offset));
+        _length = location->_compressedLength;
+        _mapLength = location->_compressedLength + location->_padLength;
+        _sharedMapping = _mapLength ? __FVCacheDataFileCopyMapping(location->_file, location->_offset, _mapLength) : NULL;
+        if (_sharedMapping)
+            _mapping = (uint8_t *)_sharedMapping->base + location->_offset;
+        else
+            _mapping = _mapLength ? mmap(0, _mapLength, PROT_READ, MAP_SHARED, location->_file->_fileDescriptor, location->_offset) : NULL;
+        if (MAP_FAILED == _mapping) {
+            perror("mmap failed");
+            _mapping = NULL;
+            [self release];
+            self = nil;
+        }
+        else if (_mapping) {
+            // the caller is probably going to read all of it
+            (void) madvise(_mapping, _mapLength, MADV_WILLNEED);
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (_sharedMapping)
+        __FVCacheMappingRelease(_sharedMapping);
+    else if (_mapping) 
+        munmap(_mapping, _mapLength);
+    [_location release];
+    [super dealloc];
+}
+
+- (NSUInteger)length { return _length; }
+
+- (const void *)bytes { return _mapping; }
+
 @end
 
 @implementation _FVCacheEventRecord
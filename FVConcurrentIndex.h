@@ -0,0 +1,233 @@
+//
+//  FVConcurrentIndex.h
+//  FileView
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FVCONCURRENTINDEX_H_
+#define _FVCONCURRENTINDEX_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "FVEpoch.h"
+
+/** @file FVConcurrentIndex.h @brief Hash table with lock-free reads.
+ 
+ FVConcurrentIndex is a chained hash table for one writer and any number of readers.  Readers take no lock; the writer publishes each change with a single atomic store, so a reader sees either the old entry or the new one.  Entries that have been replaced or removed, and the bucket array after it's been grown, are retired rather than freed, and only released once every reader that could have seen them has finished (epoch-based reclamation).
+ 
+ Reclamation uses FVEpoch, and happens at the next write, so retired entries may linger until then.
+ 
+ The Traits parameter supplies static functions hash(key), equal(key1, key2), copyKey(key), releaseKey(key), retainValue(value) and releaseValue(value).  Keys are copied on insertion and released when the entry is freed; likewise for values.
+ 
+ @warning Writers must be serialized by the caller.  Only readers may run concurrently with other calls.
+ */
+
+template <typename Key, typename Value, typename Traits>
+class FVConcurrentIndex {
+    
+    struct Node {
+        size_t hash;
+        Key    key;
+        Value  value;
+        Node  *next;
+    };
+    
+    struct Table {
+        size_t  mask;
+        Node  **buckets;
+    };
+    
+    Table              *_table;
+    size_t              _count;
+    FVEpoch             _epoch;
+    
+    static Table *_newTable(size_t bucketCount)
+    {
+        Table *table = new Table;
+        table->mask = bucketCount - 1;
+        table->buckets = (Node **)calloc(bucketCount, sizeof(Node *));
+        return table;
+    }
+    
+    static void _freeTable(Table *table)
+    {
+        free(table->buckets);
+        delete table;
+    }
+    
+    static void _freeNode(Node *node)
+    {
+        Traits::releaseKey(node->key);
+        Traits::releaseValue(node->value);
+        delete node;
+    }
+    
+    static void _freeRetiredNode(void *node) { _freeNode((Node *)node); }
+    static void _freeRetiredTable(void *table) { _freeTable((Table *)table); }
+    
+    void _retire(Node *node) { _epoch.retire(_freeRetiredNode, node); }
+    
+    void _grow()
+    {
+        Table *oldTable = _table;
+        Table *newTable = _newTable(2 * (oldTable->mask + 1));
+        
+        // readers may still be walking the old chains, so the new table gets its own nodes
+        for (size_t i = 0; i <= oldTable->mask; i++) {
+            for (Node *node = oldTable->buckets[i]; node; node = node->next) {
+                Node *copy = new Node;
+                copy->hash = node->hash;
+                copy->key = Traits::copyKey(node->key);
+                copy->value = Traits::retainValue(node->value);
+                copy->next = newTable->buckets[copy->hash & newTable->mask];
+                newTable->buckets[copy->hash & newTable->mask] = copy;
+                _retire(node);
+            }
+        }
+        __atomic_store_n(&_table, newTable, __ATOMIC_RELEASE);
+        _epoch.retire(_freeRetiredTable, oldTable);
+    }
+    
+public:
+    
+    explicit FVConcurrentIndex(size_t capacity = 64) : _count(0)
+    {
+        size_t bucketCount = 16;
+        while (bucketCount < capacity)
+            bucketCount *= 2;
+        _table = _newTable(bucketCount);
+    }
+    
+    // _epoch frees anything retired after this
+    ~FVConcurrentIndex()
+    {
+        for (size_t i = 0; i <= _table->mask; i++) {
+            Node *node = _table->buckets[i];
+            while (node) {
+                Node *next = node->next;
+                _freeNode(node);
+                node = next;
+            }
+        }
+        _freeTable(_table);
+    }
+    
+    /** Reader.  Safe to call from any thread at any time.
+     @return true if the key was found, in which case *value has been retained with Traits::retainValue. */
+    bool copyValue(const Key &key, Value *value)
+    {
+        const size_t hash = Traits::hash(key);
+        const FVEpoch::Token token = _epoch.enter();
+        
+        Table *table = __atomic_load_n(&_table, __ATOMIC_ACQUIRE);
+        Node *node = __atomic_load_n(&table->buckets[hash & table->mask], __ATOMIC_ACQUIRE);
+        while (node && (node->hash != hash || false == Traits::equal(node->key, key)))
+            node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+        if (node)
+            *value = Traits::retainValue(node->value);
+        
+        _epoch.exit(token);
+        return NULL != node;
+    }
+    
+    /** Writer.  Adds or replaces the value for a key. */
+    void setValue(const Key &key, const Value &value)
+    {
+        _epoch.reclaim();
+        
+        const size_t hash = Traits::hash(key);
+        Node **link = &_table->buckets[hash & _table->mask];
+        while (*link && ((*link)->hash != hash || false == Traits::equal((*link)->key, key)))
+            link = &(*link)->next;
+        
+        Node *node = new Node;
+        node->hash = hash;
+        node->value = Traits::retainValue(value);
+        
+        if (*link) {
+            // replace in place, so readers see the old node or the new one, but never neither
+            Node *old = *link;
+            node->key = Traits::copyKey(old->key);
+            node->next = old->next;
+            __atomic_store_n(link, node, __ATOMIC_RELEASE);
+            _retire(old);
+        }
+        else {
+            Node **head = &_table->buckets[hash & _table->mask];
+            node->key = Traits::copyKey(key);
+            node->next = *head;
+            __atomic_store_n(head, node, __ATOMIC_RELEASE);
+            if (++_count > _table->mask + 1)
+                _grow();
+        }
+    }
+    
+    /** Writer.  Removes the value for a key, if any. */
+    void removeValue(const Key &key)
+    {
+        _epoch.reclaim();
+        
+        const size_t hash = Traits::hash(key);
+        Node **link = &_table->buckets[hash & _table->mask];
+        while (*link && ((*link)->hash != hash || false == Traits::equal((*link)->key, key)))
+            link = &(*link)->next;
+        
+        // readers at the removed node can still follow its next pointer
+        if (*link) {
+            Node *old = *link;
+            __atomic_store_n(link, old->next, __ATOMIC_RELEASE);
+            _retire(old);
+            _count--;
+        }
+    }
+    
+    /** Writer.  Calls function(key, value, context) for each entry. */
+    void apply(void (*function)(Key, Value, void *), void *context) const
+    {
+        for (size_t i = 0; i <= _table->mask; i++) {
+            for (Node *node = _table->buckets[i]; node; node = node->next)
+                function(node->key, node->value, context);
+        }
+    }
+    
+    /** Writer.  Number of entries. */
+    size_t count() const { return _count; }
+    
+private:
+    // not copyable
+    FVConcurrentIndex(const FVConcurrentIndex &);
+    FVConcurrentIndex &operator=(const FVConcurrentIndex &);
+};
+
+#endif /* _FVCONCURRENTINDEX_H_ */
@@ -0,0 +1,156 @@
+//
+//  FVEpoch.h
+//  FileView
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FVEPOCH_H_
+#define _FVEPOCH_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <utility>
+
+/** @file FVEpoch.h @brief Epoch-based reclamation.
+ 
+ FVEpoch lets one writer free memory that lock-free readers may still be using.  A reader brackets its accesses with enter and exit.  The writer unlinks an object so no new reader can find it, then hands it to retire along with a function to free it.  The object is freed by a later call to reclaim, once every reader that could have seen it has exited.
+ 
+ Readers register in one of two epochs by incrementing a counter.  The counters are striped by thread, so readers on different cores don't write the same cache line.  The writer frees objects retired in the previous epoch once its counters drain, and then starts a new epoch.  Retired objects may linger until the next reclaim, so the writer should call it regularly, typically before each change.
+ 
+ @warning Writers must be serialized by the caller.  A reader must not stay in an epoch for long, since that holds up everything retired after it entered.
+ */
+
+#define FV_EPOCH_READER_STRIPES 16
+
+class FVEpoch {
+    
+    // one cache line each, so readers on different stripes don't share a line
+    struct ReaderCount {
+        volatile uint32_t count;
+        char              pad[64 - sizeof(uint32_t)];
+    };
+    
+    typedef std::pair<void (*)(void *), void *> Retiree;
+    
+    volatile uint32_t    _epoch;
+    ReaderCount          _readers[2][FV_EPOCH_READER_STRIPES];
+    std::vector<Retiree> _retired[2];
+    
+    static unsigned _stripe()
+    {
+        uintptr_t t = (uintptr_t)pthread_self();
+        return (unsigned)((t >> 12) ^ (t >> 4)) % FV_EPOCH_READER_STRIPES;
+    }
+    
+    uint32_t _readersInEpoch(uint32_t epoch)
+    {
+        uint32_t count = 0;
+        for (unsigned i = 0; i < FV_EPOCH_READER_STRIPES; i++)
+            count += __atomic_load_n(&_readers[epoch][i].count, __ATOMIC_SEQ_CST);
+        return count;
+    }
+    
+    void _freeRetired(uint32_t epoch)
+    {
+        for (size_t i = 0; i < _retired[epoch].size(); i++)
+            _retired[epoch][i].first(_retired[epoch][i].second);
+        _retired[epoch].clear();
+    }
+    
+public:
+    
+    /** Token returned by enter, which must be passed to exit. */
+    typedef uint32_t Token;
+    
+    FVEpoch() : _epoch(0)
+    {
+        for (unsigned i = 0; i < FV_EPOCH_READER_STRIPES; i++)
+            _readers[0][i].count = _readers[1][i].count = 0;
+    }
+    
+    /** Frees everything that was retired, so there must be no readers. */
+    ~FVEpoch()
+    {
+        _freeRetired(0);
+        _freeRetired(1);
+    }
+    
+    /** Reader.  Safe to call from any thread at any time. */
+    Token enter()
+    {
+        const unsigned stripe = _stripe();
+        for (;;) {
+            uint32_t epoch = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&_readers[epoch][stripe].count, 1, __ATOMIC_SEQ_CST);
+            // if the writer flipped in between, it may not have seen our count
+            if (__atomic_load_n(&_epoch, __ATOMIC_SEQ_CST) == epoch)
+                return (epoch << 8) | stripe;
+            __atomic_sub_fetch(&_readers[epoch][stripe].count, 1, __ATOMIC_RELEASE);
+        }
+    }
+    
+    /** Reader.  Must be called on the thread that called enter. */
+    void exit(Token token)
+    {
+        __atomic_sub_fetch(&_readers[token >> 8][token & 0xff].count, 1, __ATOMIC_RELEASE);
+    }
+    
+    /** Writer.  Frees ptr with function(ptr) once no reader can be using it.  The object must already be unreachable for new readers. */
+    void retire(void (*function)(void *), void *ptr) { _retired[_epoch].push_back(Retiree(function, ptr)); }
+    
+    /*
+     Anything retired in the previous epoch was unlinked before the current epoch started, so once the 
+     previous epoch's readers are gone, nobody can reach it.  Then start a new epoch if there's anything 
+     waiting, so the current epoch's retirees can be freed next time.
+     */
+    /** Writer.  Frees what it can; call this regularly. */
+    void reclaim()
+    {
+        const uint32_t current = _epoch;
+        const uint32_t previous = current ^ 1;
+        if (0 == _readersInEpoch(previous)) {
+            _freeRetired(previous);
+            if (_retired[current].size())
+                __atomic_store_n(&_epoch, previous, __ATOMIC_SEQ_CST);
+        }
+    }
+    
+private:
+    // not copyable
+    FVEpoch(const FVEpoch &);
+    FVEpoch &operator=(const FVEpoch &);
+};
+
+#endif /* _FVEPOCH_H_ */
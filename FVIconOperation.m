@@ -41,6 +41,7 @@
 #import "FVInvocationOperation.h"
 #import "FVIcon.h"
 #import "FileView.h"
+#import "FVMemoryBudget.h"
 #import <pthread.h>
 #import <sys/sysctl.h>
 
@@ -139,6 +140,9 @@
             ret = sysctlbyname("kern.rage_vnode", NULL, NULL, &oldSysctlValue, sizeof(oldSysctlValue));
             if (ret) perror("sysctlbyname failed to reset kern.rage_vnode");
         }
+        
+        // rendering is where icons grow, so this is the place to enforce the budget
+        FVMemoryBudgetCheck();
 
         FVIconUpdateOperation *op = [[FVIconUpdateOperation alloc] initWithIcon:_icon view:_view];
         [[FVOperationQueue mainQueue] addOperation:op];
@@ -38,6 +38,7 @@
 
 #import <Cocoa/Cocoa.h>
 #import <Accelerate/Accelerate.h>
+#import "FVScratchArena.h"
 
 /** @internal 
  
@@ -57,6 +58,7 @@
 @private;
     size_t        _bufferSize;          // totally unrelated to image size; only for debugging or assertions
     BOOL          _freeBufferOnDealloc; 
+    BOOL          _arenaBuffer;         // data belongs to an FVScratchArena
 }
 
 /** @internal 
@@ -96,10 +98,22 @@
  @return An initialized buffer instance. */
 - (id)initWithWidth:(size_t)w height:(size_t)h bytesPerSample:(size_t)bps;
 
+/** @internal 
+ 
+ @brief Scratch buffer initializer.
+ 
+ Like FVImageBuffer::initWithWidth:height:bytesPerSample:, but the data is carved out of @a arena instead of being allocated, so it becomes invalid when the arena is released.  The buffer should be released before the arena, and its data can't be transferred to another object.  Copies have their own memory.
+ @param w Width in pixels.
+ @param h Height in pixels.
+ @param bps Bytes per sample (4 for an 8-bit ARGB image).
+ @param arena An arena from FVScratchArenaAcquire().
+ @return An initialized buffer instance. */
+- (id)initWithWidth:(size_t)w height:(size_t)h bytesPerSample:(size_t)bps arena:(FVScratchArenaRef)arena;
+
 /** @internal 
  
  @brief Byte buffer transfer.
- Pass NO to transfer ownership of the vImage data to e.g. CFData.  This is always set to YES for new instances.
+ Pass NO to transfer ownership of the vImage data to e.g. CFData.  This is always set to YES for new instances, except those using arena memory, which can't be transferred.
  @param flag NO to allow another object to free the underlying vImage_Buffer data. */
 - (void)setFreeBufferOnDealloc:(BOOL)flag;
 
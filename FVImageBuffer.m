@@ -63,7 +63,7 @@ static volatile uint32_t _allocatedBytes = 0;
 }
 
 // safe initializer for copy, in case there's a mismatch between width/height/rowBytes
-- (id)_initWithBufferSize:(size_t)bufferSize
+- (id)_initWithBufferSize:(size_t)bufferSize arena:(FVScratchArenaRef)arena
 {
     self = [super init];
     if (self) {
@@ -77,7 +77,8 @@ static volatile uint32_t _allocatedBytes = 0;
             buffer->height = 1;
             buffer->rowBytes = bufferSize;
             _bufferSize = bufferSize;
-            buffer->data = CFAllocatorAllocate([self allocator], bufferSize, 0);
+            _arenaBuffer = (NULL != arena);
+            buffer->data = arena ? FVScratchArenaAllocate(arena, bufferSize) : CFAllocatorAllocate([self allocator], bufferSize, 0);
             bool swap;
 #if __LP64__
             do {
@@ -88,7 +89,7 @@ static volatile uint32_t _allocatedBytes = 0;
                 swap = OSAtomicCompareAndSwap32Barrier(_allocatedBytes, _allocatedBytes + _bufferSize, (int32_t *)&_allocatedBytes);
             } while (false == swap);    
 #endif
-            _freeBufferOnDealloc = YES;
+            _freeBufferOnDealloc = (NO == _arenaBuffer);
             if (NULL == buffer->data) {
                 NSZoneFree([self zone], buffer);
                 [super dealloc];
@@ -99,9 +100,9 @@ static volatile uint32_t _allocatedBytes = 0;
     return self;
 }
 
-- (id)initWithWidth:(size_t)w height:(size_t)h rowBytes:(size_t)r;
+- (id)_initWithWidth:(size_t)w height:(size_t)h rowBytes:(size_t)r arena:(FVScratchArenaRef)arena
 {
-    self = [self _initWithBufferSize:(r * h)];
+    self = [self _initWithBufferSize:(r * h) arena:arena];
     if (self) {
         buffer->width = w;
         buffer->height = h;
@@ -110,15 +111,27 @@ static volatile uint32_t _allocatedBytes = 0;
     return self;    
 }
 
+- (id)initWithWidth:(size_t)w height:(size_t)h rowBytes:(size_t)r;
+{
+    return [self _initWithWidth:w height:h rowBytes:r arena:NULL];
+}
+
 - (id)initWithWidth:(size_t)w height:(size_t)h bytesPerSample:(size_t)bps;
 {
     return [self initWithWidth:w height:h rowBytes:FVPaddedRowBytesForWidth(bps, w)];
 }
 
+- (id)initWithWidth:(size_t)w height:(size_t)h bytesPerSample:(size_t)bps arena:(FVScratchArenaRef)arena;
+{
+    NSParameterAssert(arena);
+    return [self _initWithWidth:w height:h rowBytes:FVPaddedRowBytesForWidth(bps, w) arena:arena];
+}
+
 - (id)copyWithZone:(NSZone *)aZone
 {
-    FVImageBuffer *copy = [[[self class] allocWithZone:aZone] _initWithBufferSize:_bufferSize];
-    copy->_freeBufferOnDealloc = _freeBufferOnDealloc;
+    // the arena may be released before the copy, so it gets its own memory
+    FVImageBuffer *copy = [[[self class] allocWithZone:aZone] _initWithBufferSize:_bufferSize arena:NULL];
+    copy->_freeBufferOnDealloc = _arenaBuffer ? YES : _freeBufferOnDealloc;
     copy->buffer->rowBytes = buffer->rowBytes;
     copy->buffer->height = buffer->height;
     copy->buffer->width = buffer->width;
@@ -145,6 +158,8 @@ static volatile uint32_t _allocatedBytes = 0;
 
 - (void)setFreeBufferOnDealloc:(BOOL)flag;
 {
+    // arena memory is freed all at once by FVScratchArenaRelease
+    FVAPIAssert(NO == _arenaBuffer, @"cannot change ownership of arena memory");
     _freeBufferOnDealloc = flag;
 }
 
@@ -97,6 +97,11 @@ static CFDictionaryRef _imsrcOptions = NULL;
     return NULL != _fullImage || NULL != _thumbnail || [_fallbackIcon canReleaseResources];
 }
 
+- (size_t)_imageByteSize;
+{
+    return FVCGImageByteSize(_thumbnail) + (_fullImage == _thumbnail ? 0 : FVCGImageByteSize(_fullImage));
+}
+
 - (void)releaseResources
 {
     [self lock];
@@ -0,0 +1,133 @@
+//
+//  FVMemoryBudget.h
+//  FileView
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FVMEMORYBUDGET_H_
+#define _FVMEMORYBUDGET_H_
+
+#import <Foundation/Foundation.h>
+
+__BEGIN_DECLS
+
+/** @file FVMemoryBudget.h @brief Process-wide memory budget.
+ 
+ Components that hold memory which can be given back on demand register as consumers, with a function that reports their current usage and one that releases memory.  When the total exceeds the ceiling, consumers are asked to shed memory in order of the cost of recreating it, so cached allocator blocks go first, then mapped PDF files, and finally rendered icons that aren't on screen.
+ 
+ The ceiling defaults to one eighth of physical memory, between 512 MB and 2 GB.  It can be set with the FVMemoryBudgetMegabytes user default, or with FVMemoryBudgetSetCeiling().  Other fixed limits in the framework, such as the tile memory in FVCGImageUtilities.h, are derived from it.
+ */
+
+/** @internal Order in which consumers are asked to shed memory; cheapest first. */
+enum {
+    FVMemoryCostCachedBlocks = 0,  /**< freed allocator blocks, which only cost a page fault to replace */
+    FVMemoryCostMappedFiles  = 1,  /**< mapped documents, which have to be reopened and parsed */
+    FVMemoryCostIconRasters  = 2   /**< rendered icons, which have to be drawn again */
+};
+typedef uint8_t FVMemoryCost;
+
+/** @internal 
+ 
+ @brief Usage callback.
+ 
+ Called on arbitrary threads, with the budget's lock held, so it must be cheap and must not call FVMemoryBudget functions.
+ @param info The info pointer passed to FVMemoryBudgetAddConsumer().
+ @return Bytes the consumer currently holds. */
+typedef size_t (*FVMemoryUsageFunction)(void *info);
+
+/** @internal 
+ 
+ @brief Shed callback.
+ 
+ Called on arbitrary threads, with the budget's lock held, so it must not call FVMemoryBudget functions or wait for the main thread.  A consumer that can only release memory on another thread may schedule that work and return 0.
+ @param bytes Number of bytes the budget would like released.
+ @param info The info pointer passed to FVMemoryBudgetAddConsumer().
+ @return Bytes actually released, which may be more or less than requested. */
+typedef size_t (*FVMemoryShedFunction)(size_t bytes, void *info);
+
+/** @internal Opaque consumer type. */
+typedef struct _FVMemoryConsumer *FVMemoryConsumerRef;
+
+/** @internal 
+ 
+ @brief Register a consumer.
+ 
+ @param name A static string used when logging.
+ @param cost Determines the order in which consumers shed memory.
+ @param usage Reports the consumer's current usage.
+ @param shed Releases memory.
+ @param info Passed to the callbacks; not retained.
+ @return A consumer to pass to FVMemoryBudgetRemoveConsumer(). */
+FV_PRIVATE_EXTERN FVMemoryConsumerRef FVMemoryBudgetAddConsumer(const char *name, FVMemoryCost cost, FVMemoryUsageFunction usage, FVMemoryShedFunction shed, void *info);
+
+/** @internal 
+ 
+ @brief Unregister a consumer.
+ 
+ Waits for a shed in progress to finish, so the callbacks won't be called after this returns.
+ @param consumer A consumer returned by FVMemoryBudgetAddConsumer(). */
+FV_PRIVATE_EXTERN void FVMemoryBudgetRemoveConsumer(FVMemoryConsumerRef consumer);
+
+/** @internal 
+ 
+ @brief Current ceiling.
+ 
+ @return The ceiling in bytes. */
+FV_PRIVATE_EXTERN size_t FVMemoryBudgetGetCeiling(void);
+
+/** @internal 
+ 
+ @brief Change the ceiling.
+ 
+ Limits derived from the ceiling pick up the change the next time they're checked.
+ @param ceiling New ceiling in bytes; 0 restores the default. */
+FV_PRIVATE_EXTERN void FVMemoryBudgetSetCeiling(size_t ceiling);
+
+/** @internal 
+ 
+ @brief Total usage.
+ 
+ @return The sum of the usage of all consumers. */
+FV_PRIVATE_EXTERN size_t FVMemoryBudgetGetUsage(void);
+
+/** @internal 
+ 
+ @brief Enforce the ceiling.
+ 
+ If total usage is over the ceiling, consumers are asked to shed memory, cheapest first, until usage drops to 80% of the ceiling.  This is cheap when usage is below the ceiling, and returns immediately if another thread is already shedding, so it can be called after any operation that grows a consumer. */
+FV_PRIVATE_EXTERN void FVMemoryBudgetCheck(void);
+
+__END_DECLS
+
+#endif /* _FVMEMORYBUDGET_H_ */
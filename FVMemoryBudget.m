@@ -0,0 +1,177 @@
+//
+//  FVMemoryBudget.m
+//  FileView
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#import "FVMemoryBudget.h"
+#import <pthread.h>
+#import <sys/sysctl.h>
+#import "FVUtilities.h"
+
+// default ceiling is a fraction of physical memory, clamped to these values
+#define FV_BUDGET_MINIMUM       (512 * 1024 * 1024ULL)
+#define FV_BUDGET_MAXIMUM       (2048 * 1024 * 1024ULL)
+#define FV_BUDGET_PHYSMEM_SHARE 8
+
+typedef struct _FVMemoryConsumer {
+    const char                *_name;
+    FVMemoryCost               _cost;
+    FVMemoryUsageFunction      _usage;
+    FVMemoryShedFunction       _shed;
+    void                      *_info;
+    struct _FVMemoryConsumer  *_next;     /* sorted by _cost */
+} FVMemoryConsumer;
+
+// the lock protects the list, and is held while shedding so consumers can't be removed out from under it
+static pthread_mutex_t    _budgetLock = PTHREAD_MUTEX_INITIALIZER;
+static FVMemoryConsumer  *_consumers = NULL;
+static volatile size_t    _ceiling = 0;
+static pthread_once_t     _budgetOnce = PTHREAD_ONCE_INIT;
+
+static size_t __FVMemoryBudgetDefaultCeiling(void)
+{
+    uint64_t physicalMemory = 0;
+    size_t size = sizeof(physicalMemory);
+    if (sysctlbyname("hw.memsize", &physicalMemory, &size, NULL, 0) != 0)
+        physicalMemory = 0;
+    
+    uint64_t ceiling = physicalMemory / FV_BUDGET_PHYSMEM_SHARE;
+    if (ceiling < FV_BUDGET_MINIMUM)
+        ceiling = FV_BUDGET_MINIMUM;
+    else if (ceiling > FV_BUDGET_MAXIMUM)
+        ceiling = FV_BUDGET_MAXIMUM;
+    return (size_t)ceiling;
+}
+
+static void __FVMemoryBudgetInitialize(void)
+{
+    NSAutoreleasePool *pool = [NSAutoreleasePool new];
+    NSInteger megabytes = [[NSUserDefaults standardUserDefaults] integerForKey:@"FVMemoryBudgetMegabytes"];
+    [pool release];
+    _ceiling = megabytes > 0 ? (size_t)megabytes * 1024 * 1024 : __FVMemoryBudgetDefaultCeiling();
+}
+
+static size_t __FVMemoryBudgetGetUsageLocked(void)
+{
+    size_t usage = 0;
+    for (FVMemoryConsumer *consumer = _consumers; NULL != consumer; consumer = consumer->_next)
+        usage += consumer->_usage(consumer->_info);
+    return usage;
+}
+
+FVMemoryConsumerRef FVMemoryBudgetAddConsumer(const char *name, FVMemoryCost cost, FVMemoryUsageFunction usage, FVMemoryShedFunction shed, void *info)
+{
+    NSCParameterAssert(NULL != usage);
+    NSCParameterAssert(NULL != shed);
+    FVMemoryConsumer *consumer = NSZoneMalloc(NULL, sizeof(FVMemoryConsumer));
+    consumer->_name = name;
+    consumer->_cost = cost;
+    consumer->_usage = usage;
+    consumer->_shed = shed;
+    consumer->_info = info;
+    
+    // insert after any consumers with the same cost, so registration order breaks ties
+    pthread_mutex_lock(&_budgetLock);
+    FVMemoryConsumer **prev = &_consumers;
+    while (NULL != *prev && (*prev)->_cost <= cost)
+        prev = &(*prev)->_next;
+    consumer->_next = *prev;
+    *prev = consumer;
+    pthread_mutex_unlock(&_budgetLock);
+    return consumer;
+}
+
+void FVMemoryBudgetRemoveConsumer(FVMemoryConsumerRef consumer)
+{
+    if (NULL == consumer) return;
+    pthread_mutex_lock(&_budgetLock);
+    FVMemoryConsumer **prev = &_consumers;
+    while (NULL != *prev && consumer != *prev)
+        prev = &(*prev)->_next;
+    NSCAssert1(NULL != *prev, @"memory consumer %s is not registered", consumer->_name);
+    if (NULL != *prev)
+        *prev = consumer->_next;
+    pthread_mutex_unlock(&_budgetLock);
+    NSZoneFree(NULL, consumer);
+}
+
+size_t FVMemoryBudgetGetCeiling(void)
+{
+    (void) pthread_once(&_budgetOnce, __FVMemoryBudgetInitialize);
+    return _ceiling;
+}
+
+void FVMemoryBudgetSetCeiling(size_t ceiling)
+{
+    (void) pthread_once(&_budgetOnce, __FVMemoryBudgetInitialize);
+    _ceiling = ceiling ? ceiling : __FVMemoryBudgetDefaultCeiling();
+    FVMemoryBudgetCheck();
+}
+
+size_t FVMemoryBudgetGetUsage(void)
+{
+    pthread_mutex_lock(&_budgetLock);
+    size_t usage = __FVMemoryBudgetGetUsageLocked();
+    pthread_mutex_unlock(&_budgetLock);
+    return usage;
+}
+
+void FVMemoryBudgetCheck(void)
+{
+    const size_t ceiling = FVMemoryBudgetGetCeiling();
+    
+    // if another thread is adding a consumer or shedding, there's no point in waiting for it
+    if (pthread_mutex_trylock(&_budgetLock) != 0)
+        return;
+    
+    size_t usage = __FVMemoryBudgetGetUsageLocked();
+    if (usage > ceiling) {
+        
+        // shed below the ceiling, so a consumer hovering around it doesn't cause a shed on every check
+        const size_t target = ceiling - ceiling / 5;
+        for (FVMemoryConsumer *consumer = _consumers; NULL != consumer && usage > target; consumer = consumer->_next) {
+            const size_t held = consumer->_usage(consumer->_info);
+            if (0 == held)
+                continue;
+            const size_t request = MIN(held, usage - target);
+            const size_t released = consumer->_shed(request, consumer->_info);
+#if DEBUG
+            FVLog(@"memory budget: %s released %lu of %lu KB requested", consumer->_name, (unsigned long)(released / 1024), (unsigned long)(request / 1024));
+#endif
+            usage -= MIN(usage, released);
+        }
+    }
+    pthread_mutex_unlock(&_budgetLock);
+}
@@ -43,10 +43,47 @@
 #import "_FVMappedDataProvider.h"
 #import "_FVSplitSet.h"
 #import "_FVDocumentDescription.h"
+#import "FVMemoryBudget.h"
+
+@interface FVPDFIcon (Private)
+- (BOOL)_releaseMappedResources;
+@end
 
 static pthread_mutex_t  _releaseLock = PTHREAD_MUTEX_INITIALIZER;
 static _FVSplitSet     *_releaseableIcons = nil;
 
+static size_t __FVPDFIconMappedSize(void *info)
+{
+    return [_FVMappedDataProvider mappedDataSize];
+}
+
+/*
+ Called by the memory budget on an arbitrary thread.  Icons that were least recently marked as releaseable go
+ first, and the rest only if that wasn't enough.  Icons in use for rendering are skipped by -_releaseMappedResources.
+ */
+static size_t __FVPDFIconReleaseMappedFiles(size_t bytes, void *info)
+{
+    const size_t initialSize = [_FVMappedDataProvider mappedDataSize];
+    for (int pass = 0; pass < 2 && initialSize - MIN(initialSize, [_FVMappedDataProvider mappedDataSize]) < bytes; pass++) {
+        pthread_mutex_lock(&_releaseLock);
+        NSSet *objects = 0 == pass ? [_releaseableIcons copyOldObjects] : [_releaseableIcons copyAllObjects];
+        pthread_mutex_unlock(&_releaseLock);
+        
+        // icons that are busy stay in the set, so a later shed can get them
+        NSAutoreleasePool *pool = [NSAutoreleasePool new];
+        for (FVPDFIcon *icon in objects) {
+            if ([icon _releaseMappedResources]) {
+                pthread_mutex_lock(&_releaseLock);
+                [_releaseableIcons removeObject:icon];
+                pthread_mutex_unlock(&_releaseLock);
+            }
+        }
+        [objects release];
+        [pool release];
+    }
+    return initialSize - MIN(initialSize, [_FVMappedDataProvider mappedDataSize]);
+}
+
 @implementation FVPDFIcon
 
 + (void)initialize
@@ -54,6 +91,7 @@ static _FVSplitSet     *_releaseableIcons = nil;
     FVINITIALIZE(FVPDFIcon);
     unsigned char split = [_FVMappedDataProvider maxProviderCount] / 2 - 1;
     _releaseableIcons = [[_FVSplitSet allocWithZone:[self zone]] initWithSplit:split];
+    (void) FVMemoryBudgetAddConsumer("FVPDFIcon", FVMemoryCostMappedFiles, __FVPDFIconMappedSize, __FVPDFIconReleaseMappedFiles, NULL);
 }
 
 + (CGLayerRef)_pageLayer
@@ -159,7 +197,13 @@ static _FVSplitSet     *_releaseableIcons = nil;
     return (NULL != _thumbnail || NULL != _pdfPage);
 }
 
-- (void)_releaseMappedResources
+- (size_t)_imageByteSize;
+{
+    return FVCGImageByteSize(_thumbnail);
+}
+
+// returns NO if the icon was locked for rendering
+- (BOOL)_releaseMappedResources
 {
     if ([self tryLock]) {
     
@@ -170,7 +214,9 @@ static _FVSplitSet     *_releaseableIcons = nil;
             _pdfDoc = NULL;
         }
         [self unlock];
+        return YES;
     }
+    return NO;
 }
 
 - (void)releaseResources 
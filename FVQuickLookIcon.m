@@ -119,6 +119,11 @@ static BOOL FVQLIconDisabled = NO;
     return (NULL != _fullImage);
 }
 
+- (size_t)_imageByteSize;
+{
+    return FVCGImageByteSize(_thumbnail) + (_fullImage == _thumbnail ? 0 : FVCGImageByteSize(_fullImage));
+}
+
 - (void)releaseResources
 {
     [self lock];
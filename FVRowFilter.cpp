@@ -0,0 +1,277 @@
+//
+//  FVRowFilter.cpp
+//  FileView
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FVRowFilter.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ 16 lanes of bytes for Sub and Up, which wrap around just like PNG arithmetic, and 8 lanes of shorts for Paeth, since its predictor compares sums of bytes.  The compiler lowers these to SSE2 or NEON; loads and stores go through memcpy because rows needn't be aligned.
+ */
+typedef uint8_t __FVByteVector __attribute__((vector_size(16)));
+typedef uint8_t __FVHalfByteVector __attribute__((vector_size(8)));
+typedef int16_t __FVShortVector __attribute__((vector_size(16)));
+
+static inline __FVByteVector __FVLoadBytes(const uint8_t *ptr)
+{
+    __FVByteVector v;
+    memcpy(&v, ptr, sizeof(v));
+    return v;
+}
+
+static inline void __FVStoreBytes(uint8_t *ptr, __FVByteVector v)
+{
+    memcpy(ptr, &v, sizeof(v));
+}
+
+static inline __FVShortVector __FVLoadShorts(const uint8_t *ptr)
+{
+    __FVHalfByteVector v;
+    memcpy(&v, ptr, sizeof(v));
+    return __builtin_convertvector(v, __FVShortVector);
+}
+
+static inline void __FVStoreShorts(uint8_t *ptr, __FVShortVector v)
+{
+    __FVHalfByteVector b = __builtin_convertvector(v, __FVHalfByteVector);
+    memcpy(ptr, &b, sizeof(b));
+}
+
+static inline __FVShortVector __FVAbsShorts(__FVShortVector v)
+{
+    __FVShortVector sign = v >> 15;
+    return (v ^ sign) - sign;
+}
+
+// lanes of a comparison are all ones or all zeroes, so they select lanes with bitwise operations
+static inline __FVShortVector __FVPaethShorts(__FVShortVector a, __FVShortVector b, __FVShortVector c)
+{
+    __FVShortVector pa = __FVAbsShorts(b - c);
+    __FVShortVector pb = __FVAbsShorts(a - c);
+    __FVShortVector pc = __FVAbsShorts(a + b - c - c);
+    __FVShortVector useA = (__FVShortVector)((pa <= pb) & (pa <= pc));
+    __FVShortVector useB = ~useA & (__FVShortVector)(pb <= pc);
+    return (useA & a) | (useB & b) | (~(useA | useB) & c);
+}
+
+static inline uint8_t __FVPaeth(int a, int b, int c)
+{
+    int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - c - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+// adds corresponding bytes without carrying between them
+static inline uint32_t __FVAddBytes32(uint32_t x, uint32_t y)
+{
+    return ((x & 0x7f7f7f7fU) + (y & 0x7f7f7f7fU)) ^ ((x ^ y) & 0x80808080U);
+}
+
+static inline uint64_t __FVAddBytes64(uint64_t x, uint64_t y)
+{
+    return ((x & 0x7f7f7f7f7f7f7f7fULL) + (y & 0x7f7f7f7f7f7f7f7fULL)) ^ ((x ^ y) & 0x8080808080808080ULL);
+}
+
+#pragma mark Filtering
+
+// previous is NULL for the first row, which makes Up a copy and Paeth the same as Sub
+static void __FVFilterRow(FVRowFilterType filter, const uint8_t *row, const uint8_t *previous, uint8_t *out, size_t length, size_t bpp)
+{
+    size_t i = 0;
+    if (NULL == previous && FVRowFilterUp == filter)
+        filter = FVRowFilterNone;
+    else if (NULL == previous && FVRowFilterPaeth == filter)
+        filter = FVRowFilterSub;
+    
+    switch (filter) {
+        case FVRowFilterSub:
+            for (; i < bpp && i < length; i++)
+                out[i] = row[i];
+            for (; i + 16 <= length; i += 16)
+                __FVStoreBytes(out + i, __FVLoadBytes(row + i) - __FVLoadBytes(row + i - bpp));
+            for (; i < length; i++)
+                out[i] = row[i] - row[i - bpp];
+            break;
+        case FVRowFilterUp:
+            for (; i + 16 <= length; i += 16)
+                __FVStoreBytes(out + i, __FVLoadBytes(row + i) - __FVLoadBytes(previous + i));
+            for (; i < length; i++)
+                out[i] = row[i] - previous[i];
+            break;
+        case FVRowFilterPaeth:
+            // no pixel to the left, so the prediction is the byte above
+            for (; i < bpp && i < length; i++)
+                out[i] = row[i] - previous[i];
+            for (; i + 8 <= length; i += 8) {
+                __FVShortVector p = __FVPaethShorts(__FVLoadShorts(row + i - bpp), __FVLoadShorts(previous + i), __FVLoadShorts(previous + i - bpp));
+                __FVStoreShorts(out + i, __FVLoadShorts(row + i) - p);
+            }
+            for (; i < length; i++)
+                out[i] = row[i] - __FVPaeth(row[i - bpp], previous[i], previous[i - bpp]);
+            break;
+        default:
+            memcpy(out, row, length);
+            break;
+    }
+}
+
+void FVRowFilterApply(FVRowFilterType filter, const uint8_t *source, uint8_t *destination, size_t rowCount, size_t bytesPerRow, size_t bytesPerPixel)
+{
+    const uint8_t *previous = NULL;
+    for (size_t r = 0; r < rowCount; r++) {
+        const uint8_t *row = source + r * bytesPerRow;
+        __FVFilterRow(filter, row, previous, destination + r * bytesPerRow, bytesPerRow, bytesPerPixel);
+        previous = row;
+    }
+}
+
+#pragma mark Unfiltering
+
+/*
+ Each pixel depends on the one to its left after unfiltering, so Sub and Paeth go a pixel at a time.  Sub adds a whole pixel at once in a general-purpose register for the common 4 and 8 byte pixels, and Paeth predicts all channels of a pixel at once in a vector.  Up has no dependency within a row.
+ */
+static void __FVRevertRow(FVRowFilterType filter, uint8_t *row, const uint8_t *previous, size_t length, size_t bpp)
+{
+    size_t i = 0;
+    if (NULL == previous && FVRowFilterUp == filter)
+        return;
+    else if (NULL == previous && FVRowFilterPaeth == filter)
+        filter = FVRowFilterSub;
+    
+    switch (filter) {
+        case FVRowFilterSub:
+            if (4 == bpp) {
+                uint32_t left = 0, pixel;
+                for (; i + 4 <= length; i += 4) {
+                    memcpy(&pixel, row + i, 4);
+                    left = __FVAddBytes32(pixel, left);
+                    memcpy(row + i, &left, 4);
+                }
+            }
+            else if (8 == bpp) {
+                uint64_t left = 0, pixel;
+                for (; i + 8 <= length; i += 8) {
+                    memcpy(&pixel, row + i, 8);
+                    left = __FVAddBytes64(pixel, left);
+                    memcpy(row + i, &left, 8);
+                }
+            }
+            // padding at the end of the row, or all of it for other pixel sizes
+            for (i = i < bpp ? bpp : i; i < length; i++)
+                row[i] += row[i - bpp];
+            break;
+        case FVRowFilterUp:
+            for (; i + 16 <= length; i += 16)
+                __FVStoreBytes(row + i, __FVLoadBytes(row + i) + __FVLoadBytes(previous + i));
+            for (; i < length; i++)
+                row[i] += previous[i];
+            break;
+        case FVRowFilterPaeth:
+            for (; i < bpp && i < length; i++)
+                row[i] += previous[i];
+            // a vector load of 8 bytes covers the pixel; lanes past bpp are ignored, so stay 8 bytes from the end
+            if (bpp >= 3) {
+                for (; i + 8 <= length; i += bpp) {
+                    __FVShortVector p = __FVPaethShorts(__FVLoadShorts(row + i - bpp), __FVLoadShorts(previous + i), __FVLoadShorts(previous + i - bpp));
+                    __FVHalfByteVector sum = __builtin_convertvector(__FVLoadShorts(row + i) + p, __FVHalfByteVector);
+                    memcpy(row + i, &sum, bpp);
+                }
+            }
+            for (; i < length; i++)
+                row[i] += __FVPaeth(row[i - bpp], previous[i], previous[i - bpp]);
+            break;
+        default:
+            break;
+    }
+}
+
+void FVRowFilterRevert(FVRowFilterType filter, uint8_t *rows, size_t rowCount, size_t bytesPerRow, size_t bytesPerPixel)
+{
+    const uint8_t *previous = NULL;
+    for (size_t r = 0; r < rowCount; r++) {
+        uint8_t *row = rows + r * bytesPerRow;
+        __FVRevertRow(filter, row, previous, bytesPerRow, bytesPerPixel);
+        previous = row;
+    }
+}
+
+#pragma mark Choosing
+
+// rows sampled by FVRowFilterChoose, and bytes of each
+#define FV_FILTER_SAMPLE_ROWS 16
+#define FV_FILTER_SAMPLE_BYTES 4096
+
+static uint64_t __FVResidualSum(const uint8_t *bytes, size_t length)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < length; i++)
+        sum += abs((int8_t)bytes[i]);
+    return sum;
+}
+
+FVRowFilterType FVRowFilterChoose(const uint8_t *rows, size_t rowCount, size_t bytesPerRow, size_t bytesPerPixel)
+{
+    static const FVRowFilterType filters[] = { FVRowFilterNone, FVRowFilterSub, FVRowFilterUp, FVRowFilterPaeth };
+    uint64_t sums[sizeof(filters) / sizeof(filters[0])] = { 0 };
+    uint8_t scratch[FV_FILTER_SAMPLE_BYTES];
+    
+    if (0 == rowCount || 0 == bytesPerRow || 0 == bytesPerPixel || bytesPerPixel > FV_ROW_FILTER_MAX_PIXEL_SIZE)
+        return FVRowFilterNone;
+    
+    // whole pixels from the start of each row, so the sample looks like a narrow image
+    size_t length = bytesPerRow < FV_FILTER_SAMPLE_BYTES ? bytesPerRow : FV_FILTER_SAMPLE_BYTES - FV_FILTER_SAMPLE_BYTES % bytesPerPixel;
+    size_t sampleCount = rowCount < FV_FILTER_SAMPLE_ROWS ? rowCount : FV_FILTER_SAMPLE_ROWS;
+    
+    for (size_t s = 0; s < sampleCount; s++) {
+        // skip the first row when there are others, since it has nothing above it
+        size_t r = rowCount > 1 ? 1 + s * (rowCount - 1) / sampleCount : 0;
+        const uint8_t *row = rows + r * bytesPerRow;
+        const uint8_t *previous = r ? row - bytesPerRow : NULL;
+        for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+            __FVFilterRow(filters[f], row, previous, scratch, length, bytesPerPixel);
+            sums[f] += __FVResidualSum(scratch, length);
+        }
+    }
+    
+    size_t best = 0;
+    for (size_t f = 1; f < sizeof(filters) / sizeof(filters[0]); f++) {
+        if (sums[f] < sums[best])
+            best = f;
+    }
+    return filters[best];
+}
@@ -0,0 +1,108 @@
+//
+//  FVRowFilter.h
+//  FileView
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FVROWFILTER_H_
+#define _FVROWFILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* normally provided by FileView_Prefix.pch */
+#ifndef FV_PRIVATE_EXTERN
+#ifdef __cplusplus
+#define FV_PRIVATE_EXTERN extern "C" __attribute__((visibility("hidden")))
+#else
+#define FV_PRIVATE_EXTERN extern __attribute__((visibility("hidden")))
+#endif
+#endif
+
+/** @file FVRowFilter.h @brief PNG row filters.
+ 
+ These are the Sub, Up and Paeth predictors from the PNG specification.  Each byte of a bitmap is replaced by its difference from a prediction based on the pixel to the left, the one above, or both.  For continuous-tone images, most differences are small, so a Huffman coder compresses them far better than the raw bytes.  Filtering and unfiltering use the compiler's vector extensions, which map to SSE2 or NEON; unfiltering Sub and Paeth is inherently serial from pixel to pixel, so those only work on the channels of a pixel in parallel.
+ 
+ Unlike PNG, one filter is used for every row, and the row before the first is taken to be zeroes.  Callers that split a bitmap into independently decoded pieces should filter each piece separately.
+ */
+
+/** @internal Filter types, with the values used by PNG. */
+enum {
+    FVRowFilterNone  = 0,
+    FVRowFilterSub   = 1,
+    FVRowFilterUp    = 2,
+    FVRowFilterPaeth = 4
+};
+typedef uint32_t FVRowFilterType;
+
+/** @internal Largest bytesPerPixel supported. */
+#define FV_ROW_FILTER_MAX_PIXEL_SIZE 8
+
+/** @internal 
+ 
+ @brief Choose a filter.
+ 
+ Filters a few rows spread through the bitmap with each filter, and picks the one with the smallest sum of differences taken as signed bytes, which is the heuristic recommended by the PNG specification.  This is cheap compared to filtering the whole bitmap.
+ @param rows The bitmap.
+ @param rowCount Number of rows.
+ @param bytesPerRow Length of a row, including any padding.
+ @param bytesPerPixel From 1 to FV_ROW_FILTER_MAX_PIXEL_SIZE.
+ @return A filter type, which may be FVRowFilterNone. */
+FV_PRIVATE_EXTERN FVRowFilterType FVRowFilterChoose(const uint8_t *rows, size_t rowCount, size_t bytesPerRow, size_t bytesPerPixel);
+
+/** @internal 
+ 
+ @brief Filter rows.
+ 
+ @param filter A filter type.
+ @param source The bitmap.
+ @param destination Receives rowCount * bytesPerRow filtered bytes.  Must not overlap source.
+ @param rowCount Number of rows.
+ @param bytesPerRow Length of a row, including any padding.
+ @param bytesPerPixel From 1 to FV_ROW_FILTER_MAX_PIXEL_SIZE. */
+FV_PRIVATE_EXTERN void FVRowFilterApply(FVRowFilterType filter, const uint8_t *source, uint8_t *destination, size_t rowCount, size_t bytesPerRow, size_t bytesPerPixel);
+
+/** @internal 
+ 
+ @brief Unfilter rows.
+ 
+ Reverses FVRowFilterApply in place.
+ @param filter The filter type that was applied.
+ @param rows The filtered rows.
+ @param rowCount Number of rows.
+ @param bytesPerRow Length of a row, including any padding.
+ @param bytesPerPixel From 1 to FV_ROW_FILTER_MAX_PIXEL_SIZE. */
+FV_PRIVATE_EXTERN void FVRowFilterRevert(FVRowFilterType filter, uint8_t *rows, size_t rowCount, size_t bytesPerRow, size_t bytesPerPixel);
+
+#endif /* _FVROWFILTER_H_ */
@@ -0,0 +1,93 @@
+//
+//  FVScratchArena.h
+//  FileView
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FVSCRATCHARENA_H_
+#define _FVSCRATCHARENA_H_
+
+#import <Foundation/Foundation.h>
+
+__BEGIN_DECLS
+
+/** @file FVScratchArena.h @brief Bump allocator for temporary buffers.
+ 
+ An arena hands out memory from a single large block by advancing an offset, and all of it is released at once by resetting the offset.  This is intended for scratch buffers that live for the duration of a single render operation, such as the tiles used by FVCGImageUtilities.h, so a render costs one allocation at most instead of one per buffer.
+ 
+ Each thread keeps a small pool of idle arenas, and the backing memory is kept between operations so it can be reused.  Arenas must be released on the thread that acquired them.
+ */
+
+/** @internal Opaque arena type. */
+typedef struct _FVScratchArena *FVScratchArenaRef;
+
+/** @internal 
+ 
+ @brief Get an arena from this thread's pool.
+ 
+ The arena is empty on return.  If it has less than @a capacity bytes available, the backing block is replaced with a larger one.  Arenas also remember the largest amount used in previous operations, so passing 0 is reasonable if the size isn't known in advance.
+ @param capacity Expected total size of all allocations from the arena, including padding as returned by FVScratchArenaSizeForAllocation().
+ @return An arena, or NULL if memory could not be allocated. */
+FV_PRIVATE_EXTERN FVScratchArenaRef FVScratchArenaAcquire(size_t capacity);
+
+/** @internal 
+ 
+ @brief Carve a block out of the arena.
+ 
+ The block isn't zeroed, and is aligned to 64 bytes unless the arena is full.  In that case, a separate block is allocated from FVAllocator.h::FVAllocatorGetDefault() and freed when the arena is released, so this only fails if the system is out of memory.  Blocks must not be freed individually.
+ @param arena An arena returned by FVScratchArenaAcquire().
+ @param size Size in bytes.
+ @return A pointer that remains valid until FVScratchArenaRelease() is called, or NULL on failure. */
+FV_PRIVATE_EXTERN void *FVScratchArenaAllocate(FVScratchArenaRef arena, size_t size);
+
+/** @internal 
+ 
+ @brief Space used by an allocation.
+ 
+ Sum this for all blocks to compute the capacity to pass to FVScratchArenaAcquire().
+ @param size Size in bytes as passed to FVScratchArenaAllocate().
+ @return The size rounded up to the arena's alignment. */
+FV_PRIVATE_EXTERN size_t FVScratchArenaSizeForAllocation(size_t size);
+
+/** @internal 
+ 
+ @brief Reset the arena and return it to this thread's pool.
+ 
+ All blocks allocated from the arena become invalid.  This doesn't return the backing block to the allocator unless it's unusually large.
+ @param arena An arena returned by FVScratchArenaAcquire(). */
+FV_PRIVATE_EXTERN void FVScratchArenaRelease(FVScratchArenaRef arena);
+
+__END_DECLS
+
+#endif /* _FVSCRATCHARENA_H_ */
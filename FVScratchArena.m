@@ -0,0 +1,205 @@
+//
+//  FVScratchArena.m
+//  FileView
+//
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#import "FVScratchArena.h"
+#import "FVAllocator.h"
+#import <pthread.h>
+
+// cache line size, which is also sufficient for vImage
+#define FV_ARENA_ALIGNMENT      64
+#define FV_ARENA_ROUND(x)       (((x) + FV_ARENA_ALIGNMENT - 1) & ~((size_t)FV_ARENA_ALIGNMENT - 1))
+
+// backing blocks are sized in multiples of this, so small variations in tile size don't cause reallocation
+#define FV_ARENA_GRANULARITY    65536
+
+// larger blocks are returned to the allocator when an arena is released, rather than held by an idle thread
+#define FV_ARENA_IDLE_LIMIT     (16 * 1024 * 1024)
+
+// arenas kept per thread; more than this are only needed for nested render operations
+#define FV_ARENA_POOL_SIZE      2
+
+// extra allocations made when an arena is full, freed on release
+typedef struct _FVScratchArenaOverflow {
+    struct _FVScratchArenaOverflow *next;
+} FVScratchArenaOverflow;
+
+// header size for overflow blocks, so the returned pointer keeps the arena's alignment
+#define FV_ARENA_OVERFLOW_HEADER FV_ARENA_ROUND(sizeof(FVScratchArenaOverflow))
+
+typedef struct _FVScratchArena {
+    uint8_t                  *_base;          /* backing block from FVAllocatorGetDefault()      */
+    size_t                    _capacity;      /* size of _base                                   */
+    size_t                    _offset;        /* next free byte in _base                         */
+    FVScratchArenaOverflow   *_overflow;      /* blocks allocated after _base was full           */
+    size_t                    _overflowSize;  /* bytes requested from overflow blocks            */
+    size_t                    _highWater;     /* most bytes used by any operation                */
+    struct _FVScratchArena   *_nextIdle;      /* thread's pool                                   */
+} FVScratchArena;
+
+typedef struct _FVScratchArenaPool {
+    FVScratchArena *_idle;
+    size_t          _idleCount;
+} FVScratchArenaPool;
+
+static pthread_key_t  _poolKey;
+static pthread_once_t _poolOnce = PTHREAD_ONCE_INIT;
+
+static void __FVScratchArenaDestroy(FVScratchArena *arena)
+{
+    if (arena->_base)
+        CFAllocatorDeallocate(FVAllocatorGetDefault(), arena->_base);
+    NSZoneFree(NULL, arena);
+}
+
+static void __FVScratchArenaPoolDestroy(void *value)
+{
+    FVScratchArenaPool *pool = (FVScratchArenaPool *)value;
+    while (pool->_idle) {
+        FVScratchArena *arena = pool->_idle;
+        pool->_idle = arena->_nextIdle;
+        __FVScratchArenaDestroy(arena);
+    }
+    NSZoneFree(NULL, pool);
+}
+
+static void __FVScratchArenaInitialize(void)
+{
+    (void) pthread_key_create(&_poolKey, __FVScratchArenaPoolDestroy);
+}
+
+static FVScratchArenaPool *__FVScratchArenaGetPool(void)
+{
+    (void) pthread_once(&_poolOnce, __FVScratchArenaInitialize);
+    FVScratchArenaPool *pool = (FVScratchArenaPool *)pthread_getspecific(_poolKey);
+    if (NULL == pool) {
+        pool = (FVScratchArenaPool *)NSZoneCalloc(NULL, 1, sizeof(FVScratchArenaPool));
+        if (pool && 0 != pthread_setspecific(_poolKey, pool)) {
+            NSZoneFree(NULL, pool);
+            pool = NULL;
+        }
+    }
+    return pool;
+}
+
+size_t FVScratchArenaSizeForAllocation(size_t size)
+{
+    return FV_ARENA_ROUND(size);
+}
+
+FVScratchArenaRef FVScratchArenaAcquire(size_t capacity)
+{
+    FVScratchArenaPool *pool = __FVScratchArenaGetPool();
+    FVScratchArena *arena = NULL;
+    if (pool && pool->_idle) {
+        arena = pool->_idle;
+        pool->_idle = arena->_nextIdle;
+        pool->_idleCount--;
+        arena->_nextIdle = NULL;
+    }
+    else {
+        arena = (FVScratchArena *)NSZoneCalloc(NULL, 1, sizeof(FVScratchArena));
+        if (NULL == arena)
+            return NULL;
+    }
+    
+    // size for the previous operations as well, so the next one doesn't spill into overflow blocks
+    capacity = MAX(capacity, arena->_highWater);
+    if (arena->_capacity < capacity) {
+        if (arena->_base)
+            CFAllocatorDeallocate(FVAllocatorGetDefault(), arena->_base);
+        arena->_capacity = (capacity + FV_ARENA_GRANULARITY - 1) / FV_ARENA_GRANULARITY * FV_ARENA_GRANULARITY;
+        arena->_base = (uint8_t *)CFAllocatorAllocate(FVAllocatorGetDefault(), arena->_capacity, 0);
+        // FVScratchArenaAllocate can still use overflow blocks
+        if (NULL == arena->_base)
+            arena->_capacity = 0;
+    }
+    return arena;
+}
+
+void *FVScratchArenaAllocate(FVScratchArenaRef arena, size_t size)
+{
+    NSCParameterAssert(arena);
+    size = FV_ARENA_ROUND(size);
+    
+    // the backing block is page aligned, so rounding sizes keeps every block aligned
+    if (size <= arena->_capacity - arena->_offset) {
+        void *ptr = arena->_base + arena->_offset;
+        arena->_offset += size;
+        return ptr;
+    }
+    
+    FVScratchArenaOverflow *overflow = (FVScratchArenaOverflow *)CFAllocatorAllocate(FVAllocatorGetDefault(), size + FV_ARENA_OVERFLOW_HEADER, 0);
+    if (NULL == overflow)
+        return NULL;
+    overflow->next = arena->_overflow;
+    arena->_overflow = overflow;
+    arena->_overflowSize += size;
+    return (uint8_t *)overflow + FV_ARENA_OVERFLOW_HEADER;
+}
+
+void FVScratchArenaRelease(FVScratchArenaRef arena)
+{
+    if (NULL == arena)
+        return;
+    
+    arena->_highWater = MAX(arena->_highWater, arena->_offset + arena->_overflowSize);
+    arena->_offset = 0;
+    arena->_overflowSize = 0;
+    while (arena->_overflow) {
+        FVScratchArenaOverflow *overflow = arena->_overflow;
+        arena->_overflow = overflow->next;
+        CFAllocatorDeallocate(FVAllocatorGetDefault(), overflow);
+    }
+    
+    // don't let an idle thread sit on the memory from scaling one huge image
+    if (arena->_capacity > FV_ARENA_IDLE_LIMIT) {
+        CFAllocatorDeallocate(FVAllocatorGetDefault(), arena->_base);
+        arena->_base = NULL;
+        arena->_capacity = 0;
+        arena->_highWater = 0;
+    }
+    
+    FVScratchArenaPool *pool = __FVScratchArenaGetPool();
+    if (pool && pool->_idleCount < FV_ARENA_POOL_SIZE) {
+        arena->_nextIdle = pool->_idle;
+        pool->_idle = arena;
+        pool->_idleCount++;
+    }
+    else {
+        __FVScratchArenaDestroy(arena);
+    }
+}
@@ -319,6 +319,11 @@ static OSSpinLock _cacheLock = OS_SPINLOCK_INIT;
     return (NULL != _fullImage || NULL != _thumbnail);
 }
 
+- (size_t)_imageByteSize;
+{
+    return FVCGImageByteSize(_thumbnail) + (_fullImage == _thumbnail ? 0 : FVCGImageByteSize(_fullImage));
+}
+
 - (void)releaseResources
 {
     [self lock];
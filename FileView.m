@@ -41,14 +41,17 @@
 #import <FileView/FVPreviewer.h>
 
 #import <WebKit/WebKit.h>
+#import <libkern/OSAtomic.h>
 
 #import "FVIcon.h"
+#import "FVBaseIcon.h"
 #import "FVArrowButtonCell.h"
 #import "FVUtilities.h"
 #import "FVDownload.h"
 #import "FVSlider.h"
 #import "FVColorMenuView.h"
 #import "_FVController.h"
+#import "FVMemoryBudget.h"
 
 /*
  Forward declarations to allow compilation on 10.5.  Note: the private Quick Look UI framework
@@ -85,9 +88,39 @@
 - (void)_previewURLs:(NSArray *)iconURLs;
 - (void)_previewURL:(NSURL *)aURL forIconInRect:(NSRect)iconRect;
 - (NSArray *)_selectedURLs;
+- (void)_releaseOffscreenIconResources;
 
 @end
 
+// all views, so the memory budget can release icons that aren't visible; only accessed on the main thread
+static CFMutableArrayRef _liveViews = NULL;
+static volatile int32_t  _shedScheduled = 0;
+
+// bitmaps held by icons, which is what releasing off-screen icons gives back
+static size_t __FVFileViewIconRasterSize(void *info)
+{
+    return FVBaseIconGetImageByteSize();
+}
+
+static void __FVFileViewReleaseOffscreenIcons(void *info)
+{
+    CFIndex i = CFArrayGetCount(_liveViews);
+    while (i--)
+        [(FileView *)CFArrayGetValueAtIndex(_liveViews, i) _releaseOffscreenIconResources];
+    OSAtomicCompareAndSwap32Barrier(1, 0, &_shedScheduled);
+}
+
+/*
+ Called by the memory budget on an arbitrary thread.  Views and their icon caches can only be used on the main
+ thread, so this schedules the release and returns; the budget sees the result the next time it's checked.
+ */
+static size_t __FVFileViewReleaseIconRasters(size_t bytes, void *info)
+{
+    if (OSAtomicCompareAndSwap32Barrier(0, 1, &_shedScheduled))
+        dispatch_async_f(dispatch_get_main_queue(), NULL, __FVFileViewReleaseOffscreenIcons);
+    return 0;
+}
+
 // note: extend the bitfield in _fvFlags when adding enumerates
 enum {
     FVDropNone   = 0,
@@ -157,6 +190,10 @@ static char _FVContentBindingToControllerObserverContext;
     
     // Hidden pref; 10.7 and later http://mjtsai.com/blog/2012/03/12/qlenabletextselection/
     [[NSUserDefaults standardUserDefaults] setBool:YES forKey:@"QLEnableTextSelection"];
+    
+    // non-retaining, since views remove themselves in dealloc
+    _liveViews = CFArrayCreateMutable(NULL, 0, NULL);
+    (void) FVMemoryBudgetAddConsumer("FileView", FVMemoryCostIconRasters, __FVFileViewIconRasterSize, __FVFileViewReleaseIconRasters, NULL);
 }
 
 + (NSColor *)defaultBackgroundColor
@@ -311,6 +348,7 @@ static char _FVContentBindingToControllerObserverContext;
     _selectionBinding = nil;
     _fvFlags.isObservingSelectionIndexes = NO;
     
+    CFArrayAppendValue(_liveViews, self);
 }
 
 #pragma mark NSView overrides
@@ -344,6 +382,9 @@ static char _FVContentBindingToControllerObserverContext;
 
 - (void)dealloc
 {
+    CFIndex idx = CFArrayGetFirstIndexOfValue(_liveViews, CFRangeMake(0, CFArrayGetCount(_liveViews)), self);
+    if (kCFNotFound != idx)
+        CFArrayRemoveValueAtIndex(_liveViews, idx);
     [_leftArrow release];
     [_rightArrow release];
     [_controller release];
@@ -1714,14 +1755,8 @@ static NSArray * _wordsFromAttributedString(NSAttributedString *attributedString
 
 - (BOOL)_isFastScrolling { return ABS([self _scrollVelocity]) > 10000.0f; }
 
-- (void)_scheduleIconsInRange:(NSRange)indexRange;
+- (void)_addVisibleIndexesToSet:(NSMutableIndexSet *)visibleIndexes
 {
-    NSMutableIndexSet *visibleIndexes = [NSMutableIndexSet indexSetWithIndexesInRange:indexRange];
-
-    /*
-     this method is now called with only the icons being drawn, not necessarily everything 
-     that's visible; we need to compute visibility to avoid calling -releaseResources on the wrong icons
-     */
     NSRange visRows, visCols;
     [self _getRangeOfRows:&visRows columns:&visCols inRect:[self visibleRect]];
     NSUInteger iMin, iMax = [_controller numberOfIcons];
@@ -1735,6 +1770,40 @@ static NSArray * _wordsFromAttributedString(NSAttributedString *attributedString
     
     if (iMax > iMin)
         [visibleIndexes addIndexesInRange:NSMakeRange(iMin, iMax - iMin)];
+}
+
+// memory budget was exceeded, so release everything that isn't visible, regardless of scrolling
+- (void)_releaseOffscreenIconResources
+{
+    NSMutableIndexSet *visibleIndexes = [NSMutableIndexSet indexSet];
+    [self _addVisibleIndexesToSet:visibleIndexes];
+    NSMutableIndexSet *unusedIndexes = [NSMutableIndexSet indexSetWithIndexesInRange:NSMakeRange(0, [_controller numberOfIcons])];
+    [unusedIndexes removeIndexes:visibleIndexes];
+    
+    if ([unusedIndexes count]) {
+        // same icon instance may be used for duplicate URLs
+        NSSet *visibleSet = [[NSSet alloc] initWithArray:[_controller iconsAtIndexes:visibleIndexes]];
+        NSMutableArray *unusedIcons = [[_controller iconsAtIndexes:unusedIndexes] mutableCopy];
+        NSUInteger i = [unusedIcons count];
+        while (i--) {
+            if ([visibleSet containsObject:[unusedIcons objectAtIndex:i]])
+                [unusedIcons removeObjectAtIndex:i];
+        }
+        [_controller enqueueReleaseOperationForIcons:unusedIcons];
+        [visibleSet release];
+        [unusedIcons release];
+    }
+}
+
+- (void)_scheduleIconsInRange:(NSRange)indexRange;
+{
+    NSMutableIndexSet *visibleIndexes = [NSMutableIndexSet indexSetWithIndexesInRange:indexRange];
+
+    /*
+     this method is now called with only the icons being drawn, not necessarily everything 
+     that's visible; we need to compute visibility to avoid calling -releaseResources on the wrong icons
+     */
+    [self _addVisibleIndexesToSet:visibleIndexes];
                 
     // Queuing will call needsRenderForSize: after initial display has taken place, since it may flush the icon's cache
     // this isn't obvious from the method name; it all takes place in a single op to avoid locking twice
@@ -47,9 +47,16 @@
 
 /** @internal 
  
- @brief Determine if too much data is mapped */
+ @brief Determine if too much data is mapped 
+ 
+ Mapped data is limited to half of the ceiling in FVMemoryBudget.h, as well as by the number of providers. */
 + (BOOL)maxSizeExceeded;
 
+/** @internal 
+ 
+ @brief Total size of all mapped files, in bytes */
++ (size_t)mappedDataSize;
+
 /** @internal 
  
  @brief Maximum number of memory-mapped data providers */
@@ -39,6 +39,7 @@
 #import "_FVMappedDataProvider.h"
 #import "FVObject.h"
 #import "FVUtilities.h"
+#import "FVMemoryBudget.h"
 #import <pthread.h>
 #import <sys/mman.h>
 #import <sys/stat.h>
@@ -53,7 +54,6 @@ typedef struct _FVMappedRegion {
 } FVMappedRegion;
 
 static volatile int32_t _mappedDataSizeKB = 0;
-#define MAX_MAPPED_SIZE_KB 400000
 
 // This is intentionally low, since I don't know what the limit is, and sysctl doesn't say.  The max number of file descriptors is ~255 per process, but I can actually mmap ~28,000 files on 10.5.4.  We should never see even this many in practice, though.
 #define MAX_MAPPED_PROVIDER_COUNT 254
@@ -89,7 +89,12 @@ static pthread_mutex_t _providerLock = PTHREAD_MUTEX_INITIALIZER;
 
 + (BOOL)maxSizeExceeded
 {
-    return _mappedDataSizeKB > MAX_MAPPED_SIZE_KB || CFDictionaryGetCount(_dataProviders) >= MAX_MAPPED_PROVIDER_COUNT;
+    return [self mappedDataSize] > FVMemoryBudgetGetCeiling() / 2 || CFDictionaryGetCount(_dataProviders) >= MAX_MAPPED_PROVIDER_COUNT;
+}
+
++ (size_t)mappedDataSize
+{
+    return (size_t)_mappedDataSizeKB * 1024;
 }
 
 + (unsigned char)maxProviderCount;
@@ -154,6 +159,9 @@ static pthread_mutex_t _providerLock = PTHREAD_MUTEX_INITIALIZER;
     }
     if (pInfo) pInfo->_refCount++;
     pthread_mutex_unlock(&_providerLock);
+    
+    // may release other mapped files, so don't hold the lock
+    FVMemoryBudgetCheck();
     return pInfo ? pInfo->_provider : NULL;
 }
 
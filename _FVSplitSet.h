@@ -52,6 +52,7 @@
 - (void)removeObject:(id)obj;
 - (void)removeOldObjects;
 - (NSSet *)copyOldObjects;
+- (NSSet *)copyAllObjects;
 - (NSUInteger)count;
 
 @end
@@ -84,6 +84,13 @@
 
 - (NSSet *)copyOldObjects { return (NSSet *)CFSetCreateCopy(CFGetAllocator(_old), _old); }
 
+- (NSSet *)copyAllObjects
+{
+    NSMutableSet *all = (NSMutableSet *)CFSetCreateMutableCopy(CFGetAllocator(_old), 0, _old);
+    [all unionSet:(NSSet *)_new];
+    return all;
+}
+
 - (NSUInteger)count { return CFSetGetCount(_old) + CFSetGetCount(_new); }
 
 @end
@@ -39,32 +39,57 @@
  */
 
 #import "fv_zone.h"
-#import <libkern/OSAtomic.h>
-#import <malloc/malloc.h>
-#import <mach/mach.h>
-#import <mach/mach_vm.h>
 #import <pthread.h>
 #import <sys/time.h>
 #import <math.h>
 #import <errno.h>
+
+#if defined(__APPLE__)
+#define FV_ZONE_MACH 1
+#import <malloc/malloc.h>
+#import <mach/mach.h>
+#import <mach/mach_vm.h>
+#import <mach/mach_time.h>
 #import <dispatch/dispatch.h>
+#import <sys/sysctl.h>
+#else
+#define FV_ZONE_MACH 0
+#import <unistd.h>
+#import <string.h>
+#import <stdio.h>
+#import <sys/syscall.h>
+#endif
 
 #import <set>
 #import <map>
 #import <vector>
+#import <algorithm>
 #import <iostream>
 using namespace std;
 
+// Mach VM is used on Mac OS X unless this is set; other systems always use mmap(2) and mremap(2)
+#if FV_ZONE_MACH
 #define FV_USE_MMAP 0
-#if FV_USE_MMAP
-#import <sys/mman.h>
+#else
+#define FV_USE_MMAP 1
 #endif
 
+// madvise(2) is used on all systems
+#import <sys/mman.h>
+
+#if FV_ZONE_MACH
 #if MAC_OS_X_VERSION_MAX_ALLOWED <= MAC_OS_X_VERSION_10_5
 #ifndef mach_vm_round_page
 #define mach_vm_round_page(x) (((mach_vm_offset_t)(x) + PAGE_MASK) & ~((signed)PAGE_MASK))
 #endif
 #endif
+#define FV_ROUND_PAGE(x) mach_vm_round_page(x)
+#else
+#ifndef PAGE_SIZE
+#define PAGE_SIZE ((size_t)getpagesize())
+#endif
+#define FV_ROUND_PAGE(x) (((uintptr_t)(x) + PAGE_SIZE - 1) & ~((uintptr_t)PAGE_SIZE - 1))
+#endif
 
 #if DEBUG
 #define ENABLE_STATS 0
@@ -80,23 +105,71 @@ static void fv_zone_assert(bool condition) { if(false == (condition)) { HALT; }
 
 // define so the template isn't insanely wide
 #define ALLOC struct _fv_allocation_t *
-#define MSALLOC ALLOC, bool(*)(ALLOC, ALLOC)
+
+/*
+ Size classes are spaced at quarter powers of two, from 128 bytes up to 1 GB.  Requests are rounded up to
+ the size of their class, so any block in a class can satisfy any request that maps to that class.  Blocks
+ larger than the largest class go into a single overflow class, and aren't rounded.
+ */
+#define FV_SIZE_CLASS_MIN_SHIFT   7
+#define FV_SIZE_CLASS_MAX_SHIFT   30
+#define FV_SIZE_CLASS_STEP_SHIFT  2
+#define FV_SIZE_CLASS_COUNT       (((FV_SIZE_CLASS_MAX_SHIFT - FV_SIZE_CLASS_MIN_SHIFT) << FV_SIZE_CLASS_STEP_SHIFT) + 1)
+#define FV_SIZE_CLASS_OVERFLOW    (FV_SIZE_CLASS_COUNT - 1)
+
+// one bit per size class, set when its free list is nonempty
+#define FV_SIZE_CLASS_MAP_WORDS   ((FV_SIZE_CLASS_COUNT + 63) / 64)
+
+// fv_zone.h has to agree
+typedef char __fv_size_class_count_check[(FV_ZONE_SIZE_CLASS_COUNT == FV_SIZE_CLASS_COUNT) ? 1 : -1];
+
+/*
+ Counters for fv_zone_copy_statistics().  Each thread only updates its own, so no atomic operations are needed;
+ readers take the zone lock and add up the counters of all threads, plus those of threads that have exited.
+ */
+typedef struct _fv_counters_t {
+    uint64_t           magazineHits;
+    uint64_t           freeListHits;
+    uint64_t           misses;
+    uint64_t           frees;
+    uint64_t           remoteFrees;
+    uint64_t           reallocs;
+    uint64_t           reallocsInPlace;
+    uint64_t           mallocsByClass[FV_SIZE_CLASS_COUNT];
+} fv_counters_t;
+
+// link for the remote free queue, which is intrusive so pushing a block never allocates
+typedef struct _fv_remote_node_t {
+    struct _fv_remote_node_t *volatile next;
+} fv_remote_node_t;
 
 typedef struct _fv_zone_t {
     malloc_zone_t      _basic_zone;
     void              *_reserved[4];          /* for future expansion of malloc_zone_t */
-    multiset<MSALLOC> *_availableAllocations; /* <fv_allocation_t *>, counted by size  */
+    ALLOC              _freeLists[FV_SIZE_CLASS_COUNT];       /* free blocks by size class     */
+    uint64_t           _freeListMap[FV_SIZE_CLASS_MAP_WORDS]; /* bit set if list is nonempty   */
+    ALLOC              _oldestFree;           /* head of free list blocks by age       */
+    ALLOC              _newestFree;           /* tail of free list blocks by age       */
+    ALLOC              _oldestResident;       /* oldest block that isn't soft released */
     vector<ALLOC>     *_allocations;          /* all allocations, ordered by address   */
     ALLOC             *_allocPtr;             /* pointer to _allocations storage       */
     size_t             _allocPtrCount;        /* number of ALLOC pointers in _allocPtr */
     size_t             _allocatedSize;        /* free + active allocations (allocSize) */
-    size_t             _freeSize;             /* available allocations (allocSize)     */
+    volatile size_t    _freeSize;             /* free list + magazines (allocSize)     */
+    volatile size_t    _releasedSize;         /* soft released free blocks (ptrSize)   */
+    size_t             _hugePageThreshold;    /* VM blocks this large use huge pages   */
+    size_t             _peakAllocatedSize;    /* largest value of _allocatedSize       */
+    pthread_key_t      _magazineKey;          /* fv_thread_cache_t for each thread     */
+    struct _fv_thread_cache_t *_threadCaches; /* all threads' caches, for statistics   */
+    fv_counters_t      _retiredCounters;      /* counters of threads that have exited  */
+    volatile uint64_t  _collections;          /* collector passes that released blocks */
+    volatile uint64_t  _blocksReleased;       /* blocks destroyed by the collector     */
+    volatile uint64_t  _bytesReleased;        /* allocSize destroyed by the collector  */
+    volatile uint64_t  _bytesSoftReleased;    /* ptrSize passed to madvise             */
+    fv_remote_node_t  *_remoteHead;           /* oldest remote free; lock to consume   */
+    fv_remote_node_t  *volatile _remoteTail;  /* newest remote free; swapped by push   */
+    fv_remote_node_t   _remoteStub;           /* keeps the remote free queue nonempty  */
     pthread_mutex_t    _lock;                 /* lock before manipulating fields       */
-#if ENABLE_STATS
-    volatile uint32_t  _cacheHits;
-    volatile uint32_t  _cacheMisses;
-    volatile uint32_t  _reallocCount;
-#endif
 } fv_zone_t;
 
 typedef struct _fv_allocation_t {
@@ -105,13 +178,51 @@ typedef struct _fv_allocation_t {
     void            *ptr;       /* writable region of allocation */
     size_t           ptrSize;   /* writable length of ptr        */
     const fv_zone_t *zone;      /* fv_zone_t                     */
+    unsigned         sizeClass; /* size class at creation        */
     bool             free;      /* in use or in the free list    */
+    bool             softReleased; /* pages returned with madvise */
+    ALLOC            next;      /* next block in the free list   */
+    ALLOC            prev;      /* previous block in free list   */
+    ALLOC            newer;     /* next block in the age list    */
+    ALLOC            older;     /* previous block in age list    */
+    uint64_t         freeTime;  /* when added to the free list   */
+    const void      *owner;     /* thread cache that allocated it */
+    fv_remote_node_t remote;    /* link in the remote free queue */
 #if ENABLE_STATS
     uint32_t         timesUsed; /* for stats logging only        */
 #endif
     const void      *guard;     /* pointer to a check variable   */
 } fv_allocation_t;
 
+/*
+ Per-thread magazines of recently freed blocks, one per size class up to 4 MB.  These are only touched
+ by the owning thread, so malloc and free can recycle a block without taking the zone lock.  Magazines
+ are refilled from and drained to the zone's free list in batches.
+ */
+#define FV_MAGAZINE_MAX_SHIFT     22
+#define FV_MAGAZINE_CLASS_COUNT   (((FV_MAGAZINE_MAX_SHIFT - FV_SIZE_CLASS_MIN_SHIFT) << FV_SIZE_CLASS_STEP_SHIFT) + 1)
+#define FV_MAGAZINE_CAPACITY      8
+#define FV_MAGAZINE_BATCH         (FV_MAGAZINE_CAPACITY / 2)
+// upper bound on memory held in magazines by a single thread
+#define FV_MAGAZINE_MAX_BYTES     16777216UL
+
+typedef struct _fv_magazine_t {
+    unsigned         count;                          /* number of blocks, oldest first */
+    fv_allocation_t *blocks[FV_MAGAZINE_CAPACITY];
+} fv_magazine_t;
+
+typedef struct _fv_thread_cache_t {
+    fv_zone_t       *zone;                           /* owning zone                    */
+    size_t           size;                           /* sum of allocSize in magazines  */
+    struct _fv_thread_cache_t *prevCache;            /* zone's list of thread caches   */
+    struct _fv_thread_cache_t *nextCache;
+    fv_counters_t    counters;                       /* only written by owning thread  */
+    fv_magazine_t    magazines[FV_MAGAZINE_CLASS_COUNT];
+} fv_thread_cache_t;
+
+// the cache may be NULL if it couldn't be allocated
+#define FV_COUNT(cache, counter) do { if (__builtin_expect(NULL != (cache), 1)) (cache)->counters.counter++; } while (0)
+
 typedef struct _fv_list {
 	struct _fv_list_item *first;
 	struct _fv_list_item *last;
@@ -123,6 +234,15 @@ typedef struct _fv_list_item {
     void                 *payload;
 } fv_list_item;
 
+// _freeSize is modified without the lock when blocks move in and out of magazines
+#define FV_ATOMIC_ADD(ptr, value) ((void)__sync_add_and_fetch((ptr), (value)))
+#define FV_ATOMIC_SUB(ptr, value) ((void)__sync_sub_and_fetch((ptr), (value)))
+
+// for the remote free queue; __sync has no exchange with release semantics
+#define FV_ATOMIC_EXCHANGE(ptr, value) (__atomic_exchange_n((ptr), (value), __ATOMIC_ACQ_REL))
+#define FV_ATOMIC_LOAD(ptr) (__atomic_load_n((ptr), __ATOMIC_ACQUIRE))
+#define FV_ATOMIC_STORE(ptr, value) (__atomic_store_n((ptr), (value), __ATOMIC_RELEASE))
+
 #define LOCK_INIT(z) (pthread_mutex_init(&(z)->_lock, NULL))
 #define LOCK(z) (pthread_mutex_lock(&(z)->_lock))
 #define UNLOCK(z) (pthread_mutex_unlock(&(z)->_lock))
@@ -146,6 +266,12 @@ static bool              _scribble = false;
 #define FV_VM_THRESHOLD 15360UL
 // clean up the pool at 100 MB of freed memory
 #define FV_COLLECT_THRESHOLD 104857600UL
+// free blocks unused for this long have their pages soft released
+#define FV_SOFT_RELEASE_SECONDS 5ULL
+// and release the oldest blocks until it's below 50 MB
+#define FV_COLLECT_LOW_WATER (FV_COLLECT_THRESHOLD / 2)
+// blocks released each time the lock is taken, so malloc and free aren't held up for long
+#define FV_COLLECT_BATCH_SIZE 32
 
 #if ENABLE_STATS
 #define FV_COLLECT_TIMEINTERVAL 60ULL
@@ -204,41 +330,308 @@ static fv_list_item * __fv_list_find_item(fv_list *list, const void *payload)
 
 #define FV_ALLOC_FROM_POINTER(ptr) ((fv_allocation_t *)((uintptr_t)(ptr) - sizeof(fv_allocation_t)))
 
-static inline fv_allocation_t *__fv_zone_get_allocation_from_pointer_locked(fv_zone_t *zone, const void *ptr)
+static inline bool __fv_zone_use_vm(size_t size) { return size >= FV_VM_THRESHOLD; }
+
+#pragma mark VM primitives
+
+// page-granular memory for blocks at or above FV_VM_THRESHOLD
+static inline void *__fv_zone_vm_allocate(const size_t size)
 {
-    fv_allocation_t *alloc = NULL;
-    if ((uintptr_t)ptr >= sizeof(fv_allocation_t))
-        alloc = FV_ALLOC_FROM_POINTER(ptr);
-    if (binary_search(zone->_allocations->begin(), zone->_allocations->end(), alloc) == false) {
-        alloc = NULL;
-    } 
-    else if (NULL != alloc && alloc->guard != &_vm_guard && alloc->guard != &_malloc_guard) {
-        malloc_printf("inconsistency in allocation records for zone %s\n", malloc_get_zone_name(&zone->_basic_zone));
+#if FV_USE_MMAP
+#if FV_ZONE_MACH
+    void *memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, VM_MAKE_TAG(FV_VM_MEMORY_MALLOC), 0);
+#else
+    void *memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+#endif
+    return MAP_FAILED == memory ? NULL : memory;
+#else
+    mach_vm_address_t memory;
+    kern_return_t ret = mach_vm_allocate(mach_task_self(), &memory, size, VM_FLAGS_ANYWHERE | VM_MAKE_TAG(FV_VM_MEMORY_MALLOC));
+    return KERN_SUCCESS == ret ? (void *)memory : NULL;
+#endif
+}
+
+static inline bool __fv_zone_vm_deallocate(void *base, const size_t size)
+{
+#if FV_USE_MMAP
+    return 0 == munmap(base, size);
+#else
+    return KERN_SUCCESS == mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)base, size);
+#endif
+}
+
+/*
+ Grow the region at base from size to newSize bytes, returning the (possibly new) base address or NULL on failure.
+ Unless mayMove is set, the region is only extended in place.  Mach VM can't move a region, but mremap(2) moves the
+ page table entries, so the contents are never copied.
+ */
+static inline void *__fv_zone_vm_grow(void *base, const size_t size, const size_t newSize, const bool mayMove)
+{
+#if FV_ZONE_MACH
+    if (mayMove) return NULL;
+    // attempt to allocate at a specific address and extend the existing region
+    mach_vm_address_t addr = (mach_vm_address_t)base + size;
+    kern_return_t ret = mach_vm_allocate(mach_task_self(), &addr, newSize - size, VM_FLAGS_FIXED | VM_MAKE_TAG(FV_VM_MEMORY_REALLOC));
+    return KERN_SUCCESS == ret ? base : NULL;
+#else
+    void *memory = mremap(base, size, newSize, mayMove ? MREMAP_MAYMOVE : 0);
+    return MAP_FAILED == memory ? NULL : memory;
+#endif
+}
+
+/*
+ Hint that the pages of a free block can be reclaimed, without unmapping it.  The contents are undefined afterwards.
+ MADV_FREE lets Linux reclaim lazily, but kernels before 4.5 only have MADV_DONTNEED.  Mac OS X wants
+ MADV_FREE_REUSABLE, with a matching MADV_FREE_REUSE before the pages are written again so they're accounted
+ to the task correctly.
+ */
+static inline bool __fv_zone_vm_soft_release(void *ptr, const size_t size)
+{
+#if FV_ZONE_MACH
+    return 0 == madvise(ptr, size, MADV_FREE_REUSABLE);
+#else
+#ifdef MADV_FREE
+    if (0 == madvise(ptr, size, MADV_FREE))
+        return true;
+#endif
+    return 0 == madvise(ptr, size, MADV_DONTNEED);
+#endif
+}
+
+static inline void __fv_zone_vm_reuse(void *ptr, const size_t size)
+{
+#if FV_ZONE_MACH
+    (void) madvise(ptr, size, MADV_FREE_REUSE);
+#endif
+}
+
+// transparent huge page size, or 0 if they aren't available; set up in fv_create_zone_named()
+static size_t _hugePageSize = 0;
+
+static size_t __fv_zone_get_huge_page_size(void)
+{
+    size_t hugePageSize = 0;
+#if !FV_ZONE_MACH && defined(MADV_HUGEPAGE)
+    // "always [madvise] never" lists the modes, with the current one in brackets
+    char mode[128] = { '\0' };
+    FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (file) {
+        if (NULL == fgets(mode, sizeof(mode), file)) mode[0] = '\0';
+        fclose(file);
+    }
+    file = (mode[0] && NULL == strstr(mode, "[never]")) ? fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r") : NULL;
+    if (file) {
+        unsigned long size;
+        if (1 == fscanf(file, "%lu", &size) && size > PAGE_SIZE && 0 == (size & (size - 1)))
+            hugePageSize = size;
+        fclose(file);
+    }
+#endif
+    return hugePageSize;
+}
+
+/*
+ Returns a block of size bytes (a multiple of _hugePageSize) aligned to a huge page boundary, with one page in front
+ for the header, and asks the kernel to back it with huge pages.  The mapping is over-allocated and trimmed, so the
+ result looks like any other VM block and is deallocated the same way.
+ */
+static void *__fv_zone_vm_allocate_huge(const size_t size, void **base)
+{
+    fv_zone_assert(_hugePageSize && 0 == size % _hugePageSize);
+    const size_t mapSize = size + _hugePageSize;
+    void *memory = __fv_zone_vm_allocate(mapSize);
+    if (NULL == memory)
+        return NULL;
+    
+    const uintptr_t start = (uintptr_t)memory, end = start + mapSize;
+    const uintptr_t ptr = (start + PAGE_SIZE + _hugePageSize - 1) & ~(_hugePageSize - 1);
+    if (ptr - PAGE_SIZE > start)
+        (void) __fv_zone_vm_deallocate(memory, ptr - PAGE_SIZE - start);
+    if (ptr + size < end)
+        (void) __fv_zone_vm_deallocate((void *)(ptr + size), end - ptr - size);
+#ifdef MADV_HUGEPAGE
+    (void) madvise((void *)ptr, size, MADV_HUGEPAGE);
+#endif
+    *base = (void *)(ptr - PAGE_SIZE);
+    return (void *)ptr;
+}
+
+#if FV_ZONE_MACH
+// set up in fv_create_zone_named()
+static mach_timebase_info_data_t _timebase = { 0, 0 };
+#endif
+
+// monotonic time in nanoseconds, used to age blocks in the free list
+static inline uint64_t __fv_zone_timestamp(void)
+{
+#if FV_ZONE_MACH
+    return mach_absolute_time() * _timebase.numer / _timebase.denom;
+#else
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+#pragma mark Page map
+
+/*
+ Global two-level radix map from 4K page number to fv_allocation_t, so a pointer can be validated without the zone
+ lock.  Leaves are mapped lazily and never freed, so readers don't need any synchronization; entries are published
+ after the header is complete.  Each entry is either
+ 
+ - the header of the VM block whose ptr starts on that page (an aligned pointer, so the low bit is clear), or
+ - (2 * count + 1), where count is the number of live malloc_default_zone() block headers on that page.
+ 
+ Small blocks share pages with other malloc_default_zone() allocations, so the count only says that the header
+ memory is mapped and safe to read.  The guard, zone, and ptr fields in the header then confirm the lookup.
+ */
+#define FV_PAGEMAP_ADDRESS_BITS 48
+#define FV_PAGEMAP_PAGE_SHIFT   12
+#define FV_PAGEMAP_LEAF_BITS    18
+#define FV_PAGEMAP_ROOT_BITS    (FV_PAGEMAP_ADDRESS_BITS - FV_PAGEMAP_PAGE_SHIFT - FV_PAGEMAP_LEAF_BITS)
+#define FV_PAGEMAP_LEAF_MASK    ((1UL << FV_PAGEMAP_LEAF_BITS) - 1)
+#define FV_PAGEMAP_LEAF_SIZE    ((1UL << FV_PAGEMAP_LEAF_BITS) * sizeof(uintptr_t))
+
+static uintptr_t * volatile _pagemap[1UL << FV_PAGEMAP_ROOT_BITS];
+
+static inline bool __fv_pagemap_contains(const uintptr_t addr) { return 0 == (addr >> FV_PAGEMAP_ADDRESS_BITS); }
+
+static inline uintptr_t __fv_pagemap_get(const uintptr_t addr)
+{
+    const uintptr_t page = addr >> FV_PAGEMAP_PAGE_SHIFT;
+    volatile uintptr_t *leaf = _pagemap[page >> FV_PAGEMAP_LEAF_BITS];
+    return leaf ? leaf[page & FV_PAGEMAP_LEAF_MASK] : 0;
+}
+
+// creates the leaf if needed
+static volatile uintptr_t *__fv_pagemap_slot(const uintptr_t addr)
+{
+    if (__builtin_expect(false == __fv_pagemap_contains(addr), 0)) {
+        malloc_printf("%s: address %p is outside the page map\n", __func__, (void *)addr);
         HALT;
     }
+    const uintptr_t page = addr >> FV_PAGEMAP_PAGE_SHIFT;
+    uintptr_t * volatile *root = &_pagemap[page >> FV_PAGEMAP_LEAF_BITS];
+    uintptr_t *leaf = *root;
+    if (NULL == leaf) {
+        leaf = (uintptr_t *)__fv_zone_vm_allocate(FV_PAGEMAP_LEAF_SIZE);
+        if (__builtin_expect(NULL == leaf, 0)) {
+            malloc_printf("%s: unable to allocate page map\n", __func__);
+            HALT;
+        }
+        // another thread may have installed one first
+        if (false == __sync_bool_compare_and_swap(root, NULL, leaf)) {
+            (void) __fv_zone_vm_deallocate(leaf, FV_PAGEMAP_LEAF_SIZE);
+            leaf = *root;
+        }
+    }
+    return &leaf[page & FV_PAGEMAP_LEAF_MASK];
+}
+
+// add or remove a header on each page spanned by [start, end)
+static void __fv_pagemap_count_headers(const uintptr_t start, const uintptr_t end, const bool add)
+{
+    for (uintptr_t page = start >> FV_PAGEMAP_PAGE_SHIFT; page <= (end - 1) >> FV_PAGEMAP_PAGE_SHIFT; page++) {
+        volatile uintptr_t *slot = __fv_pagemap_slot(page << FV_PAGEMAP_PAGE_SHIFT);
+        uintptr_t entry, newEntry;
+        do {
+            entry = *slot;
+            fv_zone_assert(0 == entry || (entry & 1));
+            if (add)
+                newEntry = 0 == entry ? 3 : entry + 2;
+            else
+                newEntry = 3 == entry ? 0 : entry - 2;
+        } while (false == __sync_bool_compare_and_swap(slot, entry, newEntry));
+    }
+}
+
+static void __fv_pagemap_register(fv_allocation_t *alloc)
+{
+    if (&_vm_guard == alloc->guard) {
+        volatile uintptr_t *slot = __fv_pagemap_slot((uintptr_t)alloc->ptr);
+        fv_zone_assert(0 == *slot);
+        // make sure the header is visible before the entry
+        __sync_synchronize();
+        *slot = (uintptr_t)alloc;
+    }
+    else {
+        __fv_pagemap_count_headers((uintptr_t)alloc, (uintptr_t)alloc->ptr, true);
+    }
+}
+
+static void __fv_pagemap_unregister(fv_allocation_t *alloc)
+{
+    if (&_vm_guard == alloc->guard) {
+        volatile uintptr_t *slot = __fv_pagemap_slot((uintptr_t)alloc->ptr);
+        fv_zone_assert((uintptr_t)alloc == *slot);
+        *slot = 0;
+        __sync_synchronize();
+    }
+    else {
+        __fv_pagemap_count_headers((uintptr_t)alloc, (uintptr_t)alloc->ptr, false);
+    }
+}
+
+// fv_allocation_t struct always immediately precedes the data pointer
+// returns NULL if the pointer was not allocated in this zone, or in any fv_zone if zone is NULL; does not require the lock
+static inline fv_allocation_t *__fv_zone_get_allocation_from_pointer(const fv_zone_t *zone, const void *ptr)
+{
+    const uintptr_t addr = (uintptr_t)ptr;
+    if (addr < sizeof(fv_allocation_t) || false == __fv_pagemap_contains(addr))
+        return NULL;
+    
+    fv_allocation_t *alloc = FV_ALLOC_FROM_POINTER(ptr);
+    
+    // VM blocks are page-aligned and registered by the first page of ptr
+    if (0 == (addr & ((1UL << FV_PAGEMAP_PAGE_SHIFT) - 1))) {
+        const uintptr_t entry = __fv_pagemap_get(addr);
+        if (0 != entry && 0 == (entry & 1))
+            return ((fv_allocation_t *)entry == alloc && (NULL == zone || alloc->zone == zone)) ? alloc : NULL;
+    }
+    
     /*
-     This simple check to ensure that this is one of our pointers will fail if the math results in 
-     dereferenceing a pointer outside our address space, if we're passed a non-FVAllocator pointer 
-     in a certain memory region.  This happens when loading the plugin into IB, for instance.
-     
-     if (NULL != alloc && alloc->guard != &_vm_guard && alloc->guard != &_malloc_guard)
-     alloc = NULL;
+     Any other pointer may be from some other zone.  Only read the header if its pages are known to have small 
+     block headers, since dereferencing an arbitrary pointer could fault (this happened when loading the plugin 
+     into IB, for instance).
      */
-    return alloc;
+    if ((__fv_pagemap_get((uintptr_t)alloc) & 1) && (__fv_pagemap_get(addr - 1) & 1)) {
+        if (alloc->guard == &_malloc_guard && alloc->ptr == ptr && (NULL == zone || alloc->zone == zone))
+            return alloc;
+    }
+    return NULL;
 }
 
-// fv_allocation_t struct always immediately precedes the data pointer
-// returns NULL if the pointer was not allocated in this zone
-static inline fv_allocation_t *__fv_zone_get_allocation_from_pointer(fv_zone_t *zone, const void *ptr)
+static inline unsigned __fv_zone_log2(size_t x) { return (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(x); }
+
+// smallest size class that can hold size bytes
+static inline unsigned __fv_zone_size_class(const size_t size)
 {
-    LOCK(zone);
-    fv_allocation_t *alloc = __fv_zone_get_allocation_from_pointer_locked(zone, ptr);
-    UNLOCK(zone);
-    return alloc;
+    if (size <= (1UL << FV_SIZE_CLASS_MIN_SHIFT))
+        return 0;
+    const unsigned shift = __fv_zone_log2(size - 1);
+    if (shift >= FV_SIZE_CLASS_MAX_SHIFT)
+        return FV_SIZE_CLASS_OVERFLOW;
+    const size_t step = ((size - 1 - (1UL << shift)) >> (shift - FV_SIZE_CLASS_STEP_SHIFT)) + 1;
+    return ((shift - FV_SIZE_CLASS_MIN_SHIFT) << FV_SIZE_CLASS_STEP_SHIFT) + step;
 }
 
-static inline bool __fv_zone_use_vm(size_t size) { return size >= FV_VM_THRESHOLD; }
+// largest size class that size bytes can satisfy
+static inline unsigned __fv_zone_size_class_floor(const size_t size)
+{
+    fv_zone_assert(size >= (1UL << FV_SIZE_CLASS_MIN_SHIFT));
+    const unsigned shift = __fv_zone_log2(size);
+    if (shift >= FV_SIZE_CLASS_MAX_SHIFT)
+        return FV_SIZE_CLASS_OVERFLOW;
+    const size_t step = (size - (1UL << shift)) >> (shift - FV_SIZE_CLASS_STEP_SHIFT);
+    return ((shift - FV_SIZE_CLASS_MIN_SHIFT) << FV_SIZE_CLASS_STEP_SHIFT) + step;
+}
 
+static inline size_t __fv_zone_class_size(const unsigned sizeClass)
+{
+    const size_t base = 1UL << ((sizeClass >> FV_SIZE_CLASS_STEP_SHIFT) + FV_SIZE_CLASS_MIN_SHIFT);
+    return base + (base >> FV_SIZE_CLASS_STEP_SHIFT) * (sizeClass & ((1U << FV_SIZE_CLASS_STEP_SHIFT) - 1));
+}
 
 // Deallocates a particular block, according to its underlying storage (vm or szone).
 static inline void __fv_zone_destroy_allocation(fv_allocation_t *alloc)
@@ -249,17 +642,14 @@ static inline void __fv_zone_destroy_allocation(fv_allocation_t *alloc)
         HALT;
     }
     
-    // _vm_guard indicates it should be freed with vm_deallocate
+    // no longer valid for lookups
+    __fv_pagemap_unregister(alloc);
+    
+    // _vm_guard indicates it should be freed with vm_deallocate or munmap
     if (__builtin_expect(&_vm_guard == alloc->guard, 1)) {
         fv_zone_assert(__fv_zone_use_vm(alloc->allocSize));
-#if FV_USE_MMAP
-        int ret = munmap(alloc->base, alloc->allocSize);
-#else
-        mach_vm_size_t len = alloc->allocSize;
-        kern_return_t ret = mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)alloc->base, len);
-#endif
-        if (__builtin_expect(0 != ret, 0)) {
-            malloc_printf("mach_vm_deallocate failed to deallocate object %p", alloc);        
+        if (__builtin_expect(false == __fv_zone_vm_deallocate(alloc->base, alloc->allocSize), 0)) {
+            malloc_printf("%s: failed to deallocate object %p\n", __func__, alloc);
             malloc_printf("Break on malloc_printf to debug.\n");
         }
     }
@@ -268,36 +658,23 @@ static inline void __fv_zone_destroy_allocation(fv_allocation_t *alloc)
     }
 }
 
-// does not include fv_allocation_t header size
-static inline size_t __fv_zone_round_size(const size_t requestedSize, bool *useVM)
+// does not include fv_allocation_t header size; sizeClass may be NULL
+static inline size_t __fv_zone_round_size(const size_t requestedSize, bool *useVM, unsigned *sizeClass)
 {
     fv_zone_assert(NULL != useVM);
     // allocate at least requestedSize
     size_t actualSize = requestedSize;
     *useVM = __fv_zone_use_vm(actualSize);
-    if (*useVM) {
-        
-        if (actualSize < 102400) 
-            actualSize = mach_vm_round_page(actualSize);
-        else if (actualSize < 143360)
-            actualSize = mach_vm_round_page(143360);
-        else if (actualSize < 204800)
-            actualSize = mach_vm_round_page(204800);
-        else if (actualSize < 262144)
-            actualSize = mach_vm_round_page(262144);
-        else if (actualSize < 307200)
-            actualSize = mach_vm_round_page(307200);
-        else if (actualSize < 512000)
-            actualSize = mach_vm_round_page(512000);
-        else if (actualSize < 614400)
-            actualSize = mach_vm_round_page(614400);
-        else 
-            actualSize = mach_vm_round_page(actualSize);
-        
-    }
-    else if (actualSize < 128) {
-        actualSize = 128;
-    }
+    
+    // round up to the class size, so a recycled block of this class is always large enough
+    const unsigned requestedClass = __fv_zone_size_class(actualSize);
+    if (FV_SIZE_CLASS_OVERFLOW != requestedClass)
+        actualSize = __fv_zone_class_size(requestedClass);
+    if (sizeClass) *sizeClass = requestedClass;
+    
+    if (*useVM)
+        actualSize = FV_ROUND_PAGE(actualSize);
+
     if (__builtin_expect(requestedSize > actualSize, 0)) {
         malloc_printf("%s: invalid size %y after rounding %y to page boundary\n", __func__, actualSize, requestedSize);
         malloc_printf("Break on malloc_printf to debug.\n");
@@ -312,11 +689,14 @@ static inline void __fv_zone_record_allocation(fv_allocation_t *alloc, fv_zone_t
     LOCK(zone);
     fv_zone_assert(binary_search(zone->_allocations->begin(), zone->_allocations->end(), alloc) == false);
     zone->_allocatedSize += alloc->allocSize;
+    if (zone->_allocatedSize > zone->_peakAllocatedSize)
+        zone->_peakAllocatedSize = zone->_allocatedSize;
     vector <fv_allocation_t *>::iterator it = upper_bound(zone->_allocations->begin(), zone->_allocations->end(), alloc);
     zone->_allocations->insert(it, alloc);
     zone->_allocPtr = &zone->_allocations->front();
     zone->_allocPtrCount = zone->_allocations->size();
     UNLOCK(zone);
+    __fv_pagemap_register(alloc);
 }
 
 /*
@@ -330,39 +710,43 @@ static inline void __fv_zone_record_allocation(fv_allocation_t *alloc, fv_zone_t
  |                                   |<- ptr (writeable)
  */
 
-static fv_allocation_t *__fv_zone_vm_allocation(const size_t requestedSize, fv_zone_t *zone)
+static fv_allocation_t *__fv_zone_vm_allocation(const size_t requestedSize, const unsigned sizeClass, fv_zone_t *zone)
 {
-    // base address of the allocation, including fv_allocation_t
-    mach_vm_address_t memory;
     fv_allocation_t *alloc = NULL;
     
-    // use this space for the header
-    size_t actualSize = requestedSize + PAGE_SIZE;
-    fv_zone_assert(mach_vm_round_page(actualSize) == actualSize);
+    // base address of the allocation, including fv_allocation_t
+    void *memory, *ptr = NULL;
+    size_t actualSize;
     
-    // allocations going through this allocator will always be larger than 4K
-#if FV_USE_MMAP
-    memory = (mach_vm_address_t)mmap(0, actualSize, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, VM_MAKE_TAG(FV_VM_MEMORY_MALLOC), 0);
-    if ((void *)memory == MAP_FAILED) memory = 0;
-#else    
-    kern_return_t ret;
-    ret = mach_vm_allocate(mach_task_self(), &memory, actualSize, VM_FLAGS_ANYWHERE | VM_MAKE_TAG(FV_VM_MEMORY_MALLOC));
-    if (KERN_SUCCESS != ret) memory = 0;    
-#endif
+    if (zone->_hugePageThreshold && requestedSize >= zone->_hugePageThreshold) {
+        // data is a whole number of huge pages; the header is in the normal page just before it
+        const size_t hugeSize = (requestedSize + _hugePageSize - 1) & ~(_hugePageSize - 1);
+        actualSize = hugeSize + PAGE_SIZE;
+        ptr = __fv_zone_vm_allocate_huge(hugeSize, &memory);
+    }
+    else {
+        // use this space for the header
+        actualSize = requestedSize + PAGE_SIZE;
+        fv_zone_assert(FV_ROUND_PAGE(actualSize) == actualSize);
+        
+        // allocations going through this allocator will always be larger than 4K
+        memory = __fv_zone_vm_allocate(actualSize);
+        // align ptr to a page boundary
+        if (memory) ptr = (void *)FV_ROUND_PAGE((uintptr_t)memory + sizeof(fv_allocation_t));
+    }
     
     // set up the data structure
-    if (__builtin_expect(0 != memory, 1)) {
-        // align ptr to a page boundary
-        void *ptr = (void *)mach_vm_round_page((uintptr_t)(memory + sizeof(fv_allocation_t)));
+    if (__builtin_expect(NULL != ptr, 1)) {
         // alloc struct immediately precedes ptr so we can find it again
         alloc = (fv_allocation_t *)((uintptr_t)ptr - sizeof(fv_allocation_t));
         alloc->ptr = ptr;
         // ptrSize field is the size of ptr, not including the header or padding; used for array sorting
         alloc->ptrSize = (uintptr_t)memory + actualSize - (uintptr_t)alloc->ptr;
         // record the base address and size for deallocation purposes
-        alloc->base = (void *)memory;
+        alloc->base = memory;
         alloc->allocSize = actualSize;
         alloc->zone = zone;
+        alloc->sizeClass = sizeClass;
         alloc->free = true;
         alloc->guard = &_vm_guard;
         fv_zone_assert(alloc->ptrSize >= requestedSize);
@@ -372,7 +756,7 @@ static fv_allocation_t *__fv_zone_vm_allocation(const size_t requestedSize, fv_z
 }
 
 // memory is not page-aligned so there's no padding between the start of the allocated block and the returned fv_allocation_t pointer
-static fv_allocation_t *__fv_zone_malloc_allocation(const size_t requestedSize, fv_zone_t *zone)
+static fv_allocation_t *__fv_zone_malloc_allocation(const size_t requestedSize, const unsigned sizeClass, fv_zone_t *zone)
 {
     // base address of the allocation, including fv_allocation_t
     void *memory;
@@ -395,6 +779,7 @@ static fv_allocation_t *__fv_zone_malloc_allocation(const size_t requestedSize,
         alloc->base = memory;
         alloc->allocSize = actualSize;
         alloc->zone = zone;
+        alloc->sizeClass = sizeClass;
         alloc->free = true;
         alloc->guard = &_malloc_guard;
         fv_zone_assert(alloc->ptrSize >= requestedSize);
@@ -403,6 +788,285 @@ static fv_allocation_t *__fv_zone_malloc_allocation(const size_t requestedSize,
     return alloc;
 }
 
+#pragma mark Thread caches
+
+#if FV_ZONE_MACH
+static void __fv_zone_collect_all(void *scheduled);
+#endif
+
+// signal for collection if needed (lock not required, no effect if not blocking on the condition)
+static inline void __fv_zone_signal_collector_if_needed(fv_zone_t *zone)
+{
+    if (zone->_freeSize > FV_COLLECT_THRESHOLD) {
+#if FV_ZONE_MACH
+        if (NULL != dispatch_async_f) {
+            dispatch_queue_t dq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0);
+            dispatch_async_f(dq, NULL, __fv_zone_collect_all);
+            return;
+        }
+#endif
+        pthread_cond_signal(&_collectorCond);
+    }
+}
+
+#define FV_FREE_LIST_BIT(sizeClass) (1ULL << ((sizeClass) & 63))
+
+/*
+ Blocks in the free lists are also on a list ordered by the time they were freed, so the collector can release
+ the oldest ones first.  Both lists are doubly linked, so a block can be removed from the middle of either.
+ */
+
+// block must already be marked free and counted in _freeSize
+static inline void __fv_zone_insert_free_allocation_locked(fv_zone_t *zone, fv_allocation_t *alloc)
+{
+    fv_zone_assert(alloc->free);
+    const unsigned sizeClass = alloc->sizeClass;
+    
+    // most recently freed first, since its pages are more likely to be resident
+    alloc->prev = NULL;
+    alloc->next = zone->_freeLists[sizeClass];
+    if (alloc->next) alloc->next->prev = alloc;
+    zone->_freeLists[sizeClass] = alloc;
+    zone->_freeListMap[sizeClass >> 6] |= FV_FREE_LIST_BIT(sizeClass);
+    
+    // timestamps are monotonic, so appending keeps the age list sorted
+    alloc->freeTime = __fv_zone_timestamp();
+    alloc->newer = NULL;
+    alloc->older = zone->_newestFree;
+    if (alloc->older)
+        alloc->older->newer = alloc;
+    else
+        zone->_oldestFree = alloc;
+    zone->_newestFree = alloc;
+    
+    // everything older has been soft released, or the list was empty
+    if (NULL == zone->_oldestResident)
+        zone->_oldestResident = alloc;
+}
+
+static inline fv_allocation_t *__fv_zone_unlink_free_allocation_locked(fv_zone_t *zone, fv_allocation_t *alloc)
+{
+    fv_zone_assert(NULL != alloc && alloc->free);
+    const unsigned sizeClass = alloc->sizeClass;
+    
+    if (alloc->prev)
+        alloc->prev->next = alloc->next;
+    else
+        zone->_freeLists[sizeClass] = alloc->next;
+    if (alloc->next) alloc->next->prev = alloc->prev;
+    if (NULL == zone->_freeLists[sizeClass])
+        zone->_freeListMap[sizeClass >> 6] &= ~FV_FREE_LIST_BIT(sizeClass);
+    
+    if (zone->_oldestResident == alloc)
+        zone->_oldestResident = alloc->newer;
+    if (alloc->older)
+        alloc->older->newer = alloc->newer;
+    else
+        zone->_oldestFree = alloc->newer;
+    if (alloc->newer)
+        alloc->newer->older = alloc->older;
+    else
+        zone->_newestFree = alloc->older;
+    
+    alloc->next = alloc->prev = alloc->newer = alloc->older = NULL;
+    return alloc;
+}
+
+/*
+ Blocks freed by a thread other than the one that allocated them, typically the main thread releasing a CGImage
+ drawn by a render thread, go on an intrusive multi-producer queue instead of taking the zone lock.  Pushing is a
+ single atomic exchange, so it's wait-free.  The queue is consumed by whichever thread next holds the lock for an
+ allocation, or by the collector, and the blocks go to the free lists in one batch.  This is Dmitry Vyukov's
+ MPSC queue; a producer that has swapped the tail but not yet linked the previous node briefly hides the nodes
+ behind it, and those are picked up by the next drain.
+ */
+static inline void __fv_zone_push_remote_free(fv_zone_t *zone, fv_remote_node_t *node)
+{
+    node->next = NULL;
+    fv_remote_node_t *prev = FV_ATOMIC_EXCHANGE(&zone->_remoteTail, node);
+    FV_ATOMIC_STORE(&prev->next, node);
+}
+
+static inline bool __fv_zone_has_remote_frees(fv_zone_t *zone)
+{
+    return zone->_remoteTail != &zone->_remoteStub;
+}
+
+// returns NULL if the queue is empty or the next node hasn't been linked yet
+static fv_allocation_t *__fv_zone_pop_remote_free_locked(fv_zone_t *zone)
+{
+    fv_remote_node_t *head = zone->_remoteHead;
+    fv_remote_node_t *next = FV_ATOMIC_LOAD(&head->next);
+    if (&zone->_remoteStub == head) {
+        if (NULL == next)
+            return NULL;
+        zone->_remoteHead = head = next;
+        next = FV_ATOMIC_LOAD(&head->next);
+    }
+    if (NULL == next) {
+        // head is the last node, and can only be taken if the stub goes behind it
+        if (head != FV_ATOMIC_LOAD(&zone->_remoteTail))
+            return NULL;
+        __fv_zone_push_remote_free(zone, &zone->_remoteStub);
+        next = FV_ATOMIC_LOAD(&head->next);
+        if (NULL == next)
+            return NULL;
+    }
+    zone->_remoteHead = next;
+    return (fv_allocation_t *)((uintptr_t)head - offsetof(fv_allocation_t, remote));
+}
+
+static void __fv_zone_drain_remote_frees_locked(fv_zone_t *zone)
+{
+    fv_allocation_t *alloc;
+    while (NULL != (alloc = __fv_zone_pop_remote_free_locked(zone))) {
+        fv_zone_assert(alloc->free);
+        __fv_zone_insert_free_allocation_locked(zone, alloc);
+    }
+}
+
+// first nonempty free list at or above sizeClass, or FV_SIZE_CLASS_COUNT if there is none
+static inline unsigned __fv_zone_next_free_class_locked(fv_zone_t *zone, const unsigned sizeClass)
+{
+    unsigned word = sizeClass >> 6;
+    uint64_t bits = zone->_freeListMap[word] & (~0ULL << (sizeClass & 63));
+    while (0 == bits) {
+        if (++word == FV_SIZE_CLASS_MAP_WORDS)
+            return FV_SIZE_CLASS_COUNT;
+        bits = zone->_freeListMap[word];
+    }
+    return (word << 6) + __builtin_ctzll(bits);
+}
+
+/*
+ Returns a free block of at least size bytes but no more than twice that, or NULL.  Any block in the
+ request's class or a larger one is big enough, so this is constant time except for the overflow class,
+ which is searched for the best fit.
+ */
+static fv_allocation_t *__fv_zone_remove_free_allocation_locked(fv_zone_t *zone, const size_t size, const unsigned sizeClass)
+{
+    if (FV_SIZE_CLASS_OVERFLOW != sizeClass) {
+        const unsigned freeClass = __fv_zone_next_free_class_locked(zone, sizeClass);
+        if (freeClass < FV_SIZE_CLASS_OVERFLOW && __fv_zone_class_size(freeClass) <= 2 * size)
+            return __fv_zone_unlink_free_allocation_locked(zone, zone->_freeLists[freeClass]);
+        return NULL;
+    }
+    
+    fv_allocation_t *best = NULL;
+    for (fv_allocation_t *alloc = zone->_freeLists[sizeClass]; NULL != alloc; alloc = alloc->next) {
+        const size_t ptrSize = alloc->ptrSize;
+        if (ptrSize >= size && ptrSize <= 2 * size && (NULL == best || ptrSize < best->ptrSize))
+            best = alloc;
+    }
+    return best ? __fv_zone_unlink_free_allocation_locked(zone, best) : NULL;
+}
+
+// returns NULL if the cache doesn't exist and can't be created
+static inline fv_thread_cache_t *__fv_zone_get_thread_cache(fv_zone_t *zone)
+{
+    fv_thread_cache_t *cache = (fv_thread_cache_t *)pthread_getspecific(zone->_magazineKey);
+    if (__builtin_expect(NULL == cache, 0)) {
+        cache = (fv_thread_cache_t *)malloc_zone_calloc(malloc_default_zone(), 1, sizeof(fv_thread_cache_t));
+        if (NULL != cache) {
+            cache->zone = zone;
+            if (0 != pthread_setspecific(zone->_magazineKey, cache)) {
+                malloc_zone_free(malloc_default_zone(), cache);
+                cache = NULL;
+            }
+            else {
+                // register so the counters can be read from other threads
+                LOCK(zone);
+                cache->nextCache = zone->_threadCaches;
+                if (cache->nextCache) cache->nextCache->prevCache = cache;
+                zone->_threadCaches = cache;
+                UNLOCK(zone);
+            }
+        }
+    }
+    return cache;
+}
+
+// move the oldest count blocks from a magazine to the zone's free list
+static void __fv_thread_cache_drain(fv_thread_cache_t *cache, fv_magazine_t *mag, unsigned count)
+{
+    fv_zone_t *zone = cache->zone;
+    if (count > mag->count) count = mag->count;
+    LOCK(zone);
+    for (unsigned i = 0; i < count; i++) {
+        cache->size -= mag->blocks[i]->allocSize;
+        __fv_zone_insert_free_allocation_locked(zone, mag->blocks[i]);
+    }
+    UNLOCK(zone);
+    mag->count -= count;
+    memmove(mag->blocks, mag->blocks + count, mag->count * sizeof(fv_allocation_t *));
+    __fv_zone_signal_collector_if_needed(zone);
+}
+
+// returns false if the block should go to the zone's free list instead
+static inline bool __fv_thread_cache_push(fv_thread_cache_t *cache, fv_allocation_t *alloc)
+{
+    fv_zone_assert(alloc->sizeClass < FV_MAGAZINE_CLASS_COUNT);
+    fv_magazine_t *mag = &cache->magazines[alloc->sizeClass];
+    if (FV_MAGAZINE_CAPACITY == mag->count || cache->size + alloc->allocSize > FV_MAGAZINE_MAX_BYTES) {
+        __fv_thread_cache_drain(cache, mag, FV_MAGAZINE_BATCH);
+        // other magazines may still be holding too much memory
+        if (cache->size + alloc->allocSize > FV_MAGAZINE_MAX_BYTES)
+            return false;
+    }
+    mag->blocks[mag->count++] = alloc;
+    cache->size += alloc->allocSize;
+    return true;
+}
+
+static inline fv_allocation_t *__fv_thread_cache_pop(fv_thread_cache_t *cache, const unsigned sizeClass)
+{
+    fv_magazine_t *mag = &cache->magazines[sizeClass];
+    fv_allocation_t *alloc = NULL;
+    // most recently freed block is most likely to be resident
+    if (mag->count) {
+        alloc = mag->blocks[--mag->count];
+        cache->size -= alloc->allocSize;
+    }
+    return alloc;
+}
+
+// pthread key destructor; returns all magazines to the zone when a thread exits
+static void __fv_counters_add(fv_counters_t *total, const fv_counters_t *counters)
+{
+    total->magazineHits += counters->magazineHits;
+    total->freeListHits += counters->freeListHits;
+    total->misses += counters->misses;
+    total->frees += counters->frees;
+    total->remoteFrees += counters->remoteFrees;
+    total->reallocs += counters->reallocs;
+    total->reallocsInPlace += counters->reallocsInPlace;
+    for (unsigned c = 0; c < FV_SIZE_CLASS_COUNT; c++)
+        total->mallocsByClass[c] += counters->mallocsByClass[c];
+}
+
+static void __fv_thread_cache_destroy(void *value)
+{
+    fv_thread_cache_t *cache = (fv_thread_cache_t *)value;
+    fv_zone_t *zone = cache->zone;
+    LOCK(zone);
+    
+    // keep this thread's counts
+    __fv_counters_add(&zone->_retiredCounters, &cache->counters);
+    if (cache->prevCache)
+        cache->prevCache->nextCache = cache->nextCache;
+    else
+        zone->_threadCaches = cache->nextCache;
+    if (cache->nextCache) cache->nextCache->prevCache = cache->prevCache;
+    
+    for (unsigned c = 0; c < FV_MAGAZINE_CLASS_COUNT; c++) {
+        fv_magazine_t *mag = &cache->magazines[c];
+        for (unsigned i = 0; i < mag->count; i++)
+            __fv_zone_insert_free_allocation_locked(zone, mag->blocks[i]);
+    }
+    UNLOCK(zone);
+    malloc_zone_free(malloc_default_zone(), cache);
+}
+
 #pragma mark Zone implementation
 
 static size_t fv_zone_size(malloc_zone_t *fvzone, const void *ptr)
@@ -419,46 +1083,77 @@ static void *fv_zone_malloc(malloc_zone_t *fvzone, size_t size)
     
     const size_t origSize = size;
     bool useVM;
+    unsigned sizeClass;
     // look for the possibly-rounded-up size, or the tolerance might cause us to create a new block
-    size = __fv_zone_round_size(size, &useVM);
-    
-    // !!! unlock on each if branch
-    LOCK(zone);
+    size = __fv_zone_round_size(size, &useVM, &sizeClass);
     
     void *ret = NULL;
+    fv_allocation_t *alloc = NULL;
+    fv_thread_cache_t *cache = NULL;
     
-    fv_allocation_t request = { NULL, 0, NULL, size, NULL, NULL };
-    multiset<fv_allocation_t *>::iterator next = zone->_availableAllocations->lower_bound(&request);
-    fv_allocation_t *alloc = *next;
+    // try this thread's magazine first, which doesn't require the lock
+    cache = __fv_zone_get_thread_cache(zone);
+    FV_COUNT(cache, mallocsByClass[sizeClass]);
+    if (cache && sizeClass < FV_MAGAZINE_CLASS_COUNT)
+        alloc = __fv_thread_cache_pop(cache, sizeClass);
     
-    if (zone->_availableAllocations->end() == next || ((float)(alloc->ptrSize - size) / size) > 1) {
-#if ENABLE_STATS
-        OSAtomicIncrement32Barrier((volatile int32_t *)&zone->_cacheMisses);
-#endif
-        // nothing found; unlock immediately and allocate a new chunk of memory
-        UNLOCK(zone);
-        alloc = useVM ? __fv_zone_vm_allocation(size, zone) : __fv_zone_malloc_allocation(size, zone);
+    if (NULL != alloc) {
+        FV_COUNT(cache, magazineHits);
+        fv_zone_assert(alloc->free);
+        FV_ATOMIC_SUB(&zone->_freeSize, alloc->allocSize);
     }
     else {
-#if ENABLE_STATS
-        OSAtomicIncrement32Barrier((volatile int32_t *)&zone->_cacheHits);
-#endif
-        // pass iterator to erase this element, rather than an arbitrary element of this size
-        zone->_availableAllocations->erase(next);
-        fv_zone_assert(zone->_freeSize >= alloc->allocSize);
-        zone->_freeSize -= alloc->allocSize;
-        UNLOCK(zone);
-        if (__builtin_expect(origSize > alloc->ptrSize, 0)) {
-            malloc_printf("incorrect size %y (%y expected) in %s\n", alloc->ptrSize, origSize, malloc_get_zone_name(&zone->_basic_zone));
-            malloc_printf("Break on malloc_printf to debug.\n");
-            HALT;
+        
+        // !!! unlock on each if branch
+        LOCK(zone);
+        
+        // blocks freed by other threads may satisfy this request
+        if (__fv_zone_has_remote_frees(zone))
+            __fv_zone_drain_remote_frees_locked(zone);
+        alloc = __fv_zone_remove_free_allocation_locked(zone, size, sizeClass);
+        
+        if (NULL == alloc) {
+            FV_COUNT(cache, misses);
+            // nothing found; unlock immediately and allocate a new chunk of memory
+            UNLOCK(zone);
+            alloc = useVM ? __fv_zone_vm_allocation(size, sizeClass, zone) : __fv_zone_malloc_allocation(size, sizeClass, zone);
+        }
+        else {
+            FV_COUNT(cache, freeListHits);
+            fv_zone_assert(zone->_freeSize >= alloc->allocSize);
+            FV_ATOMIC_SUB(&zone->_freeSize, alloc->allocSize);
+            
+            // refill the magazine with a batch of blocks from the same class, so the next requests don't need the lock
+            if (cache && sizeClass < FV_MAGAZINE_CLASS_COUNT) {
+                // the magazine was empty, so this can't overflow it
+                fv_magazine_t *mag = &cache->magazines[sizeClass];
+                fv_allocation_t *head;
+                while (mag->count < FV_MAGAZINE_BATCH && NULL != (head = zone->_freeLists[sizeClass]) && cache->size + head->allocSize <= FV_MAGAZINE_MAX_BYTES) {
+                    fv_allocation_t *refill = __fv_zone_unlink_free_allocation_locked(zone, head);
+                    mag->blocks[mag->count++] = refill;
+                    cache->size += refill->allocSize;
+                }
+            }
+            UNLOCK(zone);
+            
+            if (__builtin_expect(origSize > alloc->ptrSize, 0)) {
+                malloc_printf("incorrect size %y (%y expected) in %s\n", alloc->ptrSize, origSize, malloc_get_zone_name(&zone->_basic_zone));
+                malloc_printf("Break on malloc_printf to debug.\n");
+                HALT;
+            }
         }
     }
     if (__builtin_expect(NULL != alloc, 1)) {
 #if ENABLE_STATS
         alloc->timesUsed++;
 #endif
+        if (alloc->softReleased) {
+            __fv_zone_vm_reuse(alloc->ptr, alloc->ptrSize);
+            alloc->softReleased = false;
+            FV_ATOMIC_SUB(&zone->_releasedSize, alloc->ptrSize);
+        }
         alloc->free = false;
+        alloc->owner = cache;
         ret = alloc->ptr;
         if (_scribble) memset(ret, 0xaa, alloc->ptrSize);
     }
@@ -481,41 +1176,39 @@ static void *fv_zone_valloc(malloc_zone_t *zone, size_t size)
     void *memory = fv_zone_malloc(zone, size);
     memset(memory, 0, size);
     // this should have no effect if we used vm to allocate
-    void *ret = (void *)mach_vm_round_page((uintptr_t)memory);
+    void *ret = (void *)FV_ROUND_PAGE((uintptr_t)memory);
     if (useVM) { fv_zone_assert(memory == ret); }
     return ret;
 }
 
-static void __fv_zone_collect_all(void *scheduled);
-
-static void __fv_zone_free_allocation_locked(fv_zone_t *zone, fv_allocation_t *alloc)
+static void __fv_zone_free_allocation(fv_zone_t *zone, fv_allocation_t *alloc)
 {
-    if (_scribble) memset(alloc->ptr, 0x55, alloc->ptrSize);
-    // check to ensure that it's not already in the free list
-    pair <multiset<fv_allocation_t *>::iterator, multiset<fv_allocation_t *>::iterator> range;
-    range = zone->_availableAllocations->equal_range(alloc);
-    multiset <fv_allocation_t *>::iterator it;
-    for (it = range.first; it != range.second; it++) {
-        if (*it == alloc) {
-            malloc_printf("%s: double free of pointer %p in zone %s\n", __func__, alloc->ptr, malloc_get_zone_name(&zone->_basic_zone));
-            malloc_printf("Break on malloc_printf to debug.\n");
-            HALT;
-        }
+    // check to ensure that it's not already in the free list or a magazine
+    if (__builtin_expect(alloc->free, 0)) {
+        malloc_printf("%s: double free of pointer %p in zone %s\n", __func__, alloc->ptr, malloc_get_zone_name(&zone->_basic_zone));
+        malloc_printf("Break on malloc_printf to debug.\n");
+        HALT;
     }
-    // add to free list
-    zone->_availableAllocations->insert(alloc);
+    if (_scribble) memset(alloc->ptr, 0x55, alloc->ptrSize);
     alloc->free = true;
-    zone->_freeSize += alloc->allocSize;
+    FV_ATOMIC_ADD(&zone->_freeSize, alloc->allocSize);
     
-    // signal for collection if needed (lock not required, no effect if not blocking on the condition)
-    if (zone->_freeSize > FV_COLLECT_THRESHOLD) {
-        if (NULL == dispatch_async_f) {
-            pthread_cond_signal(&_collectorCond);
-        }
-        else {
-            dispatch_queue_t dq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0);
-            dispatch_async_f(dq, NULL, __fv_zone_collect_all);
-        }
+    // keep it in this thread's magazine if possible, so it can be recycled without locking
+    fv_thread_cache_t *cache = __fv_zone_get_thread_cache(zone);
+    FV_COUNT(cache, frees);
+    
+    // another thread's block; this thread probably won't allocate one like it, so don't keep it or take the lock
+    if (__builtin_expect(alloc->owner != cache && NULL != cache, 0)) {
+        FV_COUNT(cache, remoteFrees);
+        __fv_zone_push_remote_free(zone, &alloc->remote);
+        __fv_zone_signal_collector_if_needed(zone);
+    }
+    else if (NULL == cache || alloc->sizeClass >= FV_MAGAZINE_CLASS_COUNT || false == __fv_thread_cache_push(cache, alloc)) {
+        // add to free list
+        LOCK(zone);
+        __fv_zone_insert_free_allocation_locked(zone, alloc);
+        UNLOCK(zone);
+        __fv_zone_signal_collector_if_needed(zone);
     }
 }
 
@@ -525,8 +1218,12 @@ static void fv_zone_free(malloc_zone_t *fvzone, void *ptr)
     
     // ignore NULL
     if (__builtin_expect(NULL != ptr, 1)) {    
-        LOCK(zone);
-        fv_allocation_t *alloc = __fv_zone_get_allocation_from_pointer_locked(zone, ptr);
+        fv_allocation_t *alloc = __fv_zone_get_allocation_from_pointer(zone, ptr);
+        
+        // block from another fv_zone, as when zones are kept per node; it goes back where it came from
+        if (__builtin_expect(NULL == alloc, 0) && NULL != (alloc = __fv_zone_get_allocation_from_pointer(NULL, ptr)))
+            zone = const_cast<fv_zone_t *>(alloc->zone);
+        
         // error on an invalid pointer
         if (__builtin_expect(NULL == alloc, 0)) {
             malloc_printf("%s: pointer %p not malloced in zone %s\n", __func__, ptr, malloc_get_zone_name(&zone->_basic_zone));
@@ -534,29 +1231,21 @@ static void fv_zone_free(malloc_zone_t *fvzone, void *ptr)
             HALT;
             return; /* not reached; keep clang happy */
         }
-        __fv_zone_free_allocation_locked(zone, alloc);
-        UNLOCK(zone);
+        __fv_zone_free_allocation(zone, alloc);
     }
 }
 
 #if defined(MAC_OS_X_VERSION_10_6) && MAC_OS_X_VERSION_MIN_REQUIRED >= MAC_OS_X_VERSION_10_6
 static void fv_zone_free_definite(malloc_zone_t *fvzone, void *ptr, size_t size)
 {
-    fv_zone_t *zone = reinterpret_cast<fv_zone_t *>(fvzone);
     fv_allocation_t *alloc = FV_ALLOC_FROM_POINTER(ptr);
-    LOCK(zone);
-    __fv_zone_free_allocation_locked(zone, alloc);
-    UNLOCK(zone);      
+    __fv_zone_free_allocation(const_cast<fv_zone_t *>(alloc->zone), alloc);
 }
 #endif
 
 static void *fv_zone_realloc(malloc_zone_t *fvzone, void *ptr, size_t size)
 {
     fv_zone_t *zone = reinterpret_cast<fv_zone_t *>(fvzone);
-
-#if ENABLE_STATS
-    OSAtomicIncrement32Barrier((volatile int32_t *)&zone->_reallocCount);
-#endif
     
     // !!! two early returns here
     
@@ -573,6 +1262,11 @@ static void *fv_zone_realloc(malloc_zone_t *fvzone, void *ptr, size_t size)
     void *newPtr;
 
     fv_allocation_t *alloc = __fv_zone_get_allocation_from_pointer(zone, ptr);
+    
+    // block from another fv_zone; resize it there, as for free
+    if (__builtin_expect(NULL == alloc, 0) && NULL != (alloc = __fv_zone_get_allocation_from_pointer(NULL, ptr)))
+        zone = const_cast<fv_zone_t *>(alloc->zone);
+    
     // error on an invalid pointer
     if (__builtin_expect(NULL == alloc, 0)) {
         malloc_printf("%s: pointer %p not malloced in zone %s\n", __func__, ptr, malloc_get_zone_name(&zone->_basic_zone));
@@ -581,32 +1275,85 @@ static void *fv_zone_realloc(malloc_zone_t *fvzone, void *ptr, size_t size)
         return NULL; /* not reached; keep clang happy */
     }
     
-    kern_return_t ret = KERN_FAILURE;
+    fv_thread_cache_t *cache = __fv_zone_get_thread_cache(zone);
+    FV_COUNT(cache, reallocs);
+    bool resized = false;
     
     // See if it's already large enough, due to padding, or the caller requesting a smaller block (so we never resize downwards).
     if (alloc->ptrSize >= size) {
         newPtr = ptr;
-        ret = KERN_SUCCESS;
+        resized = true;
     }
     else if (alloc->guard == &_vm_guard) {
-        // pointer to the current end of this region
-        mach_vm_address_t addr = (mach_vm_address_t)alloc->base + alloc->allocSize;
-        // attempt to allocate at a specific address and extend the existing region
-        ret = mach_vm_allocate(mach_task_self(), &addr, mach_vm_round_page(size) - alloc->allocSize, VM_FLAGS_FIXED | VM_MAKE_TAG(FV_VM_MEMORY_REALLOC));
-        // if this succeeds, increase sizes and assign newPtr to the original parameter
-        if (KERN_SUCCESS == ret) {
-            alloc->allocSize += mach_vm_round_page(size);
-            alloc->ptrSize += mach_vm_round_page(size);
+        // header and padding stay the same; the block grows to the class size, so repeated small extensions don't each need a system call
+        bool useVM;
+        const size_t oldAllocSize = alloc->allocSize;
+        const size_t newAllocSize = (oldAllocSize - alloc->ptrSize) + __fv_zone_round_size(size, &useVM, NULL);
+        
+        // first try to extend the existing region in place
+        if (NULL != __fv_zone_vm_grow(alloc->base, oldAllocSize, newAllocSize, false)) {
+            alloc->allocSize = newAllocSize;
+            alloc->ptrSize += newAllocSize - oldAllocSize;
+            // can now be recycled for larger requests
+            if (alloc->sizeClass != FV_SIZE_CLASS_OVERFLOW)
+                alloc->sizeClass = __fv_zone_size_class_floor(alloc->ptrSize);
             // adjust allocation size in the zone
             LOCK(zone);
-            zone->_allocatedSize += mach_vm_round_page(size);
+            zone->_allocatedSize += newAllocSize - oldAllocSize;
+            if (zone->_allocatedSize > zone->_peakAllocatedSize)
+                zone->_peakAllocatedSize = zone->_allocatedSize;
             UNLOCK(zone);
             newPtr = ptr;
+            resized = true;
+        }
+#if !FV_ZONE_MACH
+        else {
+            /*
+             Let the kernel move the pages instead of copying them.  The header moves along with the data, so
+             the allocation record has to be replaced while holding the lock, or the collector and statistics
+             functions could dereference the old address.
+             */
+            LOCK(zone);
+            void *oldBase = alloc->base;
+            // the old pages may be unmapped, so they can't be left in the page map
+            __fv_pagemap_unregister(alloc);
+            void *newBase = __fv_zone_vm_grow(oldBase, oldAllocSize, newAllocSize, true);
+            if (NULL == newBase) {
+                __fv_pagemap_register(alloc);
+            }
+            else {
+                vector<fv_allocation_t *>::iterator toerase = lower_bound(zone->_allocations->begin(), zone->_allocations->end(), alloc);
+                fv_zone_assert(*toerase == alloc);
+                zone->_allocations->erase(toerase);
+                
+                alloc = (fv_allocation_t *)((uintptr_t)alloc - (uintptr_t)oldBase + (uintptr_t)newBase);
+                alloc->base = newBase;
+                alloc->ptr = (void *)((uintptr_t)alloc + sizeof(fv_allocation_t));
+                alloc->allocSize = newAllocSize;
+                alloc->ptrSize += newAllocSize - oldAllocSize;
+                if (alloc->sizeClass != FV_SIZE_CLASS_OVERFLOW)
+                    alloc->sizeClass = __fv_zone_size_class_floor(alloc->ptrSize);
+                
+                zone->_allocations->insert(upper_bound(zone->_allocations->begin(), zone->_allocations->end(), alloc), alloc);
+                zone->_allocPtr = &zone->_allocations->front();
+                zone->_allocPtrCount = zone->_allocations->size();
+                zone->_allocatedSize += newAllocSize - oldAllocSize;
+                if (zone->_allocatedSize > zone->_peakAllocatedSize)
+                    zone->_peakAllocatedSize = zone->_allocatedSize;
+                __fv_pagemap_register(alloc);
+                newPtr = alloc->ptr;
+                resized = true;
+            }
+            UNLOCK(zone);
         }
+#endif
     }
     
+    if (resized) {
+        FV_COUNT(cache, reallocsInPlace);
+    }
     // if this wasn't a vm region or the vm region couldn't be extended, allocate a new block
-    if (KERN_SUCCESS != ret) {
+    else {
         // get a new buffer, copy contents, return original ptr to the pool; should try to use vm_copy here
         newPtr = fv_zone_malloc(fvzone, size);
         memcpy(newPtr, ptr, alloc->ptrSize);
@@ -632,11 +1379,21 @@ static void fv_zone_destroy(malloc_zone_t *fvzone)
     __fv_list_deallocate_item(item);
     pthread_mutex_unlock(&_zone_list_lock);
     
+    // deleting the key doesn't call destructors, so free all the thread caches here; their blocks are destroyed below
+    (void) pthread_key_delete(zone->_magazineKey);
+    
     // remove all the free buffers
     LOCK(zone);
-    zone->_availableAllocations->clear();
-    delete zone->_availableAllocations;
-    zone->_availableAllocations = NULL;
+    while (zone->_threadCaches) {
+        fv_thread_cache_t *cache = zone->_threadCaches;
+        zone->_threadCaches = cache->nextCache;
+        malloc_zone_free(malloc_default_zone(), cache);
+    }
+    memset(zone->_freeLists, 0, sizeof(zone->_freeLists));
+    memset(zone->_freeListMap, 0, sizeof(zone->_freeListMap));
+    zone->_oldestFree = zone->_newestFree = zone->_oldestResident = NULL;
+    zone->_remoteStub.next = NULL;
+    zone->_remoteHead = zone->_remoteTail = &zone->_remoteStub;
 
     // now deallocate all buffers allocated using this zone, regardless of underlying call
     for_each(zone->_allocations->begin(), zone->_allocations->end(), __fv_zone_destroy_allocation);
@@ -648,8 +1405,8 @@ static void fv_zone_destroy(malloc_zone_t *fvzone)
     zone->_allocPtrCount = 0;
     UNLOCK(zone);
     
-    // free the zone itself (must have been allocated with malloc!)
-    malloc_zone_free(malloc_zone_from_ptr(zone), zone);
+    // free the zone itself (allocated from malloc_default_zone() in fv_create_zone_named)
+    malloc_zone_free(malloc_default_zone(), zone);
 }
 
 static void fv_zone_print(malloc_zone_t *zone, boolean_t verbose) {
@@ -669,66 +1426,68 @@ static size_t fv_zone_good_size(malloc_zone_t *zone, size_t size)
 {
     malloc_printf("%s\n", __func__);
     bool ignored;
-    return __fv_zone_round_size(size, &ignored);
+    return __fv_zone_round_size(size, &ignored, NULL);
 }
 
-/*
- 
- Standard malloc_zone statistics functions use fv_zone.ptrSize to determine usage.
- This size determination is not compatible with collection or __fv_zone_show_stats,
- where I'm more interested in total allocation size.  Both are correct, but which
- one is appropriate depends on whether you're more concerned about client code heap
- usage or overhead of the fv_zone.
- 
- */
-
-static inline void __fv_zone_sum_allocations(fv_allocation_t *alloc, size_t *size)
+static void __fv_zone_copy_statistics(fv_zone_t *zone, fv_zone_statistics_t *stats)
 {
-    *size += alloc->ptrSize;
-}
-
-static size_t __fv_zone_total_size(fv_zone_t *zone)
-{
-    malloc_printf("%s\n", __func__);
-    size_t sizeTotal = 0;
-    LOCK(zone);
-    vector<fv_allocation_t *>::iterator it;
-    for (it = zone->_allocations->begin(); it != zone->_allocations->end(); it++) {
-        __fv_zone_sum_allocations(*it, &sizeTotal);
-    }
-    UNLOCK(zone);
-    return sizeTotal;
-}
-
-static size_t __fv_zone_get_size_in_use(fv_zone_t *zone)
-{
-    malloc_printf("%s\n", __func__);
-    size_t sizeTotal = 0, sizeFree = 0;
+    memset(stats, 0, sizeof(fv_zone_statistics_t));
     LOCK(zone);
+    fv_counters_t counters = zone->_retiredCounters;
+    
+    // other threads may be updating their counters, but a slightly stale value is fine
+    for (fv_thread_cache_t *cache = zone->_threadCaches; NULL != cache; cache = cache->nextCache)
+        __fv_counters_add(&counters, &cache->counters);
+    
+    // free blocks may be in the free list or in a thread's magazine
     vector<fv_allocation_t *>::iterator it;
     for (it = zone->_allocations->begin(); it != zone->_allocations->end(); it++) {
-        __fv_zone_sum_allocations(*it, &sizeTotal);
-    }
-    multiset<fv_allocation_t *>::iterator freeiter;
-    for (freeiter = zone->_availableAllocations->begin(); freeiter != zone->_availableAllocations->end(); freeiter++) {
-        __fv_zone_sum_allocations(*freeiter, &sizeFree);
+        if ((*it)->free) {
+            stats->freeBlockCount++;
+            stats->freeBlocksByClass[(*it)->sizeClass]++;
+        }
     }
+    stats->blockCount = zone->_allocations->size();
+    stats->allocatedSize = zone->_allocatedSize;
+    stats->peakAllocatedSize = zone->_peakAllocatedSize;
+    stats->freeSize = zone->_freeSize;
+    stats->softReleasedSize = zone->_releasedSize;
     UNLOCK(zone);
-    if (sizeTotal < sizeFree) {
-        malloc_printf("inconsistent allocation record; free list exceeds allocation count\n");
-        HALT;
+    
+    stats->magazineHits = counters.magazineHits;
+    stats->freeListHits = counters.freeListHits;
+    stats->cacheMisses = counters.misses;
+    stats->freeCount = counters.frees;
+    stats->remoteFreeCount = counters.remoteFrees;
+    stats->reallocCount = counters.reallocs;
+    stats->reallocInPlaceCount = counters.reallocsInPlace;
+    for (unsigned c = 0; c < FV_SIZE_CLASS_COUNT; c++) {
+        stats->mallocsByClass[c] = counters.mallocsByClass[c];
+        stats->mallocCount += counters.mallocsByClass[c];
     }
-    return (sizeTotal - sizeFree);
+    stats->collectionCount = zone->_collections;
+    stats->blocksReleased = zone->_blocksReleased;
+    stats->bytesReleased = zone->_bytesReleased;
+    stats->bytesSoftReleased = zone->_bytesSoftReleased;
 }
 
+/*
+ 
+ Standard malloc_zone statistics use the same data as fv_zone_copy_statistics, so sizes include
+ headers and padding.  That reflects the overhead of the zone rather than client code heap usage,
+ but it's what the collector works with.
+ 
+ */
 static void fv_zone_statistics(malloc_zone_t *fvzone, malloc_statistics_t *stats)
 {
-    fv_zone_t *zone = reinterpret_cast<fv_zone_t *>(fvzone);
-    malloc_printf("%s\n", __func__);
-    stats->blocks_in_use = zone->_allocations->size() - zone->_availableAllocations->size();
-    stats->size_in_use = __fv_zone_get_size_in_use(zone);
-    stats->max_size_in_use = __fv_zone_total_size(zone);
-    stats->size_allocated = stats->max_size_in_use;
+    fv_zone_statistics_t zoneStats;
+    __fv_zone_copy_statistics(reinterpret_cast<fv_zone_t *>(fvzone), &zoneStats);
+    fv_zone_assert(zoneStats.blockCount >= zoneStats.freeBlockCount);
+    fv_zone_assert(zoneStats.allocatedSize >= zoneStats.freeSize);
+    stats->blocks_in_use = (unsigned)(zoneStats.blockCount - zoneStats.freeBlockCount);
+    stats->size_in_use = zoneStats.allocatedSize - zoneStats.freeSize;
+    stats->max_size_in_use = zoneStats.peakAllocatedSize;
+    stats->size_allocated = zoneStats.allocatedSize;
 }
 
 // called when preparing for a fork() (see _malloc_fork_prepare() in malloc.c)
@@ -751,6 +1510,8 @@ static boolean_t fv_zone_locked(malloc_zone_t *fvzone)
     return TRYLOCK(zone);
 }
 
+#if FV_ZONE_MACH
+
 typedef struct _fv_enumerator_context {
     task_t              task;
     void               *context;
@@ -872,8 +1633,15 @@ fv_zone_enumerator(task_t task, void *context, unsigned type_mask, vm_address_t
     return ret;
 }
 
+#endif /* FV_ZONE_MACH */
+
+// there's no way to enumerate another task's memory without Mach VM
 static const struct malloc_introspection_t __fv_zone_introspect = {
+#if FV_ZONE_MACH
     fv_zone_enumerator,
+#else
+    NULL,
+#endif
     fv_zone_good_size,
     fv_zone_check,
     fv_zone_print,
@@ -887,7 +1655,9 @@ static const struct malloc_introspection_t __fv_zone_introspect = {
 #endif
 };
 
+#if ENABLE_STATS
 static bool __fv_alloc_size_compare(fv_allocation_t *val1, fv_allocation_t *val2) { return (val1->ptrSize < val2->ptrSize); }
+#endif
 
 #pragma mark Setup and cleanup
 
@@ -895,47 +1665,144 @@ static bool __fv_alloc_size_compare(fv_allocation_t *val1, fv_allocation_t *val2
 static void __fv_zone_show_stats(fv_zone_t *fvzone);
 #endif
 
-static void __fv_zone_collect_zone(fv_zone_t *zone)
+static bool __fv_alloc_address_compare(fv_allocation_t *val1, fv_allocation_t *val2) { return (uintptr_t)val1 < (uintptr_t)val2; }
+
+// removes a sorted array of allocations from _allocations in a single pass
+static void __fv_zone_remove_allocations_locked(fv_zone_t *zone, fv_allocation_t **doomed, const size_t doomedCount)
 {
-#if ENABLE_STATS
-    __fv_zone_show_stats(zone);
-#endif
-    // read freeSize before locking, since collection isn't critical
-    // if we can't lock immediately, wait for another opportunity
-    if (zone->_freeSize > FV_COLLECT_THRESHOLD && TRYLOCK(zone)) {
-            
-        set<fv_allocation_t *>::iterator it;
-        
-        // clear out all of the available allocations; this could be more intelligent
-        for (it = zone->_availableAllocations->begin(); it != zone->_availableAllocations->end(); it++) {
-            // remove from the allocation list
-            vector<fv_allocation_t *>::iterator toerase = lower_bound(zone->_allocations->begin(), zone->_allocations->end(), *it);
-            fv_zone_assert(*toerase == *it);
-            zone->_allocations->erase(toerase);
+    vector<fv_allocation_t *>::iterator src = lower_bound(zone->_allocations->begin(), zone->_allocations->end(), doomed[0]);
+    vector<fv_allocation_t *>::iterator dst = src;
+    size_t i = 0;
+    for (; src != zone->_allocations->end(); src++) {
+        if (i < doomedCount && *src == doomed[i])
+            i++;
+        else
+            *dst++ = *src;
+    }
+    fv_zone_assert(i == doomedCount);
+    zone->_allocations->erase(dst, zone->_allocations->end());
+    
+    // reset heap pointer and length
+    zone->_allocPtr = &zone->_allocations->front();
+    zone->_allocPtrCount = zone->_allocations->size();
+}
+
+/*
+ Soft release the pages of VM blocks that were added to the free list before cutoff, oldest first, until goal bytes
+ have been released.  Blocks stay mapped and on the free lists, so the kernel can take the pages if it needs them,
+ and reusing a block only costs page faults.  Blocks from malloc_default_zone() are skipped.
+ */
+static size_t __fv_zone_soft_release(fv_zone_t *zone, const uint64_t cutoff, const size_t goal)
+{
+    size_t released = 0;
+    size_t count;
+    do {
+        count = 0;
+        LOCK(zone);
+        fv_allocation_t *alloc;
+        // every block examined counts against the batch, so a long run of skipped blocks doesn't hold the lock
+        while (count < FV_COLLECT_BATCH_SIZE && released < goal && NULL != (alloc = zone->_oldestResident) && alloc->freeTime <= cutoff) {
+            zone->_oldestResident = alloc->newer;
+            count++;
+            if (&_vm_guard == alloc->guard && false == alloc->softReleased && __fv_zone_vm_soft_release(alloc->ptr, alloc->ptrSize)) {
+                alloc->softReleased = true;
+                FV_ATOMIC_ADD(&zone->_releasedSize, alloc->ptrSize);
+                FV_ATOMIC_ADD(&zone->_bytesSoftReleased, alloc->ptrSize);
+                released += alloc->ptrSize;
+            }
+        }
+        UNLOCK(zone);
+    } while (FV_COLLECT_BATCH_SIZE == count);
+    return released;
+}
+
+/*
+ Release blocks that have been free the longest until the free size drops to lowWater, so recently used blocks stay
+ cached.  Blocks are taken off the lists in batches, and the memory is returned to the system after dropping the
+ lock.  Blocks in thread magazines aren't affected.  If wait is false, this gives up whenever the lock is busy.
+ */
+static size_t __fv_zone_release_free_blocks(fv_zone_t *zone, const size_t lowWater, const bool wait)
+{
+    // free lists have to include remote frees, or they won't be trimmed; they also count in _freeSize
+    if (__fv_zone_has_remote_frees(zone) && (wait ? (LOCK(zone), true) : TRYLOCK(zone))) {
+        __fv_zone_drain_remote_frees_locked(zone);
+        UNLOCK(zone);
+    }
+    
+    // read freeSize before locking, since it's only a hint
+    size_t released = 0;
+    if (zone->_freeSize <= lowWater || false == (wait ? (LOCK(zone), true) : TRYLOCK(zone)))
+        return released;
+    
+    FV_ATOMIC_ADD(&zone->_collections, 1);
+    fv_allocation_t *doomed[FV_COLLECT_BATCH_SIZE];
+    size_t doomedCount;
+    do {
+        doomedCount = 0;
+        while (doomedCount < FV_COLLECT_BATCH_SIZE && zone->_freeSize > lowWater && NULL != zone->_oldestFree) {
+            fv_allocation_t *alloc = __fv_zone_unlink_free_allocation_locked(zone, zone->_oldestFree);
             
             // change the sizes in the zone's record
-            fv_zone_assert(zone->_allocatedSize >= (*it)->allocSize);
-            fv_zone_assert(zone->_freeSize >= (*it)->allocSize);
-            zone->_allocatedSize -= (*it)->allocSize;
-            zone->_freeSize -= (*it)->allocSize;
-            
-            // deallocate underlying storage
-            __fv_zone_destroy_allocation(*it);
-        } 
+            fv_zone_assert(zone->_allocatedSize >= alloc->allocSize);
+            fv_zone_assert(zone->_freeSize >= alloc->allocSize);
+            zone->_allocatedSize -= alloc->allocSize;
+            FV_ATOMIC_SUB(&zone->_freeSize, alloc->allocSize);
+            if (alloc->softReleased)
+                FV_ATOMIC_SUB(&zone->_releasedSize, alloc->ptrSize);
+            doomed[doomedCount++] = alloc;
+        }
         
-        // removal doesn't alter sort order, so no need to call sort() here
+        if (doomedCount) {
+            sort(doomed, doomed + doomedCount, __fv_alloc_address_compare);
+            __fv_zone_remove_allocations_locked(zone, doomed, doomedCount);
+            FV_ATOMIC_ADD(&zone->_blocksReleased, doomedCount);
+            for (size_t i = 0; i < doomedCount; i++) {
+                FV_ATOMIC_ADD(&zone->_bytesReleased, doomed[i]->allocSize);
+                released += doomed[i]->allocSize;
+            }
+        }
+        UNLOCK(zone);
         
-        // reset heap pointer and length
-        zone->_allocPtr = &zone->_allocations->front();
-        zone->_allocPtrCount = zone->_allocations->size();
-
-        // now remove all blocks from the free list
-        zone->_availableAllocations->clear();
+        // no longer reachable from the zone, so deallocate underlying storage without the lock
+        for (size_t i = 0; i < doomedCount; i++)
+            __fv_zone_destroy_allocation(doomed[i]);
         
-        UNLOCK(zone);
-    }
+    } while (FV_COLLECT_BATCH_SIZE == doomedCount && zone->_freeSize > lowWater && (wait ? (LOCK(zone), true) : TRYLOCK(zone)));
+    
+    return released;
+}
+
+// goal of zero means as much as possible, as for malloc_zone_pressure_relief()
+static size_t fv_zone_pressure_relief(malloc_zone_t *fvzone, size_t goal)
+{
+    fv_zone_t *zone = reinterpret_cast<fv_zone_t *>(fvzone);
+    const size_t freeSize = zone->_freeSize;
+    const size_t lowWater = (0 == goal || goal >= freeSize) ? 0 : freeSize - goal;
+    return __fv_zone_release_free_blocks(zone, lowWater, true);
+}
+
+/*
+ Once the free list exceeds FV_COLLECT_THRESHOLD, trim it to FV_COLLECT_LOW_WATER.  Collection isn't critical, so
+ if the lock is busy, wait for another opportunity.
+ */
+static void __fv_zone_collect_zone(fv_zone_t *zone)
+{
+#if ENABLE_STATS
+    __fv_zone_show_stats(zone);
+#endif
+    // below the threshold, this only drains remote frees
+    const size_t lowWater = zone->_freeSize > FV_COLLECT_THRESHOLD ? FV_COLLECT_LOW_WATER : SIZE_MAX;
+    (void) __fv_zone_release_free_blocks(zone, lowWater, false);
+    
+    // whatever is left and hasn't been used recently can give its pages back
+    const uint64_t now = __fv_zone_timestamp();
+    const uint64_t age = FV_SOFT_RELEASE_SECONDS * 1000000000ULL;
+    if (now > age && NULL != zone->_oldestResident)
+        (void) __fv_zone_soft_release(zone, now - age, SIZE_MAX);
 }
 
+#if FV_ZONE_MACH
+
 // periodically check all zones against the per-zone high water mark for unused memory
 static void __fv_zone_collect_all(void *scheduled)
 { 
@@ -964,6 +1831,8 @@ static void __fv_zone_collect_all(void *scheduled)
 #endif
 }
 
+#endif /* FV_ZONE_MACH */
+
 // periodically check all zones against the per-zone high water mark for unused memory
 static void *__fv_zone_collector_thread(void *unused)
 {        
@@ -1005,7 +1874,12 @@ static void *__fv_zone_collector_thread(void *unused)
 
 static void __initialize_collector_thread()
 {    
+#if FV_ZONE_MACH
     if (NULL == dispatch_source_create) {
+#else
+    // libdispatch is optional on Linux, so always use a thread there
+    {
+#endif
         // create a thread to do periodic cleanup so memory usage doesn't get out of hand
         pthread_attr_t attr;
         pthread_attr_init(&attr);
@@ -1016,6 +1890,7 @@ static void __initialize_collector_thread()
         (void)pthread_create(&thread, &attr, __fv_zone_collector_thread, NULL);
         pthread_attr_destroy(&attr);    
     }
+#if FV_ZONE_MACH
     else {
         dispatch_queue_t dq = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0);
         dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dq);
@@ -1024,6 +1899,7 @@ static void __initialize_collector_thread()
         dispatch_source_set_timer(timer, start, FV_COLLECT_TIMEINTERVAL * NSEC_PER_SEC, NSEC_PER_SEC);
         dispatch_resume(timer);
     }
+#endif
 }
 
 #pragma mark API
@@ -1032,6 +1908,15 @@ malloc_zone_t *fv_create_zone_named(const char *name)
 {
     // can't rely on initializers to do this early enough, since FVAllocator creates a zone in a __constructor__
     pthread_mutex_lock(&_zone_list_lock);
+#if FV_ZONE_MACH
+    if (0 == _timebase.denom)
+        (void) mach_timebase_info(&_timebase);
+#endif
+    static bool checkedHugePages = false;
+    if (false == checkedHugePages) {
+        _hugePageSize = __fv_zone_get_huge_page_size();
+        checkedHugePages = true;
+    }
     if (getenv("MallocScribble") != NULL) {
         malloc_printf("will scribble memory allocations in zone %s\n", name);
         _scribble = true;
@@ -1059,19 +1944,22 @@ malloc_zone_t *fv_create_zone_named(const char *name)
 #endif
     
 #if defined(MAC_OS_X_VERSION_10_8) && MAC_OS_X_VERSION_MIN_REQUIRED >= MAC_OS_X_VERSION_10_8
-    zone->_basic_zone.pressure_relief = NULL;
-#warning should implement
+    zone->_basic_zone.pressure_relief = fv_zone_pressure_relief;
 #endif
     
     // explicitly initialize padding to NULL
-    memset(zone->_reserved, NULL, sizeof(zone->_reserved));
+    memset(zone->_reserved, 0, sizeof(zone->_reserved));
     
-    // http://www.cplusplus.com/reference/stl/set/set.html
-    // proof that C++ programmers have to be insane
-    bool (*compare_ptr)(ALLOC, ALLOC) = __fv_alloc_size_compare;
-    zone->_availableAllocations = new multiset<MSALLOC>(compare_ptr);
+    // free lists and their bitmap were zeroed by calloc
     zone->_allocations = new vector<ALLOC>;
+    zone->_remoteHead = zone->_remoteTail = &zone->_remoteStub;
     LOCK_INIT(zone);
+    (void) pthread_key_create(&zone->_magazineKey, __fv_thread_cache_destroy);
+    
+    // opt in to huge pages with FVZoneHugePageThreshold=<bytes>
+    const char *hugePageThreshold = getenv("FVZoneHugePageThreshold");
+    if (hugePageThreshold)
+        fv_zone_set_huge_page_threshold(&zone->_basic_zone, strtoul(hugePageThreshold, NULL, 10));
     
     // register so the system handles lookups correctly, or malloc_zone_from_ptr() breaks (along with free())
     malloc_zone_register((malloc_zone_t *)zone);
@@ -1093,6 +1981,103 @@ malloc_zone_t *fv_create_zone_named(const char *name)
     return (malloc_zone_t *)zone;
 }
 
+void fv_zone_set_huge_page_threshold(malloc_zone_t *fvzone, size_t minimumSize)
+{
+    fv_zone_t *zone = reinterpret_cast<fv_zone_t *>(fvzone);
+    // only affects blocks created later, so the lock isn't needed
+    zone->_hugePageThreshold = _hugePageSize ? minimumSize : 0;
+}
+
+void fv_zone_copy_statistics(malloc_zone_t *fvzone, fv_zone_statistics_t *stats)
+{
+    __fv_zone_copy_statistics(reinterpret_cast<fv_zone_t *>(fvzone), stats);
+}
+
+size_t fv_zone_release_free_memory(malloc_zone_t *fvzone, size_t goal)
+{
+    return fv_zone_pressure_relief(fvzone, goal);
+}
+
+void fv_zone_get_sizes(malloc_zone_t *fvzone, size_t *allocatedSize, size_t *freeSize)
+{
+    fv_zone_t *zone = reinterpret_cast<fv_zone_t *>(fvzone);
+    // unlocked reads; these are only hints, and can be stale by the time they're used
+    if (allocatedSize) *allocatedSize = zone->_allocatedSize;
+    if (freeSize) *freeSize = zone->_freeSize;
+}
+
+#pragma mark NUMA nodes
+
+static unsigned        _nodeCount = 1;
+#if FV_ZONE_MACH
+static unsigned        _cpusPerNode = 0;
+#endif
+static pthread_once_t  _nodeOnce = PTHREAD_ONCE_INIT;
+
+static void __fv_zone_initialize_nodes()
+{
+#if FV_ZONE_MACH
+    // each package of a multi-socket Mac Pro is a node; logical CPUs are assumed to be numbered by package
+    int packages = 0, cpus = 0;
+    size_t len = sizeof(int);
+    if (0 == sysctlbyname("hw.packages", &packages, &len, NULL, 0) && packages > 1) {
+        len = sizeof(int);
+        if (0 == sysctlbyname("hw.logicalcpu_max", &cpus, &len, NULL, 0) && cpus >= packages) {
+            _nodeCount = packages;
+            _cpusPerNode = cpus / packages;
+        }
+    }
+#else
+    // a list of ranges such as "0" or "0-1,3"; nodes may be sparse, so use the highest one
+    FILE *file = fopen("/sys/devices/system/node/online", "r");
+    if (file) {
+        unsigned node, highest = 0;
+        char separator;
+        while (fscanf(file, "%u%c", &node, &separator) >= 1) {
+            if (node > highest) highest = node;
+            if ('-' != separator && ',' != separator) break;
+        }
+        (void) fclose(file);
+        _nodeCount = highest + 1;
+    }
+#endif
+    if (_nodeCount > FV_ZONE_MAX_NODES)
+        _nodeCount = FV_ZONE_MAX_NODES;
+}
+
+unsigned fv_zone_node_count(void)
+{
+    (void) pthread_once(&_nodeOnce, __fv_zone_initialize_nodes);
+    return _nodeCount;
+}
+
+unsigned fv_zone_current_node(void)
+{
+    if (fv_zone_node_count() < 2)
+        return 0;
+    unsigned node = 0;
+#if FV_ZONE_MACH
+#if defined(MAC_OS_VERSION_11_0) && MAC_OS_X_VERSION_MAX_ALLOWED >= MAC_OS_VERSION_11_0
+    if (__builtin_available(macOS 11.0, *)) {
+        size_t cpu;
+        if (0 == pthread_cpu_number_np(&cpu))
+            node = (unsigned)(cpu / _cpusPerNode);
+    }
+#endif
+#elif defined(SYS_getcpu)
+    // vsyscall on most systems, so this is cheap enough to call for every allocation
+    unsigned cpu;
+    if (0 != syscall(SYS_getcpu, &cpu, &node, NULL))
+        node = 0;
+#endif
+    return node < _nodeCount ? node : 0;
+}
+
+size_t fv_zone_size_class_size(unsigned sizeClass)
+{
+    return sizeClass < FV_SIZE_CLASS_OVERFLOW ? __fv_zone_class_size(sizeClass) : SIZE_MAX;
+}
+
 #pragma mark statistics
 
 #if ENABLE_STATS
@@ -1101,9 +2086,12 @@ static multiset<size_t> __fv_zone_free_sizes_locked(fv_zone_t *fvzone, size_t *f
 {
     size_t freeMemory = 0;
     multiset<size_t> allocationSet;
-    set<fv_allocation_t *>::iterator it;
-    for (it = fvzone->_availableAllocations->begin(); it != fvzone->_availableAllocations->end(); it++) {
+    vector<fv_allocation_t *>::iterator it;
+    // includes blocks held in thread magazines
+    for (it = fvzone->_allocations->begin(); it != fvzone->_allocations->end(); it++) {
         fv_allocation_t *alloc = *it;
+        if (false == alloc->free)
+            continue;
         if (__builtin_expect((alloc->guard != &_vm_guard && alloc->guard != &_malloc_guard), 0)) {
             malloc_printf("%s: invalid allocation pointer %p\n", __func__, alloc);
             malloc_printf("Break on malloc_printf to debug.\n");
@@ -1215,9 +2203,13 @@ static void __fv_zone_show_stats(fv_zone_t *fvzone)
         fprintf(stderr, "%8lu    %3lu  (%3lu)  %5.2f    %5.2f %%  %12.0f\n", (long)allocationSize, (long)count, (long)freeCount, totalMbytes, percentOfTotal, averageUsage);        
     }
     
+    fv_zone_statistics_t stats;
+    __fv_zone_copy_statistics(fvzone, &stats);
+    
     // avoid divide-by-zero
-    double cacheRequests = (fvzone->_cacheHits + fvzone->_cacheMisses);
-    double missRate = cacheRequests > 0 ? (double)fvzone->_cacheMisses / (fvzone->_cacheHits + fvzone->_cacheMisses) * 100 : 0;
+    const uint64_t cacheHits = stats.magazineHits + stats.freeListHits;
+    double cacheRequests = (cacheHits + stats.cacheMisses);
+    double missRate = cacheRequests > 0 ? (double)stats.cacheMisses / cacheRequests * 100 : 0;
     
     struct tm time;
     localtime_r(&absoluteTime, &time);
@@ -1225,8 +2217,8 @@ static void __fv_zone_show_stats(fv_zone_t *fvzone)
     const char *timeFormat = "%Y-%m-%d %T"; // 2008-11-12 21:51:00 --> 20 characters
     char timeString[32] = { '\0' };
     strftime(timeString, sizeof(timeString), timeFormat, &time);
-    fprintf(stderr, "%s: %d hits and %d misses for a cache failure rate of %.2f%%\n", timeString, fvzone->_cacheHits, fvzone->_cacheMisses, missRate);
-    fprintf(stderr, "%s: total in use: %.2f Mbytes, total available: %.2f Mbytes, %d reallocations\n", timeString, double(totalMemory) / 1024 / 1024, double(freeMemory) / 1024 / 1024, fvzone->_reallocCount);
+    fprintf(stderr, "%s: %llu hits (%llu from magazines) and %llu misses for a cache failure rate of %.2f%%\n", timeString, (unsigned long long)cacheHits, (unsigned long long)stats.magazineHits, (unsigned long long)stats.cacheMisses, missRate);
+    fprintf(stderr, "%s: total in use: %.2f Mbytes, total available: %.2f Mbytes, %llu reallocations\n", timeString, double(totalMemory) / 1024 / 1024, double(freeMemory) / 1024 / 1024, (unsigned long long)stats.reallocCount);
 }
 
 #endif
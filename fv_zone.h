@@ -41,7 +41,12 @@
 #ifndef _FVZONE_H_
 #define _FVZONE_H_
 
+#if defined(__APPLE__)
 #import <malloc/malloc.h>
+#else
+#import "fv_zone_linux.h"
+#endif
+#import <stdint.h>
 
 __BEGIN_DECLS
 
@@ -49,6 +54,8 @@ __BEGIN_DECLS
  
  This allocator is primarily intended for use when many blocks >16K are needed repeatedly.  Each block is retained in a cache for some time after being freed, so reuse of similarly sized blocks should be fast.  Blocks of memory returned are not zeroed; the caller is responsible for this as needed.  In fact, a primary advantage of this allocator is that it doesn't waste time zeroing memory before returning it.  Typical usage is to provide a block of memory for a CGBitmapContext, vImage_Buffer, or backing for a CGDataProvider.  In the latter case, you can use CFDataCreateWithBytesNoCopy()/CGDataProviderCreateWithCFData() to good advantage, particularly for repeated creation/destruction of short-lived/same-sized images.
  
+ On Linux, large blocks are allocated with mmap(2) and grown with mremap(2), and fv_zone_linux.h supplies the small subset of the malloc zone API that the implementation needs.  This is only intended for running the allocator and its benchmarks on build machines; the zone isn't registered with anything, so it must be called through malloc_zone_malloc() and friends.
+ 
  This is <b>not</b> a general-purpose replacement for the system allocator(s), and the code doesn't draw from tcmalloc or Apple's malloc implementation.  For some background on the problem, see this thread:  http://lists.apple.com/archives/perfoptimization-dev/2008/Apr/msg00018.html which indicates that waiting for a solution from Apple is probably not going to be very gratifying. 
  
  It's also worth noting that some of Apple's performance tool frameworks, used by Instruments and MallocDebug, hardcode zone names.  Consequently, even though I've gone to the trouble of implementing the zone introspection functions here, they're unused.  If you change the zone's name to one of Apple's zone names, the introspection functions are called, but the system gets really confused.  Shark at least records allocations from this zone in a Malloc Trace, whereas allocations using vm_allocate directly are not recorded, so there's some gain.  <b>NB: his restriction is lifted in Instruments, as of 10.6.  The zone introspection callbacks are now used.</b>
@@ -61,10 +68,106 @@ __BEGIN_DECLS
  
  @brief Malloc zone.
  
- The zone is thread safe.  All zones share a common garbage collection thread that runs periodically or when a high water mark is reached.  There is typically little benefit from creating multiple zones, and destruction has all the caveats of Apple's zone functions. 
+ The zone is thread safe.  Each thread keeps a small cache of recently freed blocks per size class, so a thread that repeatedly frees and allocates similar sizes doesn't contend for the zone lock.  Blocks freed by a thread other than the one that allocated them are queued without locking, and returned to the zone the next time it's locked.  All zones share a common garbage collection thread that runs periodically or when a high water mark is reached.  There is typically little benefit from creating multiple zones, except one per NUMA node (see fv_zone_node_count), and destruction has all the caveats of Apple's zone functions. 
  @return A new malloc zone structure. */
 FV_PRIVATE_EXTERN malloc_zone_t * fv_create_zone_named(const char *name);
 
+/** @internal Upper limit for fv_zone_node_count. */
+#define FV_ZONE_MAX_NODES 8
+
+/** @internal 
+ 
+ @brief Number of NUMA nodes.
+ 
+ On Linux, this is the number of memory nodes the kernel reports.  On Mac OS X, each processor package is treated as a node, so this is 2 on a dual-socket Mac Pro and 1 on everything else.  Callers that keep a zone per node should route each thread's allocations to fv_zone_current_node.  Blocks may be freed or reallocated through any zone created by fv_create_zone_named, and are returned to the zone that allocated them.
+ @return A value between 1 and FV_ZONE_MAX_NODES. */
+FV_PRIVATE_EXTERN unsigned fv_zone_node_count(void);
+
+/** @internal 
+ 
+ @brief Node of the calling thread.
+ 
+ The thread may migrate at any time, so this is only a hint.  It's always 0 if the system can't say, which includes Mac OS X before 10.16/11.0.
+ @return A value less than fv_zone_node_count(). */
+FV_PRIVATE_EXTERN unsigned fv_zone_current_node(void);
+
+/** @internal 
+ 
+ @brief Huge page policy.
+ 
+ New blocks of at least minimumSize bytes are aligned and padded to the huge page size, and the kernel is asked to back them with transparent huge pages.  This reduces TLB misses when scanning large bitmaps, at the cost of up to one huge page of padding per block, so it's off by default.  It can also be enabled by setting the FVZoneHugePageThreshold environment variable to a size in bytes.  Currently this only has an effect on Linux with transparent huge pages enabled.
+ @param zone A zone returned by fv_create_zone_named.
+ @param minimumSize Smallest block to back with huge pages, e.g. 2 MB, or 0 to disable. */
+FV_PRIVATE_EXTERN void fv_zone_set_huge_page_threshold(malloc_zone_t *zone, size_t minimumSize);
+
+/** @internal 
+ 
+ @brief Release cached blocks.
+ 
+ Returns up to goal bytes of cached blocks to the system, starting with the blocks that have been free the longest.  Unlike the collector, this waits for the zone lock.  Blocks held in per-thread caches aren't released.  The zone's pressure_relief callback does the same thing, so malloc_zone_pressure_relief() also works on 10.8 and later.
+ @param zone A zone returned by fv_create_zone_named.
+ @param goal Number of bytes to release, or 0 to release as much as possible.
+ @return The number of bytes actually released. */
+FV_PRIVATE_EXTERN size_t fv_zone_release_free_memory(malloc_zone_t *zone, size_t goal);
+
+/** @internal 
+ 
+ @brief Current zone sizes.
+ 
+ Reads the sizes without locking, so this is cheap enough to call frequently, but the values may be slightly stale.  Sizes include block headers and padding.
+ @param zone A zone returned by fv_create_zone_named.
+ @param allocatedSize On return, bytes in all blocks.  May be NULL.
+ @param freeSize On return, bytes in cached blocks.  May be NULL. */
+FV_PRIVATE_EXTERN void fv_zone_get_sizes(malloc_zone_t *zone, size_t *allocatedSize, size_t *freeSize);
+
+/** @internal Number of size classes reported by fv_zone_copy_statistics. */
+#define FV_ZONE_SIZE_CLASS_COUNT 93
+
+/** @internal 
+ 
+ @brief Zone statistics.
+ 
+ Counters are totals since the zone was created; sizes are current values.  Sizes include block headers and padding, so they reflect memory used by the zone rather than the sizes requested by callers. */
+typedef struct _fv_zone_statistics_t {
+    uint64_t mallocCount;          /**< malloc, calloc and valloc, and reallocs that needed a new block */
+    uint64_t magazineHits;         /**< mallocs recycled from the calling thread's cache, without locking */
+    uint64_t freeListHits;         /**< mallocs recycled from the zone's free lists */
+    uint64_t cacheMisses;          /**< mallocs that created a new block */
+    uint64_t freeCount;            /**< blocks returned to the zone */
+    uint64_t remoteFreeCount;      /**< blocks returned by a thread other than the one that allocated them */
+    uint64_t reallocCount;         /**< calls to realloc with a non-NULL pointer */
+    uint64_t reallocInPlaceCount;  /**< reallocs that didn't copy the contents */
+    uint64_t collectionCount;      /**< collector passes that released blocks */
+    uint64_t blocksReleased;       /**< blocks returned to the system by the collector */
+    uint64_t bytesReleased;        /**< bytes returned to the system by the collector */
+    uint64_t bytesSoftReleased;    /**< bytes of cached blocks handed back to the kernel with madvise */
+    size_t   blockCount;           /**< blocks currently in use or cached */
+    size_t   freeBlockCount;       /**< blocks currently cached */
+    size_t   allocatedSize;        /**< bytes in all blocks */
+    size_t   peakAllocatedSize;    /**< largest value of allocatedSize */
+    size_t   freeSize;             /**< bytes in cached blocks */
+    size_t   softReleasedSize;     /**< bytes in cached blocks whose pages were handed back */
+    uint64_t mallocsByClass[FV_ZONE_SIZE_CLASS_COUNT];     /**< requests by size class */
+    size_t   freeBlocksByClass[FV_ZONE_SIZE_CLASS_COUNT];  /**< cached blocks by size class */
+} fv_zone_statistics_t;
+
+/** @internal 
+ 
+ @brief Copy zone statistics.
+ 
+ Counters are kept per-thread and added up here, so collecting them doesn't slow down allocation.  This takes the zone lock and walks all blocks, so it shouldn't be called at a high rate.  The standard malloc_zone_statistics() is filled in from the same data.
+ @param zone A zone returned by fv_create_zone_named.
+ @param stats Filled in on return. */
+FV_PRIVATE_EXTERN void fv_zone_copy_statistics(malloc_zone_t *zone, fv_zone_statistics_t *stats);
+
+/** @internal 
+ 
+ @brief Size class boundaries.
+ 
+ @param sizeClass An index in fv_zone_statistics_t::mallocsByClass or fv_zone_statistics_t::freeBlocksByClass.
+ @return The largest request in that class, or SIZE_MAX for the last class, which holds all larger blocks. */
+FV_PRIVATE_EXTERN size_t fv_zone_size_class_size(unsigned sizeClass);
+
 __END_DECLS
 
 #endif /* _FV_ZONE_H_ */
@@ -0,0 +1,126 @@
+/*
+ *  fv_zone_linux.cpp
+ *  FileView
+ *
+ */
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fv_zone_linux.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <malloc.h>
+
+#pragma mark Default zone
+
+static size_t __fv_default_zone_size(malloc_zone_t *zone, const void *ptr) { return malloc_usable_size((void *)ptr); }
+static void *__fv_default_zone_malloc(malloc_zone_t *zone, size_t size) { return malloc(size); }
+static void *__fv_default_zone_calloc(malloc_zone_t *zone, size_t num_items, size_t size) { return calloc(num_items, size); }
+static void *__fv_default_zone_valloc(malloc_zone_t *zone, size_t size) { return valloc(size); }
+static void __fv_default_zone_free(malloc_zone_t *zone, void *ptr) { free(ptr); }
+static void *__fv_default_zone_realloc(malloc_zone_t *zone, void *ptr, size_t size) { return realloc(ptr, size); }
+static void __fv_default_zone_destroy(malloc_zone_t *zone) { /* never destroyed */ }
+
+static malloc_zone_t _default_zone = {
+    NULL,
+    NULL,
+    __fv_default_zone_size,
+    __fv_default_zone_malloc,
+    __fv_default_zone_calloc,
+    __fv_default_zone_valloc,
+    __fv_default_zone_free,
+    __fv_default_zone_realloc,
+    __fv_default_zone_destroy,
+    "DefaultMallocZone",
+    NULL,
+    NULL,
+    NULL,
+    0,
+    NULL,
+    NULL,
+    NULL
+};
+
+malloc_zone_t *malloc_default_zone(void) { return &_default_zone; }
+
+#pragma mark Zone names
+
+// there's no process-wide zone list, since nothing here looks up a zone from a pointer
+void malloc_zone_register(malloc_zone_t *zone) {}
+
+void malloc_set_zone_name(malloc_zone_t *zone, const char *name)
+{
+    char *newName = name ? strdup(name) : NULL;
+    char *oldName = zone == &_default_zone ? NULL : (char *)zone->zone_name;
+    zone->zone_name = newName;
+    free(oldName);
+}
+
+const char *malloc_get_zone_name(malloc_zone_t *zone) { return zone->zone_name; }
+
+#pragma mark Logging
+
+// rewrite %y (Apple's size_t conversion) as %zu and print to stderr
+void malloc_printf(const char *format, ...)
+{
+    const size_t len = strlen(format);
+    char *fmt = (char *)malloc(2 * len + 1);
+    if (NULL == fmt) return;
+    
+    size_t j = 0;
+    for (size_t i = 0; i < len; i++) {
+        if ('%' == format[i] && i + 1 < len) {
+            if ('y' == format[i + 1]) {
+                fmt[j++] = '%';
+                fmt[j++] = 'z';
+                fmt[j++] = 'u';
+                i++;
+                continue;
+            }
+            // copy escaped percent signs as a pair, so "%%y" is left alone
+            if ('%' == format[i + 1]) {
+                fmt[j++] = format[i++];
+            }
+        }
+        fmt[j++] = format[i];
+    }
+    fmt[j] = '\0';
+    
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    free(fmt);
+}
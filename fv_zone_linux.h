@@ -0,0 +1,143 @@
+/*
+ *  fv_zone_linux.h
+ *  FileView
+ *
+ */
+/*
+ This software is Copyright (c) 2008-2013
+ Adam Maxwell. All rights reserved.
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+ 
+ - Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ - Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ - Neither the name of Adam Maxwell nor the names of any
+ contributors may be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FVZONE_LINUX_H_
+#define _FVZONE_LINUX_H_
+
+/*
+ Minimal stand-in for the parts of <malloc/malloc.h> that fv_zone uses, so the allocator and
+ its benchmarks can be built on Linux.  The zone structure has the same layout as Apple's, but
+ there is no zone registry: malloc_zone_register() is a no-op, malloc_default_zone() wraps the
+ C library's malloc, and nothing calls the introspection functions.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#ifndef __BEGIN_DECLS
+#ifdef __cplusplus
+#define __BEGIN_DECLS extern "C" {
+#define __END_DECLS }
+#else
+#define __BEGIN_DECLS
+#define __END_DECLS
+#endif
+#endif
+
+/* normally provided by FileView_Prefix.pch */
+#ifndef FV_PRIVATE_EXTERN
+#ifdef __cplusplus
+#define FV_PRIVATE_EXTERN extern "C" __attribute__((visibility("hidden")))
+#else
+#define FV_PRIVATE_EXTERN extern __attribute__((visibility("hidden")))
+#endif
+#endif
+
+#ifndef HALT
+#include <signal.h>
+#include <unistd.h>
+#define HALT do { __builtin_trap(); kill(getpid(), 9); } while (0)
+#endif
+
+#ifndef CLANG_ANALYZER_NORETURN
+#define CLANG_ANALYZER_NORETURN
+#endif
+
+__BEGIN_DECLS
+
+typedef int boolean_t;
+
+typedef struct _malloc_zone_t {
+    void     *reserved1;
+    void     *reserved2;
+    size_t  (*size)(struct _malloc_zone_t *zone, const void *ptr);
+    void   *(*malloc)(struct _malloc_zone_t *zone, size_t size);
+    void   *(*calloc)(struct _malloc_zone_t *zone, size_t num_items, size_t size);
+    void   *(*valloc)(struct _malloc_zone_t *zone, size_t size);
+    void    (*free)(struct _malloc_zone_t *zone, void *ptr);
+    void   *(*realloc)(struct _malloc_zone_t *zone, void *ptr, size_t size);
+    void    (*destroy)(struct _malloc_zone_t *zone);
+    const char *zone_name;
+    unsigned (*batch_malloc)(struct _malloc_zone_t *zone, size_t size, void **results, unsigned num_requested);
+    void    (*batch_free)(struct _malloc_zone_t *zone, void **to_be_freed, unsigned num_to_be_freed);
+    struct malloc_introspection_t *introspect;
+    unsigned  version;
+    void   *(*memalign)(struct _malloc_zone_t *zone, size_t alignment, size_t size);
+    void    (*free_definite_size)(struct _malloc_zone_t *zone, void *ptr, size_t size);
+    size_t  (*pressure_relief)(struct _malloc_zone_t *zone, size_t goal);
+} malloc_zone_t;
+
+typedef struct malloc_statistics_t {
+    unsigned  blocks_in_use;
+    size_t    size_in_use;
+    size_t    max_size_in_use;
+    size_t    size_allocated;
+} malloc_statistics_t;
+
+/* the enumerator needs Mach VM, so its slot is untyped here */
+typedef struct malloc_introspection_t {
+    void     *enumerator;
+    size_t  (*good_size)(malloc_zone_t *zone, size_t size);
+    boolean_t (*check)(malloc_zone_t *zone);
+    void    (*print)(malloc_zone_t *zone, boolean_t verbose);
+    void    (*log)(malloc_zone_t *zone, void *address);
+    void    (*force_lock)(malloc_zone_t *zone);
+    void    (*force_unlock)(malloc_zone_t *zone);
+    void    (*statistics)(malloc_zone_t *zone, malloc_statistics_t *stats);
+    boolean_t (*zone_locked)(malloc_zone_t *zone);
+} malloc_introspection_t;
+
+FV_PRIVATE_EXTERN malloc_zone_t *malloc_default_zone(void);
+FV_PRIVATE_EXTERN void malloc_zone_register(malloc_zone_t *zone);
+FV_PRIVATE_EXTERN void malloc_set_zone_name(malloc_zone_t *zone, const char *name);
+FV_PRIVATE_EXTERN const char *malloc_get_zone_name(malloc_zone_t *zone);
+
+/* accepts the %y (size_t) conversion like the Mac OS X version */
+FV_PRIVATE_EXTERN void malloc_printf(const char *format, ...);
+
+static inline void *malloc_zone_malloc(malloc_zone_t *zone, size_t size) { return zone->malloc(zone, size); }
+static inline void *malloc_zone_calloc(malloc_zone_t *zone, size_t num_items, size_t size) { return zone->calloc(zone, num_items, size); }
+static inline void *malloc_zone_valloc(malloc_zone_t *zone, size_t size) { return zone->valloc(zone, size); }
+static inline void *malloc_zone_realloc(malloc_zone_t *zone, void *ptr, size_t size) { return zone->realloc(zone, ptr, size); }
+static inline void malloc_zone_free(malloc_zone_t *zone, void *ptr) { zone->free(zone, ptr); }
+static inline void malloc_destroy_zone(malloc_zone_t *zone) { zone->destroy(zone); }
+
+__END_DECLS
+
+#endif /* _FVZONE_LINUX_H_ */